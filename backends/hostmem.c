@@ -22,6 +22,7 @@
 #include "qemu/mmap-alloc.h"
 
 #ifdef CONFIG_NUMA
+#include <numa.h>
 #include <numaif.h>
 QEMU_BUILD_BUG_ON(HOST_MEM_POLICY_DEFAULT != MPOL_DEFAULT);
 QEMU_BUILD_BUG_ON(HOST_MEM_POLICY_PREFERRED != MPOL_PREFERRED);
@@ -207,6 +208,58 @@ static void host_memory_backend_set_dump(Object *obj, bool value, Error **errp)
     }
 }
 
+/*
+ * Preallocate the memory of @backend.  With a NUMA policy, the threads are
+ * spread over the host nodes of the policy and run on the CPUs of their
+ * node, so that each node's pages are allocated and cleared by local CPUs.
+ */
+static void host_memory_backend_prealloc(HostMemoryBackend *backend, int fd,
+                                         void *ptr, uint64_t sz, Error **errp)
+{
+#ifdef CONFIG_NUMA
+    unsigned long *cpus[MAX_NODES];
+    struct bitmask *mask;
+    unsigned long node;
+    int nr_cpus = 0, ngroups = 0;
+    int i;
+
+    if (backend->policy != MPOL_DEFAULT && numa_available() >= 0) {
+        nr_cpus = numa_num_possible_cpus();
+        mask = numa_allocate_cpumask();
+        for (node = find_first_bit(backend->host_nodes, MAX_NODES);
+             node < MAX_NODES;
+             node = find_next_bit(backend->host_nodes, MAX_NODES, node + 1)) {
+            if (numa_node_to_cpus(node, mask) < 0) {
+                continue;
+            }
+            cpus[ngroups] = bitmap_new(nr_cpus);
+            for (i = 0; i < nr_cpus; i++) {
+                if (numa_bitmask_isbitset(mask, i)) {
+                    set_bit(i, cpus[ngroups]);
+                }
+            }
+            /* Nodes with memory only are left to the other nodes' CPUs */
+            if (bitmap_empty(cpus[ngroups], nr_cpus)) {
+                g_free(cpus[ngroups]);
+                continue;
+            }
+            ngroups++;
+        }
+        numa_free_cpumask(mask);
+    }
+
+    if (ngroups) {
+        os_mem_prealloc_on_cpus(fd, ptr, sz, backend->prealloc_threads,
+                                cpus, ngroups, nr_cpus, errp);
+        for (i = 0; i < ngroups; i++) {
+            g_free(cpus[i]);
+        }
+        return;
+    }
+#endif
+    os_mem_prealloc(fd, ptr, sz, backend->prealloc_threads, errp);
+}
+
 static bool host_memory_backend_get_prealloc(Object *obj, Error **errp)
 {
     HostMemoryBackend *backend = MEMORY_BACKEND(obj);
@@ -230,7 +283,7 @@ static void host_memory_backend_set_prealloc(Object *obj, bool value,
         void *ptr = memory_region_get_ram_ptr(&backend->mr);
         uint64_t sz = memory_region_size(&backend->mr);
 
-        os_mem_prealloc(fd, ptr, sz, backend->prealloc_threads, &local_err);
+        host_memory_backend_prealloc(backend, fd, ptr, sz, &local_err);
         if (local_err) {
             error_propagate(errp, local_err);
             return;
@@ -390,8 +443,9 @@ host_memory_backend_memory_complete(UserCreatable *uc, Error **errp)
          * specified NUMA policy in place.
          */
         if (backend->prealloc) {
-            os_mem_prealloc(memory_region_get_fd(&backend->mr), ptr, sz,
-                            backend->prealloc_threads, &local_err);
+            host_memory_backend_prealloc(backend,
+                                         memory_region_get_fd(&backend->mr),
+                                         ptr, sz, &local_err);
             if (local_err) {
                 goto out;
             }
@@ -22,6 +22,8 @@
 
 #include "block/block_int.h"
 #include "block/qdict.h"
+#include "block/aio_task.h"
+#include "block/thread-pool.h"
 #include "sysemu/block-backend.h"
 #include "crypto/block.h"
 #include "qapi/opts-visitor.h"
@@ -35,9 +37,24 @@
 
 typedef struct BlockCrypto BlockCrypto;
 
+/*
+ * Maximum number of concurrent encryption/decryption jobs submitted to
+ * the thread pool per image.  The QCryptoBlock is opened with this many
+ * cipher instances so that each job gets its own.
+ */
+#define BLOCK_CRYPTO_MAX_THREADS 4
+
+/* Maximum number of in-flight chunks per guest request */
+#define BLOCK_CRYPTO_MAX_WORKERS 8
+
 struct BlockCrypto {
     QCryptoBlock *block;
     bool updating_keys;
+
+    /* Protects nb_threads and thread_task_queue */
+    CoMutex lock;
+    int nb_threads;
+    CoQueue thread_task_queue;
 };
 
 
@@ -274,6 +291,9 @@ static int block_crypto_open_generic(QCryptoBlockFormat format,
     bs->supported_write_flags = BDRV_REQ_FUA &
         bs->file->bs->supported_write_flags;
 
+    qemu_co_mutex_init(&crypto->lock);
+    qemu_co_queue_init(&crypto->thread_task_queue);
+
     opts = qemu_opts_create(opts_spec, NULL, 0, &error_abort);
     if (!qemu_opts_absorb_qdict(opts, options, errp)) {
         goto cleanup;
@@ -294,7 +314,7 @@ static int block_crypto_open_generic(QCryptoBlockFormat format,
                                        block_crypto_read_func,
                                        bs,
                                        cflags,
-                                       1,
+                                       BLOCK_CRYPTO_MAX_THREADS,
                                        errp);
 
     if (!crypto->block) {
@@ -396,131 +416,274 @@ static int block_crypto_reopen_prepare(BDRVReopenState *state,
  */
 #define BLOCK_CRYPTO_MAX_IO_SIZE (1024 * 1024)
 
-static coroutine_fn int
-block_crypto_co_preadv(BlockDriverState *bs, uint64_t offset, uint64_t bytes,
-                       QEMUIOVector *qiov, int flags)
+/*
+ * Requests are split into chunks of at least this size so that several
+ * of them can be encrypted in parallel without drowning in overhead.
+ */
+#define BLOCK_CRYPTO_MIN_TASK_SIZE (64 * 1024)
+
+/*
+ * BlockCryptoEncDecFunc: common prototype of qcrypto_block_encrypt() and
+ * qcrypto_block_decrypt() functions.
+ */
+typedef int (*BlockCryptoEncDecFunc)(QCryptoBlock *block, uint64_t offset,
+                                     uint8_t *buf, size_t len, Error **errp);
+
+typedef struct BlockCryptoEncDecData {
+    QCryptoBlock *block;
+    uint64_t offset;
+    uint8_t *buf;
+    size_t len;
+
+    BlockCryptoEncDecFunc func;
+} BlockCryptoEncDecData;
+
+static int block_crypto_encdec_pool_func(void *opaque)
+{
+    BlockCryptoEncDecData *data = opaque;
+
+    return data->func(data->block, data->offset, data->buf, data->len, NULL);
+}
+
+/*
+ * Run @func on @buf in a thread pool worker, limiting the number of jobs
+ * in flight to the number of cipher instances the block was opened with.
+ */
+static int coroutine_fn
+block_crypto_co_encdec(BlockDriverState *bs, uint64_t offset,
+                       uint8_t *buf, size_t len, BlockCryptoEncDecFunc func)
 {
     BlockCrypto *crypto = bs->opaque;
+    ThreadPool *pool = aio_get_thread_pool(bdrv_get_aio_context(bs));
+    BlockCryptoEncDecData arg = {
+        .block = crypto->block,
+        .offset = offset,
+        .buf = buf,
+        .len = len,
+        .func = func,
+    };
+    int ret;
+
+    qemu_co_mutex_lock(&crypto->lock);
+    while (crypto->nb_threads >= BLOCK_CRYPTO_MAX_THREADS) {
+        qemu_co_queue_wait(&crypto->thread_task_queue, &crypto->lock);
+    }
+    crypto->nb_threads++;
+    qemu_co_mutex_unlock(&crypto->lock);
+
+    ret = thread_pool_submit_co(pool, block_crypto_encdec_pool_func, &arg);
+
+    qemu_co_mutex_lock(&crypto->lock);
+    crypto->nb_threads--;
+    qemu_co_queue_next(&crypto->thread_task_queue);
+    qemu_co_mutex_unlock(&crypto->lock);
+
+    return ret;
+}
+
+typedef struct BlockCryptoAioTask {
+    AioTask task;
+
+    BlockDriverState *bs;
+    uint64_t offset;
+    uint64_t bytes;
+    QEMUIOVector *qiov;
+    uint64_t qiov_offset;
+    int flags; /* only for write */
+} BlockCryptoAioTask;
+
+/*
+ * Pick a chunk size that spreads @bytes over the available workers while
+ * staying sector aligned and within the bounce buffer limit.
+ */
+static uint64_t block_crypto_task_size(uint64_t bytes, uint64_t sector_size)
+{
+    uint64_t size = DIV_ROUND_UP(bytes, BLOCK_CRYPTO_MAX_WORKERS);
+
+    size = MAX(size, BLOCK_CRYPTO_MIN_TASK_SIZE);
+    size = QEMU_ALIGN_UP(size, sector_size);
+
+    return MIN(size, BLOCK_CRYPTO_MAX_IO_SIZE);
+}
+
+static coroutine_fn int block_crypto_add_task(BlockDriverState *bs,
+                                              AioTaskPool *pool,
+                                              AioTaskFunc func,
+                                              uint64_t offset,
+                                              uint64_t bytes,
+                                              QEMUIOVector *qiov,
+                                              size_t qiov_offset,
+                                              int flags)
+{
+    BlockCryptoAioTask local_task;
+    BlockCryptoAioTask *task = pool ? g_new(BlockCryptoAioTask, 1)
+                                    : &local_task;
+
+    *task = (BlockCryptoAioTask) {
+        .task.func = func,
+        .bs = bs,
+        .offset = offset,
+        .bytes = bytes,
+        .qiov = qiov,
+        .qiov_offset = qiov_offset,
+        .flags = flags,
+    };
+
+    if (!pool) {
+        return func(&task->task);
+    }
+
+    aio_task_pool_start_task(pool, &task->task);
+
+    return 0;
+}
+
+/*
+ * Split a request into chunks and run @func on each of them, with up to
+ * BLOCK_CRYPTO_MAX_WORKERS chunks in flight.
+ */
+static coroutine_fn int block_crypto_co_rw(BlockDriverState *bs,
+                                           uint64_t offset, uint64_t bytes,
+                                           QEMUIOVector *qiov, int flags,
+                                           AioTaskFunc func)
+{
+    BlockCrypto *crypto = bs->opaque;
+    uint64_t sector_size = qcrypto_block_get_sector_size(crypto->block);
+    uint64_t task_size = block_crypto_task_size(bytes, sector_size);
     uint64_t cur_bytes; /* number of bytes in current iteration */
     uint64_t bytes_done = 0;
-    uint8_t *cipher_data = NULL;
-    QEMUIOVector hd_qiov;
+    AioTaskPool *aio = NULL;
     int ret = 0;
-    uint64_t sector_size = qcrypto_block_get_sector_size(crypto->block);
-    uint64_t payload_offset = qcrypto_block_get_payload_offset(crypto->block);
 
-    assert(!flags);
-    assert(payload_offset < INT64_MAX);
     assert(QEMU_IS_ALIGNED(offset, sector_size));
     assert(QEMU_IS_ALIGNED(bytes, sector_size));
 
-    qemu_iovec_init(&hd_qiov, qiov->niov);
-
-    /* Bounce buffer because we don't wish to expose cipher text
-     * in qiov which points to guest memory.
-     */
-    cipher_data =
-        qemu_try_blockalign(bs->file->bs, MIN(BLOCK_CRYPTO_MAX_IO_SIZE,
-                                              qiov->size));
-    if (cipher_data == NULL) {
-        ret = -ENOMEM;
-        goto cleanup;
-    }
-
-    while (bytes) {
-        cur_bytes = MIN(bytes, BLOCK_CRYPTO_MAX_IO_SIZE);
+    while (bytes && aio_task_pool_status(aio) == 0) {
+        cur_bytes = MIN(bytes, task_size);
 
-        qemu_iovec_reset(&hd_qiov);
-        qemu_iovec_add(&hd_qiov, cipher_data, cur_bytes);
+        if (!aio && cur_bytes != bytes) {
+            aio = aio_task_pool_new(BLOCK_CRYPTO_MAX_WORKERS);
+        }
 
-        ret = bdrv_co_preadv(bs->file, payload_offset + offset + bytes_done,
-                             cur_bytes, &hd_qiov, 0);
+        ret = block_crypto_add_task(bs, aio, func, offset + bytes_done,
+                                    cur_bytes, qiov, bytes_done, flags);
         if (ret < 0) {
-            goto cleanup;
+            break;
         }
 
-        if (qcrypto_block_decrypt(crypto->block, offset + bytes_done,
-                                  cipher_data, cur_bytes, NULL) < 0) {
-            ret = -EIO;
-            goto cleanup;
+        bytes -= cur_bytes;
+        bytes_done += cur_bytes;
+    }
+
+    if (aio) {
+        aio_task_pool_wait_all(aio);
+        if (ret == 0) {
+            ret = aio_task_pool_status(aio);
         }
+        aio_task_pool_free(aio);
+    }
 
-        qemu_iovec_from_buf(qiov, bytes_done, cipher_data, cur_bytes);
+    return ret;
+}
 
-        bytes -= cur_bytes;
-        bytes_done += cur_bytes;
+static coroutine_fn int block_crypto_co_preadv_task_entry(AioTask *task)
+{
+    BlockCryptoAioTask *t = container_of(task, BlockCryptoAioTask, task);
+    BlockDriverState *bs = t->bs;
+    BlockCrypto *crypto = bs->opaque;
+    uint64_t payload_offset = qcrypto_block_get_payload_offset(crypto->block);
+    uint8_t *cipher_data;
+    int ret;
+
+    /* Bounce buffer because we don't wish to expose cipher text
+     * in qiov which points to guest memory.
+     */
+    cipher_data = qemu_try_blockalign(bs->file->bs, t->bytes);
+    if (cipher_data == NULL) {
+        return -ENOMEM;
+    }
+
+    ret = bdrv_co_pread(bs->file, payload_offset + t->offset, t->bytes,
+                        cipher_data, 0);
+    if (ret < 0) {
+        goto cleanup;
     }
 
+    if (block_crypto_co_encdec(bs, t->offset, cipher_data, t->bytes,
+                               qcrypto_block_decrypt) < 0) {
+        ret = -EIO;
+        goto cleanup;
+    }
+
+    qemu_iovec_from_buf(t->qiov, t->qiov_offset, cipher_data, t->bytes);
+
  cleanup:
-    qemu_iovec_destroy(&hd_qiov);
     qemu_vfree(cipher_data);
-
     return ret;
 }
 
-
 static coroutine_fn int
-block_crypto_co_pwritev(BlockDriverState *bs, uint64_t offset, uint64_t bytes,
-                        QEMUIOVector *qiov, int flags)
+block_crypto_co_preadv(BlockDriverState *bs, uint64_t offset, uint64_t bytes,
+                       QEMUIOVector *qiov, int flags)
 {
     BlockCrypto *crypto = bs->opaque;
-    uint64_t cur_bytes; /* number of bytes in current iteration */
-    uint64_t bytes_done = 0;
-    uint8_t *cipher_data = NULL;
-    QEMUIOVector hd_qiov;
-    int ret = 0;
-    uint64_t sector_size = qcrypto_block_get_sector_size(crypto->block);
     uint64_t payload_offset = qcrypto_block_get_payload_offset(crypto->block);
 
-    assert(!(flags & ~BDRV_REQ_FUA));
+    assert(!flags);
     assert(payload_offset < INT64_MAX);
-    assert(QEMU_IS_ALIGNED(offset, sector_size));
-    assert(QEMU_IS_ALIGNED(bytes, sector_size));
 
-    qemu_iovec_init(&hd_qiov, qiov->niov);
+    return block_crypto_co_rw(bs, offset, bytes, qiov, 0,
+                              block_crypto_co_preadv_task_entry);
+}
+
+
+static coroutine_fn int block_crypto_co_pwritev_task_entry(AioTask *task)
+{
+    BlockCryptoAioTask *t = container_of(task, BlockCryptoAioTask, task);
+    BlockDriverState *bs = t->bs;
+    BlockCrypto *crypto = bs->opaque;
+    uint64_t payload_offset = qcrypto_block_get_payload_offset(crypto->block);
+    uint8_t *cipher_data;
+    int ret;
 
     /* Bounce buffer because we're not permitted to touch
      * contents of qiov - it points to guest memory.
      */
-    cipher_data =
-        qemu_try_blockalign(bs->file->bs, MIN(BLOCK_CRYPTO_MAX_IO_SIZE,
-                                              qiov->size));
+    cipher_data = qemu_try_blockalign(bs->file->bs, t->bytes);
     if (cipher_data == NULL) {
-        ret = -ENOMEM;
-        goto cleanup;
+        return -ENOMEM;
     }
 
-    while (bytes) {
-        cur_bytes = MIN(bytes, BLOCK_CRYPTO_MAX_IO_SIZE);
-
-        qemu_iovec_to_buf(qiov, bytes_done, cipher_data, cur_bytes);
-
-        if (qcrypto_block_encrypt(crypto->block, offset + bytes_done,
-                                  cipher_data, cur_bytes, NULL) < 0) {
-            ret = -EIO;
-            goto cleanup;
-        }
-
-        qemu_iovec_reset(&hd_qiov);
-        qemu_iovec_add(&hd_qiov, cipher_data, cur_bytes);
-
-        ret = bdrv_co_pwritev(bs->file, payload_offset + offset + bytes_done,
-                              cur_bytes, &hd_qiov, flags);
-        if (ret < 0) {
-            goto cleanup;
-        }
+    qemu_iovec_to_buf(t->qiov, t->qiov_offset, cipher_data, t->bytes);
 
-        bytes -= cur_bytes;
-        bytes_done += cur_bytes;
+    if (block_crypto_co_encdec(bs, t->offset, cipher_data, t->bytes,
+                               qcrypto_block_encrypt) < 0) {
+        ret = -EIO;
+        goto cleanup;
     }
 
+    ret = bdrv_co_pwrite(bs->file, payload_offset + t->offset, t->bytes,
+                         cipher_data, t->flags);
+
  cleanup:
-    qemu_iovec_destroy(&hd_qiov);
     qemu_vfree(cipher_data);
-
     return ret;
 }
 
+static coroutine_fn int
+block_crypto_co_pwritev(BlockDriverState *bs, uint64_t offset, uint64_t bytes,
+                        QEMUIOVector *qiov, int flags)
+{
+    BlockCrypto *crypto = bs->opaque;
+    uint64_t payload_offset = qcrypto_block_get_payload_offset(crypto->block);
+
+    assert(!(flags & ~BDRV_REQ_FUA));
+    assert(payload_offset < INT64_MAX);
+
+    return block_crypto_co_rw(bs, offset, bytes, qiov, flags,
+                              block_crypto_co_pwritev_task_entry);
+}
+
 static void block_crypto_refresh_limits(BlockDriverState *bs, Error **errp)
 {
     BlockCrypto *crypto = bs->opaque;
@@ -17,6 +17,7 @@
 #include "qemu/cutils.h"
 #include "qemu/module.h"
 #include "qemu/option.h"
+#include "qemu/timer.h"
 #include "block/block_int.h"
 #include "block/qdict.h"
 #include "qapi/error.h"
@@ -33,6 +34,24 @@
 #define QUORUM_OPT_BLKVERIFY      "blkverify"
 #define QUORUM_OPT_REWRITE        "rewrite-corrupted"
 #define QUORUM_OPT_READ_PATTERN   "read-pattern"
+#define QUORUM_OPT_HEDGE_THRESHOLD "hedge-threshold"
+
+/* Per-child read statistics are exponentially weighted moving averages in
+ * which each new sample has a weight of 1 / (1 << QUORUM_EWMA_SHIFT).
+ */
+#define QUORUM_EWMA_SHIFT 3
+
+/* A failed read adds QUORUM_ERROR_UNIT to the error score before weighting.
+ * Children whose score reaches QUORUM_ERROR_UNHEALTHY (three failures in a
+ * row from a clean state) are only read from if no healthy child is left.
+ */
+#define QUORUM_ERROR_UNIT      1024
+#define QUORUM_ERROR_UNHEALTHY (QUORUM_ERROR_UNIT / 4)
+
+/* Error scores also halve every QUORUM_ERROR_HALF_LIFE_NS, so that an
+ * unhealthy child, which is no longer read from, is eventually tried again.
+ */
+#define QUORUM_ERROR_HALF_LIFE_NS (5 * NANOSECONDS_PER_SECOND)
 
 /* This union holds a vote hash value */
 typedef union QuorumVoteValue {
@@ -65,9 +84,19 @@ typedef struct QuorumVotes {
     bool (*compare)(QuorumVoteValue *a, QuorumVoteValue *b);
 } QuorumVotes;
 
+/* Read statistics of one child, used by the fastest read pattern */
+typedef struct QuorumChildStats {
+    int64_t latency_ns;    /* average latency of successful reads, 0 if none
+                            * has completed yet
+                            */
+    unsigned error_score;  /* decaying score of failed reads */
+    int64_t error_stamp_ns; /* time error_score was last decayed to */
+} QuorumChildStats;
+
 /* the following structure holds the state of one quorum instance */
 typedef struct BDRVQuorumState {
     BdrvChild **children;  /* children BlockDriverStates */
+    QuorumChildStats *stats; /* read statistics, indexed like children */
     int num_children;      /* children count */
     unsigned next_child_index;  /* the index of the next child that should
                                  * be added
@@ -88,6 +117,11 @@ typedef struct BDRVQuorumState {
                             */
 
     QuorumReadPattern read_pattern;
+    int64_t hedge_threshold_ns; /* if non-zero, a fifo or fastest read that
+                                 * takes longer than this is also issued to
+                                 * the next child, and the first one to
+                                 * succeed wins
+                                 */
 } BDRVQuorumState;
 
 typedef struct QuorumAIOCB QuorumAIOCB;
@@ -639,17 +673,226 @@ static int read_quorum_children(QuorumAIOCB *acb)
     return acb->vote_ret;
 }
 
-static int read_fifo_child(QuorumAIOCB *acb)
+static void quorum_decay_error_score(QuorumChildStats *stats, int64_t now_ns)
+{
+    int64_t halvings = (now_ns - stats->error_stamp_ns) /
+                       QUORUM_ERROR_HALF_LIFE_NS;
+
+    if (halvings <= 0) {
+        return;
+    }
+    stats->error_score = halvings >= 32 ? 0 : stats->error_score >> halvings;
+    stats->error_stamp_ns += halvings * QUORUM_ERROR_HALF_LIFE_NS;
+}
+
+static void quorum_account_read(BDRVQuorumState *s, int i, int64_t start_ns,
+                                int ret)
+{
+    QuorumChildStats *stats = &s->stats[i];
+    int64_t now_ns = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+    int64_t latency_ns = now_ns - start_ns;
+
+    quorum_decay_error_score(stats, now_ns);
+    stats->error_score -= stats->error_score >> QUORUM_EWMA_SHIFT;
+    if (ret < 0) {
+        stats->error_score += QUORUM_ERROR_UNIT >> QUORUM_EWMA_SHIFT;
+        return;
+    }
+
+    if (!stats->latency_ns) {
+        stats->latency_ns = MAX(latency_ns, 1);
+    } else {
+        stats->latency_ns += (latency_ns - stats->latency_ns) /
+                             (1 << QUORUM_EWMA_SHIFT);
+        stats->latency_ns = MAX(stats->latency_ns, 1);
+    }
+}
+
+static bool quorum_child_is_faster(BDRVQuorumState *s, int a, int b)
+{
+    bool a_healthy = s->stats[a].error_score < QUORUM_ERROR_UNHEALTHY;
+    bool b_healthy = s->stats[b].error_score < QUORUM_ERROR_UNHEALTHY;
+
+    if (a_healthy != b_healthy) {
+        return a_healthy;
+    }
+
+    /* Children that were never read from sort first, so that they get
+     * a latency sample.
+     */
+    return s->stats[a].latency_ns < s->stats[b].latency_ns;
+}
+
+/* Fill @order with the children indexes, fastest healthy child first */
+static void quorum_sort_children(BDRVQuorumState *s, int *order)
+{
+    int64_t now_ns = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+    int i, j;
+
+    for (i = 0; i < s->num_children; i++) {
+        quorum_decay_error_score(&s->stats[i], now_ns);
+    }
+    for (i = 0; i < s->num_children; i++) {
+        for (j = i; j > 0 && quorum_child_is_faster(s, i, order[j - 1]); j--) {
+            order[j] = order[j - 1];
+        }
+        order[j] = i;
+    }
+}
+
+/* State shared by the reads that a hedged request issues to its children.
+ * Reads that are still in flight when the request completes keep it alive
+ * until they finish, and only write to their own bounce buffer.
+ */
+typedef struct QuorumHedgedRead {
+    BlockDriverState *bs;
+    uint64_t offset;
+    uint64_t bytes;
+
+    Coroutine *co;              /* the request, or NULL once it returned */
+    QEMUIOVector *qiov;         /* calling IOV, only valid while co is set */
+    QemuCoSleepState *sleep_state;
+
+    int refcnt;
+    int pending;                /* number of child reads in flight */
+    int completed;              /* number of child reads that finished */
+    bool done;                  /* qiov was filled by a successful read */
+    int ret;                    /* result of the last failed read */
+} QuorumHedgedRead;
+
+typedef struct QuorumHedgedCo {
+    QuorumHedgedRead *hr;
+    int idx;
+} QuorumHedgedCo;
+
+static void quorum_hedged_read_unref(QuorumHedgedRead *hr)
+{
+    if (--hr->refcnt == 0) {
+        g_free(hr);
+    }
+}
+
+static void coroutine_fn read_hedged_child_entry(void *opaque)
+{
+    QuorumHedgedCo *data = opaque;
+    QuorumHedgedRead *hr = data->hr;
+    BlockDriverState *bs = hr->bs;
+    BDRVQuorumState *s = bs->opaque;
+    int i = data->idx;
+    BdrvChild *child = s->children[i];
+    uint8_t *buf = qemu_blockalign(child->bs, hr->bytes);
+    int64_t start_ns = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+    QEMUIOVector qiov;
+    int ret;
+
+    qemu_iovec_init_buf(&qiov, buf, hr->bytes);
+    ret = bdrv_co_preadv(child, hr->offset, hr->bytes, &qiov, 0);
+    quorum_account_read(s, i, start_ns, ret);
+    if (ret < 0) {
+        quorum_report_bad(QUORUM_OP_TYPE_READ, hr->offset, hr->bytes,
+                          child->bs->node_name, ret);
+        hr->ret = ret;
+    } else if (hr->co && !hr->done) {
+        qemu_iovec_from_buf(hr->qiov, 0, buf, hr->bytes);
+        hr->done = true;
+    }
+    qemu_vfree(buf);
+
+    hr->pending--;
+    hr->completed++;
+    if (hr->co) {
+        if (hr->sleep_state) {
+            qemu_co_sleep_wake(hr->sleep_state);
+        } else {
+            qemu_coroutine_enter_if_inactive(hr->co);
+        }
+    }
+
+    quorum_hedged_read_unref(hr);
+    bdrv_dec_in_flight(bs);
+}
+
+static void quorum_hedged_read_start(QuorumHedgedRead *hr, int idx)
+{
+    Coroutine *co;
+    QuorumHedgedCo data = {
+        .hr = hr,
+        .idx = idx,
+    };
+
+    hr->refcnt++;
+    hr->pending++;
+    bdrv_inc_in_flight(hr->bs);
+
+    co = qemu_coroutine_create(read_hedged_child_entry, &data);
+    qemu_coroutine_enter(co);
+}
+
+/* Read from the children in @order, starting the read on the next child
+ * when the current one fails or when no read completed within the hedge
+ * threshold.  The first successful read completes the request.
+ */
+static int read_hedged_children(QuorumAIOCB *acb, const int *order)
 {
     BDRVQuorumState *s = acb->bs->opaque;
+    QuorumHedgedRead *hr = g_new(QuorumHedgedRead, 1);
+    int n = 0, completed, ret;
+
+    *hr = (QuorumHedgedRead) {
+        .bs         = acb->bs,
+        .offset     = acb->offset,
+        .bytes      = acb->bytes,
+        .co         = qemu_coroutine_self(),
+        .qiov       = acb->qiov,
+        .refcnt     = 1,
+        .ret        = -EIO,
+    };
+
+    while (!hr->done) {
+        if (hr->pending == 0) {
+            if (n == s->num_children) {
+                break;
+            }
+            quorum_hedged_read_start(hr, order[n++]);
+        } else if (n == s->num_children) {
+            qemu_coroutine_yield();
+        } else {
+            completed = hr->completed;
+            qemu_co_sleep_ns_wakeable(QEMU_CLOCK_REALTIME,
+                                      s->hedge_threshold_ns,
+                                      &hr->sleep_state);
+            if (hr->completed == completed) {
+                quorum_hedged_read_start(hr, order[n++]);
+            }
+        }
+    }
+    acb->children_read = n;
+
+    ret = hr->done ? 0 : hr->ret;
+    hr->co = NULL;
+    quorum_hedged_read_unref(hr);
+
+    return ret;
+}
+
+static int read_children_in_order(QuorumAIOCB *acb, const int *order)
+{
+    BDRVQuorumState *s = acb->bs->opaque;
+    int64_t start_ns;
     int n, ret;
 
-    /* We try to read the next child in FIFO order if we failed to read */
+    if (s->hedge_threshold_ns) {
+        return read_hedged_children(acb, order);
+    }
+
+    /* We try to read the next child in order if we failed to read */
     do {
-        n = acb->children_read++;
+        n = order[acb->children_read++];
         acb->qcrs[n].bs = s->children[n]->bs;
+        start_ns = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
         ret = bdrv_co_preadv(s->children[n], acb->offset, acb->bytes,
                              acb->qiov, 0);
+        quorum_account_read(s, n, start_ns, ret);
         if (ret < 0) {
             quorum_report_bad_acb(&acb->qcrs[n], ret);
         }
@@ -660,6 +903,29 @@ static int read_fifo_child(QuorumAIOCB *acb)
     return ret;
 }
 
+static int read_fifo_child(QuorumAIOCB *acb)
+{
+    BDRVQuorumState *s = acb->bs->opaque;
+    g_autofree int *order = g_new(int, s->num_children);
+    int i;
+
+    for (i = 0; i < s->num_children; i++) {
+        order[i] = i;
+    }
+
+    return read_children_in_order(acb, order);
+}
+
+static int read_fastest_child(QuorumAIOCB *acb)
+{
+    BDRVQuorumState *s = acb->bs->opaque;
+    g_autofree int *order = g_new(int, s->num_children);
+
+    quorum_sort_children(s, order);
+
+    return read_children_in_order(acb, order);
+}
+
 static int quorum_co_preadv(BlockDriverState *bs, uint64_t offset,
                             uint64_t bytes, QEMUIOVector *qiov, int flags)
 {
@@ -670,10 +936,18 @@ static int quorum_co_preadv(BlockDriverState *bs, uint64_t offset,
     acb->is_read = true;
     acb->children_read = 0;
 
-    if (s->read_pattern == QUORUM_READ_PATTERN_QUORUM) {
+    switch (s->read_pattern) {
+    case QUORUM_READ_PATTERN_QUORUM:
         ret = read_quorum_children(acb);
-    } else {
+        break;
+    case QUORUM_READ_PATTERN_FIFO:
         ret = read_fifo_child(acb);
+        break;
+    case QUORUM_READ_PATTERN_FASTEST:
+        ret = read_fastest_child(acb);
+        break;
+    default:
+        abort();
     }
     quorum_aio_finalize(acb);
 
@@ -888,7 +1162,14 @@ static QemuOptsList quorum_runtime_opts = {
         {
             .name = QUORUM_OPT_READ_PATTERN,
             .type = QEMU_OPT_STRING,
-            .help = "Allowed pattern: quorum, fifo. Quorum is default",
+            .help = "Allowed pattern: quorum, fifo, fastest. "
+                    "Quorum is default",
+        },
+        {
+            .name = QUORUM_OPT_HEDGE_THRESHOLD,
+            .type = QEMU_OPT_NUMBER,
+            .help = "Milliseconds after which a fifo or fastest read is also "
+                    "sent to the next child (0 = never)",
         },
         { /* end of list */ }
     },
@@ -941,11 +1222,28 @@ static int quorum_open(BlockDriverState *bs, QDict *options, int flags,
                               -EINVAL, NULL);
     }
     if (ret < 0) {
-        error_setg(errp, "Please set read-pattern as fifo or quorum");
+        error_setg(errp, "Please set read-pattern as fifo, fastest or quorum");
         goto exit;
     }
     s->read_pattern = ret;
 
+    s->hedge_threshold_ns = qemu_opt_get_number(opts,
+                                                QUORUM_OPT_HEDGE_THRESHOLD, 0);
+    if (s->hedge_threshold_ns < 0 ||
+        s->hedge_threshold_ns > INT64_MAX / SCALE_MS) {
+        error_setg(errp, "hedge-threshold is out of range");
+        ret = -EINVAL;
+        goto exit;
+    }
+    s->hedge_threshold_ns *= SCALE_MS;
+    if (s->hedge_threshold_ns &&
+        s->read_pattern == QUORUM_READ_PATTERN_QUORUM) {
+        error_setg(errp, "hedge-threshold can only be set with "
+                   "read-pattern=fifo or read-pattern=fastest");
+        ret = -EINVAL;
+        goto exit;
+    }
+
     if (s->read_pattern == QUORUM_READ_PATTERN_QUORUM) {
         s->is_blkverify = qemu_opt_get_bool(opts, QUORUM_OPT_BLKVERIFY, false);
         if (s->is_blkverify && (s->num_children != 2 || s->threshold != 2)) {
@@ -967,6 +1265,7 @@ static int quorum_open(BlockDriverState *bs, QDict *options, int flags,
 
     /* allocate the children array */
     s->children = g_new0(BdrvChild *, s->num_children);
+    s->stats = g_new0(QuorumChildStats, s->num_children);
     opened = g_new0(bool, s->num_children);
 
     for (i = 0; i < s->num_children; i++) {
@@ -1001,6 +1300,7 @@ close_exit:
         bdrv_unref_child(bs, s->children[i]);
     }
     g_free(s->children);
+    g_free(s->stats);
     g_free(opened);
 exit:
     qemu_opts_del(opts);
@@ -1017,6 +1317,7 @@ static void quorum_close(BlockDriverState *bs)
     }
 
     g_free(s->children);
+    g_free(s->stats);
 }
 
 static void quorum_add_child(BlockDriverState *bs, BlockDriverState *child_bs,
@@ -1058,6 +1359,8 @@ static void quorum_add_child(BlockDriverState *bs, BlockDriverState *child_bs,
         goto out;
     }
     s->children = g_renew(BdrvChild *, s->children, s->num_children + 1);
+    s->stats = g_renew(QuorumChildStats, s->stats, s->num_children + 1);
+    s->stats[s->num_children] = (QuorumChildStats) { 0 };
     s->children[s->num_children++] = child;
 
 out:
@@ -1094,7 +1397,10 @@ static void quorum_del_child(BlockDriverState *bs, BdrvChild *child,
     /* We can safely remove this child now */
     memmove(&s->children[i], &s->children[i + 1],
             (s->num_children - i - 1) * sizeof(BdrvChild *));
+    memmove(&s->stats[i], &s->stats[i + 1],
+            (s->num_children - i - 1) * sizeof(QuorumChildStats));
     s->children = g_renew(BdrvChild *, s->children, --s->num_children);
+    s->stats = g_renew(QuorumChildStats, s->stats, s->num_children);
     bdrv_unref_child(bs, child);
 
     bdrv_drained_end(bs);
@@ -1171,6 +1477,7 @@ static const char *const quorum_strong_runtime_opts[] = {
     QUORUM_OPT_BLKVERIFY,
     QUORUM_OPT_REWRITE,
     QUORUM_OPT_READ_PATTERN,
+    QUORUM_OPT_HEDGE_THRESHOLD,
 
     NULL
 };
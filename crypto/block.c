@@ -347,11 +347,19 @@ void qcrypto_block_free(QCryptoBlock *block)
 }
 
 
-typedef int (*QCryptoCipherEncDecFunc)(QCryptoCipher *cipher,
-                                        const void *in,
-                                        void *out,
-                                        size_t len,
-                                        Error **errp);
+typedef int (*QCryptoCipherEncDecSectorsFunc)(QCryptoCipher *cipher,
+                                              const uint8_t *ivs,
+                                              size_t niv,
+                                              uint8_t *buf,
+                                              size_t sectorsize,
+                                              size_t nsectors,
+                                              Error **errp);
+
+/*
+ * Maximum number of sectors whose IVs are generated up front and
+ * handed to the cipher in a single call.
+ */
+#define QCRYPTO_BLOCK_BATCH_SECTORS 64
 
 static int do_qcrypto_block_cipher_encdec(QCryptoCipher *cipher,
                                           size_t niv,
@@ -361,23 +369,34 @@ static int do_qcrypto_block_cipher_encdec(QCryptoCipher *cipher,
                                           uint64_t offset,
                                           uint8_t *buf,
                                           size_t len,
-                                          QCryptoCipherEncDecFunc func,
+                                          QCryptoCipherEncDecSectorsFunc func,
                                           Error **errp)
 {
-    g_autofree uint8_t *iv = niv ? g_new0(uint8_t, niv) : NULL;
-    int ret = -1;
+    g_autofree uint8_t *ivs = NULL;
     uint64_t startsector = offset / sectorsize;
+    size_t nsectors = len / sectorsize;
+    int ret = 0;
 
     assert(QEMU_IS_ALIGNED(offset, sectorsize));
     assert(QEMU_IS_ALIGNED(len, sectorsize));
 
-    while (len > 0) {
-        size_t nbytes;
+    if (niv) {
+        ivs = g_new(uint8_t,
+                    niv * MIN(nsectors, QCRYPTO_BLOCK_BATCH_SECTORS));
+    }
+
+    while (nsectors > 0) {
+        size_t n = MIN(nsectors, QCRYPTO_BLOCK_BATCH_SECTORS);
+        size_t i;
+
         if (niv) {
             if (ivgen_mutex) {
                 qemu_mutex_lock(ivgen_mutex);
             }
-            ret = qcrypto_ivgen_calculate(ivgen, startsector, iv, niv, errp);
+            for (i = 0; i < n && ret == 0; i++) {
+                ret = qcrypto_ivgen_calculate(ivgen, startsector + i,
+                                              ivs + i * niv, niv, errp);
+            }
             if (ivgen_mutex) {
                 qemu_mutex_unlock(ivgen_mutex);
             }
@@ -385,22 +404,15 @@ static int do_qcrypto_block_cipher_encdec(QCryptoCipher *cipher,
             if (ret < 0) {
                 return -1;
             }
-
-            if (qcrypto_cipher_setiv(cipher,
-                                     iv, niv,
-                                     errp) < 0) {
-                return -1;
-            }
         }
 
-        nbytes = len > sectorsize ? sectorsize : len;
-        if (func(cipher, buf, buf, nbytes, errp) < 0) {
+        if (func(cipher, ivs, niv, buf, sectorsize, n, errp) < 0) {
             return -1;
         }
 
-        startsector++;
-        buf += nbytes;
-        len -= nbytes;
+        startsector += n;
+        buf += n * sectorsize;
+        nsectors -= n;
     }
 
     return 0;
@@ -418,7 +430,8 @@ int qcrypto_block_cipher_decrypt_helper(QCryptoCipher *cipher,
 {
     return do_qcrypto_block_cipher_encdec(cipher, niv, ivgen, NULL, sectorsize,
                                           offset, buf, len,
-                                          qcrypto_cipher_decrypt, errp);
+                                          qcrypto_cipher_decrypt_sectors,
+                                          errp);
 }
 
 
@@ -433,7 +446,8 @@ int qcrypto_block_cipher_encrypt_helper(QCryptoCipher *cipher,
 {
     return do_qcrypto_block_cipher_encdec(cipher, niv, ivgen, NULL, sectorsize,
                                           offset, buf, len,
-                                          qcrypto_cipher_encrypt, errp);
+                                          qcrypto_cipher_encrypt_sectors,
+                                          errp);
 }
 
 int qcrypto_block_decrypt_helper(QCryptoBlock *block,
@@ -448,7 +462,8 @@ int qcrypto_block_decrypt_helper(QCryptoBlock *block,
 
     ret = do_qcrypto_block_cipher_encdec(cipher, block->niv, block->ivgen,
                                          &block->mutex, sectorsize, offset, buf,
-                                         len, qcrypto_cipher_decrypt, errp);
+                                         len, qcrypto_cipher_decrypt_sectors,
+                                         errp);
 
     qcrypto_block_push_cipher(block, cipher);
 
@@ -467,7 +482,8 @@ int qcrypto_block_encrypt_helper(QCryptoBlock *block,
 
     ret = do_qcrypto_block_cipher_encdec(cipher, block->niv, block->ivgen,
                                          &block->mutex, sectorsize, offset, buf,
-                                         len, qcrypto_cipher_encrypt, errp);
+                                         len, qcrypto_cipher_encrypt_sectors,
+                                         errp);
 
     qcrypto_block_push_cipher(block, cipher);
 
@@ -14,6 +14,7 @@
 #include "qemu/osdep.h"
 #include "qemu-common.h"
 #include "qemu/cutils.h"
+#include "qemu/units.h"
 #include "elf.h"
 #include "cpu.h"
 #include "exec/hwaddr.h"
@@ -42,6 +43,9 @@
 #ifdef CONFIG_SNAPPY
 #include <snappy-c.h>
 #endif
+#ifdef CONFIG_ZSTD
+#include <zstd.h>
+#endif
 #ifndef ELF_MACHINE_UNAME
 #define ELF_MACHINE_UNAME "Unknown"
 #endif
@@ -847,6 +851,11 @@ static void create_header32(DumpState *s, Error **errp)
     if (s->flag_compress & DUMP_DH_COMPRESSED_SNAPPY) {
         status |= DUMP_DH_COMPRESSED_SNAPPY;
     }
+#endif
+#ifdef CONFIG_ZSTD
+    if (s->flag_compress & DUMP_DH_COMPRESSED_ZSTD) {
+        status |= DUMP_DH_COMPRESSED_ZSTD;
+    }
 #endif
     dh->status = cpu_to_dump32(s, status);
 
@@ -959,6 +968,11 @@ static void create_header64(DumpState *s, Error **errp)
     if (s->flag_compress & DUMP_DH_COMPRESSED_SNAPPY) {
         status |= DUMP_DH_COMPRESSED_SNAPPY;
     }
+#endif
+#ifdef CONFIG_ZSTD
+    if (s->flag_compress & DUMP_DH_COMPRESSED_ZSTD) {
+        status |= DUMP_DH_COMPRESSED_ZSTD;
+    }
 #endif
     dh->status = cpu_to_dump32(s, status);
 
@@ -1286,6 +1300,11 @@ static size_t get_len_buf_out(size_t page_size, uint32_t flag_compress)
     case DUMP_DH_COMPRESSED_SNAPPY:
         return snappy_max_compressed_length(page_size);
 #endif
+
+#ifdef CONFIG_ZSTD
+    case DUMP_DH_COMPRESSED_ZSTD:
+        return ZSTD_compressBound(page_size);
+#endif
     }
     return 0;
 }
@@ -1298,20 +1317,278 @@ static inline bool is_zero_page(const uint8_t *buf, size_t page_size)
     return buffer_is_zero(buf, page_size);
 }
 
+/*
+ * Pages are filtered and compressed by a pool of threads, in batches of
+ * DUMP_BATCH_SIZE bytes.  The dump thread queues the batches in guest
+ * physical order and writes them out in the same order as they complete,
+ * so that the output stays sequential while the next batches are being
+ * compressed.
+ */
+#define DUMP_BATCH_SIZE         (512 * KiB)
+#define DUMP_MAX_THREADS        16
+
+typedef struct DumpPageBatch {
+    size_t count;
+    /* host address of each page */
+    uint8_t **pages;
+    /* DUMP_DH_COMPRESSED_* flag of each page, 0 if stored in plaintext */
+    uint32_t *flags;
+    /* size of the data of each page, 0 for a zero page */
+    size_t *size;
+    /* compressed data, len_buf_out bytes for each page */
+    uint8_t *data;
+    bool done;
+} DumpPageBatch;
+
+typedef struct DumpPagePool DumpPagePool;
+
+typedef struct DumpCompressThread {
+    DumpPagePool *pool;
+    QemuThread thread;
+#ifdef CONFIG_LZO
+    lzo_bytep wrkmem;
+#endif
+#ifdef CONFIG_ZSTD
+    ZSTD_CCtx *zstd;
+#endif
+} DumpCompressThread;
+
+struct DumpPagePool {
+    DumpState *s;
+    size_t len_buf_out;
+    size_t batch_pages;
+
+    QemuMutex lock;
+    /* signaled when a batch is queued, or on quit */
+    QemuCond work_cond;
+    /* signaled when a batch is done */
+    QemuCond done_cond;
+    DumpPageBatch *batches;
+    unsigned nbatches;
+    /* number of batches queued by the dump thread and taken by the pool */
+    uint64_t queued;
+    uint64_t taken;
+    bool quit;
+
+    DumpCompressThread *threads;
+    unsigned nthreads;
+    bool started;
+};
+
+/*
+ * Compress the page at @buf into @buf_out.  Return the size of the page
+ * data in the vmcore, 0 for a zero page, and its flags in @flags.
+ */
+static size_t dump_compress_page(DumpCompressThread *t, uint8_t *buf,
+                                 uint8_t *buf_out, uint32_t *flags)
+{
+    DumpState *s = t->pool->s;
+    size_t size_out = t->pool->len_buf_out;
+
+    /* check zero page */
+    if (is_zero_page(buf, s->dump_info.page_size)) {
+        *flags = 0;
+        return 0;
+    }
+
+    /*
+     * only one compression format will be used here, for
+     * s->flag_compress is set. But when compression fails to work,
+     * we fall back to save in plaintext.
+     */
+    if ((s->flag_compress & DUMP_DH_COMPRESSED_ZLIB) &&
+        (compress2(buf_out, (uLongf *)&size_out, buf,
+                   s->dump_info.page_size, Z_BEST_SPEED) == Z_OK) &&
+        (size_out < s->dump_info.page_size)) {
+        *flags = DUMP_DH_COMPRESSED_ZLIB;
+        return size_out;
+    }
+#ifdef CONFIG_LZO
+    if ((s->flag_compress & DUMP_DH_COMPRESSED_LZO) &&
+        (lzo1x_1_compress(buf, s->dump_info.page_size, buf_out,
+                          (lzo_uint *)&size_out, t->wrkmem) == LZO_E_OK) &&
+        (size_out < s->dump_info.page_size)) {
+        *flags = DUMP_DH_COMPRESSED_LZO;
+        return size_out;
+    }
+#endif
+#ifdef CONFIG_SNAPPY
+    if ((s->flag_compress & DUMP_DH_COMPRESSED_SNAPPY) &&
+        (snappy_compress((char *)buf, s->dump_info.page_size,
+                         (char *)buf_out, &size_out) == SNAPPY_OK) &&
+        (size_out < s->dump_info.page_size)) {
+        *flags = DUMP_DH_COMPRESSED_SNAPPY;
+        return size_out;
+    }
+#endif
+#ifdef CONFIG_ZSTD
+    if (s->flag_compress & DUMP_DH_COMPRESSED_ZSTD) {
+        size_out = ZSTD_compressCCtx(t->zstd, buf_out, size_out, buf,
+                                     s->dump_info.page_size, 1);
+        if (!ZSTD_isError(size_out) && size_out < s->dump_info.page_size) {
+            *flags = DUMP_DH_COMPRESSED_ZSTD;
+            return size_out;
+        }
+    }
+#endif
+
+    /* fall back to save in plaintext */
+    *flags = 0;
+    return s->dump_info.page_size;
+}
+
+static void *dump_compress_thread(void *opaque)
+{
+    DumpCompressThread *t = opaque;
+    DumpPagePool *pool = t->pool;
+    DumpPageBatch *batch;
+    size_t i;
+
+    qemu_mutex_lock(&pool->lock);
+    for (;;) {
+        while (!pool->quit && pool->taken == pool->queued) {
+            qemu_cond_wait(&pool->work_cond, &pool->lock);
+        }
+        if (pool->quit) {
+            break;
+        }
+        batch = &pool->batches[pool->taken++ % pool->nbatches];
+        qemu_mutex_unlock(&pool->lock);
+
+        for (i = 0; i < batch->count; i++) {
+            batch->size[i] = dump_compress_page(t, batch->pages[i],
+                                                batch->data +
+                                                i * pool->len_buf_out,
+                                                &batch->flags[i]);
+        }
+
+        qemu_mutex_lock(&pool->lock);
+        batch->done = true;
+        qemu_cond_signal(&pool->done_cond);
+    }
+    qemu_mutex_unlock(&pool->lock);
+
+    return NULL;
+}
+
+static void dump_page_pool_cleanup(DumpPagePool *pool);
+
+static bool dump_page_pool_init(DumpPagePool *pool, DumpState *s,
+                                Error **errp)
+{
+    unsigned i;
+
+    pool->s = s;
+    pool->len_buf_out = get_len_buf_out(s->dump_info.page_size,
+                                        s->flag_compress);
+    assert(pool->len_buf_out != 0);
+    pool->batch_pages = MAX(DUMP_BATCH_SIZE / s->dump_info.page_size, 1);
+    pool->nthreads = MIN(g_get_num_processors(), DUMP_MAX_THREADS);
+
+    qemu_mutex_init(&pool->lock);
+    qemu_cond_init(&pool->work_cond);
+    qemu_cond_init(&pool->done_cond);
+    pool->queued = 0;
+    pool->taken = 0;
+    pool->quit = false;
+    pool->started = false;
+
+    /* Two batches per thread, so that the threads never wait for a write */
+    pool->nbatches = pool->nthreads * 2;
+    pool->batches = g_new0(DumpPageBatch, pool->nbatches);
+    for (i = 0; i < pool->nbatches; i++) {
+        DumpPageBatch *batch = &pool->batches[i];
+
+        batch->pages = g_new(uint8_t *, pool->batch_pages);
+        batch->flags = g_new(uint32_t, pool->batch_pages);
+        batch->size = g_new(size_t, pool->batch_pages);
+        batch->data = g_malloc(pool->batch_pages * pool->len_buf_out);
+    }
+
+    pool->threads = g_new0(DumpCompressThread, pool->nthreads);
+    for (i = 0; i < pool->nthreads; i++) {
+        DumpCompressThread *t = &pool->threads[i];
+
+        t->pool = pool;
+#ifdef CONFIG_LZO
+        t->wrkmem = g_malloc(LZO1X_1_MEM_COMPRESS);
+#endif
+#ifdef CONFIG_ZSTD
+        if (s->flag_compress & DUMP_DH_COMPRESSED_ZSTD) {
+            t->zstd = ZSTD_createCCtx();
+            if (!t->zstd) {
+                error_setg(errp, "dump: failed to create zstd context");
+                dump_page_pool_cleanup(pool);
+                return false;
+            }
+        }
+#endif
+    }
+
+    for (i = 0; i < pool->nthreads; i++) {
+        qemu_thread_create(&pool->threads[i].thread, "dump_compress",
+                           dump_compress_thread, &pool->threads[i],
+                           QEMU_THREAD_JOINABLE);
+    }
+    pool->started = true;
+    return true;
+}
+
+static void dump_page_pool_cleanup(DumpPagePool *pool)
+{
+    unsigned i;
+
+    if (pool->started) {
+        qemu_mutex_lock(&pool->lock);
+        pool->quit = true;
+        qemu_cond_broadcast(&pool->work_cond);
+        qemu_mutex_unlock(&pool->lock);
+    }
+
+    for (i = 0; i < pool->nthreads; i++) {
+        DumpCompressThread *t = &pool->threads[i];
+
+        if (pool->started) {
+            qemu_thread_join(&t->thread);
+        }
+#ifdef CONFIG_LZO
+        g_free(t->wrkmem);
+#endif
+#ifdef CONFIG_ZSTD
+        ZSTD_freeCCtx(t->zstd);
+#endif
+    }
+    g_free(pool->threads);
+
+    for (i = 0; i < pool->nbatches; i++) {
+        DumpPageBatch *batch = &pool->batches[i];
+
+        g_free(batch->pages);
+        g_free(batch->flags);
+        g_free(batch->size);
+        g_free(batch->data);
+    }
+    g_free(pool->batches);
+
+    qemu_cond_destroy(&pool->done_cond);
+    qemu_cond_destroy(&pool->work_cond);
+    qemu_mutex_destroy(&pool->lock);
+}
+
 static void write_dump_pages(DumpState *s, Error **errp)
 {
     int ret = 0;
     DataCache page_desc, page_data;
-    size_t len_buf_out, size_out;
-#ifdef CONFIG_LZO
-    lzo_bytep wrkmem = NULL;
-#endif
-    uint8_t *buf_out = NULL;
+    DumpPagePool pool;
+    DumpPageBatch *batch;
     off_t offset_desc, offset_data;
     PageDescriptor pd, pd_zero;
     uint8_t *buf;
     GuestPhysBlock *block_iter = NULL;
     uint64_t pfn_iter;
+    uint64_t written = 0;
+    bool more;
+    size_t i;
 
     /* get offset of page_desc and page_data in dump file */
     offset_desc = s->offset_page;
@@ -1320,15 +1597,11 @@ static void write_dump_pages(DumpState *s, Error **errp)
     prepare_data_cache(&page_desc, s, offset_desc);
     prepare_data_cache(&page_data, s, offset_data);
 
-    /* prepare buffer to store compressed data */
-    len_buf_out = get_len_buf_out(s->dump_info.page_size, s->flag_compress);
-    assert(len_buf_out != 0);
-
-#ifdef CONFIG_LZO
-    wrkmem = g_malloc(LZO1X_1_MEM_COMPRESS);
-#endif
-
-    buf_out = g_malloc(len_buf_out);
+    if (!dump_page_pool_init(&pool, s, errp)) {
+        free_data_cache(&page_desc);
+        free_data_cache(&page_data);
+        return;
+    }
 
     /*
      * init zero page's page_desc and page_data, because every zero page
@@ -1352,97 +1625,79 @@ static void write_dump_pages(DumpState *s, Error **errp)
      * dump memory to vmcore page by page. zero page will all be resided in the
      * first page of page section
      */
-    while (get_next_page(&block_iter, &pfn_iter, &buf, s)) {
-        /* check zero page */
-        if (is_zero_page(buf, s->dump_info.page_size)) {
-            ret = write_cache(&page_desc, &pd_zero, sizeof(PageDescriptor),
-                              false);
-            if (ret < 0) {
-                error_setg(errp, "dump: failed to write page desc");
-                goto out;
+    more = get_next_page(&block_iter, &pfn_iter, &buf, s);
+    for (;;) {
+        /* keep all the batches busy while there are pages left */
+        if (more && pool.queued - written < pool.nbatches) {
+            batch = &pool.batches[pool.queued % pool.nbatches];
+            batch->count = 0;
+            batch->done = false;
+            while (more && batch->count < pool.batch_pages) {
+                batch->pages[batch->count++] = buf;
+                more = get_next_page(&block_iter, &pfn_iter, &buf, s);
             }
-        } else {
-            /*
-             * not zero page, then:
-             * 1. compress the page
-             * 2. write the compressed page into the cache of page_data
-             * 3. get page desc of the compressed page and write it into the
-             *    cache of page_desc
-             *
-             * only one compression format will be used here, for
-             * s->flag_compress is set. But when compression fails to work,
-             * we fall back to save in plaintext.
-             */
-             size_out = len_buf_out;
-             if ((s->flag_compress & DUMP_DH_COMPRESSED_ZLIB) &&
-                    (compress2(buf_out, (uLongf *)&size_out, buf,
-                               s->dump_info.page_size, Z_BEST_SPEED) == Z_OK) &&
-                    (size_out < s->dump_info.page_size)) {
-                pd.flags = cpu_to_dump32(s, DUMP_DH_COMPRESSED_ZLIB);
-                pd.size  = cpu_to_dump32(s, size_out);
-
-                ret = write_cache(&page_data, buf_out, size_out, false);
-                if (ret < 0) {
-                    error_setg(errp, "dump: failed to write page data");
-                    goto out;
-                }
-#ifdef CONFIG_LZO
-            } else if ((s->flag_compress & DUMP_DH_COMPRESSED_LZO) &&
-                    (lzo1x_1_compress(buf, s->dump_info.page_size, buf_out,
-                    (lzo_uint *)&size_out, wrkmem) == LZO_E_OK) &&
-                    (size_out < s->dump_info.page_size)) {
-                pd.flags = cpu_to_dump32(s, DUMP_DH_COMPRESSED_LZO);
-                pd.size  = cpu_to_dump32(s, size_out);
-
-                ret = write_cache(&page_data, buf_out, size_out, false);
-                if (ret < 0) {
-                    error_setg(errp, "dump: failed to write page data");
-                    goto out;
-                }
-#endif
-#ifdef CONFIG_SNAPPY
-            } else if ((s->flag_compress & DUMP_DH_COMPRESSED_SNAPPY) &&
-                    (snappy_compress((char *)buf, s->dump_info.page_size,
-                    (char *)buf_out, &size_out) == SNAPPY_OK) &&
-                    (size_out < s->dump_info.page_size)) {
-                pd.flags = cpu_to_dump32(s, DUMP_DH_COMPRESSED_SNAPPY);
-                pd.size  = cpu_to_dump32(s, size_out);
-
-                ret = write_cache(&page_data, buf_out, size_out, false);
-                if (ret < 0) {
-                    error_setg(errp, "dump: failed to write page data");
-                    goto out;
-                }
-#endif
-            } else {
-                /*
-                 * fall back to save in plaintext, size_out should be
-                 * assigned the target's page size
-                 */
-                pd.flags = cpu_to_dump32(s, 0);
-                size_out = s->dump_info.page_size;
-                pd.size = cpu_to_dump32(s, size_out);
-
-                ret = write_cache(&page_data, buf,
-                                  s->dump_info.page_size, false);
+
+            qemu_mutex_lock(&pool.lock);
+            pool.queued++;
+            qemu_cond_signal(&pool.work_cond);
+            qemu_mutex_unlock(&pool.lock);
+            continue;
+        }
+
+        if (written == pool.queued) {
+            break;
+        }
+
+        /* write out the oldest batch */
+        batch = &pool.batches[written % pool.nbatches];
+        qemu_mutex_lock(&pool.lock);
+        while (!batch->done) {
+            qemu_cond_wait(&pool.done_cond, &pool.lock);
+        }
+        qemu_mutex_unlock(&pool.lock);
+
+        for (i = 0; i < batch->count; i++) {
+            if (!batch->size[i]) {
+                ret = write_cache(&page_desc, &pd_zero, sizeof(PageDescriptor),
+                                  false);
                 if (ret < 0) {
-                    error_setg(errp, "dump: failed to write page data");
+                    error_setg(errp, "dump: failed to write page desc");
                     goto out;
                 }
+                s->written_size += s->dump_info.page_size;
+                continue;
             }
 
-            /* get and write page desc here */
+            /*
+             * not zero page, then:
+             * 1. write the (compressed) page into the cache of page_data
+             * 2. get page desc of the page and write it into the cache of
+             *    page_desc
+             */
+            ret = write_cache(&page_data,
+                              batch->flags[i] ?
+                              batch->data + i * pool.len_buf_out :
+                              batch->pages[i],
+                              batch->size[i], false);
+            if (ret < 0) {
+                error_setg(errp, "dump: failed to write page data");
+                goto out;
+            }
+
+            pd.flags = cpu_to_dump32(s, batch->flags[i]);
+            pd.size = cpu_to_dump32(s, batch->size[i]);
             pd.page_flags = cpu_to_dump64(s, 0);
             pd.offset = cpu_to_dump64(s, offset_data);
-            offset_data += size_out;
+            offset_data += batch->size[i];
 
             ret = write_cache(&page_desc, &pd, sizeof(PageDescriptor), false);
             if (ret < 0) {
                 error_setg(errp, "dump: failed to write page desc");
                 goto out;
             }
+            s->written_size += s->dump_info.page_size;
         }
-        s->written_size += s->dump_info.page_size;
+        written++;
     }
 
     ret = write_cache(&page_desc, NULL, 0, true);
@@ -1457,14 +1712,9 @@ static void write_dump_pages(DumpState *s, Error **errp)
     }
 
 out:
+    dump_page_pool_cleanup(&pool);
     free_data_cache(&page_desc);
     free_data_cache(&page_data);
-
-#ifdef CONFIG_LZO
-    g_free(wrkmem);
-#endif
-
-    g_free(buf_out);
 }
 
 static void create_kdump_vmcore(DumpState *s, Error **errp)
@@ -1805,6 +2055,10 @@ static void dump_init(DumpState *s, int fd, bool has_format,
             s->flag_compress = DUMP_DH_COMPRESSED_SNAPPY;
             break;
 
+        case DUMP_GUEST_MEMORY_FORMAT_KDUMP_ZSTD:
+            s->flag_compress = DUMP_DH_COMPRESSED_ZSTD;
+            break;
+
         default:
             s->flag_compress = 0;
         }
@@ -1962,7 +2216,7 @@ void qmp_dump_guest_memory(bool paging, const char *file,
         detach_p = detach;
     }
 
-    /* check whether lzo/snappy is supported */
+    /* check whether lzo/snappy/zstd is supported */
 #ifndef CONFIG_LZO
     if (has_format && format == DUMP_GUEST_MEMORY_FORMAT_KDUMP_LZO) {
         error_setg(errp, "kdump-lzo is not available now");
@@ -1977,6 +2231,13 @@ void qmp_dump_guest_memory(bool paging, const char *file,
     }
 #endif
 
+#ifndef CONFIG_ZSTD
+    if (has_format && format == DUMP_GUEST_MEMORY_FORMAT_KDUMP_ZSTD) {
+        error_setg(errp, "kdump-zstd is not available now");
+        return;
+    }
+#endif
+
 #ifndef TARGET_X86_64
     if (has_format && format == DUMP_GUEST_MEMORY_FORMAT_WIN_DMP) {
         error_setg(errp, "Windows dump is only available for x86-64");
@@ -2058,6 +2319,13 @@ DumpGuestMemoryCapability *qmp_query_dump_guest_memory_capability(Error **errp)
     item->value = DUMP_GUEST_MEMORY_FORMAT_KDUMP_SNAPPY;
 #endif
 
+    /* add new item if kdump-zstd is available */
+#ifdef CONFIG_ZSTD
+    item->next = g_malloc0(sizeof(DumpGuestMemoryFormatList));
+    item = item->next;
+    item->value = DUMP_GUEST_MEMORY_FORMAT_KDUMP_ZSTD;
+#endif
+
     /* Windows dump is available only if target is x86_64 */
 #ifdef TARGET_X86_64
     item->next = g_malloc0(sizeof(DumpGuestMemoryFormatList));
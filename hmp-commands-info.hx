@@ -580,6 +580,19 @@ SRST
     Show current migration xbzrle cache size.
 ERST
 
+    {
+        .name       = "dirty_rate",
+        .args_type  = "",
+        .params     = "",
+        .help       = "show dirty rate information",
+        .cmd        = hmp_info_dirty_rate,
+    },
+
+SRST
+  ``info dirty_rate``
+    Show the result of the last dirty page rate calculation.
+ERST
+
     {
         .name       = "balloon",
         .args_type  = "",
@@ -730,6 +730,18 @@ const PropertyInfo qdev_prop_multifd_compression = {
     .set_default_value = set_default_value_enum,
 };
 
+/* --- CompressMethod --- */
+
+const PropertyInfo qdev_prop_compress_method = {
+    .name = "CompressMethod",
+    .description = "compress_method values, "
+                   "zlib/zstd",
+    .enum_table = &CompressMethod_lookup,
+    .get = get_enum,
+    .set = set_enum,
+    .set_default_value = set_default_value_enum,
+};
+
 /* --- pci address --- */
 
 /*
@@ -235,4 +235,52 @@ int qcrypto_cipher_setiv(QCryptoCipher *cipher,
                          const uint8_t *iv, size_t niv,
                          Error **errp);
 
+/**
+ * qcrypto_cipher_encrypt_sectors:
+ * @cipher: the cipher object
+ * @ivs: the initialization vectors, @niv bytes per sector
+ * @niv: the length of each initialization vector
+ * @buf: buffer holding the plain text, replaced by the cipher text
+ * @sectorsize: the size of each sector in bytes
+ * @nsectors: the number of sectors in @buf
+ * @errp: pointer to a NULL-initialized error object
+ *
+ * Encrypts @nsectors consecutive sectors in place, using
+ * the i-th IV from @ivs for the i-th sector. This is
+ * equivalent to calling qcrypto_cipher_setiv() and
+ * qcrypto_cipher_encrypt() once per sector, but lets
+ * the caller generate the IVs of a whole batch at once.
+ * If @niv is zero, no IV is set.
+ *
+ * The IV state of @cipher is undefined after this call.
+ *
+ * Returns: 0 on success, or -1 on error
+ */
+int qcrypto_cipher_encrypt_sectors(QCryptoCipher *cipher,
+                                   const uint8_t *ivs, size_t niv,
+                                   uint8_t *buf, size_t sectorsize,
+                                   size_t nsectors,
+                                   Error **errp);
+
+/**
+ * qcrypto_cipher_decrypt_sectors:
+ * @cipher: the cipher object
+ * @ivs: the initialization vectors, @niv bytes per sector
+ * @niv: the length of each initialization vector
+ * @buf: buffer holding the cipher text, replaced by the plain text
+ * @sectorsize: the size of each sector in bytes
+ * @nsectors: the number of sectors in @buf
+ * @errp: pointer to a NULL-initialized error object
+ *
+ * Decrypts @nsectors consecutive sectors in place; the
+ * counterpart of qcrypto_cipher_encrypt_sectors().
+ *
+ * Returns: 0 on success, or -1 on error
+ */
+int qcrypto_cipher_decrypt_sectors(QCryptoCipher *cipher,
+                                   const uint8_t *ivs, size_t niv,
+                                   uint8_t *buf, size_t sectorsize,
+                                   size_t nsectors,
+                                   Error **errp);
+
 #endif /* QCRYPTO_CIPHER_H */
@@ -129,6 +129,11 @@ typedef struct IOMMUNotifier IOMMUNotifier;
 /* RAM is a persistent kind memory */
 #define RAM_PMEM (1 << 5)
 
+/* Writes to this RAMBlock are tracked with userfaultfd write-protection.
+ * (Set during background snapshot)
+ */
+#define RAM_UF_WRITEPROTECT (1 << 6)
+
 static inline void iommu_notifier_init(IOMMUNotifier *n, IOMMUNotify fn,
                                        IOMMUNotifierFlag flags,
                                        hwaddr start, hwaddr end,
@@ -533,6 +538,20 @@ struct MemoryListener {
      */
     void (*log_sync)(MemoryListener *listener, MemoryRegionSection *section);
 
+    /**
+     * @log_sync_global:
+     *
+     * This is the global version of @log_sync for listeners that cannot
+     * synchronize the log with a finer granularity than the whole
+     * guest, for example because the dirty pages are reported per vCPU
+     * rather than per memory slot.  It is called once per sync instead
+     * of once per #MemoryRegionSection.  A listener must not define
+     * both @log_sync and @log_sync_global.
+     *
+     * @listener: The #MemoryListener.
+     */
+    void (*log_sync_global)(MemoryListener *listener);
+
     /**
      * @log_clear:
      *
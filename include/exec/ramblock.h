@@ -59,6 +59,16 @@ struct RAMBlock {
      */
     unsigned long *clear_bmap;
     uint8_t clear_bmap_shift;
+
+    /*
+     * With the mapped-ram capability, every page of the block has a
+     * fixed place in the migration file, starting at pages_offset.
+     * file_bmap tracks which of them hold data; it is written out at
+     * bitmap_offset once migration completes.  Source side only.
+     */
+    unsigned long *file_bmap;
+    off_t bitmap_offset;
+    off_t pages_offset;
 };
 #endif
 #endif
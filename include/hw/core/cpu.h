@@ -273,6 +273,7 @@ typedef struct SavedIOTLB {
 
 struct KVMState;
 struct kvm_run;
+struct kvm_dirty_gfn;
 
 struct hax_vcpu_state;
 
@@ -343,6 +344,13 @@ struct qemu_work_item;
  * @opaque: User data.
  * @mem_io_pc: Host Program Counter at which the memory was accessed.
  * @kvm_fd: vCPU file descriptor for KVM.
+ * @kvm_dirty_gfns: Mapping of the vCPU's KVM dirty ring, if enabled.
+ * @kvm_fetch_index: Next entry of @kvm_dirty_gfns to be harvested.
+ * @dirty_pages: Number of pages reported dirty by this vCPU's dirty ring.
+ * @dirty_pages_sampled: Value of @dirty_pages at the last dirty rate sample
+ *   of cpu_throttle_dirty_limit().
+ * @throttle_percentage: Throttle percentage of this vCPU alone, see
+ *   cpu_throttle_set_vcpu().
  * @work_mutex: Lock to prevent multiple access to @work_list.
  * @work_list: List of pending asynchronous work.
  * @trace_dstate_delayed: Delayed changes to trace_dstate (includes all changes
@@ -422,6 +430,10 @@ struct CPUState {
     int kvm_fd;
     struct KVMState *kvm_state;
     struct kvm_run *kvm_run;
+    struct kvm_dirty_gfn *kvm_dirty_gfns;
+    uint32_t kvm_fetch_index;
+    uint64_t dirty_pages;
+    uint64_t dirty_pages_sampled;
 
     /* Used for events with 'vcpu' and *without* the 'disabled' properties */
     DECLARE_BITMAP(trace_dstate_delayed, CPU_TRACE_DSTATE_MAX_EVENTS);
@@ -449,6 +461,7 @@ struct CPUState {
      * autoconverge
      */
     bool throttle_thread_scheduled;
+    int throttle_percentage;
 
     bool ignore_memory_transaction_failures;
 
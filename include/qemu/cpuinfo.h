@@ -0,0 +1,30 @@
+/*
+ * Host x86 ISA feature detection
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#ifndef QEMU_CPUINFO_H
+#define QEMU_CPUINFO_H
+
+#define CPUINFO_ALWAYS      (1u << 0)  /* detection has been run */
+#define CPUINFO_SSE2        (1u << 1)
+#define CPUINFO_SSE4        (1u << 2)
+#define CPUINFO_AVX2        (1u << 3)
+#define CPUINFO_AVX512F     (1u << 4)
+
+/**
+ * cpuinfo_init:
+ *
+ * Return the CPUINFO_* bits for the vector extensions that the host
+ * both implements and has enabled in the OS.  The CPUID probe runs
+ * once; later calls return the cached value, so it is safe to call
+ * from the __attribute__((constructor)) functions that select the
+ * accelerated routines of bufferiszero, hbitmap and xbzrle.
+ *
+ * Returns 0 (without CPUINFO_ALWAYS) on hosts without <cpuid.h>.
+ */
+unsigned cpuinfo_init(void);
+
+#endif
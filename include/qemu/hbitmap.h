@@ -349,4 +349,13 @@ bool hbitmap_next_dirty_area(const HBitmap *hb, int64_t start, int64_t end,
  */
 int64_t hbitmap_iter_next(HBitmapIter *hbi);
 
+/**
+ * test_hbitmap_next_accel:
+ *
+ * Switch the vectorized word scan and merge kernels to the next less
+ * preferred implementation.  Return false if the generic implementation
+ * was already in use.  For use by unit tests and benchmarks only.
+ */
+bool test_hbitmap_next_accel(void);
+
 #endif
@@ -611,6 +611,20 @@ void qemu_set_tty_echo(int fd, bool echo);
 void os_mem_prealloc(int fd, char *area, size_t sz, int smp_cpus,
                      Error **errp);
 
+/**
+ * os_mem_prealloc_on_cpus:
+ * @cpus: @ngroups bitmaps of @nr_cpus host CPUs each
+ *
+ * Like os_mem_prealloc(), but the threads are split evenly between the
+ * groups of host CPUs in @cpus, and each one only runs on the CPUs of its
+ * group.  The area is split between the groups in the same order, so
+ * that each group touches a contiguous part of it.  The binding is only
+ * honored on Linux.
+ */
+void os_mem_prealloc_on_cpus(int fd, char *area, size_t sz, int smp_cpus,
+                             unsigned long **cpus, int ngroups, int nr_cpus,
+                             Error **errp);
+
 /**
  * qemu_get_pid_name:
  * @pid: pid of a process
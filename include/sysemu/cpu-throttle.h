@@ -42,10 +42,59 @@ void cpu_throttle_init(void);
  */
 void cpu_throttle_set(int new_throttle_pct);
 
+/**
+ * cpu_throttle_set_vcpu:
+ * @cpu: The vCPU to throttle.
+ * @new_throttle_pct: Percent of sleep time. Valid range is 1 to 99, or 0
+ * to stop throttling @cpu.
+ *
+ * Throttles a single vcpu like cpu_throttle_set does for all of them.  A
+ * vcpu is throttled by the larger of its own and the global percentage.
+ *
+ * Must be called with the iothread lock held.
+ */
+void cpu_throttle_set_vcpu(CPUState *cpu, int new_throttle_pct);
+
+/**
+ * cpu_throttle_get_vcpu_percentage:
+ * @cpu: The vCPU to query.
+ *
+ * Returns: The throttle percentage set by cpu_throttle_set_vcpu for @cpu,
+ * or 0 if it is not throttled on its own.
+ */
+int cpu_throttle_get_vcpu_percentage(CPUState *cpu);
+
+/**
+ * cpu_throttle_vcpu_active:
+ *
+ * Returns: %true if any vcpu is throttled on its own, %false otherwise.
+ */
+bool cpu_throttle_vcpu_active(void);
+
+/**
+ * cpu_throttle_dirty_limit:
+ * @quota_mbps: Dirty page rate allowed to each vcpu, in MB/s.
+ * @max_pct: Highest throttle percentage to apply.
+ *
+ * Measures the dirty page rate of each vcpu since the previous call, from
+ * the pages its KVM dirty ring reported, and adjusts the throttle of each
+ * vcpu so that its rate converges to @quota_mbps.  vcpus that stay below
+ * the quota are not slowed down.  The first call only takes a sample.
+ *
+ * The dirty rings must be harvested just before the call, e.g. by a dirty
+ * log sync, for the rates to be accurate.
+ *
+ * Must be called with the iothread lock held.
+ */
+void cpu_throttle_dirty_limit(uint64_t quota_mbps, int max_pct);
+
 /**
  * cpu_throttle_stop:
  *
- * Stops the vcpu throttling started by cpu_throttle_set.
+ * Stops the vcpu throttling started by cpu_throttle_set, as well as that
+ * of each vcpu, and drops the dirty rate sample of cpu_throttle_dirty_limit.
+ *
+ * Must be called with the iothread lock held.
  */
 void cpu_throttle_stop(void);
 
@@ -216,6 +216,14 @@ int kvm_has_many_ioeventfds(void);
 int kvm_has_gsi_routing(void);
 int kvm_has_intx_set_mask(void);
 
+/**
+ * kvm_dirty_ring_enabled:
+ *
+ * Returns: true if the vCPUs report dirty pages through KVM dirty rings,
+ * which also counts them per vCPU in CPUState.dirty_pages.
+ */
+bool kvm_dirty_ring_enabled(void);
+
 int kvm_init_vcpu(CPUState *cpu);
 int kvm_cpu_exec(CPUState *cpu);
 int kvm_destroy_vcpu(CPUState *cpu);
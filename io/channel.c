@@ -67,12 +67,13 @@ ssize_t qio_channel_readv_full(QIOChannel *ioc,
 }
 
 
-ssize_t qio_channel_writev_full(QIOChannel *ioc,
-                                const struct iovec *iov,
-                                size_t niov,
-                                int *fds,
-                                size_t nfds,
-                                Error **errp)
+static ssize_t qio_channel_writev_full_flags(QIOChannel *ioc,
+                                             const struct iovec *iov,
+                                             size_t niov,
+                                             int *fds,
+                                             size_t nfds,
+                                             int flags,
+                                             Error **errp)
 {
     QIOChannelClass *klass = QIO_CHANNEL_GET_CLASS(ioc);
 
@@ -83,7 +84,25 @@ ssize_t qio_channel_writev_full(QIOChannel *ioc,
         return -1;
     }
 
-    return klass->io_writev(ioc, iov, niov, fds, nfds, errp);
+    if ((flags & QIO_CHANNEL_WRITE_FLAG_ZERO_COPY) &&
+        !qio_channel_has_feature(ioc, QIO_CHANNEL_FEATURE_WRITE_ZERO_COPY)) {
+        error_setg_errno(errp, EINVAL,
+                         "Channel does not support zero copy writes");
+        return -1;
+    }
+
+    return klass->io_writev(ioc, iov, niov, fds, nfds, flags, errp);
+}
+
+
+ssize_t qio_channel_writev_full(QIOChannel *ioc,
+                                const struct iovec *iov,
+                                size_t niov,
+                                int *fds,
+                                size_t nfds,
+                                Error **errp)
+{
+    return qio_channel_writev_full_flags(ioc, iov, niov, fds, nfds, 0, errp);
 }
 
 
@@ -156,6 +175,15 @@ int qio_channel_writev_all(QIOChannel *ioc,
                            const struct iovec *iov,
                            size_t niov,
                            Error **errp)
+{
+    return qio_channel_writev_all_flags(ioc, iov, niov, 0, errp);
+}
+
+int qio_channel_writev_all_flags(QIOChannel *ioc,
+                                 const struct iovec *iov,
+                                 size_t niov,
+                                 int flags,
+                                 Error **errp)
 {
     int ret = -1;
     struct iovec *local_iov = g_new(struct iovec, niov);
@@ -168,7 +196,8 @@ int qio_channel_writev_all(QIOChannel *ioc,
 
     while (nlocal_iov > 0) {
         ssize_t len;
-        len = qio_channel_writev(ioc, local_iov, nlocal_iov, errp);
+        len = qio_channel_writev_full_flags(ioc, local_iov, nlocal_iov,
+                                            NULL, 0, flags, errp);
         if (len == QIO_CHANNEL_ERR_BLOCK) {
             if (qemu_in_coroutine()) {
                 qio_channel_yield(ioc, G_IO_OUT);
@@ -363,6 +392,20 @@ int qio_channel_shutdown(QIOChannel *ioc,
 }
 
 
+int qio_channel_flush(QIOChannel *ioc,
+                      Error **errp)
+{
+    QIOChannelClass *klass = QIO_CHANNEL_GET_CLASS(ioc);
+
+    if (!klass->io_flush ||
+        !qio_channel_has_feature(ioc, QIO_CHANNEL_FEATURE_WRITE_ZERO_COPY)) {
+        return 0;
+    }
+
+    return klass->io_flush(ioc, errp);
+}
+
+
 void qio_channel_set_delay(QIOChannel *ioc,
                            bool enabled)
 {
@@ -401,6 +444,102 @@ off_t qio_channel_io_seek(QIOChannel *ioc,
 }
 
 
+static int qio_channel_prwv_all(QIOChannel *ioc,
+                                const struct iovec *iov,
+                                size_t niov,
+                                off_t offset,
+                                bool is_write,
+                                Error **errp)
+{
+    QIOChannelClass *klass = QIO_CHANNEL_GET_CLASS(ioc);
+    int ret = -1;
+    struct iovec *local_iov;
+    struct iovec *local_iov_head;
+    unsigned int nlocal_iov = niov;
+
+    if (!qio_channel_has_feature(ioc, QIO_CHANNEL_FEATURE_SEEKABLE) ||
+        !(is_write ? klass->io_pwritev : klass->io_preadv)) {
+        error_setg(errp, "Channel does not support random access");
+        return -1;
+    }
+
+    local_iov = g_new(struct iovec, niov);
+    local_iov_head = local_iov;
+    nlocal_iov = iov_copy(local_iov, nlocal_iov,
+                          iov, niov,
+                          0, iov_size(iov, niov));
+
+    while (nlocal_iov > 0) {
+        ssize_t len;
+
+        if (is_write) {
+            len = klass->io_pwritev(ioc, local_iov, nlocal_iov, offset, errp);
+        } else {
+            len = klass->io_preadv(ioc, local_iov, nlocal_iov, offset, errp);
+        }
+        if (len < 0) {
+            goto cleanup;
+        }
+        if (len == 0 && !is_write) {
+            error_setg(errp, "Unexpected end-of-file at offset %lld",
+                       (long long int)offset);
+            goto cleanup;
+        }
+
+        iov_discard_front(&local_iov, &nlocal_iov, len);
+        offset += len;
+    }
+
+    ret = 0;
+
+ cleanup:
+    g_free(local_iov_head);
+    return ret;
+}
+
+
+int qio_channel_pwritev_all(QIOChannel *ioc,
+                            const struct iovec *iov,
+                            size_t niov,
+                            off_t offset,
+                            Error **errp)
+{
+    return qio_channel_prwv_all(ioc, iov, niov, offset, true, errp);
+}
+
+
+int qio_channel_pwrite_all(QIOChannel *ioc,
+                           const char *buf,
+                           size_t buflen,
+                           off_t offset,
+                           Error **errp)
+{
+    struct iovec iov = { .iov_base = (char *)buf, .iov_len = buflen };
+    return qio_channel_pwritev_all(ioc, &iov, 1, offset, errp);
+}
+
+
+int qio_channel_preadv_all(QIOChannel *ioc,
+                           const struct iovec *iov,
+                           size_t niov,
+                           off_t offset,
+                           Error **errp)
+{
+    return qio_channel_prwv_all(ioc, iov, niov, offset, false, errp);
+}
+
+
+int qio_channel_pread_all(QIOChannel *ioc,
+                          char *buf,
+                          size_t buflen,
+                          off_t offset,
+                          Error **errp)
+{
+    struct iovec iov = { .iov_base = buf, .iov_len = buflen };
+    return qio_channel_preadv_all(ioc, &iov, 1, offset, errp);
+}
+
+
 static void qio_channel_restart_read(void *opaque)
 {
     QIOChannel *ioc = opaque;
@@ -19,6 +19,7 @@
 #include "qemu/main-loop.h"
 #include "qemu/cutils.h"
 #include "qemu/queue.h"
+#include "qemu/bitmap.h"
 #include "block.h"
 #include "migration/misc.h"
 #include "migration.h"
@@ -35,8 +36,6 @@
 #define BLK_MIG_FLAG_PROGRESS           0x04
 #define BLK_MIG_FLAG_ZERO_BLOCK         0x08
 
-#define MAX_IS_ALLOCATED_SEARCH (65536 * BDRV_SECTOR_SIZE)
-
 #define MAX_IO_BUFFERS 512
 #define MAX_PARALLEL_IO 16
 
@@ -61,25 +60,28 @@ typedef struct BlkMigDevState {
 
     /* Only used by migration thread.  Does not need a lock.  */
     int bulk_completed;
-    int64_t cur_sector;
     int64_t cur_dirty;
 
-    /* Data in the aio_bitmap is protected by block migration lock.
-     * Allocation and free happen during setup and cleanup respectively.
+    /* One bit per chunk with a read in flight.  Data in the aio_bitmap
+     * is protected by block migration lock.  Allocation and free happen
+     * during setup and cleanup respectively.
      */
     unsigned long *aio_bitmap;
 
     /* Protected by block migration lock.  */
     int64_t completed_sectors;
 
-    /* During migration this is protected by iothread lock / AioContext.
+    /* Chunks still to be sent.  Filled with the whole device (or its
+     * allocated part with a shared base) at setup, so that the bulk
+     * phase is just the first pass over it.
+     * During migration this is protected by iothread lock / AioContext.
      * Allocation and free happen during setup and cleanup respectively.
      */
     BdrvDirtyBitmap *dirty_bitmap;
 } BlkMigDevState;
 
 typedef struct BlkMigBlock {
-    /* Only used by migration thread.  */
+    /* Only used by migration thread.  NULL for a chunk known to be zero.  */
     uint8_t *buf;
     BlkMigDevState *bmds;
     int64_t sector;
@@ -132,8 +134,9 @@ static void blk_send(QEMUFile *f, BlkMigBlock * blk)
     int len;
     uint64_t flags = BLK_MIG_FLAG_DEVICE_BLOCK;
 
-    if (block_mig_state.zero_blocks &&
-        buffer_is_zero(blk->buf, BLK_MIG_BLOCK_SIZE)) {
+    if (!blk->buf ||
+        (block_mig_state.zero_blocks &&
+         buffer_is_zero(blk->buf, BLK_MIG_BLOCK_SIZE))) {
         flags |= BLK_MIG_FLAG_ZERO_BLOCK;
     }
 
@@ -148,9 +151,13 @@ static void blk_send(QEMUFile *f, BlkMigBlock * blk)
 
     /* if a block is zero we need to flush here since the network
      * bandwidth is now a lot higher than the storage device bandwidth.
-     * thus if we queue zero blocks we slow down the migration */
+     * thus if we queue zero blocks we slow down the migration.  Blocks
+     * known to be zero without reading them cost no storage bandwidth,
+     * so they are simply queued. */
     if (flags & BLK_MIG_FLAG_ZERO_BLOCK) {
-        qemu_fflush(f);
+        if (blk->buf) {
+            qemu_fflush(f);
+        }
         return;
     }
 
@@ -201,11 +208,9 @@ uint64_t blk_mig_bytes_total(void)
 
 static int bmds_aio_inflight(BlkMigDevState *bmds, int64_t sector)
 {
-    int64_t chunk = sector / (int64_t)BDRV_SECTORS_PER_DIRTY_CHUNK;
-
-    if (sector < blk_nb_sectors(bmds->blk)) {
-        return !!(bmds->aio_bitmap[chunk / (sizeof(unsigned long) * 8)] &
-            (1UL << (chunk % (sizeof(unsigned long) * 8))));
+    if (sector < bmds->total_sectors) {
+        return test_bit(sector / BDRV_SECTORS_PER_DIRTY_CHUNK,
+                        bmds->aio_bitmap);
     } else {
         return 0;
     }
@@ -217,33 +222,21 @@ static void bmds_set_aio_inflight(BlkMigDevState *bmds, int64_t sector_num,
                              int nb_sectors, int set)
 {
     int64_t start, end;
-    unsigned long val, idx, bit;
 
     start = sector_num / BDRV_SECTORS_PER_DIRTY_CHUNK;
     end = (sector_num + nb_sectors - 1) / BDRV_SECTORS_PER_DIRTY_CHUNK;
 
-    for (; start <= end; start++) {
-        idx = start / (sizeof(unsigned long) * 8);
-        bit = start % (sizeof(unsigned long) * 8);
-        val = bmds->aio_bitmap[idx];
-        if (set) {
-            val |= 1UL << bit;
-        } else {
-            val &= ~(1UL << bit);
-        }
-        bmds->aio_bitmap[idx] = val;
+    if (set) {
+        bitmap_set(bmds->aio_bitmap, start, end - start + 1);
+    } else {
+        bitmap_clear(bmds->aio_bitmap, start, end - start + 1);
     }
 }
 
 static void alloc_aio_bitmap(BlkMigDevState *bmds)
 {
-    BlockBackend *bb = bmds->blk;
-    int64_t bitmap_size;
-
-    bitmap_size = blk_nb_sectors(bb) + BDRV_SECTORS_PER_DIRTY_CHUNK * 8 - 1;
-    bitmap_size /= BDRV_SECTORS_PER_DIRTY_CHUNK * 8;
-
-    bmds->aio_bitmap = g_malloc0(bitmap_size);
+    bmds->aio_bitmap = bitmap_new(DIV_ROUND_UP(bmds->total_sectors,
+                                               BDRV_SECTORS_PER_DIRTY_CHUNK));
 }
 
 /* Never hold migration lock when yielding to the main loop!  */
@@ -264,85 +257,40 @@ static void blk_mig_read_cb(void *opaque, int ret)
     blk_mig_unlock();
 }
 
-/* Called with no lock taken.  */
+/* Called with iothread lock taken.  */
+
+/* Mark everything the bulk phase has to send as dirty.  */
 
-static int mig_save_device_bulk(QEMUFile *f, BlkMigDevState *bmds)
+static void bmds_mark_bulk(BlkMigDevState *bmds)
 {
-    int64_t total_sectors = bmds->total_sectors;
-    int64_t cur_sector = bmds->cur_sector;
-    BlockBackend *bb = bmds->blk;
-    BlkMigBlock *blk;
-    int nr_sectors;
-    int64_t count;
+    BlockDriverState *bs = blk_bs(bmds->blk);
+    int64_t total_bytes = bmds->total_sectors * BDRV_SECTOR_SIZE;
+    int64_t offset = 0, count;
+    int ret;
 
-    if (bmds->shared_base) {
-        qemu_mutex_lock_iothread();
-        aio_context_acquire(blk_get_aio_context(bb));
+    if (!bmds->shared_base) {
+        bdrv_set_dirty_bitmap(bmds->dirty_bitmap, 0, total_bytes);
+        return;
+    }
+
+    aio_context_acquire(blk_get_aio_context(bmds->blk));
+    while (offset < total_bytes) {
+        ret = bdrv_is_allocated(bs, offset, total_bytes - offset, &count);
         /* Skip unallocated sectors; intentionally treats failure or
          * partial sector as an allocated sector */
-        while (cur_sector < total_sectors &&
-               !bdrv_is_allocated(blk_bs(bb), cur_sector * BDRV_SECTOR_SIZE,
-                                  MAX_IS_ALLOCATED_SEARCH, &count)) {
-            if (count < BDRV_SECTOR_SIZE) {
-                break;
-            }
-            cur_sector += count >> BDRV_SECTOR_BITS;
+        if (ret < 0 || count < BDRV_SECTOR_SIZE) {
+            bdrv_set_dirty_bitmap(bmds->dirty_bitmap, offset,
+                                  total_bytes - offset);
+            break;
         }
-        aio_context_release(blk_get_aio_context(bb));
-        qemu_mutex_unlock_iothread();
-    }
-
-    if (cur_sector >= total_sectors) {
-        bmds->cur_sector = bmds->completed_sectors = total_sectors;
-        return 1;
-    }
-
-    bmds->completed_sectors = cur_sector;
-
-    cur_sector &= ~((int64_t)BDRV_SECTORS_PER_DIRTY_CHUNK - 1);
-
-    /* we are going to transfer a full block even if it is not allocated */
-    nr_sectors = BDRV_SECTORS_PER_DIRTY_CHUNK;
-
-    if (total_sectors - cur_sector < BDRV_SECTORS_PER_DIRTY_CHUNK) {
-        nr_sectors = total_sectors - cur_sector;
+        if (ret) {
+            bdrv_set_dirty_bitmap(bmds->dirty_bitmap, offset, count);
+        }
+        offset += count;
     }
-
-    blk = g_new(BlkMigBlock, 1);
-    blk->buf = g_malloc(BLK_MIG_BLOCK_SIZE);
-    blk->bmds = bmds;
-    blk->sector = cur_sector;
-    blk->nr_sectors = nr_sectors;
-
-    qemu_iovec_init_buf(&blk->qiov, blk->buf, nr_sectors * BDRV_SECTOR_SIZE);
-
-    blk_mig_lock();
-    block_mig_state.submitted++;
-    blk_mig_unlock();
-
-    /* We do not know if bs is under the main thread (and thus does
-     * not acquire the AioContext when doing AIO) or rather under
-     * dataplane.  Thus acquire both the iothread mutex and the
-     * AioContext.
-     *
-     * This is ugly and will disappear when we make bdrv_* thread-safe,
-     * without the need to acquire the AioContext.
-     */
-    qemu_mutex_lock_iothread();
-    aio_context_acquire(blk_get_aio_context(bmds->blk));
-    bdrv_reset_dirty_bitmap(bmds->dirty_bitmap, cur_sector * BDRV_SECTOR_SIZE,
-                            nr_sectors * BDRV_SECTOR_SIZE);
-    blk->aiocb = blk_aio_preadv(bb, cur_sector * BDRV_SECTOR_SIZE, &blk->qiov,
-                                0, blk_mig_read_cb, blk);
     aio_context_release(blk_get_aio_context(bmds->blk));
-    qemu_mutex_unlock_iothread();
-
-    bmds->cur_sector = cur_sector + nr_sectors;
-    return (bmds->cur_sector >= total_sectors);
 }
 
-/* Called with iothread lock taken.  */
-
 static int set_dirty_tracking(void)
 {
     BlkMigDevState *bmds;
@@ -357,6 +305,9 @@ static int set_dirty_tracking(void)
             goto fail;
         }
     }
+    QSIMPLEQ_FOREACH(bmds, &block_mig_state.bmds_list, entry) {
+        bmds_mark_bulk(bmds);
+    }
     return 0;
 
 fail:
@@ -468,128 +419,146 @@ out:
     return ret;
 }
 
-/* Called with no lock taken.  */
-
-static int blk_mig_save_bulked_block(QEMUFile *f)
+static void blk_mig_reset_dirty_cursor(void)
 {
-    int64_t completed_sector_sum = 0;
     BlkMigDevState *bmds;
-    int progress;
-    int ret = 0;
 
     QSIMPLEQ_FOREACH(bmds, &block_mig_state.bmds_list, entry) {
-        if (bmds->bulk_completed == 0) {
-            if (mig_save_device_bulk(f, bmds) == 1) {
-                /* completed bulk section for this device */
-                bmds->bulk_completed = 1;
-            }
-            completed_sector_sum += bmds->completed_sectors;
-            ret = 1;
-            break;
-        } else {
-            completed_sector_sum += bmds->completed_sectors;
-        }
-    }
-
-    if (block_mig_state.total_sector_sum != 0) {
-        progress = completed_sector_sum * 100 /
-                   block_mig_state.total_sector_sum;
-    } else {
-        progress = 100;
-    }
-    if (progress != block_mig_state.prev_progress) {
-        block_mig_state.prev_progress = progress;
-        qemu_put_be64(f, (progress << BDRV_SECTOR_BITS)
-                         | BLK_MIG_FLAG_PROGRESS);
-        DPRINTF("Completed %d %%\r", progress);
+        bmds->cur_dirty = 0;
     }
-
-    return ret;
 }
 
-static void blk_mig_reset_dirty_cursor(void)
+/* Called with iothread lock and AioContext taken.
+ *
+ * Return true if the block layer knows that the chunk reads as zeroes,
+ * so that it can be sent without reading it.
+ */
+
+static bool bmds_chunk_is_zero(BlkMigDevState *bmds, int64_t sector,
+                               int nr_sectors)
 {
-    BlkMigDevState *bmds;
+    int64_t offset = sector * BDRV_SECTOR_SIZE;
+    int64_t bytes = nr_sectors * BDRV_SECTOR_SIZE;
+    int64_t pnum;
+    int ret;
 
-    QSIMPLEQ_FOREACH(bmds, &block_mig_state.bmds_list, entry) {
-        bmds->cur_dirty = 0;
+    if (!block_mig_state.zero_blocks) {
+        return false;
     }
+
+    while (bytes > 0) {
+        ret = bdrv_block_status_above(blk_bs(bmds->blk), NULL, offset, bytes,
+                                      &pnum, NULL, NULL);
+        if (ret < 0 || !(ret & BDRV_BLOCK_ZERO) || pnum == 0) {
+            return false;
+        }
+        offset += pnum;
+        bytes -= pnum;
+    }
+    return true;
 }
 
-/* Called with iothread lock and AioContext taken.  */
+/* Called with iothread lock and AioContext taken.
+ *
+ * Queue the next dirty chunk at or after the cursor of the device.
+ *
+ * return value:
+ * 0: a chunk was queued, the device may have more
+ * 1: the cursor reached the end of the device
+ * < 0: error
+ */
 
 static int mig_save_device_dirty(QEMUFile *f, BlkMigDevState *bmds,
                                  int is_async)
 {
     BlkMigBlock *blk;
     int64_t total_sectors = bmds->total_sectors;
+    int64_t offset;
     int64_t sector;
     int nr_sectors;
     int ret = -EIO;
 
-    for (sector = bmds->cur_dirty; sector < bmds->total_sectors;) {
-        blk_mig_lock();
-        if (bmds_aio_inflight(bmds, sector)) {
+    if (bmds->cur_dirty >= total_sectors) {
+        return 1;
+    }
+
+    bdrv_dirty_bitmap_lock(bmds->dirty_bitmap);
+    offset = bdrv_dirty_bitmap_next_dirty(bmds->dirty_bitmap,
+                                          bmds->cur_dirty * BDRV_SECTOR_SIZE,
+                                          INT64_MAX);
+    if (offset < 0) {
+        bdrv_dirty_bitmap_unlock(bmds->dirty_bitmap);
+        bmds->cur_dirty = total_sectors;
+        return 1;
+    }
+
+    sector = QEMU_ALIGN_DOWN(offset >> BDRV_SECTOR_BITS,
+                             BDRV_SECTORS_PER_DIRTY_CHUNK);
+    if (total_sectors - sector < BDRV_SECTORS_PER_DIRTY_CHUNK) {
+        nr_sectors = total_sectors - sector;
+    } else {
+        nr_sectors = BDRV_SECTORS_PER_DIRTY_CHUNK;
+    }
+    bdrv_reset_dirty_bitmap_locked(bmds->dirty_bitmap,
+                                   sector * BDRV_SECTOR_SIZE,
+                                   nr_sectors * BDRV_SECTOR_SIZE);
+    bdrv_dirty_bitmap_unlock(bmds->dirty_bitmap);
+
+    /* An earlier read of the chunk must be queued before this one */
+    blk_mig_lock();
+    if (bmds_aio_inflight(bmds, sector)) {
+        blk_mig_unlock();
+        blk_drain(bmds->blk);
+    } else {
+        blk_mig_unlock();
+    }
+
+    blk = g_new(BlkMigBlock, 1);
+    blk->buf = NULL;
+    blk->bmds = bmds;
+    blk->sector = sector;
+    blk->nr_sectors = nr_sectors;
+    blk->ret = 0;
+
+    if (bmds_chunk_is_zero(bmds, sector, nr_sectors)) {
+        if (is_async) {
+            blk_mig_lock();
+            QSIMPLEQ_INSERT_TAIL(&block_mig_state.blk_list, blk, entry);
+            block_mig_state.read_done++;
             blk_mig_unlock();
-            blk_drain(bmds->blk);
         } else {
-            blk_mig_unlock();
+            blk_send(f, blk);
+            g_free(blk);
         }
-        bdrv_dirty_bitmap_lock(bmds->dirty_bitmap);
-        if (bdrv_dirty_bitmap_get_locked(bmds->dirty_bitmap,
-                                         sector * BDRV_SECTOR_SIZE)) {
-            if (total_sectors - sector < BDRV_SECTORS_PER_DIRTY_CHUNK) {
-                nr_sectors = total_sectors - sector;
-            } else {
-                nr_sectors = BDRV_SECTORS_PER_DIRTY_CHUNK;
-            }
-            bdrv_reset_dirty_bitmap_locked(bmds->dirty_bitmap,
-                                           sector * BDRV_SECTOR_SIZE,
-                                           nr_sectors * BDRV_SECTOR_SIZE);
-            bdrv_dirty_bitmap_unlock(bmds->dirty_bitmap);
-
-            blk = g_new(BlkMigBlock, 1);
-            blk->buf = g_malloc(BLK_MIG_BLOCK_SIZE);
-            blk->bmds = bmds;
-            blk->sector = sector;
-            blk->nr_sectors = nr_sectors;
-
-            if (is_async) {
-                qemu_iovec_init_buf(&blk->qiov, blk->buf,
-                                    nr_sectors * BDRV_SECTOR_SIZE);
-
-                blk->aiocb = blk_aio_preadv(bmds->blk,
-                                            sector * BDRV_SECTOR_SIZE,
-                                            &blk->qiov, 0, blk_mig_read_cb,
-                                            blk);
-
-                blk_mig_lock();
-                block_mig_state.submitted++;
-                bmds_set_aio_inflight(bmds, sector, nr_sectors, 1);
-                blk_mig_unlock();
-            } else {
-                ret = blk_pread(bmds->blk, sector * BDRV_SECTOR_SIZE, blk->buf,
-                                nr_sectors * BDRV_SECTOR_SIZE);
-                if (ret < 0) {
-                    goto error;
-                }
-                blk_send(f, blk);
+    } else if (is_async) {
+        blk->buf = g_malloc(BLK_MIG_BLOCK_SIZE);
+        qemu_iovec_init_buf(&blk->qiov, blk->buf,
+                            nr_sectors * BDRV_SECTOR_SIZE);
 
-                g_free(blk->buf);
-                g_free(blk);
-            }
+        blk->aiocb = blk_aio_preadv(bmds->blk,
+                                    sector * BDRV_SECTOR_SIZE,
+                                    &blk->qiov, 0, blk_mig_read_cb,
+                                    blk);
 
-            sector += nr_sectors;
-            bmds->cur_dirty = sector;
-            break;
+        blk_mig_lock();
+        block_mig_state.submitted++;
+        bmds_set_aio_inflight(bmds, sector, nr_sectors, 1);
+        blk_mig_unlock();
+    } else {
+        blk->buf = g_malloc(BLK_MIG_BLOCK_SIZE);
+        ret = blk_pread(bmds->blk, sector * BDRV_SECTOR_SIZE, blk->buf,
+                        nr_sectors * BDRV_SECTOR_SIZE);
+        if (ret < 0) {
+            goto error;
         }
+        blk_send(f, blk);
 
-        bdrv_dirty_bitmap_unlock(bmds->dirty_bitmap);
-        sector += BDRV_SECTORS_PER_DIRTY_CHUNK;
-        bmds->cur_dirty = sector;
+        g_free(blk->buf);
+        g_free(blk);
     }
 
-    return (bmds->cur_dirty >= bmds->total_sectors);
+    bmds->cur_dirty = sector + nr_sectors;
+    return (bmds->cur_dirty >= total_sectors);
 
 error:
     DPRINTF("Error reading sector %" PRId64 "\n", sector);
@@ -598,6 +567,52 @@ error:
     return ret;
 }
 
+/* Called with iothread lock taken.  */
+
+static int blk_mig_save_bulked_block(QEMUFile *f)
+{
+    int64_t completed_sector_sum = 0;
+    BlkMigDevState *bmds;
+    int progress;
+    int ret = 0;
+
+    QSIMPLEQ_FOREACH(bmds, &block_mig_state.bmds_list, entry) {
+        if (bmds->bulk_completed == 0) {
+            aio_context_acquire(blk_get_aio_context(bmds->blk));
+            ret = mig_save_device_dirty(f, bmds, 1);
+            aio_context_release(blk_get_aio_context(bmds->blk));
+            if (ret < 0) {
+                return ret;
+            }
+            if (ret == 1) {
+                /* completed bulk section for this device */
+                bmds->bulk_completed = 1;
+            }
+            bmds->completed_sectors = bmds->cur_dirty;
+            completed_sector_sum += bmds->completed_sectors;
+            ret = 1;
+            break;
+        } else {
+            completed_sector_sum += bmds->completed_sectors;
+        }
+    }
+
+    if (block_mig_state.total_sector_sum != 0) {
+        progress = completed_sector_sum * 100 /
+                   block_mig_state.total_sector_sum;
+    } else {
+        progress = 100;
+    }
+    if (progress != block_mig_state.prev_progress) {
+        block_mig_state.prev_progress = progress;
+        qemu_put_be64(f, (progress << BDRV_SECTOR_BITS)
+                         | BLK_MIG_FLAG_PROGRESS);
+        DPRINTF("Completed %d %%\r", progress);
+    }
+
+    return ret;
+}
+
 /* Called with iothread lock taken.
  *
  * return value:
@@ -767,7 +782,10 @@ static int block_save_iterate(QEMUFile *f, void *opaque)
         return ret;
     }
 
-    blk_mig_reset_dirty_cursor();
+    /* The bulk phase is a single pass that spans several iterations */
+    if (block_mig_state.bulk_completed) {
+        blk_mig_reset_dirty_cursor();
+    }
 
     /* control the rate of transfer */
     blk_mig_lock();
@@ -777,21 +795,25 @@ static int block_save_iterate(QEMUFile *f, void *opaque)
            (block_mig_state.submitted + block_mig_state.read_done) <
            MAX_IO_BUFFERS) {
         blk_mig_unlock();
+        /* Both phases are always called with iothread lock taken for
+         * simplicity, block_save_complete also calls them.  It is only
+         * held for one chunk, because looking up the block status of a
+         * chunk may do I/O and the guest must not stall meanwhile.
+         */
+        qemu_mutex_lock_iothread();
         if (block_mig_state.bulk_completed == 0) {
             /* first finish the bulk phase */
-            if (blk_mig_save_bulked_block(f) == 0) {
+            ret = blk_mig_save_bulked_block(f);
+            if (ret == 0) {
                 /* finished saving bulk on all devices */
                 block_mig_state.bulk_completed = 1;
+            } else if (ret > 0) {
+                ret = 0;
             }
-            ret = 0;
         } else {
-            /* Always called with iothread lock taken for
-             * simplicity, block_save_complete also calls it.
-             */
-            qemu_mutex_lock_iothread();
             ret = blk_mig_save_dirty_block(f, 1);
-            qemu_mutex_unlock_iothread();
         }
+        qemu_mutex_unlock_iothread();
         if (ret < 0) {
             return ret;
         }
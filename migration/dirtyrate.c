@@ -0,0 +1,558 @@
+/*
+ * Dirtyrate implement code
+ *
+ * The dirty page rate of the guest is estimated by hashing a random
+ * sample of its pages twice, some time apart, and counting the pages
+ * whose hash changed.  With the KVM dirty ring, the pages that each vCPU
+ * dirtied can be counted instead.  No migration needs to be running.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/units.h"
+#include "qemu/crc32c.h"
+#include "qemu/rcu.h"
+#include "qemu/timer.h"
+#include "qemu/error-report.h"
+#include "qemu/main-loop.h"
+#include "qapi/error.h"
+#include "exec/memory.h"
+#include "exec/ramblock.h"
+#include "exec/target_page.h"
+#include "hw/core/cpu.h"
+#include "sysemu/kvm.h"
+#include "qapi/qapi-commands-migration.h"
+#include "migration.h"
+#include "ram.h"
+#include "trace.h"
+#include "dirtyrate.h"
+
+static int CalculatingState = DIRTY_RATE_STATUS_UNSTARTED;
+static struct DirtyRateStat DirtyStat;
+
+static int64_t set_sample_page_period(int64_t msec, int64_t initial_time)
+{
+    int64_t current_time;
+
+    current_time = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
+    if ((current_time - initial_time) >= msec) {
+        msec = current_time - initial_time;
+    } else {
+        g_usleep((msec + initial_time - current_time) * 1000);
+    }
+
+    return msec;
+}
+
+static bool is_sample_period_valid(int64_t sec)
+{
+    if (sec < MIN_FETCH_DIRTYRATE_TIME_SEC ||
+        sec > MAX_FETCH_DIRTYRATE_TIME_SEC) {
+        return false;
+    }
+
+    return true;
+}
+
+static bool is_sample_pages_valid(int64_t pages)
+{
+    return pages >= MIN_SAMPLE_PAGE_COUNT &&
+           pages <= MAX_SAMPLE_PAGE_COUNT;
+}
+
+static int dirtyrate_set_state(int *state, int old_state, int new_state)
+{
+    assert(new_state < DIRTY_RATE_STATUS__MAX);
+    trace_dirtyrate_set_state(DirtyRateStatus_str(new_state));
+    if (atomic_cmpxchg(state, old_state, new_state) == old_state) {
+        return 0;
+    } else {
+        return -1;
+    }
+}
+
+static struct DirtyRateInfo *query_dirty_rate_info(void)
+{
+    int64_t dirty_rate = DirtyStat.dirty_rate;
+    struct DirtyRateInfo *info = g_malloc0(sizeof(DirtyRateInfo));
+
+    if (atomic_read(&CalculatingState) == DIRTY_RATE_STATUS_MEASURED) {
+        info->has_dirty_rate = true;
+        info->dirty_rate = dirty_rate;
+    }
+
+    info->status = CalculatingState;
+    info->start_time = DirtyStat.start_time;
+    info->calc_time = DirtyStat.calc_time;
+    info->sample_pages = DirtyStat.sample_pages;
+    info->mode = DirtyStat.mode;
+
+    if (info->has_dirty_rate &&
+        DirtyStat.mode == DIRTY_RATE_MEASURE_MODE_DIRTY_RING) {
+        DirtyRateVcpuList *head = NULL, **tail = &head;
+        int i;
+
+        for (i = 0; i < DirtyStat.nr_vcpus; i++) {
+            DirtyRateVcpuList *entry = g_new0(DirtyRateVcpuList, 1);
+
+            entry->value = g_memdup(&DirtyStat.vcpu_dirty_rate[i],
+                                    sizeof(DirtyRateVcpu));
+            *tail = entry;
+            tail = &entry->next;
+        }
+        info->has_vcpu_dirty_rate = true;
+        info->vcpu_dirty_rate = head;
+    }
+
+    trace_query_dirty_rate_info(DirtyRateStatus_str(CalculatingState));
+
+    return info;
+}
+
+static void init_dirtyrate_stat(int64_t start_time,
+                                struct DirtyRateConfig config)
+{
+    DirtyStat.total_dirty_samples = 0;
+    DirtyStat.total_sample_count = 0;
+    DirtyStat.total_block_mem_MB = 0;
+    DirtyStat.dirty_rate = -1;
+    DirtyStat.start_time = start_time;
+    DirtyStat.calc_time = config.sample_period_seconds;
+    DirtyStat.sample_pages = config.sample_pages_per_gigabytes;
+    DirtyStat.mode = config.mode;
+    DirtyStat.nr_vcpus = 0;
+    g_free(DirtyStat.vcpu_dirty_rate);
+    DirtyStat.vcpu_dirty_rate = NULL;
+}
+
+static void update_dirtyrate_stat(struct RamblockDirtyInfo *info)
+{
+    DirtyStat.total_dirty_samples += info->sample_dirty_count;
+    DirtyStat.total_sample_count += info->sample_pages_count;
+    /* size of total pages in MB */
+    DirtyStat.total_block_mem_MB += (info->ramblock_pages *
+                                     qemu_target_page_size()) >> 20;
+}
+
+static void update_dirtyrate(uint64_t msec)
+{
+    uint64_t dirtyrate;
+    uint64_t total_dirty_samples = DirtyStat.total_dirty_samples;
+    uint64_t total_sample_count = DirtyStat.total_sample_count;
+    uint64_t total_block_mem_MB = DirtyStat.total_block_mem_MB;
+
+    if (!total_sample_count || !msec) {
+        DirtyStat.dirty_rate = 0;
+        return;
+    }
+    dirtyrate = total_dirty_samples * total_block_mem_MB *
+                1000 / (total_sample_count * msec);
+
+    DirtyStat.dirty_rate = dirtyrate;
+}
+
+/*
+ * get hash result for the sampled memory with length of TARGET_PAGE_SIZE
+ * in ramblock, which starts from ramblock base address.
+ */
+static uint32_t get_ramblock_vfn_hash(struct RamblockDirtyInfo *info,
+                                      uint64_t vfn)
+{
+    size_t page_size = qemu_target_page_size();
+
+    return crc32c(0xffffffff, info->ramblock_addr + vfn * page_size,
+                  page_size);
+}
+
+static bool save_ramblock_hash(struct RamblockDirtyInfo *info)
+{
+    unsigned int sample_pages_count;
+    int i;
+    GRand *rand;
+
+    sample_pages_count = info->sample_pages_count;
+
+    /* ramblock size less than one page, return success to skip this ramblock */
+    if (unlikely(info->ramblock_pages == 0 || sample_pages_count == 0)) {
+        return true;
+    }
+
+    info->hash_result = g_try_malloc0_n(sample_pages_count,
+                                        sizeof(uint32_t));
+    if (!info->hash_result) {
+        return false;
+    }
+
+    info->sample_page_vfn = g_try_malloc0_n(sample_pages_count,
+                                            sizeof(uint64_t));
+    if (!info->sample_page_vfn) {
+        g_free(info->hash_result);
+        info->hash_result = NULL;
+        return false;
+    }
+
+    rand = g_rand_new();
+    for (i = 0; i < sample_pages_count; i++) {
+        info->sample_page_vfn[i] = g_rand_double(rand) * info->ramblock_pages;
+        info->hash_result[i] = get_ramblock_vfn_hash(info,
+                                                     info->sample_page_vfn[i]);
+    }
+    g_rand_free(rand);
+
+    return true;
+}
+
+static void get_ramblock_dirty_info(RAMBlock *block,
+                                    struct RamblockDirtyInfo *info,
+                                    struct DirtyRateConfig *config)
+{
+    uint64_t sample_pages_per_gigabytes = config->sample_pages_per_gigabytes;
+
+    /* Right shift 30 bits to calc ramblock size in GB */
+    info->sample_pages_count = (qemu_ram_get_used_length(block) *
+                                sample_pages_per_gigabytes) >> 30;
+    /* Right shift TARGET_PAGE_BITS to calc page count */
+    info->ramblock_pages = qemu_ram_get_used_length(block) /
+                           qemu_target_page_size();
+    info->ramblock_addr = qemu_ram_get_host_addr(block);
+    strcpy(info->idstr, qemu_ram_get_idstr(block));
+}
+
+static void free_ramblock_dirty_info(struct RamblockDirtyInfo *infos, int count)
+{
+    int i;
+
+    if (!infos) {
+        return;
+    }
+
+    for (i = 0; i < count; i++) {
+        g_free(infos[i].sample_page_vfn);
+        g_free(infos[i].hash_result);
+    }
+    g_free(infos);
+}
+
+static bool skip_sample_ramblock(RAMBlock *block)
+{
+    /*
+     * Sample only blocks larger than MIN_RAMBLOCK_SIZE.
+     */
+    if (qemu_ram_get_used_length(block) < MIN_RAMBLOCK_SIZE) {
+        trace_skip_sample_ramblock(block->idstr,
+                                   qemu_ram_get_used_length(block));
+        return true;
+    }
+
+    return false;
+}
+
+static bool record_ramblock_hash_info(struct RamblockDirtyInfo **block_dinfo,
+                                      struct DirtyRateConfig config,
+                                      int *block_count)
+{
+    struct RamblockDirtyInfo *info = NULL;
+    struct RamblockDirtyInfo *dinfo = NULL;
+    RAMBlock *block = NULL;
+    int total_count = 0;
+    int index = 0;
+    bool ret = false;
+
+    RAMBLOCK_FOREACH_MIGRATABLE(block) {
+        if (skip_sample_ramblock(block)) {
+            continue;
+        }
+        total_count++;
+    }
+
+    if (!total_count) {
+        goto out;
+    }
+
+    dinfo = g_try_malloc0_n(total_count, sizeof(struct RamblockDirtyInfo));
+    if (dinfo == NULL) {
+        goto out;
+    }
+
+    RAMBLOCK_FOREACH_MIGRATABLE(block) {
+        if (skip_sample_ramblock(block)) {
+            continue;
+        }
+        if (index >= total_count) {
+            break;
+        }
+        info = &dinfo[index];
+        get_ramblock_dirty_info(block, info, &config);
+        if (!save_ramblock_hash(info)) {
+            goto out;
+        }
+        index++;
+    }
+    ret = true;
+
+out:
+    *block_count = index;
+    *block_dinfo = dinfo;
+    return ret;
+}
+
+static void calc_page_dirty_rate(struct RamblockDirtyInfo *info)
+{
+    uint32_t crc;
+    int i;
+
+    for (i = 0; i < info->sample_pages_count; i++) {
+        crc = get_ramblock_vfn_hash(info, info->sample_page_vfn[i]);
+        if (crc != info->hash_result[i]) {
+            trace_calc_page_dirty_rate(info->idstr, crc, info->hash_result[i]);
+            info->sample_dirty_count++;
+        }
+    }
+}
+
+static struct RamblockDirtyInfo *
+find_block_matched(RAMBlock *block,
+                   int count,
+                   struct RamblockDirtyInfo *infos)
+{
+    int i;
+
+    for (i = 0; i < count; i++) {
+        if (!strcmp(infos[i].idstr, qemu_ram_get_idstr(block))) {
+            break;
+        }
+    }
+
+    if (i == count) {
+        return NULL;
+    }
+
+    /* The block may have been resized or reallocated in the meantime */
+    if (infos[i].ramblock_addr != qemu_ram_get_host_addr(block) ||
+        infos[i].ramblock_pages !=
+            (qemu_ram_get_used_length(block) / qemu_target_page_size())) {
+        trace_find_page_matched(block->idstr);
+        return NULL;
+    }
+
+    return &infos[i];
+}
+
+static bool compare_page_hash_info(struct RamblockDirtyInfo *info,
+                                   int block_count)
+{
+    struct RamblockDirtyInfo *block_dinfo = NULL;
+    RAMBlock *block = NULL;
+
+    RAMBLOCK_FOREACH_MIGRATABLE(block) {
+        if (skip_sample_ramblock(block)) {
+            continue;
+        }
+        block_dinfo = find_block_matched(block, block_count, info);
+        if (block_dinfo == NULL) {
+            continue;
+        }
+        calc_page_dirty_rate(block_dinfo);
+        update_dirtyrate_stat(block_dinfo);
+    }
+
+    if (DirtyStat.total_sample_count == 0) {
+        return false;
+    }
+
+    return true;
+}
+
+static void calculate_dirtyrate(struct DirtyRateConfig config,
+                                int64_t initial_time)
+{
+    struct RamblockDirtyInfo *block_dinfo = NULL;
+    int block_count = 0;
+    int64_t msec = 0;
+
+    rcu_register_thread();
+
+    WITH_RCU_READ_LOCK_GUARD() {
+        if (!record_ramblock_hash_info(&block_dinfo, config, &block_count)) {
+            goto out;
+        }
+    }
+
+    msec = config.sample_period_seconds * 1000;
+    msec = set_sample_page_period(msec, initial_time);
+
+    WITH_RCU_READ_LOCK_GUARD() {
+        if (!compare_page_hash_info(block_dinfo, block_count)) {
+            goto out;
+        }
+    }
+
+    update_dirtyrate(msec);
+
+out:
+    free_ramblock_dirty_info(block_dinfo, block_count);
+    rcu_unregister_thread();
+}
+
+/*
+ * Flush the dirty rings of all vCPUs and record how many pages each of
+ * them has dirtied so far.  Called with the BQL held.
+ */
+static void record_vcpu_dirty_pages(uint64_t *dirty_pages, int nr_vcpus)
+{
+    CPUState *cpu;
+
+    memory_global_dirty_log_sync();
+    CPU_FOREACH(cpu) {
+        if (cpu->cpu_index < nr_vcpus) {
+            dirty_pages[cpu->cpu_index] = cpu->dirty_pages;
+        }
+    }
+}
+
+static void calculate_dirtyrate_dirty_ring(struct DirtyRateConfig config,
+                                           int64_t initial_time)
+{
+    uint64_t *start_pages, *end_pages;
+    bool start_log;
+    int64_t msec;
+    int64_t total = 0;
+    CPUState *cpu;
+    int nr_vcpus = 0;
+    int i;
+
+    qemu_mutex_lock_iothread();
+    CPU_FOREACH(cpu) {
+        nr_vcpus = MAX(nr_vcpus, cpu->cpu_index + 1);
+    }
+    start_pages = g_new0(uint64_t, nr_vcpus);
+    end_pages = g_new0(uint64_t, nr_vcpus);
+
+    /*
+     * Nothing is pushed to the dirty rings unless dirty logging is on.
+     * A running migration has already turned it on, and must not see it
+     * turned off at the end of the measurement.
+     */
+    start_log = !global_dirty_log;
+    if (start_log) {
+        memory_global_dirty_log_start();
+    }
+    record_vcpu_dirty_pages(start_pages, nr_vcpus);
+    qemu_mutex_unlock_iothread();
+
+    msec = config.sample_period_seconds * 1000;
+    msec = set_sample_page_period(msec, initial_time);
+
+    qemu_mutex_lock_iothread();
+    record_vcpu_dirty_pages(end_pages, nr_vcpus);
+    if (start_log && global_dirty_log &&
+        !migration_is_running(migrate_get_current()->state)) {
+        memory_global_dirty_log_stop();
+    }
+    qemu_mutex_unlock_iothread();
+
+    DirtyStat.vcpu_dirty_rate = g_new0(DirtyRateVcpu, nr_vcpus);
+    for (i = 0; i < nr_vcpus; i++) {
+        uint64_t pages = end_pages[i] - start_pages[i];
+        /* Divide last, or vCPUs dirtying less than 1 MiB read as idle */
+        int64_t rate = pages * qemu_target_page_size() * 1000 / msec / MiB;
+
+        DirtyStat.vcpu_dirty_rate[i].id = i;
+        DirtyStat.vcpu_dirty_rate[i].dirty_rate = rate;
+        total += rate;
+    }
+    DirtyStat.nr_vcpus = nr_vcpus;
+    DirtyStat.dirty_rate = total;
+
+    g_free(start_pages);
+    g_free(end_pages);
+}
+
+void *get_dirtyrate_thread(void *arg)
+{
+    struct DirtyRateConfig config = *(struct DirtyRateConfig *)arg;
+    int64_t initial_time = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
+    int ret;
+
+    if (config.mode == DIRTY_RATE_MEASURE_MODE_DIRTY_RING) {
+        calculate_dirtyrate_dirty_ring(config, initial_time);
+    } else {
+        calculate_dirtyrate(config, initial_time);
+    }
+
+    ret = dirtyrate_set_state(&CalculatingState, DIRTY_RATE_STATUS_MEASURING,
+                              DIRTY_RATE_STATUS_MEASURED);
+    if (ret == -1) {
+        error_report("change dirtyrate state failed.");
+    }
+    return NULL;
+}
+
+void qmp_calc_dirty_rate(int64_t calc_time, bool has_sample_pages,
+                         int64_t sample_pages, bool has_mode,
+                         DirtyRateMeasureMode mode, Error **errp)
+{
+    static struct DirtyRateConfig config;
+    QemuThread thread;
+    int state = atomic_read(&CalculatingState);
+
+    /*
+     * If the dirty rate is already being measured, don't attempt to start.
+     */
+    if (state == DIRTY_RATE_STATUS_MEASURING) {
+        error_setg(errp, "the dirty rate is already being measured.");
+        return;
+    }
+
+    if (!is_sample_period_valid(calc_time)) {
+        error_setg(errp, "calc-time is out of range[%d, %d].",
+                         MIN_FETCH_DIRTYRATE_TIME_SEC,
+                         MAX_FETCH_DIRTYRATE_TIME_SEC);
+        return;
+    }
+
+    if (has_sample_pages) {
+        if (!is_sample_pages_valid(sample_pages)) {
+            error_setg(errp, "sample-pages is out of range[%d, %d].",
+                             MIN_SAMPLE_PAGE_COUNT,
+                             MAX_SAMPLE_PAGE_COUNT);
+            return;
+        }
+    } else {
+        sample_pages = DIRTYRATE_DEFAULT_SAMPLE_PAGES;
+    }
+
+    if (!has_mode) {
+        mode = DIRTY_RATE_MEASURE_MODE_PAGE_SAMPLING;
+    }
+    if (mode == DIRTY_RATE_MEASURE_MODE_DIRTY_RING &&
+        !kvm_dirty_ring_enabled()) {
+        error_setg(errp, "mode dirty-ring needs the KVM dirty ring, "
+                   "use -accel kvm,dirty-ring-size=N.");
+        return;
+    }
+
+    /*
+     * The state only goes back from measuring to measured in the
+     * thread, so a concurrent request can only make this fail.
+     */
+    if (dirtyrate_set_state(&CalculatingState, state,
+                            DIRTY_RATE_STATUS_MEASURING) == -1) {
+        error_setg(errp, "the dirty rate is already being measured.");
+        return;
+    }
+
+    config.sample_period_seconds = calc_time;
+    config.sample_pages_per_gigabytes = sample_pages;
+    config.mode = mode;
+    init_dirtyrate_stat(qemu_clock_get_ms(QEMU_CLOCK_REALTIME) / 1000, config);
+    qemu_thread_create(&thread, "get_dirtyrate", get_dirtyrate_thread,
+                       (void *)&config, QEMU_THREAD_DETACHED);
+}
+
+struct DirtyRateInfo *qmp_query_dirty_rate(Error **errp)
+{
+    return query_dirty_rate_info();
+}
@@ -20,10 +20,14 @@
 #include "migration/blocker.h"
 #include "exec.h"
 #include "fd.h"
+#include "file.h"
 #include "socket.h"
 #include "sysemu/runstate.h"
 #include "sysemu/sysemu.h"
 #include "sysemu/cpu-throttle.h"
+#include "sysemu/cpus.h"
+#include "sysemu/kvm.h"
+#include "hw/core/cpu.h"
 #include "rdma.h"
 #include "ram.h"
 #include "migration/global_state.h"
@@ -91,6 +95,7 @@
 #define DEFAULT_MIGRATE_X_CHECKPOINT_DELAY (200 * 100)
 #define DEFAULT_MIGRATE_MULTIFD_CHANNELS 2
 #define DEFAULT_MIGRATE_MULTIFD_COMPRESSION MULTIFD_COMPRESSION_NONE
+#define DEFAULT_MIGRATE_COMPRESS_METHOD COMPRESS_METHOD_ZLIB
 /* 0: means nocompress, 1: best speed, ... 9: best compress ratio */
 #define DEFAULT_MIGRATE_MULTIFD_ZLIB_LEVEL 1
 /* 0: means nocompress, 1: best speed, ... 20: best compress ratio */
@@ -101,6 +106,18 @@
  */
 #define DEFAULT_MIGRATE_MAX_POSTCOPY_BANDWIDTH 0
 
+/* Host pages requested after a postcopy fault, 0 means no prefetch */
+#define DEFAULT_MIGRATE_POSTCOPY_PREFETCH_WINDOW 0
+#define MAX_MIGRATE_POSTCOPY_PREFETCH_WINDOW 512
+
+/* Threads synchronizing the dirty bitmap of large RAM blocks */
+#define DEFAULT_MIGRATE_DIRTY_SYNC_THREADS 4
+#define MAX_MIGRATE_DIRTY_SYNC_THREADS 64
+
+/* Dirty page rate in MB/s above which dirty-limit throttles a vCPU */
+#define DEFAULT_MIGRATE_VCPU_DIRTY_LIMIT 1
+#define MAX_MIGRATE_VCPU_DIRTY_LIMIT 1048576
+
 /*
  * Parameters for self_announce_delay giving a stream of RARP/ARP
  * packets after migration.
@@ -164,6 +181,13 @@ void migration_object_init(void)
     qemu_event_init(&current_incoming->main_thread_load_event, false);
     qemu_sem_init(&current_incoming->postcopy_pause_sem_dst, 0);
     qemu_sem_init(&current_incoming->postcopy_pause_sem_fault, 0);
+    qemu_sem_init(&current_incoming->postcopy_qemufile_dst_done, 0);
+    qemu_mutex_init(&current_incoming->page_request_mutex);
+    current_incoming->page_requested = g_hash_table_new_full(g_direct_hash,
+                                                             g_direct_equal,
+                                                             NULL, g_free);
+    current_incoming->page_prefetched = g_hash_table_new(g_direct_hash,
+                                                         g_direct_equal);
 
     if (!migration_object_check(current_migration, &err)) {
         error_report_err(err);
@@ -232,6 +256,14 @@ void migration_incoming_state_destroy(void)
         qemu_fclose(mis->from_src_file);
         mis->from_src_file = NULL;
     }
+    if (mis->postcopy_qemufile_dst) {
+        qemu_fclose(mis->postcopy_qemufile_dst);
+        mis->postcopy_qemufile_dst = NULL;
+    }
+    WITH_QEMU_LOCK_GUARD(&mis->page_request_mutex) {
+        g_hash_table_remove_all(mis->page_requested);
+        g_hash_table_remove_all(mis->page_prefetched);
+    }
     if (mis->postcopy_remote_fds) {
         g_array_free(mis->postcopy_remote_fds, TRUE);
         mis->postcopy_remote_fds = NULL;
@@ -245,6 +277,18 @@ void migration_incoming_state_destroy(void)
     }
 }
 
+/*
+ * Returns the time in microseconds since @start, the beginning of the
+ * phase of the switchover named @phase.
+ */
+uint64_t migration_downtime_phase(const char *phase, int64_t start)
+{
+    uint64_t time = qemu_clock_get_us(QEMU_CLOCK_REALTIME) - start;
+
+    trace_migration_downtime_phase(phase, time);
+    return time;
+}
+
 static void migrate_generate_event(int new_state)
 {
     if (migrate_use_events()) {
@@ -379,6 +423,12 @@ void qemu_start_incoming_migration(const char *uri, Error **errp)
 {
     const char *p;
 
+    if (migrate_mapped_ram() && strcmp(uri, "defer") &&
+        !strstart(uri, "file:", NULL)) {
+        error_setg(errp, "mapped-ram requires a file: migration URI");
+        return;
+    }
+
     qapi_event_send_migration(MIGRATION_STATUS_SETUP);
     if (!strcmp(uri, "defer")) {
         deferred_incoming_migration(errp);
@@ -394,6 +444,8 @@ void qemu_start_incoming_migration(const char *uri, Error **errp)
         unix_start_incoming_migration(p, errp);
     } else if (strstart(uri, "fd:", &p)) {
         fd_start_incoming_migration(p, errp);
+    } else if (strstart(uri, "file:", &p)) {
+        file_start_incoming_migration(p, errp);
     } else {
         error_setg(errp, "unknown migration protocol: %s", uri);
     }
@@ -403,6 +455,8 @@ static void process_incoming_migration_bh(void *opaque)
 {
     Error *local_err = NULL;
     MigrationIncomingState *mis = opaque;
+    DowntimeBreakdown *dt = &mis->downtime_breakdown;
+    int64_t start;
 
     /* If capability late_block_activate is set:
      * Only fire up the block code now if we're going to restart the
@@ -415,12 +469,15 @@ static void process_incoming_migration_bh(void *opaque)
             global_state_get_runstate() == RUN_STATE_RUNNING))) {
         /* Make sure all file formats flush their mutable metadata.
          * If we get an error here, just don't restart the VM yet. */
+        start = qemu_clock_get_us(QEMU_CLOCK_REALTIME);
         bdrv_invalidate_cache_all(&local_err);
         if (local_err) {
             error_report_err(local_err);
             local_err = NULL;
             autostart = false;
         }
+        dt->has_block_activate = true;
+        dt->block_activate = migration_downtime_phase("block-activate", start);
     }
 
     /*
@@ -442,7 +499,10 @@ static void process_incoming_migration_bh(void *opaque)
     if (!global_state_received() ||
         global_state_get_runstate() == RUN_STATE_RUNNING) {
         if (autostart) {
+            start = qemu_clock_get_us(QEMU_CLOCK_REALTIME);
             vm_start();
+            dt->has_vm_start = true;
+            dt->vm_start = migration_downtime_phase("vm-start", start);
         } else {
             runstate_set(RUN_STATE_PAUSED);
         }
@@ -646,7 +706,17 @@ void migration_ioc_process_incoming(QIOChannel *ioc, Error **errp)
          * Common migration only needs one channel, so we can start
          * right now.  Multifd needs more than one channel, we wait.
          */
-        start_migration = !migrate_use_multifd();
+        start_migration = !migrate_use_multifd() || migrate_mapped_ram();
+    } else if (migrate_postcopy_preempt() && !mis->postcopy_qemufile_dst) {
+        /*
+         * The source only connects the preempt channel once its main
+         * channel is established, so the second connection is always
+         * this one.  The main channel is already being loaded; just hand
+         * the new one over to the preempt thread.
+         */
+        mis->postcopy_qemufile_dst = qemu_fopen_channel_input(ioc);
+        qemu_sem_post(&mis->postcopy_qemufile_dst_done);
+        return;
     } else {
         /* Multiple connections */
         assert(migrate_use_multifd());
@@ -675,6 +745,10 @@ bool migration_has_all_channels(void)
 
     all_channels = multifd_recv_all_channels_created();
 
+    if (migrate_postcopy_preempt()) {
+        all_channels = all_channels && mis->postcopy_qemufile_dst != NULL;
+    }
+
     return all_channels && mis->from_src_file != NULL;
 }
 
@@ -834,6 +908,16 @@ MigrationParameters *qmp_query_migrate_parameters(Error **errp)
     params->max_postcopy_bandwidth = s->parameters.max_postcopy_bandwidth;
     params->has_max_cpu_throttle = true;
     params->max_cpu_throttle = s->parameters.max_cpu_throttle;
+    params->has_postcopy_prefetch_window = true;
+    params->postcopy_prefetch_window = s->parameters.postcopy_prefetch_window;
+    params->has_postcopy_prefetch_stride = true;
+    params->postcopy_prefetch_stride = s->parameters.postcopy_prefetch_stride;
+    params->has_dirty_sync_threads = true;
+    params->dirty_sync_threads = s->parameters.dirty_sync_threads;
+    params->has_compress_method = true;
+    params->compress_method = s->parameters.compress_method;
+    params->has_vcpu_dirty_limit = true;
+    params->vcpu_dirty_limit = s->parameters.vcpu_dirty_limit;
     params->has_announce_initial = true;
     params->announce_initial = s->parameters.announce_initial;
     params->has_announce_max = true;
@@ -923,6 +1007,22 @@ static void populate_time_info(MigrationInfo *info, MigrationState *s)
     }
 }
 
+static intList *get_vcpu_throttle_list(void)
+{
+    intList *list = NULL, **tail = &list;
+    CPUState *cpu;
+
+    CPU_FOREACH(cpu) {
+        intList *entry = g_new0(intList, 1);
+
+        entry->value = cpu_throttle_get_vcpu_percentage(cpu);
+        *tail = entry;
+        tail = &entry->next;
+    }
+
+    return list;
+}
+
 static void populate_ram_info(MigrationInfo *info, MigrationState *s)
 {
     info->has_ram = true;
@@ -941,6 +1041,7 @@ static void populate_ram_info(MigrationInfo *info, MigrationState *s)
     info->ram->page_size = qemu_target_page_size();
     info->ram->multifd_bytes = ram_counters.multifd_bytes;
     info->ram->pages_per_second = s->pages_per_second;
+    info->ram->dirty_sync_time = ram_counters.dirty_sync_time;
 
     if (migrate_use_xbzrle()) {
         info->has_xbzrle_cache = true;
@@ -952,6 +1053,8 @@ static void populate_ram_info(MigrationInfo *info, MigrationState *s)
         info->xbzrle_cache->cache_miss_rate = xbzrle_counters.cache_miss_rate;
         info->xbzrle_cache->encoding_rate = xbzrle_counters.encoding_rate;
         info->xbzrle_cache->overflow = xbzrle_counters.overflow;
+        info->xbzrle_cache->cache_hit = xbzrle_counters.cache_hit;
+        info->xbzrle_cache->cache_eviction = xbzrle_counters.cache_eviction;
     }
 
     if (migrate_use_compression()) {
@@ -966,11 +1069,21 @@ static void populate_ram_info(MigrationInfo *info, MigrationState *s)
                                     compression_counters.compression_rate;
     }
 
+    if (migrate_use_multifd()) {
+        info->multifd_stats = multifd_query_send_stats();
+        info->has_multifd_stats = !!info->multifd_stats;
+    }
+
     if (cpu_throttle_active()) {
         info->has_cpu_throttle_percentage = true;
         info->cpu_throttle_percentage = cpu_throttle_get_percentage();
     }
 
+    if (migrate_dirty_limit()) {
+        info->has_vcpu_throttle_percentage = true;
+        info->vcpu_throttle_percentage = get_vcpu_throttle_list();
+    }
+
     if (s->state != MIGRATION_STATUS_COMPLETED) {
         info->ram->remaining = ram_bytes_remaining();
         info->ram->dirty_pages_rate = ram_counters.dirty_pages_rate;
@@ -1020,6 +1133,14 @@ static void fill_source_migration_info(MigrationInfo *info)
     case MIGRATION_STATUS_COMPLETED:
         populate_time_info(info, s);
         populate_ram_info(info, s);
+        qapi_free_DeviceStateTimeList(info->device_state_times);
+        info->device_state_times = qemu_savevm_device_state_times(false);
+        info->has_device_state_times = !!info->device_state_times;
+        if (s->downtime_breakdown.has_vm_stop) {
+            info->has_downtime_breakdown = true;
+            info->downtime_breakdown = QAPI_CLONE(DowntimeBreakdown,
+                                                  &s->downtime_breakdown);
+        }
         break;
     case MIGRATION_STATUS_FAILED:
         info->has_status = true;
@@ -1052,10 +1173,11 @@ static bool migrate_caps_check(bool *cap_list,
                                Error **errp)
 {
     MigrationCapabilityStatusList *cap;
-    bool old_postcopy_cap;
+    bool old_postcopy_cap, old_bg_snapshot_cap;
     MigrationIncomingState *mis = migration_incoming_get_current();
 
     old_postcopy_cap = cap_list[MIGRATION_CAPABILITY_POSTCOPY_RAM];
+    old_bg_snapshot_cap = cap_list[MIGRATION_CAPABILITY_BACKGROUND_SNAPSHOT];
 
     for (cap = params; cap; cap = cap->next) {
         cap_list[cap->value->capability] = cap->value->state;
@@ -1099,6 +1221,128 @@ static bool migrate_caps_check(bool *cap_list,
         }
     }
 
+    if (cap_list[MIGRATION_CAPABILITY_MULTIFD_ZERO_PAGE] &&
+        !cap_list[MIGRATION_CAPABILITY_MULTIFD]) {
+        error_setg(errp, "multifd-zero-page requires multifd");
+        return false;
+    }
+
+    if (cap_list[MIGRATION_CAPABILITY_ZERO_COPY_SEND]) {
+#ifdef CONFIG_LINUX
+        if (!cap_list[MIGRATION_CAPABILITY_MULTIFD]) {
+            error_setg(errp, "zero-copy-send requires multifd");
+            return false;
+        }
+        /* Compression methods reuse their buffers, so they always copy */
+        if (migrate_multifd_compression() != MULTIFD_COMPRESSION_NONE) {
+            error_setg(errp, "zero-copy-send is not compatible with multifd "
+                       "compression");
+            return false;
+        }
+        /* A file channel has no zero copy writes */
+        if (cap_list[MIGRATION_CAPABILITY_MAPPED_RAM]) {
+            error_setg(errp, "zero-copy-send is not compatible with "
+                       "mapped-ram");
+            return false;
+        }
+#else
+        error_setg(errp, "zero-copy-send is only available on Linux");
+        return false;
+#endif
+    }
+
+    if (cap_list[MIGRATION_CAPABILITY_MAPPED_RAM]) {
+        if (cap_list[MIGRATION_CAPABILITY_XBZRLE] ||
+            cap_list[MIGRATION_CAPABILITY_COMPRESS]) {
+            error_setg(errp, "mapped-ram is not compatible with xbzrle or "
+                       "compress");
+            return false;
+        }
+        if (cap_list[MIGRATION_CAPABILITY_POSTCOPY_RAM]) {
+            error_setg(errp, "mapped-ram is not compatible with postcopy");
+            return false;
+        }
+    }
+
+    if (cap_list[MIGRATION_CAPABILITY_POSTCOPY_PREEMPT]) {
+        if (!cap_list[MIGRATION_CAPABILITY_POSTCOPY_RAM]) {
+            error_setg(errp, "postcopy-preempt requires postcopy-ram");
+            return false;
+        }
+        /*
+         * The destination tells the preempt channel apart from the main
+         * one by connection order, which multifd channels would upset.
+         */
+        if (cap_list[MIGRATION_CAPABILITY_MULTIFD]) {
+            error_setg(errp, "postcopy-preempt is not compatible with multifd");
+            return false;
+        }
+    }
+
+    if (cap_list[MIGRATION_CAPABILITY_DIRTY_LIMIT]) {
+        if (cap_list[MIGRATION_CAPABILITY_AUTO_CONVERGE]) {
+            error_setg(errp, "dirty-limit is not compatible with "
+                       "auto-converge");
+            return false;
+        }
+        /* The per-vCPU dirty rates come from the KVM dirty rings */
+        if (!kvm_dirty_ring_enabled()) {
+            error_setg(errp, "dirty-limit requires KVM with the "
+                       "dirty-ring-size accelerator property set");
+            return false;
+        }
+    }
+
+    if (cap_list[MIGRATION_CAPABILITY_BACKGROUND_SNAPSHOT]) {
+        /*
+         * RAM is saved in a single pass while the guest runs, and pages
+         * must be copied out before they are unprotected.
+         */
+        static const MigrationCapability incompatible_caps[] = {
+            MIGRATION_CAPABILITY_POSTCOPY_RAM,
+            MIGRATION_CAPABILITY_DIRTY_BITMAPS,
+            MIGRATION_CAPABILITY_POSTCOPY_BLOCKTIME,
+            MIGRATION_CAPABILITY_LATE_BLOCK_ACTIVATE,
+            MIGRATION_CAPABILITY_RETURN_PATH,
+            MIGRATION_CAPABILITY_MULTIFD,
+            MIGRATION_CAPABILITY_PAUSE_BEFORE_SWITCHOVER,
+            MIGRATION_CAPABILITY_AUTO_CONVERGE,
+            MIGRATION_CAPABILITY_DIRTY_LIMIT,
+            MIGRATION_CAPABILITY_RELEASE_RAM,
+            MIGRATION_CAPABILITY_RDMA_PIN_ALL,
+            MIGRATION_CAPABILITY_COMPRESS,
+            MIGRATION_CAPABILITY_XBZRLE,
+            MIGRATION_CAPABILITY_X_COLO,
+            MIGRATION_CAPABILITY_VALIDATE_UUID,
+            MIGRATION_CAPABILITY_BLOCK,
+            MIGRATION_CAPABILITY_MAPPED_RAM,
+        };
+        int i;
+
+        for (i = 0; i < ARRAY_SIZE(incompatible_caps); i++) {
+            if (cap_list[incompatible_caps[i]]) {
+                error_setg(errp, "background-snapshot is not compatible "
+                           "with %s",
+                           MigrationCapability_str(incompatible_caps[i]));
+                return false;
+            }
+        }
+
+        /* Like for postcopy, only check the host when first enabled */
+        if (!old_bg_snapshot_cap) {
+            if (!ram_write_tracking_available()) {
+                error_setg(errp, "background-snapshot is not supported by "
+                           "the host kernel");
+                return false;
+            }
+            if (!ram_write_tracking_compatible()) {
+                error_setg(errp, "background-snapshot is not compatible "
+                           "with the guest memory backends");
+                return false;
+            }
+        }
+    }
+
     return true;
 }
 
@@ -1119,18 +1363,27 @@ static void fill_destination_migration_info(MigrationInfo *info)
     case MIGRATION_STATUS_CANCELLING:
     case MIGRATION_STATUS_CANCELLED:
     case MIGRATION_STATUS_ACTIVE:
-    case MIGRATION_STATUS_POSTCOPY_ACTIVE:
-    case MIGRATION_STATUS_POSTCOPY_PAUSED:
-    case MIGRATION_STATUS_POSTCOPY_RECOVER:
     case MIGRATION_STATUS_FAILED:
     case MIGRATION_STATUS_COLO:
         info->has_status = true;
         break;
+    case MIGRATION_STATUS_POSTCOPY_ACTIVE:
+    case MIGRATION_STATUS_POSTCOPY_PAUSED:
+    case MIGRATION_STATUS_POSTCOPY_RECOVER:
     case MIGRATION_STATUS_COMPLETED:
         info->has_status = true;
         fill_destination_postcopy_migration_info(info);
         break;
     }
+    if (mis->state == MIGRATION_STATUS_COMPLETED) {
+        info->device_state_times = qemu_savevm_device_state_times(true);
+        info->has_device_state_times = !!info->device_state_times;
+        if (mis->downtime_breakdown.has_load) {
+            info->has_downtime_breakdown = true;
+            info->downtime_breakdown = QAPI_CLONE(DowntimeBreakdown,
+                                                  &mis->downtime_breakdown);
+        }
+    }
     info->status = mis->state;
 }
 
@@ -1246,6 +1499,14 @@ static bool migrate_params_check(MigrationParameters *params, Error **errp)
         return false;
     }
 
+    if (params->has_multifd_compression &&
+        params->multifd_compression != MULTIFD_COMPRESSION_NONE &&
+        migrate_use_zero_copy_send()) {
+        error_setg(errp, "multifd compression is not compatible with "
+                   "zero-copy-send");
+        return false;
+    }
+
     if (params->has_multifd_zlib_level &&
         (params->multifd_zlib_level > 9)) {
         error_setg(errp, QERR_INVALID_PARAMETER_VALUE, "multifd_zlib_level",
@@ -1260,6 +1521,36 @@ static bool migrate_params_check(MigrationParameters *params, Error **errp)
         return false;
     }
 
+    if (params->has_postcopy_prefetch_window &&
+        params->postcopy_prefetch_window >
+        MAX_MIGRATE_POSTCOPY_PREFETCH_WINDOW) {
+        error_setg(errp, QERR_INVALID_PARAMETER_VALUE,
+                   "postcopy_prefetch_window",
+                   "is invalid, it should be in the range of 0 to "
+                   stringify(MAX_MIGRATE_POSTCOPY_PREFETCH_WINDOW));
+        return false;
+    }
+
+    if (params->has_dirty_sync_threads &&
+        (params->dirty_sync_threads < 1 ||
+         params->dirty_sync_threads > MAX_MIGRATE_DIRTY_SYNC_THREADS)) {
+        error_setg(errp, QERR_INVALID_PARAMETER_VALUE,
+                   "dirty_sync_threads",
+                   "is invalid, it should be in the range of 1 to "
+                   stringify(MAX_MIGRATE_DIRTY_SYNC_THREADS));
+        return false;
+    }
+
+    if (params->has_vcpu_dirty_limit &&
+        (params->vcpu_dirty_limit < 1 ||
+         params->vcpu_dirty_limit > MAX_MIGRATE_VCPU_DIRTY_LIMIT)) {
+        error_setg(errp, QERR_INVALID_PARAMETER_VALUE,
+                   "vcpu_dirty_limit",
+                   "is invalid, it should be in the range of 1 to "
+                   stringify(MAX_MIGRATE_VCPU_DIRTY_LIMIT) " MB/s");
+        return false;
+    }
+
     if (params->has_xbzrle_cache_size &&
         (params->xbzrle_cache_size < qemu_target_page_size() ||
          !is_power_of_2(params->xbzrle_cache_size))) {
@@ -1390,6 +1681,21 @@ static void migrate_params_test_apply(MigrateSetParameters *params,
     if (params->has_max_cpu_throttle) {
         dest->max_cpu_throttle = params->max_cpu_throttle;
     }
+    if (params->has_postcopy_prefetch_window) {
+        dest->postcopy_prefetch_window = params->postcopy_prefetch_window;
+    }
+    if (params->has_postcopy_prefetch_stride) {
+        dest->postcopy_prefetch_stride = params->postcopy_prefetch_stride;
+    }
+    if (params->has_dirty_sync_threads) {
+        dest->dirty_sync_threads = params->dirty_sync_threads;
+    }
+    if (params->has_compress_method) {
+        dest->compress_method = params->compress_method;
+    }
+    if (params->has_vcpu_dirty_limit) {
+        dest->vcpu_dirty_limit = params->vcpu_dirty_limit;
+    }
     if (params->has_announce_initial) {
         dest->announce_initial = params->announce_initial;
     }
@@ -1502,6 +1808,23 @@ static void migrate_params_apply(MigrateSetParameters *params, Error **errp)
     if (params->has_max_cpu_throttle) {
         s->parameters.max_cpu_throttle = params->max_cpu_throttle;
     }
+    if (params->has_postcopy_prefetch_window) {
+        s->parameters.postcopy_prefetch_window =
+            params->postcopy_prefetch_window;
+    }
+    if (params->has_postcopy_prefetch_stride) {
+        s->parameters.postcopy_prefetch_stride =
+            params->postcopy_prefetch_stride;
+    }
+    if (params->has_dirty_sync_threads) {
+        s->parameters.dirty_sync_threads = params->dirty_sync_threads;
+    }
+    if (params->has_compress_method) {
+        s->parameters.compress_method = params->compress_method;
+    }
+    if (params->has_vcpu_dirty_limit) {
+        s->parameters.vcpu_dirty_limit = params->vcpu_dirty_limit;
+    }
     if (params->has_announce_initial) {
         s->parameters.announce_initial = params->announce_initial;
     }
@@ -1649,6 +1972,16 @@ static void migrate_fd_cleanup(MigrationState *s)
         qemu_fclose(tmp);
     }
 
+    if (s->postcopy_qemufile_src) {
+        QEMUFile *tmp;
+
+        qemu_mutex_lock(&s->qemu_file_lock);
+        tmp = s->postcopy_qemufile_src;
+        s->postcopy_qemufile_src = NULL;
+        qemu_mutex_unlock(&s->qemu_file_lock);
+        qemu_fclose(tmp);
+    }
+
     assert(!migration_is_active(s));
 
     if (s->state == MIGRATION_STATUS_CANCELLING) {
@@ -1731,6 +2064,9 @@ static void migrate_fd_cancel(MigrationState *s)
     if (s->state == MIGRATION_STATUS_CANCELLING && f) {
         qemu_file_shutdown(f);
     }
+    if (s->state == MIGRATION_STATUS_CANCELLING && s->postcopy_qemufile_src) {
+        qemu_file_shutdown(s->postcopy_qemufile_src);
+    }
     if (s->state == MIGRATION_STATUS_CANCELLING && s->block_inactive) {
         Error *local_err = NULL;
 
@@ -1846,6 +2182,7 @@ void migrate_init(MigrationState *s)
     s->mbps = 0.0;
     s->pages_per_second = 0.0;
     s->downtime = 0;
+    memset(&s->downtime_breakdown, 0, sizeof(s->downtime_breakdown));
     s->expected_downtime = 0;
     s->setup_time = 0;
     s->start_postcopy = false;
@@ -2066,6 +2403,31 @@ void qmp_migrate(const char *uri, bool has_blk, bool blk,
     MigrationState *s = migrate_get_current();
     const char *p;
 
+    if (migrate_mapped_ram()) {
+        if (!strstart(uri, "file:", NULL)) {
+            error_setg(errp, "mapped-ram requires a file: migration URI");
+            return;
+        }
+        if (migrate_use_multifd() &&
+            migrate_multifd_compression() != MULTIFD_COMPRESSION_NONE) {
+            error_setg(errp, "mapped-ram is not compatible with multifd "
+                       "compression");
+            return;
+        }
+    }
+
+    if (migrate_postcopy_preempt()) {
+        if (!strstart(uri, "tcp:", NULL) && !strstart(uri, "unix:", NULL)) {
+            error_setg(errp, "postcopy-preempt requires a tcp: or unix: "
+                       "migration URI");
+            return;
+        }
+        if (s->parameters.tls_creds && *s->parameters.tls_creds) {
+            error_setg(errp, "postcopy-preempt is not compatible with TLS");
+            return;
+        }
+    }
+
     if (!migrate_prepare(s, has_blk && blk, has_inc && inc,
                          has_resume && resume, errp)) {
         /* Error detected, put into errp */
@@ -2084,6 +2446,8 @@ void qmp_migrate(const char *uri, bool has_blk, bool blk,
         unix_start_outgoing_migration(s, p, &local_err);
     } else if (strstart(uri, "fd:", &p)) {
         fd_start_outgoing_migration(s, p, &local_err);
+    } else if (strstart(uri, "file:", &p)) {
+        file_start_outgoing_migration(s, p, &local_err);
     } else {
         error_setg(errp, QERR_INVALID_PARAMETER_VALUE, "uri",
                    "a valid migration protocol");
@@ -2256,6 +2620,24 @@ int migrate_decompress_threads(void)
     return s->parameters.decompress_threads;
 }
 
+CompressMethod migrate_compress_method(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->parameters.compress_method;
+}
+
+uint64_t migrate_vcpu_dirty_limit(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->parameters.vcpu_dirty_limit;
+}
+
 bool migrate_dirty_bitmaps(void)
 {
     MigrationState *s;
@@ -2301,6 +2683,60 @@ bool migrate_use_multifd(void)
     return s->enabled_capabilities[MIGRATION_CAPABILITY_MULTIFD];
 }
 
+bool migrate_multifd_zero_page(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_MULTIFD_ZERO_PAGE];
+}
+
+bool migrate_use_zero_copy_send(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_ZERO_COPY_SEND];
+}
+
+bool migrate_mapped_ram(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_MAPPED_RAM];
+}
+
+bool migrate_postcopy_preempt(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_POSTCOPY_PREEMPT];
+}
+
+bool migrate_background_snapshot(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_BACKGROUND_SNAPSHOT];
+}
+
+bool migrate_dirty_limit(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_DIRTY_LIMIT];
+}
+
 bool migrate_pause_before_switchover(void)
 {
     MigrationState *s;
@@ -2347,6 +2783,33 @@ int migrate_multifd_zstd_level(void)
     return s->parameters.multifd_zstd_level;
 }
 
+uint32_t migrate_postcopy_prefetch_window(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->parameters.postcopy_prefetch_window;
+}
+
+bool migrate_postcopy_prefetch_stride(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->parameters.postcopy_prefetch_stride;
+}
+
+int migrate_dirty_sync_threads(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->parameters.dirty_sync_threads;
+}
+
 int migrate_use_xbzrle(void)
 {
     MigrationState *s;
@@ -2928,6 +3391,40 @@ static int migration_maybe_pause(MigrationState *s,
     return s->state == new_state ? 0 : -EINVAL;
 }
 
+/*
+ * This is qemu_savevm_state_complete_precopy(), split in its iterable and
+ * non-iterable halves so that each of them can be timed.
+ */
+static int migration_completion_precopy(MigrationState *s, bool inactivate)
+{
+    DowntimeBreakdown *dt = &s->downtime_breakdown;
+    int64_t start = qemu_clock_get_us(QEMU_CLOCK_REALTIME);
+    int ret;
+
+    ret = qemu_savevm_state_complete_precopy(s->to_dst_file, true, false);
+    if (ret) {
+        return ret;
+    }
+    dt->has_iterable = true;
+    dt->iterable = migration_downtime_phase("iterable", start);
+    /* The last sync of the dirty bitmap was the one of ram_save_complete() */
+    dt->has_bitmap_sync = true;
+    dt->bitmap_sync = ram_counters.dirty_sync_time;
+    trace_migration_downtime_phase("bitmap-sync", dt->bitmap_sync);
+
+    start = qemu_clock_get_us(QEMU_CLOCK_REALTIME);
+    ret = qemu_savevm_state_complete_precopy_non_iterable(s->to_dst_file,
+                                                          false, inactivate);
+    if (ret) {
+        return ret;
+    }
+    qemu_fflush(s->to_dst_file);
+    dt->has_non_iterable = true;
+    dt->non_iterable = migration_downtime_phase("non-iterable", start);
+
+    return 0;
+}
+
 /**
  * migration_completion: Used by migration_thread when there's not much left.
  *   The caller 'breaks' the loop when this returns.
@@ -2936,8 +3433,11 @@ static int migration_maybe_pause(MigrationState *s,
  */
 static void migration_completion(MigrationState *s)
 {
+    DowntimeBreakdown *dt = &s->downtime_breakdown;
     int ret;
     int current_active_state = s->state;
+    bool precopy = s->state == MIGRATION_STATUS_ACTIVE;
+    int64_t start;
 
     if (s->state == MIGRATION_STATUS_ACTIVE) {
         qemu_mutex_lock_iothread();
@@ -2948,15 +3448,18 @@ static void migration_completion(MigrationState *s)
 
         if (!ret) {
             bool inactivate = !migrate_colo_enabled();
+
+            start = qemu_clock_get_us(QEMU_CLOCK_REALTIME);
             ret = vm_stop_force_state(RUN_STATE_FINISH_MIGRATE);
+            dt->has_vm_stop = true;
+            dt->vm_stop = migration_downtime_phase("vm-stop", start);
             if (ret >= 0) {
                 ret = migration_maybe_pause(s, &current_active_state,
                                             MIGRATION_STATUS_DEVICE);
             }
             if (ret >= 0) {
                 qemu_file_set_rate_limit(s->to_dst_file, INT64_MAX);
-                ret = qemu_savevm_state_complete_precopy(s->to_dst_file, false,
-                                                         inactivate);
+                ret = migration_completion_precopy(s, inactivate);
             }
             if (inactivate && ret >= 0) {
                 s->block_inactive = true;
@@ -2983,8 +3486,13 @@ static void migration_completion(MigrationState *s)
     if (s->rp_state.from_dst_file) {
         int rp_error;
         trace_migration_return_path_end_before();
+        start = qemu_clock_get_us(QEMU_CLOCK_REALTIME);
         rp_error = await_return_path_close_on_source(s);
         trace_migration_return_path_end_after(rp_error);
+        if (precopy) {
+            dt->has_return_path = true;
+            dt->return_path = migration_downtime_phase("return-path", start);
+        }
         if (rp_error) {
             goto fail_invalidate;
         }
@@ -3197,7 +3705,7 @@ static MigThrError migration_detect_error(MigrationState *s)
 /* How many bytes have we transferred since the beginning of the migration */
 static uint64_t migration_total_bytes(MigrationState *s)
 {
-    return qemu_ftell(s->to_dst_file) + ram_counters.multifd_bytes;
+    return qemu_file_transferred(s->to_dst_file) + ram_counters.multifd_bytes;
 }
 
 static void migration_calculate_complete(MigrationState *s)
@@ -3318,10 +3826,14 @@ static MigIterateState migration_iteration_run(MigrationState *s)
 
 static void migration_iteration_finish(MigrationState *s)
 {
-    /* If we enabled cpu throttling for auto-converge, turn it off. */
+    qemu_mutex_lock_iothread();
+
+    /*
+     * If we enabled cpu throttling for auto-converge or dirty-limit, turn
+     * it off.
+     */
     cpu_throttle_stop();
 
-    qemu_mutex_lock_iothread();
     switch (s->state) {
     case MIGRATION_STATUS_COMPLETED:
         migration_calculate_complete(s);
@@ -3512,6 +4024,207 @@ static void *migration_thread(void *opaque)
     return NULL;
 }
 
+static void bg_migration_vm_start_bh(void *opaque)
+{
+    MigrationState *s = opaque;
+
+    qemu_bh_delete(s->vm_start_bh);
+    s->vm_start_bh = NULL;
+
+    if (s->vm_was_running) {
+        vm_start();
+    }
+    s->downtime = qemu_clock_get_ms(QEMU_CLOCK_REALTIME) - s->downtime_start;
+}
+
+/*
+ * Background snapshot completion: RAM has been written, so stop tracking
+ * guest writes and append the device state saved when the snapshot was
+ * taken.
+ */
+static void bg_migration_completion(MigrationState *s)
+{
+    int current_active_state = s->state;
+
+    ram_write_tracking_stop();
+
+    if (s->state == MIGRATION_STATUS_ACTIVE) {
+        qemu_put_buffer(s->to_dst_file, s->bioc->data, s->bioc->usage);
+        qemu_fflush(s->to_dst_file);
+    } else if (s->state == MIGRATION_STATUS_CANCELLING) {
+        goto fail;
+    }
+
+    if (qemu_file_get_error(s->to_dst_file)) {
+        trace_migration_completion_file_err();
+        goto fail;
+    }
+
+    migrate_set_state(&s->state, current_active_state,
+                      MIGRATION_STATUS_COMPLETED);
+    return;
+
+fail:
+    migrate_set_state(&s->state, current_active_state,
+                      MIGRATION_STATUS_FAILED);
+}
+
+static void bg_migration_iteration_finish(MigrationState *s)
+{
+    /*
+     * Unprotect guest RAM before taking the iothread lock, whose holder
+     * may be waiting on a write fault.
+     */
+    ram_write_tracking_stop();
+
+    qemu_mutex_lock_iothread();
+    switch (s->state) {
+    case MIGRATION_STATUS_COMPLETED:
+        migration_calculate_complete(s);
+        break;
+
+    case MIGRATION_STATUS_ACTIVE:
+    case MIGRATION_STATUS_FAILED:
+    case MIGRATION_STATUS_CANCELLED:
+    case MIGRATION_STATUS_CANCELLING:
+        /* The guest may still be stopped if we failed before resuming it */
+        if (s->vm_was_running && !s->vm_start_bh && !runstate_is_running()) {
+            vm_start();
+        }
+        break;
+
+    default:
+        /* Should not reach here, but if so, forgive the VM. */
+        error_report("%s: Unknown ending state %d", __func__, s->state);
+        break;
+    }
+    migrate_fd_cleanup_schedule(s);
+    qemu_mutex_unlock_iothread();
+}
+
+/*
+ * Migration thread for background snapshot.
+ *
+ * The device state is saved to a buffer with the guest stopped, then
+ * guest RAM is write-protected and the guest resumed.  RAM is written in
+ * a single pass while the guest runs; pages the guest writes to are
+ * saved first, before the write is allowed to proceed, so the stream
+ * holds RAM as it was when the guest was stopped.  The device state is
+ * appended at the end, since the destination loads RAM first.
+ */
+static void *bg_migration_thread(void *opaque)
+{
+    MigrationState *s = opaque;
+    int64_t setup_start = qemu_clock_get_ms(QEMU_CLOCK_HOST);
+    MigThrError thr_error;
+    QEMUFile *fb;
+    bool early_fail = true;
+
+    rcu_register_thread();
+    object_ref(OBJECT(s));
+
+    /* Guest writes wait for the pages to be saved, never throttle */
+    qemu_file_set_rate_limit(s->to_dst_file, INT64_MAX);
+
+    s->bioc = qio_channel_buffer_new(512 * KiB);
+    qio_channel_set_name(QIO_CHANNEL(s->bioc), "vmstate-buffer");
+    fb = qemu_fopen_channel_output(QIO_CHANNEL(s->bioc));
+    object_unref(OBJECT(s->bioc));
+
+    update_iteration_initial_status(s);
+
+    /* Map all of RAM while the guest runs, so that it can be protected */
+    ram_write_tracking_prepare();
+
+    qemu_savevm_state_header(s->to_dst_file);
+    qemu_savevm_state_setup(s->to_dst_file);
+
+    if (qemu_savevm_state_guest_unplug_pending()) {
+        migrate_set_state(&s->state, MIGRATION_STATUS_SETUP,
+                          MIGRATION_STATUS_WAIT_UNPLUG);
+
+        while (s->state == MIGRATION_STATUS_WAIT_UNPLUG &&
+               qemu_savevm_state_guest_unplug_pending()) {
+            qemu_sem_timedwait(&s->wait_unplug_sem, 250);
+        }
+
+        migrate_set_state(&s->state, MIGRATION_STATUS_WAIT_UNPLUG,
+                          MIGRATION_STATUS_ACTIVE);
+    } else {
+        migrate_set_state(&s->state, MIGRATION_STATUS_SETUP,
+                          MIGRATION_STATUS_ACTIVE);
+    }
+    s->setup_time = qemu_clock_get_ms(QEMU_CLOCK_HOST) - setup_start;
+
+    trace_migration_thread_setup_complete();
+    s->downtime_start = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
+
+    qemu_mutex_lock_iothread();
+
+    /* A suspended guest must be woken up to be stopped */
+    qemu_system_wakeup_request(QEMU_WAKEUP_REASON_OTHER, NULL);
+    s->vm_was_running = runstate_is_running();
+
+    if (global_state_store()) {
+        goto fail;
+    }
+    if (vm_stop_force_state(RUN_STATE_PAUSED)) {
+        goto fail;
+    }
+    cpu_synchronize_all_states();
+    if (qemu_savevm_state_complete_precopy_non_iterable(fb, false, false)) {
+        goto fail;
+    }
+    /* s->bioc->data is read directly at completion */
+    qemu_fflush(fb);
+
+    if (ram_write_tracking_start()) {
+        goto fail;
+    }
+    early_fail = false;
+
+    /*
+     * Resume the guest from a bottom half: the vm state change notifiers
+     * may write to guest RAM, which is now protected, and those writes
+     * can only be served by this thread once it drops the iothread lock.
+     */
+    s->vm_start_bh = qemu_bh_new(bg_migration_vm_start_bh, s);
+    qemu_bh_schedule(s->vm_start_bh);
+
+    qemu_mutex_unlock_iothread();
+
+    while (migration_is_active(s)) {
+        if (qemu_savevm_state_iterate(s->to_dst_file, false) > 0) {
+            bg_migration_completion(s);
+            break;
+        }
+
+        thr_error = migration_detect_error(s);
+        if (thr_error == MIG_THR_ERR_FATAL) {
+            break;
+        }
+
+        migration_update_counters(s, qemu_clock_get_ms(QEMU_CLOCK_REALTIME));
+    }
+
+    trace_migration_thread_after_loop();
+
+fail:
+    if (early_fail) {
+        migrate_set_state(&s->state, MIGRATION_STATUS_ACTIVE,
+                          MIGRATION_STATUS_FAILED);
+        qemu_mutex_unlock_iothread();
+    }
+
+    bg_migration_iteration_finish(s);
+
+    qemu_fclose(fb);
+    s->bioc = NULL;
+    object_unref(OBJECT(s));
+    rcu_unregister_thread();
+    return NULL;
+}
+
 void migrate_fd_connect(MigrationState *s, Error *error_in)
 {
     Error *local_err = NULL;
@@ -3560,6 +4273,19 @@ void migrate_fd_connect(MigrationState *s, Error *error_in)
         }
     }
 
+    /*
+     * The preempt channel is connected only after the main one is up, so
+     * that the destination can tell them apart by accept order.
+     */
+    if (!resume && migrate_postcopy_preempt() &&
+        postcopy_preempt_setup(s, &local_err)) {
+        error_report_err(local_err);
+        migrate_set_state(&s->state, MIGRATION_STATUS_SETUP,
+                          MIGRATION_STATUS_FAILED);
+        migrate_fd_cleanup(s);
+        return;
+    }
+
     if (resume) {
         /* Wakeup the main migration thread to do the recovery */
         migrate_set_state(&s->state, MIGRATION_STATUS_POSTCOPY_PAUSED,
@@ -3575,8 +4301,13 @@ void migrate_fd_connect(MigrationState *s, Error *error_in)
         migrate_fd_cleanup(s);
         return;
     }
-    qemu_thread_create(&s->thread, "live_migration", migration_thread, s,
-                       QEMU_THREAD_JOINABLE);
+    if (migrate_background_snapshot()) {
+        qemu_thread_create(&s->thread, "bg_snapshot", bg_migration_thread, s,
+                           QEMU_THREAD_JOINABLE);
+    } else {
+        qemu_thread_create(&s->thread, "live_migration", migration_thread, s,
+                           QEMU_THREAD_JOINABLE);
+    }
     s->migration_thread_running = true;
 }
 
@@ -3666,6 +4397,20 @@ static Property migration_properties[] = {
     DEFINE_PROP_UINT8("max-cpu-throttle", MigrationState,
                       parameters.max_cpu_throttle,
                       DEFAULT_MIGRATE_MAX_CPU_THROTTLE),
+    DEFINE_PROP_UINT32("postcopy-prefetch-window", MigrationState,
+                      parameters.postcopy_prefetch_window,
+                      DEFAULT_MIGRATE_POSTCOPY_PREFETCH_WINDOW),
+    DEFINE_PROP_BOOL("postcopy-prefetch-stride", MigrationState,
+                      parameters.postcopy_prefetch_stride, false),
+    DEFINE_PROP_UINT8("dirty-sync-threads", MigrationState,
+                      parameters.dirty_sync_threads,
+                      DEFAULT_MIGRATE_DIRTY_SYNC_THREADS),
+    DEFINE_PROP_COMPRESS_METHOD("compress-method", MigrationState,
+                      parameters.compress_method,
+                      DEFAULT_MIGRATE_COMPRESS_METHOD),
+    DEFINE_PROP_UINT64("vcpu-dirty-limit", MigrationState,
+                      parameters.vcpu_dirty_limit,
+                      DEFAULT_MIGRATE_VCPU_DIRTY_LIMIT),
     DEFINE_PROP_SIZE("announce-initial", MigrationState,
                       parameters.announce_initial,
                       DEFAULT_MIGRATE_ANNOUNCE_INITIAL),
@@ -3755,6 +4500,11 @@ static void migration_instance_init(Object *obj)
     params->has_xbzrle_cache_size = true;
     params->has_max_postcopy_bandwidth = true;
     params->has_max_cpu_throttle = true;
+    params->has_postcopy_prefetch_window = true;
+    params->has_postcopy_prefetch_stride = true;
+    params->has_dirty_sync_threads = true;
+    params->has_compress_method = true;
+    params->has_vcpu_dirty_limit = true;
     params->has_announce_initial = true;
     params->has_announce_max = true;
     params->has_announce_rounds = true;
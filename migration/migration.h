@@ -20,6 +20,7 @@
 #include "qemu/thread.h"
 #include "qemu/coroutine_int.h"
 #include "io/channel.h"
+#include "io/channel-buffer.h"
 #include "net/announce.h"
 
 struct PostcopyBlocktimeContext;
@@ -103,10 +104,54 @@ struct MigrationIncomingState {
 
     /* List of listening socket addresses  */
     SocketAddressList *socket_address_list;
+
+    /*
+     * Dedicated channel for urgent postcopy pages (postcopy-preempt).
+     * It is the second connection accepted from the source, and is
+     * drained by its own thread into postcopy_preempt_tmp_page.
+     */
+    QEMUFile *postcopy_qemufile_dst;
+    /* Posted once postcopy_qemufile_dst is set up, or to stop the thread */
+    QemuSemaphore postcopy_qemufile_dst_done;
+    bool have_preempt_thread;
+    QemuThread postcopy_preempt_thread;
+    void *postcopy_preempt_tmp_page;
+
+    /*
+     * Page fault latency: host page address -> time (ns) at which the
+     * page was requested from the source.  Entries are dropped once the
+     * page is placed.  Protected by page_request_mutex.
+     */
+    QemuMutex page_request_mutex;
+    GHashTable *page_requested;
+    uint64_t postcopy_latency_total;
+    uint64_t postcopy_latency_count;
+    uint64_t postcopy_latency_max;
+    /*
+     * Host pages requested ahead of a fault (postcopy-prefetch-window) and
+     * not placed yet, also protected by page_request_mutex.  A fault on
+     * one of them counts as a prefetch hit.
+     */
+    GHashTable *page_prefetched;
+    uint64_t postcopy_prefetch_pages;
+    uint64_t postcopy_prefetch_hits;
+    /* Stride detector, only used by the fault thread */
+    RAMBlock *prefetch_last_rb;
+    int64_t prefetch_last_page;
+    int64_t prefetch_last_delta;
+
+    /*
+     * Time (us) at which the first final section of an iterable device
+     * arrived, i.e. shortly after the source stopped the guest.  The
+     * phases of the switchover are timed from there.
+     */
+    int64_t switchover_start;
+    DowntimeBreakdown downtime_breakdown;
 };
 
 MigrationIncomingState *migration_incoming_get_current(void);
 void migration_incoming_state_destroy(void);
+uint64_t migration_downtime_phase(const char *phase, int64_t start);
 /*
  * Functions to work with blocktime context
  */
@@ -135,10 +180,12 @@ struct MigrationState
     QemuThread thread;
     QEMUBH *cleanup_bh;
     QEMUFile *to_dst_file;
+    /* Urgent page channel for postcopy-preempt, NULL when not in use */
+    QEMUFile *postcopy_qemufile_src;
     /*
-     * Protects to_dst_file pointer.  We need to make sure we won't
-     * yield or hang during the critical section, since this lock will
-     * be used in OOB command handler.
+     * Protects to_dst_file and postcopy_qemufile_src pointers.  We need
+     * to make sure we won't yield or hang during the critical section,
+     * since this lock will be used in OOB command handler.
      */
     QemuMutex qemu_file_lock;
 
@@ -185,6 +232,8 @@ struct MigrationState
     /* Timestamp when VM is down (ms) to migrate the last stuff */
     int64_t downtime_start;
     int64_t downtime;
+    /* Time spent in each phase of the downtime of a precopy migration */
+    DowntimeBreakdown downtime_breakdown;
     int64_t expected_downtime;
     bool enabled_capabilities[MIGRATION_CAPABILITY__MAX];
     int64_t setup_time;
@@ -195,6 +244,11 @@ struct MigrationState
      */
     bool vm_was_running;
 
+    /* Background snapshot: device state saved with the guest stopped */
+    QIOChannelBuffer *bioc;
+    /* Background snapshot: resumes the guest once RAM is protected */
+    QEMUBH *vm_start_bh;
+
     /* Flag set once the migration has been asked to enter postcopy */
     bool start_postcopy;
     /* Flag set after postcopy has sent the device state */
@@ -298,11 +352,20 @@ bool migrate_validate_uuid(void);
 
 bool migrate_auto_converge(void);
 bool migrate_use_multifd(void);
+bool migrate_multifd_zero_page(void);
+bool migrate_use_zero_copy_send(void);
+bool migrate_mapped_ram(void);
+bool migrate_postcopy_preempt(void);
+bool migrate_background_snapshot(void);
+bool migrate_dirty_limit(void);
 bool migrate_pause_before_switchover(void);
 int migrate_multifd_channels(void);
 MultiFDCompression migrate_multifd_compression(void);
 int migrate_multifd_zlib_level(void);
 int migrate_multifd_zstd_level(void);
+uint32_t migrate_postcopy_prefetch_window(void);
+bool migrate_postcopy_prefetch_stride(void);
+int migrate_dirty_sync_threads(void);
 
 int migrate_use_xbzrle(void);
 int64_t migrate_xbzrle_cache_size(void);
@@ -319,6 +382,8 @@ bool migrate_use_compression(void);
 int migrate_compress_level(void);
 int migrate_compress_threads(void);
 int migrate_compress_wait_thread(void);
+CompressMethod migrate_compress_method(void);
+uint64_t migrate_vcpu_dirty_limit(void);
 int migrate_decompress_threads(void);
 bool migrate_use_events(void);
 bool migrate_postcopy_blocktime(void);
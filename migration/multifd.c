@@ -12,6 +12,8 @@
 
 #include "qemu/osdep.h"
 #include "qemu/rcu.h"
+#include "qemu/cutils.h"
+#include "qemu/timer.h"
 #include "exec/target_page.h"
 #include "sysemu/sysemu.h"
 #include "exec/ramblock.h"
@@ -20,6 +22,7 @@
 #include "ram.h"
 #include "migration.h"
 #include "socket.h"
+#include "file.h"
 #include "qemu-file.h"
 #include "trace.h"
 #include "multifd.h"
@@ -28,6 +31,17 @@
 
 #define MULTIFD_MAGIC 0x11223344U
 #define MULTIFD_VERSION 1
+/*
+ * With multifd-zero-page, packets use the zero_pages field that older
+ * versions ignored, so they must refuse the channels.
+ */
+#define MULTIFD_VERSION_ZERO_PAGE 2
+
+static uint32_t multifd_version(void)
+{
+    return migrate_multifd_zero_page() ? MULTIFD_VERSION_ZERO_PAGE
+                                       : MULTIFD_VERSION;
+}
 
 typedef struct {
     uint32_t magic;
@@ -90,7 +104,8 @@ static int nocomp_send_prepare(MultiFDSendParams *p, uint32_t used,
 /**
  * nocomp_send_write: do the actual write of the data
  *
- * For no compression we just have to write the data.
+ * For no compression we just have to write the data.  The pages are
+ * sent without copying them if the channel was set up for zero copy.
  *
  * Returns 0 for success or -1 for error
  *
@@ -100,7 +115,8 @@ static int nocomp_send_prepare(MultiFDSendParams *p, uint32_t used,
  */
 static int nocomp_send_write(MultiFDSendParams *p, uint32_t used, Error **errp)
 {
-    return qio_channel_writev_all(p->c, p->pages->iov, used, errp);
+    return qio_channel_writev_all_flags(p->c, p->pages->iov, used,
+                                        p->write_flags, errp);
 }
 
 /**
@@ -178,7 +194,7 @@ static int multifd_send_initial_packet(MultiFDSendParams *p, Error **errp)
     int ret;
 
     msg.magic = cpu_to_be32(MULTIFD_MAGIC);
-    msg.version = cpu_to_be32(MULTIFD_VERSION);
+    msg.version = cpu_to_be32(multifd_version());
     msg.id = p->id;
     memcpy(msg.uuid, &qemu_uuid.data, sizeof(msg.uuid));
 
@@ -208,9 +224,14 @@ static int multifd_recv_initial_packet(QIOChannel *c, Error **errp)
         return -1;
     }
 
-    if (msg.version != MULTIFD_VERSION) {
+    if (msg.version != multifd_version()) {
         error_setg(errp, "multifd: received packet version %d "
-                   "expected %d", msg.version, MULTIFD_VERSION);
+                   "expected %d", msg.version, multifd_version());
+        if (msg.version == MULTIFD_VERSION_ZERO_PAGE ||
+            multifd_version() == MULTIFD_VERSION_ZERO_PAGE) {
+            error_append_hint(errp, "The multifd-zero-page capability must "
+                              "be set on both sides\n");
+        }
         return -1;
     }
 
@@ -248,6 +269,7 @@ static MultiFDPages_t *multifd_pages_init(size_t size)
 static void multifd_pages_clear(MultiFDPages_t *pages)
 {
     pages->used = 0;
+    pages->zero = 0;
     pages->allocated = 0;
     pages->packet_num = 0;
     pages->block = NULL;
@@ -261,19 +283,24 @@ static void multifd_pages_clear(MultiFDPages_t *pages)
 static void multifd_send_fill_packet(MultiFDSendParams *p)
 {
     MultiFDPacket_t *packet = p->packet;
+    uint32_t flags = p->flags;
     int i;
 
-    packet->flags = cpu_to_be32(p->flags);
+    if (p->pages->zero) {
+        flags |= MULTIFD_FLAG_ZERO_PAGE;
+    }
+    packet->flags = cpu_to_be32(flags);
     packet->pages_alloc = cpu_to_be32(p->pages->allocated);
     packet->pages_used = cpu_to_be32(p->pages->used);
     packet->next_packet_size = cpu_to_be32(p->next_packet_size);
     packet->packet_num = cpu_to_be64(p->packet_num);
+    packet->zero_pages = cpu_to_be32(p->pages->zero);
 
     if (p->pages->block) {
         strncpy(packet->ramblock, p->pages->block->idstr, 256);
     }
 
-    for (i = 0; i < p->pages->used; i++) {
+    for (i = 0; i < p->pages->used + p->pages->zero; i++) {
         /* there are architectures where ram_addr_t is 32 bit */
         uint64_t temp = p->pages->offset[i];
 
@@ -297,14 +324,19 @@ static int multifd_recv_unfill_packet(MultiFDRecvParams *p, Error **errp)
     }
 
     packet->version = be32_to_cpu(packet->version);
-    if (packet->version != MULTIFD_VERSION) {
+    if (packet->version != multifd_version()) {
         error_setg(errp, "multifd: received packet "
                    "version %d and expected version %d",
-                   packet->version, MULTIFD_VERSION);
+                   packet->version, multifd_version());
         return -1;
     }
 
     p->flags = be32_to_cpu(packet->flags);
+    if (p->flags & ~MULTIFD_FLAG_MASK) {
+        error_setg(errp, "multifd: received packet with unknown flags 0x%x",
+                   p->flags & ~MULTIFD_FLAG_MASK);
+        return -1;
+    }
 
     packet->pages_alloc = be32_to_cpu(packet->pages_alloc);
     /*
@@ -327,17 +359,25 @@ static int multifd_recv_unfill_packet(MultiFDRecvParams *p, Error **errp)
     }
 
     p->pages->used = be32_to_cpu(packet->pages_used);
-    if (p->pages->used > packet->pages_alloc) {
+    p->pages->zero = be32_to_cpu(packet->zero_pages);
+    if (p->pages->zero && !(p->flags & MULTIFD_FLAG_ZERO_PAGE)) {
+        error_setg(errp, "multifd: received %d zero pages without "
+                   "MULTIFD_FLAG_ZERO_PAGE", p->pages->zero);
+        return -1;
+    }
+    if (p->pages->used > packet->pages_alloc ||
+        p->pages->zero > packet->pages_alloc - p->pages->used) {
         error_setg(errp, "multifd: received packet "
-                   "with %d pages and expected maximum pages are %d",
-                   p->pages->used, packet->pages_alloc) ;
+                   "with %d pages and %d zero pages and expected maximum "
+                   "pages are %d",
+                   p->pages->used, p->pages->zero, packet->pages_alloc) ;
         return -1;
     }
 
     p->next_packet_size = be32_to_cpu(packet->next_packet_size);
     p->packet_num = be64_to_cpu(packet->packet_num);
 
-    if (p->pages->used == 0) {
+    if (p->pages->used + p->pages->zero == 0) {
         return 0;
     }
 
@@ -350,7 +390,7 @@ static int multifd_recv_unfill_packet(MultiFDRecvParams *p, Error **errp)
         return -1;
     }
 
-    for (i = 0; i < p->pages->used; i++) {
+    for (i = 0; i < p->pages->used + p->pages->zero; i++) {
         uint64_t offset = be64_to_cpu(packet->offset[i]);
 
         if (offset > (block->used_length - qemu_target_page_size())) {
@@ -372,6 +412,10 @@ struct {
     MultiFDPages_t *pages;
     /* global number of generated multifd packets */
     uint64_t packet_num;
+    /* zero pages are detected by the channels */
+    bool zero_page;
+    /* pages are written at their place in the file, without packets */
+    bool mapped_ram;
     /* send channels ready */
     QemuSemaphore channels_ready;
     /*
@@ -384,6 +428,59 @@ struct {
     MultiFDMethods *ops;
 } *multifd_send_state;
 
+/* One per send channel; kept after multifd_save_cleanup() for queries */
+static MultiFDSendStats *multifd_send_stats;
+static int multifd_send_stats_count;
+
+/* Returns the CPU time consumed by the calling thread, in nanoseconds */
+static uint64_t multifd_thread_cpu_ns(void)
+{
+#ifdef CLOCK_THREAD_CPUTIME_ID
+    struct timespec ts;
+
+    if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts) == 0) {
+        return ts.tv_sec * NANOSECONDS_PER_SECOND + ts.tv_nsec;
+    }
+#endif
+    return 0;
+}
+
+MultiFDChannelStatsList *multifd_query_send_stats(void)
+{
+    MultiFDChannelStatsList *head = NULL;
+    int i;
+
+    for (i = multifd_send_stats_count - 1; i >= 0; i--) {
+        MultiFDChannelStatsList *entry = g_new0(MultiFDChannelStatsList, 1);
+        MultiFDChannelStats *info = g_new0(MultiFDChannelStats, 1);
+        MultiFDSendStats stats;
+
+        /* While the channels exist, their threads update the stats */
+        if (multifd_send_state) {
+            MultiFDSendParams *p = &multifd_send_state->params[i];
+
+            qemu_mutex_lock(&p->mutex);
+            stats = multifd_send_stats[i];
+            qemu_mutex_unlock(&p->mutex);
+        } else {
+            stats = multifd_send_stats[i];
+        }
+
+        info->id = i;
+        info->packets = stats.packets;
+        info->pages = stats.pages;
+        info->bytes = stats.bytes;
+        info->compressed_bytes = stats.compressed_bytes;
+        info->compression_ratio = stats.compressed_bytes ?
+            (double)stats.bytes / stats.compressed_bytes : 0;
+        info->compress_time = stats.compress_time_ns / SCALE_US;
+        entry->value = info;
+        entry->next = head;
+        head = entry;
+    }
+    return head;
+}
+
 /*
  * How we use multifd_send_state->pages and channel->pages?
  *
@@ -402,6 +499,23 @@ struct {
  * false.
  */
 
+/*
+ * Add the pages that @p sent since the last call to the migration
+ * counters.  Must be called by the migration thread with p->mutex held.
+ */
+static void multifd_send_account(QEMUFile *f, MultiFDSendParams *p)
+{
+    uint64_t transferred = p->done_pages * qemu_target_page_size();
+
+    ram_counters.normal += p->done_pages;
+    ram_counters.duplicate += p->done_zero_pages;
+    qemu_file_update_transfer(f, transferred);
+    ram_counters.multifd_bytes += transferred;
+    ram_counters.transferred += transferred;
+    p->done_pages = 0;
+    p->done_zero_pages = 0;
+}
+
 static int multifd_send_pages(QEMUFile *f)
 {
     int i;
@@ -443,11 +557,15 @@ static int multifd_send_pages(QEMUFile *f)
     p->packet_num = multifd_send_state->packet_num++;
     multifd_send_state->pages = p->pages;
     p->pages = pages;
-    transferred = ((uint64_t) pages->used) * qemu_target_page_size()
-                + p->packet_len;
+    /*
+     * Pages are accounted once the channel knows which ones are zero,
+     * i.e. after it has sent them; only the packet header is known now.
+     */
+    multifd_send_account(f, p);
+    transferred = multifd_send_state->mapped_ram ? 0 : p->packet_len;
     qemu_file_update_transfer(f, transferred);
     ram_counters.multifd_bytes += transferred;
-    ram_counters.transferred += transferred;;
+    ram_counters.transferred += transferred;
     qemu_mutex_unlock(&p->mutex);
     qemu_sem_post(&p->sem);
 
@@ -541,7 +659,11 @@ void multifd_save_cleanup(void)
         MultiFDSendParams *p = &multifd_send_state->params[i];
         Error *local_err = NULL;
 
-        socket_send_channel_destroy(p->c);
+        if (multifd_send_state->mapped_ram) {
+            file_send_channel_destroy(p->c);
+        } else {
+            socket_send_channel_destroy(p->c);
+        }
         p->c = NULL;
         qemu_mutex_destroy(&p->mutex);
         qemu_sem_destroy(&p->sem);
@@ -597,9 +719,11 @@ void multifd_send_sync_main(QEMUFile *f)
         p->packet_num = multifd_send_state->packet_num++;
         p->flags |= MULTIFD_FLAG_SYNC;
         p->pending_job++;
-        qemu_file_update_transfer(f, p->packet_len);
-        ram_counters.multifd_bytes += p->packet_len;
-        ram_counters.transferred += p->packet_len;
+        if (!multifd_send_state->mapped_ram) {
+            qemu_file_update_transfer(f, p->packet_len);
+            ram_counters.multifd_bytes += p->packet_len;
+            ram_counters.transferred += p->packet_len;
+        }
         qemu_mutex_unlock(&p->mutex);
         qemu_sem_post(&p->sem);
     }
@@ -609,9 +733,95 @@ void multifd_send_sync_main(QEMUFile *f)
         trace_multifd_send_sync_main_wait(p->id);
         qemu_sem_wait(&p->sem_sync);
     }
+    for (i = 0; i < migrate_multifd_channels(); i++) {
+        MultiFDSendParams *p = &multifd_send_state->params[i];
+
+        qemu_mutex_lock(&p->mutex);
+        multifd_send_account(f, p);
+        qemu_mutex_unlock(&p->mutex);
+    }
     trace_multifd_send_sync_main(multifd_send_state->packet_num);
 }
 
+/**
+ * multifd_send_zero_page_detect: move the zero pages to the end
+ *
+ * Reorders the pages of @p so that the ones that only contain zeroes
+ * come after the others, and sets pages->used to the number of non-zero
+ * pages and pages->zero to the number of zero pages.
+ *
+ * @p: Params for the channel that we are using
+ */
+static void multifd_send_zero_page_detect(MultiFDSendParams *p)
+{
+    MultiFDPages_t *pages = p->pages;
+    size_t page_size = qemu_target_page_size();
+    uint32_t i = 0, j = pages->used;
+
+    while (i < j) {
+        if (buffer_is_zero(pages->iov[i].iov_base, page_size)) {
+            ram_addr_t offset = pages->offset[i];
+            struct iovec iov = pages->iov[i];
+
+            j--;
+            pages->offset[i] = pages->offset[j];
+            pages->iov[i] = pages->iov[j];
+            pages->offset[j] = offset;
+            pages->iov[j] = iov;
+        } else {
+            i++;
+        }
+    }
+    pages->zero = pages->used - j;
+    pages->used = j;
+}
+
+/**
+ * multifd_send_mapped_ram: write the pages at their place in the file
+ *
+ * Pages that are contiguous in the RAM block are also contiguous in the
+ * file, so each run of them is written with a single pwritev().  The
+ * pages are then marked as present in the file bitmap of the block, and
+ * the zero pages, which don't need to be written, as absent.
+ *
+ * Returns 0 for success or -1 for error
+ *
+ * @block: RAM block the pages belong to
+ * @p: Params for the channel that we are using
+ * @used: number of non-zero pages, at the start of p->pages
+ * @zero: number of zero pages, following them
+ * @errp: pointer to an error
+ */
+static int multifd_send_mapped_ram(RAMBlock *block, MultiFDSendParams *p,
+                                   uint32_t used, uint32_t zero,
+                                   Error **errp)
+{
+    MultiFDPages_t *pages = p->pages;
+    size_t page_size = qemu_target_page_size();
+    uint32_t i, j;
+
+    for (i = 0; i < used; i = j) {
+        for (j = i + 1; j < used; j++) {
+            if (pages->offset[j] != pages->offset[j - 1] + page_size) {
+                break;
+            }
+        }
+        if (qio_channel_pwritev_all(p->c, &pages->iov[i], j - i,
+                                    block->pages_offset + pages->offset[i],
+                                    errp) < 0) {
+            return -1;
+        }
+    }
+
+    for (i = 0; i < used; i++) {
+        set_bit_atomic(pages->offset[i] / page_size, block->file_bmap);
+    }
+    for (; i < used + zero; i++) {
+        clear_bit_atomic(pages->offset[i] / page_size, block->file_bmap);
+    }
+    return 0;
+}
+
 static void *multifd_send_thread(void *opaque)
 {
     MultiFDSendParams *p = opaque;
@@ -622,12 +832,15 @@ static void *multifd_send_thread(void *opaque)
     trace_multifd_send_thread_start(p->id);
     rcu_register_thread();
 
-    if (multifd_send_initial_packet(p, &local_err) < 0) {
-        ret = -1;
-        goto out;
+    /* A mapped-ram file has no packets, only pages */
+    if (!multifd_send_state->mapped_ram) {
+        if (multifd_send_initial_packet(p, &local_err) < 0) {
+            ret = -1;
+            goto out;
+        }
+        /* initial packet */
+        p->num_packets = 1;
     }
-    /* initial packet */
-    p->num_packets = 1;
 
     while (true) {
         qemu_sem_wait(&p->sem);
@@ -638,47 +851,90 @@ static void *multifd_send_thread(void *opaque)
         qemu_mutex_lock(&p->mutex);
 
         if (p->pending_job) {
-            uint32_t used = p->pages->used;
+            uint32_t used, zero;
             uint64_t packet_num = p->packet_num;
+            RAMBlock *block = p->pages->block;
             flags = p->flags;
 
+            if (multifd_send_state->zero_page) {
+                multifd_send_zero_page_detect(p);
+            }
+            used = p->pages->used;
+            zero = p->pages->zero;
+
             if (used) {
+                uint64_t start = multifd_thread_cpu_ns();
+
                 ret = multifd_send_state->ops->send_prepare(p, used,
                                                             &local_err);
                 if (ret != 0) {
                     qemu_mutex_unlock(&p->mutex);
                     break;
                 }
+                p->stats->compress_time_ns += multifd_thread_cpu_ns() - start;
+                p->stats->pages += used;
+                p->stats->bytes += used * qemu_target_page_size();
+                p->stats->compressed_bytes += p->next_packet_size;
             }
+            p->stats->packets++;
             multifd_send_fill_packet(p);
             p->flags = 0;
             p->num_packets++;
             p->num_pages += used;
+            p->num_zero_pages += zero;
             p->pages->used = 0;
+            p->pages->zero = 0;
             p->pages->block = NULL;
             qemu_mutex_unlock(&p->mutex);
 
-            trace_multifd_send(p->id, packet_num, used, flags,
+            trace_multifd_send(p->id, packet_num, used, zero, flags,
                                p->next_packet_size);
 
-            ret = qio_channel_write_all(p->c, (void *)p->packet,
-                                        p->packet_len, &local_err);
-            if (ret != 0) {
-                break;
-            }
-
-            if (used) {
-                ret = multifd_send_state->ops->send_write(p, used, &local_err);
+            if (multifd_send_state->mapped_ram) {
+                /* p->pages stays ours until pending_job is dropped */
+                if (used + zero) {
+                    ret = multifd_send_mapped_ram(block, p, used, zero,
+                                                  &local_err);
+                    if (ret != 0) {
+                        break;
+                    }
+                }
+            } else {
+                ret = qio_channel_write_all(p->c, (void *)p->packet,
+                                            p->packet_len, &local_err);
                 if (ret != 0) {
                     break;
                 }
+
+                if (used) {
+                    ret = multifd_send_state->ops->send_write(p, used,
+                                                              &local_err);
+                    if (ret != 0) {
+                        break;
+                    }
+                }
             }
 
             qemu_mutex_lock(&p->mutex);
             p->pending_job--;
+            p->done_pages += used;
+            p->done_zero_pages += zero;
             qemu_mutex_unlock(&p->mutex);
 
             if (flags & MULTIFD_FLAG_SYNC) {
+                /*
+                 * Pages sent with zero copy may still be queued in the
+                 * kernel; make sure they are out before the next dirty
+                 * bitmap sync can resend them.
+                 */
+                if (p->write_flags & QIO_CHANNEL_WRITE_FLAG_ZERO_COPY) {
+                    ret = qio_channel_flush(p->c, &local_err);
+                    if (ret < 0) {
+                        break;
+                    }
+                    trace_multifd_send_flush(p->id, ret == 1);
+                    ret = 0;
+                }
                 qemu_sem_post(&p->sem_sync);
             }
             qemu_sem_post(&multifd_send_state->channels_ready);
@@ -712,7 +968,8 @@ out:
     qemu_mutex_unlock(&p->mutex);
 
     rcu_unregister_thread();
-    trace_multifd_send_thread_end(p->id, p->num_packets, p->num_pages);
+    trace_multifd_send_thread_end(p->id, p->num_packets, p->num_pages,
+                                  p->num_zero_pages);
 
     return NULL;
 }
@@ -724,7 +981,14 @@ static void multifd_new_send_channel_async(QIOTask *task, gpointer opaque)
     Error *local_err = NULL;
 
     trace_multifd_new_send_channel_async(p->id);
-    if (qio_task_propagate_error(task, &local_err)) {
+    if (!qio_task_propagate_error(task, &local_err) &&
+        migrate_use_zero_copy_send() &&
+        !qio_channel_has_feature(QIO_CHANNEL(sioc),
+                                 QIO_CHANNEL_FEATURE_WRITE_ZERO_COPY)) {
+        error_setg(&local_err, "multifd: channel %d does not support "
+                   "zero-copy-send", p->id);
+    }
+    if (local_err) {
         migrate_set_error(migrate_get_current(), local_err);
         /* Error happen, we need to tell who pay attention to me */
         qemu_sem_post(&multifd_send_state->channels_ready);
@@ -740,6 +1004,10 @@ static void multifd_new_send_channel_async(QIOTask *task, gpointer opaque)
     } else {
         p->c = QIO_CHANNEL(sioc);
         qio_channel_set_delay(p->c, false);
+        if (migrate_use_zero_copy_send()) {
+            p->write_flags = QIO_CHANNEL_WRITE_FLAG_ZERO_COPY;
+        }
+        trace_multifd_send_zero_copy(p->id, p->write_flags != 0);
         p->running = true;
         qemu_thread_create(&p->thread, p->name, multifd_send_thread, p,
                            QEMU_THREAD_JOINABLE);
@@ -761,7 +1029,12 @@ int multifd_save_setup(Error **errp)
     multifd_send_state->pages = multifd_pages_init(page_count);
     qemu_sem_init(&multifd_send_state->channels_ready, 0);
     atomic_set(&multifd_send_state->exiting, 0);
+    multifd_send_state->zero_page = migrate_multifd_zero_page();
+    multifd_send_state->mapped_ram = migrate_mapped_ram();
     multifd_send_state->ops = multifd_ops[migrate_multifd_compression()];
+    g_free(multifd_send_stats);
+    multifd_send_stats = g_new0(MultiFDSendStats, thread_count);
+    multifd_send_stats_count = thread_count;
 
     for (i = 0; i < thread_count; i++) {
         MultiFDSendParams *p = &multifd_send_state->params[i];
@@ -772,14 +1045,19 @@ int multifd_save_setup(Error **errp)
         p->quit = false;
         p->pending_job = 0;
         p->id = i;
+        p->stats = &multifd_send_stats[i];
         p->pages = multifd_pages_init(page_count);
         p->packet_len = sizeof(MultiFDPacket_t)
                       + sizeof(uint64_t) * page_count;
         p->packet = g_malloc0(p->packet_len);
         p->packet->magic = cpu_to_be32(MULTIFD_MAGIC);
-        p->packet->version = cpu_to_be32(MULTIFD_VERSION);
+        p->packet->version = cpu_to_be32(multifd_version());
         p->name = g_strdup_printf("multifdsend_%d", i);
-        socket_send_channel_create(multifd_new_send_channel_async, p);
+        if (multifd_send_state->mapped_ram) {
+            file_send_channel_create(multifd_new_send_channel_async, p);
+        } else {
+            socket_send_channel_create(multifd_new_send_channel_async, p);
+        }
     }
 
     for (i = 0; i < thread_count; i++) {
@@ -846,7 +1124,7 @@ int multifd_load_cleanup(Error **errp)
 {
     int i;
 
-    if (!migrate_use_multifd()) {
+    if (!migrate_use_multifd() || migrate_mapped_ram()) {
         return 0;
     }
     multifd_recv_terminate_threads(NULL);
@@ -892,7 +1170,7 @@ void multifd_recv_sync_main(void)
 {
     int i;
 
-    if (!migrate_use_multifd()) {
+    if (!migrate_use_multifd() || migrate_mapped_ram()) {
         return;
     }
     for (i = 0; i < migrate_multifd_channels(); i++) {
@@ -915,6 +1193,27 @@ void multifd_recv_sync_main(void)
     trace_multifd_recv_sync_main(multifd_recv_state->packet_num);
 }
 
+/**
+ * multifd_recv_zero_pages: clear the zero pages of a packet
+ *
+ * Pages that were never written by the guest are still zero on the
+ * destination, so only write to the ones that are not, to avoid
+ * allocating memory for them.
+ *
+ * @p: Params for the channel that we are using
+ */
+static void multifd_recv_zero_pages(MultiFDRecvParams *p)
+{
+    MultiFDPages_t *pages = p->pages;
+    uint32_t i;
+
+    for (i = pages->used; i < pages->used + pages->zero; i++) {
+        if (!buffer_is_zero(pages->iov[i].iov_base, pages->iov[i].iov_len)) {
+            memset(pages->iov[i].iov_base, 0, pages->iov[i].iov_len);
+        }
+    }
+}
+
 static void *multifd_recv_thread(void *opaque)
 {
     MultiFDRecvParams *p = opaque;
@@ -925,7 +1224,7 @@ static void *multifd_recv_thread(void *opaque)
     rcu_register_thread();
 
     while (true) {
-        uint32_t used;
+        uint32_t used, zero;
         uint32_t flags;
 
         if (p->quit) {
@@ -949,13 +1248,15 @@ static void *multifd_recv_thread(void *opaque)
         }
 
         used = p->pages->used;
+        zero = p->pages->zero;
         flags = p->flags;
         /* recv methods don't know how to handle the SYNC flag */
         p->flags &= ~MULTIFD_FLAG_SYNC;
-        trace_multifd_recv(p->id, p->packet_num, used, flags,
+        trace_multifd_recv(p->id, p->packet_num, used, zero, flags,
                            p->next_packet_size);
         p->num_packets++;
         p->num_pages += used;
+        p->num_zero_pages += zero;
         qemu_mutex_unlock(&p->mutex);
 
         if (used) {
@@ -965,6 +1266,10 @@ static void *multifd_recv_thread(void *opaque)
             }
         }
 
+        if (zero) {
+            multifd_recv_zero_pages(p);
+        }
+
         if (flags & MULTIFD_FLAG_SYNC) {
             qemu_sem_post(&multifd_recv_state->sem_sync);
             qemu_sem_wait(&p->sem_sync);
@@ -980,7 +1285,8 @@ static void *multifd_recv_thread(void *opaque)
     qemu_mutex_unlock(&p->mutex);
 
     rcu_unregister_thread();
-    trace_multifd_recv_thread_end(p->id, p->num_packets, p->num_pages);
+    trace_multifd_recv_thread_end(p->id, p->num_packets, p->num_pages,
+                                  p->num_zero_pages);
 
     return NULL;
 }
@@ -991,7 +1297,8 @@ int multifd_load_setup(Error **errp)
     uint32_t page_count = MULTIFD_PACKET_SIZE / qemu_target_page_size();
     uint8_t i;
 
-    if (!migrate_use_multifd()) {
+    /* The pages of a mapped-ram file are loaded by ram_load() */
+    if (!migrate_use_multifd() || migrate_mapped_ram()) {
         return 0;
     }
     thread_count = migrate_multifd_channels();
@@ -1033,7 +1340,7 @@ bool multifd_recv_all_channels_created(void)
 {
     int thread_count = migrate_multifd_channels();
 
-    if (!migrate_use_multifd()) {
+    if (!migrate_use_multifd() || migrate_mapped_ram()) {
         return true;
     }
 
@@ -22,6 +22,7 @@ bool multifd_recv_new_channel(QIOChannel *ioc, Error **errp);
 void multifd_recv_sync_main(void);
 void multifd_send_sync_main(QEMUFile *f);
 int multifd_queue_page(QEMUFile *f, RAMBlock *block, ram_addr_t offset);
+MultiFDChannelStatsList *multifd_query_send_stats(void);
 
 /* Multifd Compression flags */
 #define MULTIFD_FLAG_SYNC (1 << 0)
@@ -32,6 +33,14 @@ int multifd_queue_page(QEMUFile *f, RAMBlock *block, ram_addr_t offset);
 #define MULTIFD_FLAG_NOCOMP (0 << 1)
 #define MULTIFD_FLAG_ZLIB (1 << 1)
 #define MULTIFD_FLAG_ZSTD (2 << 1)
+#define MULTIFD_FLAG_LZ4 (3 << 1)
+
+/* The packet carries zero_pages offsets, see multifd-zero-page */
+#define MULTIFD_FLAG_ZERO_PAGE (1 << 4)
+
+/* The receiver rejects packets with any other flag */
+#define MULTIFD_FLAG_MASK (MULTIFD_FLAG_SYNC | MULTIFD_FLAG_COMPRESSION_MASK | \
+                           MULTIFD_FLAG_ZERO_PAGE)
 
 /* This value needs to be a multiple of qemu_target_page_size() */
 #define MULTIFD_PACKET_SIZE (512 * 1024)
@@ -42,18 +51,25 @@ typedef struct {
     uint32_t flags;
     /* maximum number of allocated pages */
     uint32_t pages_alloc;
+    /* number of pages whose data follows in the next packet */
     uint32_t pages_used;
     /* size of the next packet that contains pages */
     uint32_t next_packet_size;
     uint64_t packet_num;
-    uint64_t unused[4];    /* Reserved for future use */
+    /* number of zero pages, sent as offsets only */
+    uint32_t zero_pages;
+    uint32_t unused32[1];  /* Reserved for future use */
+    uint64_t unused64[3];  /* Reserved for future use */
     char ramblock[256];
+    /* offsets of the pages_used pages, then of the zero_pages pages */
     uint64_t offset[];
 } __attribute__((packed)) MultiFDPacket_t;
 
 typedef struct {
     /* number of used pages */
     uint32_t used;
+    /* number of zero pages, stored after the used ones */
+    uint32_t zero;
     /* number of allocated pages */
     uint32_t allocated;
     /* global number of generated multifd packets */
@@ -65,6 +81,22 @@ typedef struct {
     RAMBlock *block;
 } MultiFDPages_t;
 
+/*
+ * Statistics of a send channel.  They outlive the channel, so that
+ * they can still be queried once migration has completed.
+ */
+typedef struct {
+    /* packets sent */
+    uint64_t packets;
+    /* normal pages sent */
+    uint64_t pages;
+    /* size of those pages before and after compression */
+    uint64_t bytes;
+    uint64_t compressed_bytes;
+    /* thread CPU time spent in send_prepare */
+    uint64_t compress_time_ns;
+} MultiFDSendStats;
+
 typedef struct {
     /* this fields are not changed once the thread is created */
     /* channel number */
@@ -75,6 +107,8 @@ typedef struct {
     QemuThread thread;
     /* communication channel */
     QIOChannel *c;
+    /* flags used to write pages to the channel */
+    int write_flags;
     /* sem where to wait for more work */
     QemuSemaphore sem;
     /* this mutex protects the following parameters */
@@ -102,10 +136,17 @@ typedef struct {
     uint64_t num_packets;
     /* pages sent through this channel */
     uint64_t num_pages;
+    /* zero pages found by this channel */
+    uint64_t num_zero_pages;
     /* syncs main thread and channels */
     QemuSemaphore sem_sync;
     /* used for compression methods */
     void *data;
+    /* pages of sent packets not yet added to ram_counters, under mutex */
+    uint64_t done_pages;
+    uint64_t done_zero_pages;
+    /* statistics for query-migrate, under mutex */
+    MultiFDSendStats *stats;
 }  MultiFDSendParams;
 
 typedef struct {
@@ -141,6 +182,8 @@ typedef struct {
     uint64_t num_packets;
     /* pages sent through this channel */
     uint64_t num_pages;
+    /* zero pages received through this channel */
+    uint64_t num_zero_pages;
     /* syncs main thread and channels */
     QemuSemaphore sem_sync;
     /* used for de-compression methods */
@@ -20,6 +20,8 @@
 #include "exec/target_page.h"
 #include "migration.h"
 #include "qemu-file.h"
+#include "qemu-file-channel.h"
+#include "socket.h"
 #include "savevm.h"
 #include "postcopy-ram.h"
 #include "ram.h"
@@ -159,9 +161,9 @@ static uint32List *get_vcpu_blocktime_list(PostcopyBlocktimeContext *ctx)
 }
 
 /*
- * This function just populates MigrationInfo from postcopy's
- * blocktime context. It will not populate MigrationInfo,
- * unless postcopy-blocktime capability was set.
+ * This function populates MigrationInfo with the page request latency
+ * and with postcopy's blocktime context. Blocktime is only populated
+ * if postcopy-blocktime capability was set.
  *
  * @info: pointer to MigrationInfo to populate
  */
@@ -170,6 +172,22 @@ void fill_destination_postcopy_migration_info(MigrationInfo *info)
     MigrationIncomingState *mis = migration_incoming_get_current();
     PostcopyBlocktimeContext *bc = mis->blocktime_ctx;
 
+    WITH_QEMU_LOCK_GUARD(&mis->page_request_mutex) {
+        info->has_postcopy_prefetch_pages = true;
+        info->postcopy_prefetch_pages = mis->postcopy_prefetch_pages;
+        info->has_postcopy_prefetch_hits = true;
+        info->postcopy_prefetch_hits = mis->postcopy_prefetch_hits;
+        info->has_postcopy_page_requests = true;
+        info->postcopy_page_requests = mis->postcopy_latency_count;
+        if (mis->postcopy_latency_count) {
+            info->has_postcopy_latency = true;
+            info->postcopy_latency = mis->postcopy_latency_total /
+                                     mis->postcopy_latency_count;
+            info->has_postcopy_latency_max = true;
+            info->postcopy_latency_max = mis->postcopy_latency_max;
+        }
+    }
+
     if (!bc) {
         return;
     }
@@ -192,6 +210,150 @@ static uint32_t get_postcopy_total_blocktime(void)
     return bc->total_blocktime;
 }
 
+/*
+ * Note the time at which a host page is requested from the source, unless
+ * it is already outstanding.
+ */
+static void postcopy_page_request_begin(MigrationIncomingState *mis,
+                                        void *host_addr)
+{
+    int64_t *start;
+
+    QEMU_LOCK_GUARD(&mis->page_request_mutex);
+    if (!g_hash_table_contains(mis->page_requested, host_addr)) {
+        start = g_new(int64_t, 1);
+        *start = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+        g_hash_table_insert(mis->page_requested, host_addr, start);
+    }
+}
+
+/* A host page has been placed; account its latency if it was requested */
+static void postcopy_page_request_end(MigrationIncomingState *mis,
+                                      void *host_addr)
+{
+    int64_t now = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+    int64_t *start;
+    uint64_t latency_us;
+
+    QEMU_LOCK_GUARD(&mis->page_request_mutex);
+    g_hash_table_remove(mis->page_prefetched, host_addr);
+    start = g_hash_table_lookup(mis->page_requested, host_addr);
+    if (!start) {
+        return;
+    }
+    latency_us = (now - *start) / SCALE_US;
+    g_hash_table_remove(mis->page_requested, host_addr);
+
+    mis->postcopy_latency_total += latency_us;
+    mis->postcopy_latency_count++;
+    mis->postcopy_latency_max = MAX(mis->postcopy_latency_max, latency_us);
+    trace_postcopy_page_req_latency(host_addr, latency_us);
+}
+
+/* Largest stride, in host pages, that the prefetch stride detector follows */
+#define POSTCOPY_PREFETCH_MAX_STRIDE 64
+
+/*
+ * A fault on a page that was prefetched but has not arrived yet: the
+ * guest did need it, the prefetch just was not early enough.
+ */
+static void postcopy_prefetch_check_hit(MigrationIncomingState *mis,
+                                        void *host_addr)
+{
+    QEMU_LOCK_GUARD(&mis->page_request_mutex);
+    if (g_hash_table_remove(mis->page_prefetched, host_addr)) {
+        mis->postcopy_prefetch_hits++;
+    }
+}
+
+/*
+ * Returns the stride, in host pages, to prefetch along after a fault on
+ * @page of @rb: the distance between the last faults if it was the same
+ * twice in a row, otherwise 1.
+ */
+static int64_t postcopy_prefetch_stride(MigrationIncomingState *mis,
+                                        RAMBlock *rb, int64_t page)
+{
+    int64_t delta = page - mis->prefetch_last_page;
+    int64_t stride = 1;
+
+    if (rb != mis->prefetch_last_rb) {
+        delta = 0;
+    } else if (delta && delta == mis->prefetch_last_delta &&
+               ABS(delta) <= POSTCOPY_PREFETCH_MAX_STRIDE) {
+        stride = delta;
+    }
+
+    mis->prefetch_last_rb = rb;
+    mis->prefetch_last_page = page;
+    mis->prefetch_last_delta = delta;
+    return stride;
+}
+
+/* Returns false if the page has already been prefetched */
+static bool postcopy_prefetch_mark(MigrationIncomingState *mis,
+                                   void *host_addr)
+{
+    QEMU_LOCK_GUARD(&mis->page_request_mutex);
+    if (g_hash_table_contains(mis->page_prefetched, host_addr)) {
+        return false;
+    }
+    g_hash_table_add(mis->page_prefetched, host_addr);
+    mis->postcopy_prefetch_pages++;
+    return true;
+}
+
+/*
+ * After the fault on @rb_offset has been requested, also request the
+ * next postcopy-prefetch-window host pages that haven't been received,
+ * so that sequential access costs one round trip instead of one per page.
+ * Contiguous pages go in a single request; since the faulting page was
+ * just requested, the block name can always be omitted.
+ */
+static void postcopy_prefetch_pages(MigrationIncomingState *mis,
+                                    RAMBlock *rb, ram_addr_t rb_offset)
+{
+    uint32_t window = migrate_postcopy_prefetch_window();
+    size_t pagesize = qemu_ram_pagesize(rb);
+    void *host = qemu_ram_get_host_addr(rb);
+    int64_t page = rb_offset / pagesize;
+    int64_t npages = rb->used_length / pagesize;
+    int64_t stride = 1;
+    ram_addr_t run_start = 0;
+    size_t run_len = 0;
+    uint32_t i;
+
+    if (!window) {
+        return;
+    }
+    if (migrate_postcopy_prefetch_stride()) {
+        stride = postcopy_prefetch_stride(mis, rb, page);
+    }
+
+    for (i = 1; i <= window + 1; i++) {
+        int64_t next = page + i * stride;
+        ram_addr_t offset = next * pagesize;
+        bool wanted = i <= window && next >= 0 && next < npages &&
+                      !ramblock_recv_bitmap_test_byte_offset(rb, offset) &&
+                      postcopy_prefetch_mark(mis, host + offset);
+
+        if (wanted && run_len && run_start + run_len == offset) {
+            run_len += pagesize;
+            continue;
+        }
+        if (run_len) {
+            trace_postcopy_prefetch_pages(rb->idstr, run_start, run_len,
+                                          stride);
+            migrate_send_rp_req_pages(mis, NULL, run_start, run_len);
+            run_len = 0;
+        }
+        if (wanted) {
+            run_start = offset;
+            run_len = pagesize;
+        }
+    }
+}
+
 /**
  * receive_ufd_features: check userfault fd features, to request only supported
  * features in the future.
@@ -526,6 +688,24 @@ int postcopy_ram_incoming_cleanup(MigrationIncomingState *mis)
 {
     trace_postcopy_ram_incoming_cleanup_entry();
 
+    /* The preempt thread places pages, so it must go before the fault thread */
+    if (mis->have_preempt_thread) {
+        /*
+         * If postcopy completed, the source ends the channel itself;
+         * otherwise kick the thread out of its read, or out of waiting
+         * for the channel.
+         */
+        if (mis->state != MIGRATION_STATUS_POSTCOPY_ACTIVE ||
+            !mis->postcopy_qemufile_dst) {
+            if (mis->postcopy_qemufile_dst) {
+                qemu_file_shutdown(mis->postcopy_qemufile_dst);
+            }
+            qemu_sem_post(&mis->postcopy_qemufile_dst_done);
+        }
+        qemu_thread_join(&mis->postcopy_preempt_thread);
+        mis->have_preempt_thread = false;
+    }
+
     if (mis->have_fault_thread) {
         Error *local_err = NULL;
 
@@ -568,6 +748,10 @@ int postcopy_ram_incoming_cleanup(MigrationIncomingState *mis)
         munmap(mis->postcopy_tmp_zero_page, mis->largest_page_size);
         mis->postcopy_tmp_zero_page = NULL;
     }
+    if (mis->postcopy_preempt_tmp_page) {
+        munmap(mis->postcopy_preempt_tmp_page, mis->largest_page_size);
+        mis->postcopy_preempt_tmp_page = NULL;
+    }
     trace_postcopy_ram_incoming_cleanup_blocktime(
             get_postcopy_total_blocktime());
 
@@ -684,6 +868,7 @@ int postcopy_request_shared_page(struct PostCopyFD *pcfd, RAMBlock *rb,
                                         qemu_ram_get_idstr(rb), rb_offset);
         return postcopy_wake_shared(pcfd, client_addr, rb);
     }
+    postcopy_page_request_begin(mis, qemu_ram_get_host_addr(rb) + aligned_rbo);
     if (rb != mis->last_rb) {
         mis->last_rb = rb;
         migrate_send_rp_req_pages(mis, qemu_ram_get_idstr(rb),
@@ -980,6 +1165,10 @@ static void *postcopy_ram_fault_thread(void *opaque)
             mark_postcopy_blocktime_begin(
                     (uintptr_t)(msg.arg.pagefault.address),
                                 msg.arg.pagefault.feat.ptid, rb);
+            postcopy_page_request_begin(mis,
+                    qemu_ram_get_host_addr(rb) + rb_offset);
+            postcopy_prefetch_check_hit(mis,
+                    qemu_ram_get_host_addr(rb) + rb_offset);
 
 retry:
             /*
@@ -1013,6 +1202,8 @@ retry:
                     break;
                 }
             }
+
+            postcopy_prefetch_pages(mis, rb, rb_offset);
         }
 
         /* Now handle any requests from external processes on shared memory */
@@ -1077,6 +1268,57 @@ retry:
     return NULL;
 }
 
+/*
+ * Loads the urgent pages that the source sends on the preempt channel,
+ * concurrently with the main thread loading the background stream.
+ */
+static void *postcopy_preempt_thread(void *opaque)
+{
+    MigrationIncomingState *mis = opaque;
+    QEMUFile *f;
+    int ret = 0;
+
+    rcu_register_thread();
+    trace_postcopy_preempt_thread_entry();
+
+    /* The source connects the channel before it starts migrating */
+    qemu_sem_wait(&mis->postcopy_qemufile_dst_done);
+    f = mis->postcopy_qemufile_dst;
+    if (!f) {
+        goto out;
+    }
+    qemu_file_set_blocking(f, true);
+
+    while (true) {
+        uint8_t *buf;
+
+        /* Don't sit in an RCU critical section while the channel is idle */
+        if (qemu_peek_buffer(f, &buf, 8, 0) != 8) {
+            ret = qemu_file_get_error(f) ?: -EIO;
+            break;
+        }
+        WITH_RCU_READ_LOCK_GUARD() {
+            ret = ram_load_postcopy(f, RAM_CHANNEL_POSTCOPY);
+        }
+        if (ret) {
+            break;
+        }
+    }
+
+    if (ret < 0) {
+        /*
+         * Pages that did not make it are still missing on this side, and
+         * a postcopy recovery resends them on the main channel.
+         */
+        error_report("%s: error loading urgent pages: %d", __func__, ret);
+    }
+
+out:
+    trace_postcopy_preempt_thread_exit(ret);
+    rcu_unregister_thread();
+    return NULL;
+}
+
 int postcopy_ram_incoming_setup(MigrationIncomingState *mis)
 {
     /* Open the fd for the kernel to give us userfaults */
@@ -1143,6 +1385,25 @@ int postcopy_ram_incoming_setup(MigrationIncomingState *mis)
     }
     memset(mis->postcopy_tmp_zero_page, '\0', mis->largest_page_size);
 
+    if (migrate_postcopy_preempt()) {
+        mis->postcopy_preempt_tmp_page = mmap(NULL, mis->largest_page_size,
+                                              PROT_READ | PROT_WRITE,
+                                              MAP_PRIVATE | MAP_ANONYMOUS,
+                                              -1, 0);
+        if (mis->postcopy_preempt_tmp_page == MAP_FAILED) {
+            int e = errno;
+            mis->postcopy_preempt_tmp_page = NULL;
+            error_report("%s: Failed to map postcopy_preempt_tmp_page %s",
+                         __func__, strerror(e));
+            return -e;
+        }
+
+        qemu_thread_create(&mis->postcopy_preempt_thread, "postcopy/preempt",
+                           postcopy_preempt_thread, mis,
+                           QEMU_THREAD_JOINABLE);
+        mis->have_preempt_thread = true;
+    }
+
     trace_postcopy_ram_enable_notify();
 
     return 0;
@@ -1170,7 +1431,7 @@ static int qemu_ufd_copy_ioctl(int userfault_fd, void *host_addr,
         ramblock_recv_bitmap_set_range(rb, host_addr,
                                        pagesize / qemu_target_page_size());
         mark_postcopy_blocktime_end((uintptr_t)host_addr);
-
+        postcopy_page_request_end(migration_incoming_get_current(), host_addr);
     }
     return ret;
 }
@@ -1247,6 +1508,155 @@ int postcopy_place_page_zero(MigrationIncomingState *mis, void *host,
     }
 }
 
+/*
+ * Write-protection with userfaultfd, used by background snapshots to copy
+ * out guest pages before the guest modifies them.
+ */
+
+/* Return true if the kernel can write-protect anonymous memory */
+bool ufd_wp_supported_by_host(void)
+{
+    uint64_t features;
+
+    if (!receive_ufd_features(&features)) {
+        return false;
+    }
+    return features & UFFD_FEATURE_PAGEFAULT_FLAG_WP;
+}
+
+/**
+ * ufd_wp_open: open a userfaultfd with write-protect faults enabled
+ *
+ * Returns the file descriptor, or -1 on error
+ *
+ * @nonblock: open the descriptor in non-blocking mode, so that faults can
+ *            be polled from a thread that does other work
+ */
+int ufd_wp_open(bool nonblock)
+{
+    int ufd = syscall(__NR_userfaultfd,
+                      O_CLOEXEC | (nonblock ? O_NONBLOCK : 0));
+
+    if (ufd == -1) {
+        error_report("%s: syscall __NR_userfaultfd failed: %s", __func__,
+                     strerror(errno));
+        return -1;
+    }
+    if (!request_ufd_features(ufd, UFFD_FEATURE_PAGEFAULT_FLAG_WP)) {
+        close(ufd);
+        return -1;
+    }
+    return ufd;
+}
+
+/**
+ * ufd_wp_register: register a range to track writes to it
+ *
+ * Returns 0 on success, or -1 if the range cannot be registered or the
+ * kernel cannot write-protect it (e.g. shared memory on older kernels)
+ *
+ * @ufd: descriptor from ufd_wp_open()
+ * @host: start of the range
+ * @length: length of the range in bytes
+ */
+int ufd_wp_register(int ufd, void *host, uint64_t length)
+{
+    struct uffdio_register reg_struct = {
+        .range.start = (uintptr_t)host,
+        .range.len = length,
+        .mode = UFFDIO_REGISTER_MODE_WP,
+    };
+
+    if (ioctl(ufd, UFFDIO_REGISTER, &reg_struct)) {
+        error_report("%s: userfault register: %s", __func__, strerror(errno));
+        return -1;
+    }
+    if (!(reg_struct.ioctls & ((__u64)1 << _UFFDIO_WRITEPROTECT))) {
+        error_report("%s: write-protection not available for %p",
+                     __func__, host);
+        ufd_wp_unregister(ufd, host, length);
+        return -1;
+    }
+    return 0;
+}
+
+int ufd_wp_unregister(int ufd, void *host, uint64_t length)
+{
+    struct uffdio_range range_struct = {
+        .start = (uintptr_t)host,
+        .len = length,
+    };
+
+    if (ioctl(ufd, UFFDIO_UNREGISTER, &range_struct)) {
+        error_report("%s: userfault unregister: %s", __func__,
+                     strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * ufd_wp_protect: change the write-protection of a registered range
+ *
+ * Removing the protection also wakes up the threads that faulted on it.
+ *
+ * Returns 0 on success, or -1 on error
+ *
+ * @ufd: descriptor from ufd_wp_open()
+ * @host: start of the range
+ * @length: length of the range in bytes
+ * @wp: true to write-protect the range, false to unprotect it
+ */
+int ufd_wp_protect(int ufd, void *host, uint64_t length, bool wp)
+{
+    struct uffdio_writeprotect wp_struct = {
+        .range.start = (uintptr_t)host,
+        .range.len = length,
+        .mode = wp ? UFFDIO_WRITEPROTECT_MODE_WP : 0,
+    };
+
+    if (ioctl(ufd, UFFDIO_WRITEPROTECT, &wp_struct)) {
+        error_report("%s: %s %p/%" PRIx64 ": %s", __func__,
+                     wp ? "protect" : "unprotect", host, length,
+                     strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * ufd_wp_read_fault: fetch a pending write fault
+ *
+ * Returns the faulting address, or NULL if there is no pending fault
+ *
+ * @ufd: non-blocking descriptor from ufd_wp_open()
+ */
+void *ufd_wp_read_fault(int ufd)
+{
+    struct uffd_msg msg;
+    ssize_t ret;
+
+    do {
+        ret = read(ufd, &msg, sizeof(msg));
+    } while (ret < 0 && errno == EINTR);
+
+    if (ret != sizeof(msg)) {
+        if (ret < 0 && errno != EAGAIN) {
+            error_report("%s: Failed to read full userfault message: %s",
+                         __func__, strerror(errno));
+        }
+        return NULL;
+    }
+    if (msg.event != UFFD_EVENT_PAGEFAULT ||
+        !(msg.arg.pagefault.flags & UFFD_PAGEFAULT_FLAG_WP)) {
+        error_report("%s: Unexpected userfault event %d flags %" PRIx64,
+                     __func__, msg.event,
+                     (uint64_t)msg.arg.pagefault.flags);
+        return NULL;
+    }
+    return (void *)(uintptr_t)msg.arg.pagefault.address;
+}
+
 #else
 /* No target OS support, stubs just fail */
 void fill_destination_postcopy_migration_info(MigrationInfo *info)
@@ -1311,6 +1721,41 @@ int postcopy_wake_shared(struct PostCopyFD *pcfd,
     assert(0);
     return -1;
 }
+
+bool ufd_wp_supported_by_host(void)
+{
+    return false;
+}
+
+int ufd_wp_open(bool nonblock)
+{
+    error_report("%s: No OS support", __func__);
+    return -1;
+}
+
+int ufd_wp_register(int ufd, void *host, uint64_t length)
+{
+    assert(0);
+    return -1;
+}
+
+int ufd_wp_unregister(int ufd, void *host, uint64_t length)
+{
+    assert(0);
+    return -1;
+}
+
+int ufd_wp_protect(int ufd, void *host, uint64_t length, bool wp)
+{
+    assert(0);
+    return -1;
+}
+
+void *ufd_wp_read_fault(int ufd)
+{
+    assert(0);
+    return NULL;
+}
 #endif
 
 /* ------------------------------------------------------------------------- */
@@ -1446,3 +1891,27 @@ void postcopy_unregister_shared_ufd(struct PostCopyFD *pcfd)
         }
     }
 }
+
+/*
+ * Connect the channel that urgent page requests are sent on when
+ * postcopy-preempt is enabled.  Called on the source once the main
+ * channel is up.
+ *
+ * Returns 0 on success
+ */
+int postcopy_preempt_setup(MigrationState *s, Error **errp)
+{
+    QIOChannel *ioc;
+
+    ioc = socket_send_channel_create_sync(errp);
+    if (!ioc) {
+        return -1;
+    }
+
+    qio_channel_set_name(ioc, "migration-postcopy-preempt");
+    s->postcopy_qemufile_src = qemu_fopen_channel_output(ioc);
+    object_unref(OBJECT(ioc));
+    qemu_file_set_blocking(s->postcopy_qemufile_src, true);
+
+    return 0;
+}
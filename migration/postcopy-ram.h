@@ -179,4 +179,18 @@ int postcopy_wake_shared(struct PostCopyFD *pcfd, uint64_t client_addr,
 int postcopy_request_shared_page(struct PostCopyFD *pcfd, RAMBlock *rb,
                                  uint64_t client_addr, uint64_t offset);
 
+/* Connect the postcopy-preempt channel on the source */
+int postcopy_preempt_setup(MigrationState *s, Error **errp);
+
+/*
+ * userfaultfd write-protection, used by background snapshots to track
+ * writes to guest RAM on the source.
+ */
+bool ufd_wp_supported_by_host(void);
+int ufd_wp_open(bool nonblock);
+int ufd_wp_register(int ufd, void *host, uint64_t length);
+int ufd_wp_unregister(int ufd, void *host, uint64_t length);
+int ufd_wp_protect(int ufd, void *host, uint64_t length, bool wp);
+void *ufd_wp_read_fault(int ufd);
+
 #endif
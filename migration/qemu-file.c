@@ -22,7 +22,6 @@
  * THE SOFTWARE.
  */
 #include "qemu/osdep.h"
-#include <zlib.h>
 #include "qemu/error-report.h"
 #include "qemu/iov.h"
 #include "migration.h"
@@ -43,6 +42,10 @@ struct QEMUFile {
 
     int64_t pos; /* start of buffer when writing, end of buffer
                     when reading */
+    /* bytes that pos moved over in qemu_fseek(), never transferred */
+    int64_t skipped;
+    /* bytes written at an explicit offset, outside of the buffer */
+    int64_t pwritten;
     int buf_index;
     int buf_size; /* 0 when writing */
     uint8_t buf[IO_BUF_SIZE];
@@ -657,6 +660,51 @@ int64_t qemu_ftell(QEMUFile *f)
     return f->pos;
 }
 
+/*
+ * Move the stream to @pos, which only makes sense for files whose
+ * channel supports random access.  Data that was buffered for writing
+ * is flushed first; data that was read ahead is dropped.
+ *
+ * Returns 0 on success, negative errno on error
+ */
+int qemu_fseek(QEMUFile *f, int64_t pos)
+{
+    QIOChannel *ioc = qemu_file_get_ioc(f);
+    Error *local_error = NULL;
+    int ret;
+
+    if (qemu_file_is_writable(f)) {
+        qemu_fflush(f);
+    } else {
+        f->buf_index = 0;
+        f->buf_size = 0;
+    }
+
+    ret = qemu_file_get_error(f);
+    if (ret) {
+        return ret;
+    }
+    if (!ioc) {
+        qemu_file_set_error(f, -ENOTSUP);
+        return -ENOTSUP;
+    }
+    if (qio_channel_io_seek(ioc, pos, SEEK_SET, &local_error) < 0) {
+        qemu_file_set_error_obj(f, -EIO, local_error);
+        return -EIO;
+    }
+    f->skipped += pos - f->pos;
+    f->pos = pos;
+    return 0;
+}
+
+QIOChannel *qemu_file_get_ioc(QEMUFile *f)
+{
+    if (!f->ops->get_ioc) {
+        return NULL;
+    }
+    return f->ops->get_ioc(f->opaque);
+}
+
 int qemu_file_rate_limit(QEMUFile *f)
 {
     if (f->shutdown) {
@@ -691,6 +739,27 @@ void qemu_file_update_transfer(QEMUFile *f, int64_t len)
     f->bytes_xfer += len;
 }
 
+/*
+ * Account @len bytes that were written directly to the channel of @f
+ * with qio_channel_pwrite_all(), so that they are rate limited and
+ * counted by qemu_file_transferred().
+ */
+void qemu_file_account_pwrite(QEMUFile *f, int64_t len)
+{
+    f->bytes_xfer += len;
+    f->pwritten += len;
+}
+
+/*
+ * Number of bytes written through @f.  Unlike qemu_ftell() this includes
+ * the data written at explicit offsets and excludes what qemu_fseek()
+ * jumped over.
+ */
+int64_t qemu_file_transferred(QEMUFile *f)
+{
+    return qemu_ftell(f) - f->skipped + f->pwritten;
+}
+
 void qemu_put_be16(QEMUFile *f, unsigned int v)
 {
     qemu_put_byte(f, v >> 8);
@@ -737,73 +806,6 @@ uint64_t qemu_get_be64(QEMUFile *f)
     return v;
 }
 
-/* return the size after compression, or negative value on error */
-static int qemu_compress_data(z_stream *stream, uint8_t *dest, size_t dest_len,
-                              const uint8_t *source, size_t source_len)
-{
-    int err;
-
-    err = deflateReset(stream);
-    if (err != Z_OK) {
-        return -1;
-    }
-
-    stream->avail_in = source_len;
-    stream->next_in = (uint8_t *)source;
-    stream->avail_out = dest_len;
-    stream->next_out = dest;
-
-    err = deflate(stream, Z_FINISH);
-    if (err != Z_STREAM_END) {
-        return -1;
-    }
-
-    return stream->next_out - dest;
-}
-
-/* Compress size bytes of data start at p and store the compressed
- * data to the buffer of f.
- *
- * Since the file is dummy file with empty_ops, return -1 if f has no space to
- * save the compressed data.
- */
-ssize_t qemu_put_compression_data(QEMUFile *f, z_stream *stream,
-                                  const uint8_t *p, size_t size)
-{
-    ssize_t blen = IO_BUF_SIZE - f->buf_index - sizeof(int32_t);
-
-    if (blen < compressBound(size)) {
-        return -1;
-    }
-
-    blen = qemu_compress_data(stream, f->buf + f->buf_index + sizeof(int32_t),
-                              blen, p, size);
-    if (blen < 0) {
-        return -1;
-    }
-
-    qemu_put_be32(f, blen);
-    add_buf_to_iovec(f, blen);
-    return blen + sizeof(int32_t);
-}
-
-/* Put the data in the buffer of f_src to the buffer of f_des, and
- * then reset the buf_index of f_src to 0.
- */
-
-int qemu_put_qemu_file(QEMUFile *f_des, QEMUFile *f_src)
-{
-    int len = 0;
-
-    if (f_src->buf_index > 0) {
-        len = f_src->buf_index;
-        qemu_put_buffer(f_des, f_src->buf, f_src->buf_index);
-        f_src->buf_index = 0;
-        f_src->iovcnt = 0;
-    }
-    return len;
-}
-
 /*
  * Get a string whose length is determined by a single preceding byte
  * A preallocated 256 byte buffer must be passed in.
@@ -27,8 +27,13 @@
  */
 
 #include "qemu/osdep.h"
+#include <zlib.h>
+#ifdef CONFIG_ZSTD
+#include <zstd.h>
+#endif
 #include "cpu.h"
 #include "qemu/cutils.h"
+#include "qemu/units.h"
 #include "qemu/bitops.h"
 #include "qemu/bitmap.h"
 #include "qemu/main-loop.h"
@@ -56,6 +61,7 @@
 #include "savevm.h"
 #include "qemu/iov.h"
 #include "multifd.h"
+#include "worker-pool.h"
 
 /***********************************************************/
 /* ram save/restore */
@@ -76,6 +82,14 @@
 /* 0x80 is reserved in migration.h start with 0x100 next */
 #define RAM_SAVE_FLAG_COMPRESS_PAGE    0x100
 
+/*
+ * With mapped-ram, the description of each RAM block in the stream is
+ * followed by a header giving the place of its pages in the file.
+ */
+#define MAPPED_RAM_HDR_VERSION 1
+/* The pages of each block start on such a boundary, so they can be mapped */
+#define MAPPED_RAM_FILE_ALIGN  (1 * MiB)
+
 static inline bool is_zero_range(uint8_t *p, uint64_t size)
 {
     return buffer_is_zero(p, size);
@@ -158,21 +172,12 @@ out:
     return ret;
 }
 
-static bool ramblock_is_ignored(RAMBlock *block)
+bool ramblock_is_ignored(RAMBlock *block)
 {
     return !qemu_ram_is_migratable(block) ||
            (migrate_ignore_shared() && qemu_ram_is_shared(block));
 }
 
-/* Should be holding either ram_list.mutex, or the RCU lock. */
-#define RAMBLOCK_FOREACH_NOT_IGNORED(block)            \
-    INTERNAL_RAMBLOCK_FOREACH(block)                   \
-        if (ramblock_is_ignored(block)) {} else
-
-#define RAMBLOCK_FOREACH_MIGRATABLE(block)             \
-    INTERNAL_RAMBLOCK_FOREACH(block)                   \
-        if (!qemu_ram_is_migratable(block)) {} else
-
 #undef RAMBLOCK_FOREACH
 
 int foreach_not_ignored_block(RAMBlockIterFunc func, void *opaque)
@@ -349,11 +354,35 @@ struct RAMState {
     uint64_t migration_dirty_pages;
     /* Protects modification of the bitmap and migration dirty pages */
     QemuMutex bitmap_mutex;
+    /* Threads of migration_bitmap_sync_ramblocks() */
+    WorkerPool *sync_pool;
     /* The RAMBlock used in the last src_page_requests */
     RAMBlock *last_req_rb;
     /* Queue of outstanding page requests from the destination */
     QemuMutex src_page_req_mutex;
     QSIMPLEQ_HEAD(, RAMSrcPageRequest) src_page_requests;
+    /*
+     * With postcopy-preempt, serializes sending of pages between the
+     * migration thread and urgent requests from the return path, so that
+     * a host page is never split between the two channels.  Urgent
+     * requests send a whole host page under the lock; the migration
+     * thread only holds it for one target page at a time and publishes
+     * the host page it is in the middle of, which urgent requests leave
+     * to the main channel.
+     */
+    QemuMutex postcopy_page_mutex;
+    RAMBlock *postcopy_main_block;
+    ram_addr_t postcopy_main_offset;
+    /* The end marker has been sent on the preempt channel */
+    bool postcopy_preempt_done;
+    /* userfaultfd tracking guest writes for background snapshot, or -1 */
+    int uffdio_fd;
+    /* Run of saved pages that are still write-protected */
+    RAMBlock *wp_block;
+    unsigned long wp_start;
+    unsigned long wp_pages;
+    /* A vCPU is waiting for the page being saved */
+    bool wp_urgent;
 };
 typedef struct RAMState RAMState;
 
@@ -415,86 +444,158 @@ typedef struct PageSearchStatus PageSearchStatus;
 
 CompressionStats compression_counters;
 
-struct CompressParam {
-    bool done;
-    bool quit;
-    bool zero_page;
-    QEMUFile *file;
-    QemuMutex mutex;
-    QemuCond cond;
+/*
+ * Each (de)compression thread is fed through a ring of COMPRESS_RING_SIZE
+ * slots.  The ring indexes are free running: @head is only written by the
+ * thread queueing pages, @done only by the (de)compression thread, so a
+ * page is handed over and its result collected without taking any lock.
+ * Threads only sleep on their event when the ring is empty, and the
+ * migration thread only when every ring is full.
+ */
+#define COMPRESS_RING_SIZE 32
+
+struct CompressSlot {
+    /* Filled by the migration thread */
     RAMBlock *block;
     ram_addr_t offset;
+    /* Filled by the compression thread */
+    bool zero_page;
+    int len;
+    uint8_t *buf;
+};
+typedef struct CompressSlot CompressSlot;
+
+struct CompressParam {
+    bool quit;
+    QemuEvent event;
+    /* Next slot to queue and next slot to send, migration thread only */
+    unsigned head;
+    unsigned tail;
+    /* Next slot to compress, written by the compression thread */
+    unsigned done QEMU_ALIGNED(64);
+    CompressSlot slots[COMPRESS_RING_SIZE];
 
     /* internally used fields */
     z_stream stream;
+#ifdef CONFIG_ZSTD
+    ZSTD_CCtx *zcctx;
+#endif
     uint8_t *originbuf;
+    uint8_t *slotbuf;
 };
 typedef struct CompressParam CompressParam;
 
-struct DecompressParam {
-    bool done;
-    bool quit;
-    QemuMutex mutex;
-    QemuCond cond;
+struct DecompressSlot {
     void *des;
-    uint8_t *compbuf;
     int len;
+    uint8_t *compbuf;
+};
+typedef struct DecompressSlot DecompressSlot;
+
+struct DecompressParam {
+    bool quit;
+    QemuEvent event;
+    /* Next slot to queue, written by the loading thread */
+    unsigned head;
+    /* Next slot to decompress, written by the decompression thread */
+    unsigned done QEMU_ALIGNED(64);
+    DecompressSlot slots[COMPRESS_RING_SIZE];
     z_stream stream;
+#ifdef CONFIG_ZSTD
+    ZSTD_DCtx *zdctx;
+#endif
+    uint8_t *compbuf;
 };
 typedef struct DecompressParam DecompressParam;
 
 static CompressParam *comp_param;
 static QemuThread *compress_threads;
-/* comp_done_cond is used to wake up the migration thread when
- * one of the compression threads has finished the compression.
- * comp_done_lock is used to co-work with comp_done_cond.
+static CompressMethod comp_method;
+static int comp_level;
+static size_t comp_buf_size;
+/* next thread to queue a page to, so that the threads are used in turn */
+static int comp_next;
+/*
+ * comp_done_event is set by the compression threads whenever they finish
+ * a page, to wake up the migration thread when all the rings are full.
  */
-static QemuMutex comp_done_lock;
-static QemuCond comp_done_cond;
-/* The empty QEMUFileOps will be used by file in CompressParam */
-static const QEMUFileOps empty_ops = { };
+static QemuEvent comp_done_event;
 
 static QEMUFile *decomp_file;
 static DecompressParam *decomp_param;
 static QemuThread *decompress_threads;
-static QemuMutex decomp_done_lock;
-static QemuCond decomp_done_cond;
+static CompressMethod decomp_method;
+static int decomp_next;
+static QemuEvent decomp_done_event;
 
-static bool do_compress_ram_page(QEMUFile *f, z_stream *stream, RAMBlock *block,
-                                 ram_addr_t offset, uint8_t *source_buf);
+/* Upper bound of the compressed size of a @size bytes buffer */
+static size_t compress_bound(CompressMethod method, size_t size)
+{
+    switch (method) {
+#ifdef CONFIG_ZSTD
+    case COMPRESS_METHOD_ZSTD:
+        return ZSTD_compressBound(size);
+#endif
+    default:
+        return compressBound(size);
+    }
+}
+
+static void do_compress_ram_page(CompressParam *param, CompressSlot *slot);
 
 static void *do_data_compress(void *opaque)
 {
     CompressParam *param = opaque;
-    RAMBlock *block;
-    ram_addr_t offset;
-    bool zero_page;
+    unsigned done = param->done;
 
-    qemu_mutex_lock(&param->mutex);
-    while (!param->quit) {
-        if (param->block) {
-            block = param->block;
-            offset = param->offset;
-            param->block = NULL;
-            qemu_mutex_unlock(&param->mutex);
+    while (true) {
+        if (done == atomic_load_acquire(&param->head)) {
+            if (atomic_read(&param->quit)) {
+                break;
+            }
+            qemu_event_reset(&param->event);
+            if (done == atomic_load_acquire(&param->head) &&
+                !atomic_read(&param->quit)) {
+                qemu_event_wait(&param->event);
+            }
+            continue;
+        }
 
-            zero_page = do_compress_ram_page(param->file, &param->stream,
-                                             block, offset, param->originbuf);
+        do_compress_ram_page(param,
+                             &param->slots[done % COMPRESS_RING_SIZE]);
+        atomic_store_release(&param->done, ++done);
+        qemu_event_set(&comp_done_event);
+    }
 
-            qemu_mutex_lock(&comp_done_lock);
-            param->done = true;
-            param->zero_page = zero_page;
-            qemu_cond_signal(&comp_done_cond);
-            qemu_mutex_unlock(&comp_done_lock);
+    return NULL;
+}
 
-            qemu_mutex_lock(&param->mutex);
-        } else {
-            qemu_cond_wait(&param->cond, &param->mutex);
-        }
+static int compress_init_stream(CompressParam *param)
+{
+    switch (comp_method) {
+#ifdef CONFIG_ZSTD
+    case COMPRESS_METHOD_ZSTD:
+        param->zcctx = ZSTD_createCCtx();
+        return param->zcctx ? 0 : -1;
+#endif
+    default:
+        return deflateInit(&param->stream, comp_level) == Z_OK ? 0 : -1;
     }
-    qemu_mutex_unlock(&param->mutex);
+}
 
-    return NULL;
+static void compress_end_stream(CompressParam *param)
+{
+    switch (comp_method) {
+#ifdef CONFIG_ZSTD
+    case COMPRESS_METHOD_ZSTD:
+        ZSTD_freeCCtx(param->zcctx);
+        param->zcctx = NULL;
+        break;
+#endif
+    default:
+        deflateEnd(&param->stream);
+        break;
+    }
 }
 
 static void compress_threads_save_cleanup(void)
@@ -511,25 +612,22 @@ static void compress_threads_save_cleanup(void)
          * we use it as a indicator which shows if the thread is
          * properly init'd or not
          */
-        if (!comp_param[i].file) {
+        if (!comp_param[i].originbuf) {
             break;
         }
 
-        qemu_mutex_lock(&comp_param[i].mutex);
-        comp_param[i].quit = true;
-        qemu_cond_signal(&comp_param[i].cond);
-        qemu_mutex_unlock(&comp_param[i].mutex);
+        atomic_set(&comp_param[i].quit, true);
+        qemu_event_set(&comp_param[i].event);
 
         qemu_thread_join(compress_threads + i);
-        qemu_mutex_destroy(&comp_param[i].mutex);
-        qemu_cond_destroy(&comp_param[i].cond);
-        deflateEnd(&comp_param[i].stream);
+        qemu_event_destroy(&comp_param[i].event);
+        compress_end_stream(&comp_param[i]);
         g_free(comp_param[i].originbuf);
-        qemu_fclose(comp_param[i].file);
-        comp_param[i].file = NULL;
+        comp_param[i].originbuf = NULL;
+        g_free(comp_param[i].slotbuf);
+        comp_param[i].slotbuf = NULL;
     }
-    qemu_mutex_destroy(&comp_done_lock);
-    qemu_cond_destroy(&comp_done_cond);
+    qemu_event_destroy(&comp_done_event);
     g_free(compress_threads);
     g_free(comp_param);
     compress_threads = NULL;
@@ -538,7 +636,7 @@ static void compress_threads_save_cleanup(void)
 
 static int compress_threads_save_setup(void)
 {
-    int i, thread_count;
+    int i, j, thread_count;
 
     if (!migrate_use_compression()) {
         return 0;
@@ -546,28 +644,29 @@ static int compress_threads_save_setup(void)
     thread_count = migrate_compress_threads();
     compress_threads = g_new0(QemuThread, thread_count);
     comp_param = g_new0(CompressParam, thread_count);
-    qemu_cond_init(&comp_done_cond);
-    qemu_mutex_init(&comp_done_lock);
+    comp_method = migrate_compress_method();
+    comp_level = migrate_compress_level();
+    comp_buf_size = compress_bound(comp_method, TARGET_PAGE_SIZE);
+    comp_next = 0;
+    qemu_event_init(&comp_done_event, false);
     for (i = 0; i < thread_count; i++) {
         comp_param[i].originbuf = g_try_malloc(TARGET_PAGE_SIZE);
-        if (!comp_param[i].originbuf) {
-            goto exit;
-        }
-
-        if (deflateInit(&comp_param[i].stream,
-                        migrate_compress_level()) != Z_OK) {
+        comp_param[i].slotbuf = g_try_malloc(COMPRESS_RING_SIZE *
+                                             comp_buf_size);
+        if (!comp_param[i].originbuf || !comp_param[i].slotbuf ||
+            compress_init_stream(&comp_param[i]) < 0) {
             g_free(comp_param[i].originbuf);
+            comp_param[i].originbuf = NULL;
+            g_free(comp_param[i].slotbuf);
+            comp_param[i].slotbuf = NULL;
             goto exit;
         }
 
-        /* comp_param[i].file is just used as a dummy buffer to save data,
-         * set its ops to empty.
-         */
-        comp_param[i].file = qemu_fopen_ops(NULL, &empty_ops);
-        comp_param[i].done = true;
-        comp_param[i].quit = false;
-        qemu_mutex_init(&comp_param[i].mutex);
-        qemu_cond_init(&comp_param[i].cond);
+        for (j = 0; j < COMPRESS_RING_SIZE; j++) {
+            comp_param[i].slots[j].buf = comp_param[i].slotbuf +
+                                         j * comp_buf_size;
+        }
+        qemu_event_init(&comp_param[i].event, false);
         qemu_thread_create(compress_threads + i, "compress",
                            do_data_compress, comp_param + i,
                            QEMU_THREAD_JOINABLE);
@@ -672,8 +771,10 @@ static void xbzrle_cache_zero_page(RAMState *rs, ram_addr_t current_addr)
 
     /* We don't care if this fails to allocate a new cache page
      * as long as it updated an old one */
-    cache_insert(XBZRLE.cache, current_addr, XBZRLE.zero_target_page,
-                 ram_counters.dirty_sync_count);
+    if (cache_insert(XBZRLE.cache, current_addr, XBZRLE.zero_target_page,
+                     ram_counters.dirty_sync_count) == 1) {
+        xbzrle_counters.cache_eviction++;
+    }
 }
 
 #define ENCODING_FLAG_XBZRLE 0x1
@@ -698,15 +799,20 @@ static int save_xbzrle_page(RAMState *rs, uint8_t **current_data,
 {
     int encoded_len = 0, bytes_xbzrle;
     uint8_t *prev_cached_page;
+    int ret;
 
     if (!cache_is_cached(XBZRLE.cache, current_addr,
                          ram_counters.dirty_sync_count)) {
         xbzrle_counters.cache_miss++;
         if (!last_stage) {
-            if (cache_insert(XBZRLE.cache, current_addr, *current_data,
-                             ram_counters.dirty_sync_count) == -1) {
+            ret = cache_insert(XBZRLE.cache, current_addr, *current_data,
+                               ram_counters.dirty_sync_count);
+            if (ret == -1) {
                 return -1;
             } else {
+                if (ret == 1) {
+                    xbzrle_counters.cache_eviction++;
+                }
                 /* update *current_data when the page has been
                    inserted into cache */
                 *current_data = get_cached_data(XBZRLE.cache, current_addr);
@@ -727,6 +833,7 @@ static int save_xbzrle_page(RAMState *rs, uint8_t **current_data,
      * guest page is good for xbzrle encoding.
      */
     xbzrle_counters.pages++;
+    xbzrle_counters.cache_hit++;
     prev_cached_page = get_cached_data(XBZRLE.cache, current_addr);
 
     /* save current buffer into memory */
@@ -769,7 +876,7 @@ static int save_xbzrle_page(RAMState *rs, uint8_t **current_data,
     qemu_put_buffer(rs->f, XBZRLE.encoded_buf, encoded_len);
     bytes_xbzrle += encoded_len + 1 + 2;
     /*
-     * Like compressed_size (please see update_compress_thread_counts),
+     * Like compressed_size (please see save_compressed_page),
      * the xbzrle encoded bytes don't count the 8 byte header with
      * RAM_SAVE_FLAG_CONTINUE.
      */
@@ -867,6 +974,108 @@ static void ramblock_sync_dirty_bitmap(RAMState *rs, RAMBlock *rb)
     rs->num_dirty_pages_period += new_dirty_pages;
 }
 
+/*
+ * RAMBlocks are synchronized in chunks of at most this size, so that the
+ * dirty bitmap of a large guest can be processed by several threads.
+ */
+#define DIRTY_SYNC_CHUNK_SIZE (1 * GiB)
+
+typedef struct DirtySyncChunk {
+    RAMBlock *block;
+    ram_addr_t start;
+    ram_addr_t length;
+    /* pages found dirty in the chunk */
+    uint64_t num_dirty;
+} DirtySyncChunk;
+
+/*
+ * The RCU critical section is held by the thread that runs the pool and
+ * outlives the run, so the RAMBlocks and dirty memory blocks stay valid.
+ */
+static int migration_bitmap_sync_chunk(void *opaque, unsigned int index)
+{
+    DirtySyncChunk *c = (DirtySyncChunk *)opaque + index;
+
+    c->num_dirty = cpu_physical_memory_sync_dirty_bitmap(c->block, c->start,
+                                                         c->length);
+    return 0;
+}
+
+static void dirty_sync_add_chunk(GArray *chunks, RAMBlock *block,
+                                 ram_addr_t start, ram_addr_t length)
+{
+    DirtySyncChunk c = {
+        .block = block,
+        .start = start,
+        .length = length,
+    };
+
+    g_array_append_val(chunks, c);
+}
+
+/**
+ * migration_bitmap_sync_ramblocks: sync the dirty bitmap of all RAMBlocks
+ *
+ * Every RAMBlock is split in chunks of DIRTY_SYNC_CHUNK_SIZE, rounded up
+ * to the clear_bmap granularity so that each chunk takes the word-wise
+ * fast path of cpu_physical_memory_sync_dirty_bitmap() and sets whole
+ * bits of clear_bmap.  The pages of a block past its last multiple of
+ * BITS_PER_LONG pages get a chunk of their own, so that only they take
+ * the per-page slow path.  The chunks are then shared among up to
+ * dirty-sync-threads threads of rs->sync_pool, the caller included.
+ * Chunks never share a word of RAMBlock.bmap, and the bits of the global
+ * dirty bitmap are taken with atomic operations, so no further locking is
+ * needed.
+ *
+ * Called with RCU critical section and bitmap_mutex held
+ *
+ * @rs: current RAM state
+ */
+static void migration_bitmap_sync_ramblocks(RAMState *rs)
+{
+    GArray *chunks = g_array_new(FALSE, FALSE, sizeof(DirtySyncChunk));
+    uint64_t num_dirty = 0;
+    RAMBlock *block;
+    unsigned int i;
+
+    RAMBLOCK_FOREACH_NOT_IGNORED(block) {
+        ram_addr_t chunk_size = DIRTY_SYNC_CHUNK_SIZE;
+        ram_addr_t start;
+
+        if (block->clear_bmap) {
+            chunk_size = ROUND_UP(chunk_size, (ram_addr_t)1 <<
+                                  (block->clear_bmap_shift + TARGET_PAGE_BITS));
+        }
+        for (start = 0; start < block->used_length; start += chunk_size) {
+            ram_addr_t length = MIN(chunk_size, block->used_length - start);
+            ram_addr_t tail = length &
+                              ((BITS_PER_LONG << TARGET_PAGE_BITS) - 1);
+
+            if (length > tail) {
+                dirty_sync_add_chunk(chunks, block, start, length - tail);
+            }
+            if (tail) {
+                dirty_sync_add_chunk(chunks, block, start + length - tail,
+                                     tail);
+            }
+        }
+    }
+
+    worker_pool_run(rs->sync_pool, migrate_dirty_sync_threads(), chunks->len,
+                    migration_bitmap_sync_chunk, chunks->data);
+    for (i = 0; i < chunks->len; i++) {
+        num_dirty += g_array_index(chunks, DirtySyncChunk, i).num_dirty;
+    }
+    trace_migration_bitmap_sync_ramblocks(chunks->len,
+                                          MIN(migrate_dirty_sync_threads(),
+                                              chunks->len),
+                                          num_dirty);
+    g_array_free(chunks, TRUE);
+
+    rs->migration_dirty_pages += num_dirty;
+    rs->num_dirty_pages_period += num_dirty;
+}
+
 /**
  * ram_pagesize_summary: calculate all the pagesizes of a VM
  *
@@ -955,6 +1164,18 @@ static void migration_trigger_throttle(RAMState *rs)
     uint64_t bytes_dirty_period = rs->num_dirty_pages_period * TARGET_PAGE_SIZE;
     uint64_t bytes_dirty_threshold = bytes_xfer_period * threshold / 100;
 
+    /*
+     * The dirty rings were just harvested by the dirty log sync, so the
+     * per-vCPU counts are up to date: throttle the vCPUs that dirty
+     * memory too fast, and only those.
+     */
+    if (migrate_dirty_limit()) {
+        trace_migration_dirty_limit(migrate_vcpu_dirty_limit());
+        cpu_throttle_dirty_limit(migrate_vcpu_dirty_limit(),
+                                 s->parameters.max_cpu_throttle);
+        return;
+    }
+
     /* During block migration the auto-converge logic incorrectly detects
      * that ram migration makes no progress. Avoid this by disabling the
      * throttling logic during the bulk phase of block migration. */
@@ -977,8 +1198,7 @@ static void migration_trigger_throttle(RAMState *rs)
 
 static void migration_bitmap_sync(RAMState *rs)
 {
-    RAMBlock *block;
-    int64_t end_time;
+    int64_t start_time, end_time;
 
     ram_counters.dirty_sync_count++;
 
@@ -987,19 +1207,21 @@ static void migration_bitmap_sync(RAMState *rs)
     }
 
     trace_migration_bitmap_sync_start();
+    start_time = qemu_clock_get_us(QEMU_CLOCK_REALTIME);
     memory_global_dirty_log_sync();
 
     qemu_mutex_lock(&rs->bitmap_mutex);
     WITH_RCU_READ_LOCK_GUARD() {
-        RAMBLOCK_FOREACH_NOT_IGNORED(block) {
-            ramblock_sync_dirty_bitmap(rs, block);
-        }
+        migration_bitmap_sync_ramblocks(rs);
         ram_counters.remaining = ram_bytes_remaining();
     }
     qemu_mutex_unlock(&rs->bitmap_mutex);
 
     memory_global_after_dirty_log_sync();
-    trace_migration_bitmap_sync_end(rs->num_dirty_pages_period);
+    ram_counters.dirty_sync_time =
+        qemu_clock_get_us(QEMU_CLOCK_REALTIME) - start_time;
+    trace_migration_bitmap_sync_end(rs->num_dirty_pages_period,
+                                    ram_counters.dirty_sync_time);
 
     end_time = qemu_clock_get_ms(QEMU_CLOCK_REALTIME);
 
@@ -1077,7 +1299,19 @@ static int save_zero_page_to_file(RAMState *rs, QEMUFile *file,
  */
 static int save_zero_page(RAMState *rs, RAMBlock *block, ram_addr_t offset)
 {
-    int len = save_zero_page_to_file(rs, rs->f, block, offset);
+    int len;
+
+    if (migrate_mapped_ram()) {
+        /* Nothing is written, the page is just absent from the file */
+        if (!is_zero_range(block->host + offset, TARGET_PAGE_SIZE)) {
+            return -1;
+        }
+        clear_bit_atomic(offset >> TARGET_PAGE_BITS, block->file_bmap);
+        ram_counters.duplicate++;
+        return 1;
+    }
+
+    len = save_zero_page_to_file(rs, rs->f, block, offset);
 
     if (len) {
         ram_counters.duplicate++;
@@ -1148,6 +1382,23 @@ static bool control_save_page(RAMState *rs, RAMBlock *block, ram_addr_t offset,
 static int save_normal_page(RAMState *rs, RAMBlock *block, ram_addr_t offset,
                             uint8_t *buf, bool async)
 {
+    if (migrate_mapped_ram()) {
+        Error *local_err = NULL;
+
+        if (qio_channel_pwrite_all(qemu_file_get_ioc(rs->f), (char *)buf,
+                                   TARGET_PAGE_SIZE,
+                                   block->pages_offset + offset,
+                                   &local_err) < 0) {
+            qemu_file_set_error_obj(rs->f, -EIO, local_err);
+            return -1;
+        }
+        set_bit_atomic(offset >> TARGET_PAGE_BITS, block->file_bmap);
+        qemu_file_account_pwrite(rs->f, TARGET_PAGE_SIZE);
+        ram_counters.transferred += TARGET_PAGE_SIZE;
+        ram_counters.normal++;
+        return 1;
+    }
+
     ram_counters.transferred += save_page_header(rs, rs->f, block,
                                                  offset | RAM_SAVE_FLAG_PAGE);
     if (async) {
@@ -1179,7 +1430,12 @@ static int ram_save_page(RAMState *rs, PageSearchStatus *pss, bool last_stage)
 {
     int pages = -1;
     uint8_t *p;
-    bool send_async = true;
+    /*
+     * With background snapshot the page is unprotected right after it is
+     * saved, so it must be copied to the stream buffer rather than sent
+     * from guest memory later.
+     */
+    bool send_async = !migrate_background_snapshot();
     RAMBlock *block = pss->block;
     ram_addr_t offset = ((ram_addr_t)pss->page) << TARGET_PAGE_BITS;
     ram_addr_t current_addr = block->offset + offset;
@@ -1213,137 +1469,213 @@ static int ram_save_page(RAMState *rs, PageSearchStatus *pss, bool last_stage)
 static int ram_save_multifd_page(RAMState *rs, RAMBlock *block,
                                  ram_addr_t offset)
 {
+    /* The page is accounted by multifd once it has been sent */
     if (multifd_queue_page(rs->f, block, offset) < 0) {
         return -1;
     }
-    ram_counters.normal++;
 
     return 1;
 }
 
-static bool do_compress_ram_page(QEMUFile *f, z_stream *stream, RAMBlock *block,
-                                 ram_addr_t offset, uint8_t *source_buf)
+/* return the size after compression, or negative value on error */
+static int qemu_compress_data(z_stream *stream, uint8_t *dest, size_t dest_len,
+                              const uint8_t *source, size_t source_len)
 {
-    RAMState *rs = ram_state;
+    int err;
+
+    err = deflateReset(stream);
+    if (err != Z_OK) {
+        return -1;
+    }
+
+    stream->avail_in = source_len;
+    stream->next_in = (uint8_t *)source;
+    stream->avail_out = dest_len;
+    stream->next_out = dest;
+
+    err = deflate(stream, Z_FINISH);
+    if (err != Z_STREAM_END) {
+        return -1;
+    }
+
+    return stream->next_out - dest;
+}
+
+#ifdef CONFIG_ZSTD
+/* return the size after compression, or negative value on error */
+static int qemu_zstd_compress_data(ZSTD_CCtx *cctx, uint8_t *dest,
+                                   size_t dest_len, const uint8_t *source,
+                                   size_t source_len, int level)
+{
+    size_t ret = ZSTD_compressCCtx(cctx, dest, dest_len, source, source_len,
+                                   level);
+
+    return ZSTD_isError(ret) ? -1 : ret;
+}
+#endif
+
+static void do_compress_ram_page(CompressParam *param, CompressSlot *slot)
+{
+    RAMBlock *block = slot->block;
+    ram_addr_t offset = slot->offset;
     uint8_t *p = block->host + (offset & TARGET_PAGE_MASK);
-    bool zero_page = false;
-    int ret;
 
-    if (save_zero_page_to_file(rs, f, block, offset)) {
-        zero_page = true;
+    slot->zero_page = is_zero_range(p, TARGET_PAGE_SIZE);
+    if (slot->zero_page) {
         goto exit;
     }
 
-    save_page_header(rs, f, block, offset | RAM_SAVE_FLAG_COMPRESS_PAGE);
-
     /*
      * copy it to a internal buffer to avoid it being modified by VM
      * so that we can catch up the error during compression and
      * decompression
      */
-    memcpy(source_buf, p, TARGET_PAGE_SIZE);
-    ret = qemu_put_compression_data(f, stream, source_buf, TARGET_PAGE_SIZE);
-    if (ret < 0) {
-        qemu_file_set_error(migrate_get_current()->to_dst_file, ret);
-        error_report("compressed data failed!");
-        return false;
+    memcpy(param->originbuf, p, TARGET_PAGE_SIZE);
+    switch (comp_method) {
+#ifdef CONFIG_ZSTD
+    case COMPRESS_METHOD_ZSTD:
+        slot->len = qemu_zstd_compress_data(param->zcctx, slot->buf,
+                                            comp_buf_size, param->originbuf,
+                                            TARGET_PAGE_SIZE, comp_level);
+        break;
+#endif
+    default:
+        slot->len = qemu_compress_data(&param->stream, slot->buf,
+                                       comp_buf_size, param->originbuf,
+                                       TARGET_PAGE_SIZE);
+        break;
+    }
+    if (slot->len < 0) {
+        return;
     }
 
 exit:
     ram_release_pages(block->idstr, offset & TARGET_PAGE_MASK, 1);
-    return zero_page;
 }
 
-static void
-update_compress_thread_counts(const CompressParam *param, int bytes_xmit)
+/*
+ * Send the result of a compressed page from the migration thread; the
+ * page header is only written here, so that it is ordered with the rest
+ * of the stream.
+ */
+static void save_compressed_page(RAMState *rs, CompressSlot *slot)
 {
-    ram_counters.transferred += bytes_xmit;
+    int bytes_xmit;
 
-    if (param->zero_page) {
+    if (slot->zero_page) {
+        bytes_xmit = save_page_header(rs, rs->f, slot->block,
+                                      slot->offset | RAM_SAVE_FLAG_ZERO);
+        qemu_put_byte(rs->f, 0);
+        ram_counters.transferred += bytes_xmit + 1;
         ram_counters.duplicate++;
         return;
     }
 
+    if (slot->len < 0) {
+        qemu_file_set_error(rs->f, -EIO);
+        error_report("compressed data failed!");
+        return;
+    }
+
+    bytes_xmit = save_page_header(rs, rs->f, slot->block,
+                                  slot->offset | RAM_SAVE_FLAG_COMPRESS_PAGE);
+    qemu_put_be32(rs->f, slot->len);
+    qemu_put_buffer(rs->f, slot->buf, slot->len);
+    bytes_xmit += sizeof(int32_t) + slot->len;
+    ram_counters.transferred += bytes_xmit;
+
     /* 8 means a header with RAM_SAVE_FLAG_CONTINUE. */
     compression_counters.compressed_size += bytes_xmit - 8;
     compression_counters.pages++;
 }
 
+/* Send every page the thread has finished compressing */
+static void drain_compressed_data(RAMState *rs, CompressParam *param)
+{
+    unsigned done = atomic_load_acquire(&param->done);
+
+    while (param->tail != done) {
+        save_compressed_page(rs,
+                             &param->slots[param->tail % COMPRESS_RING_SIZE]);
+        param->tail++;
+    }
+}
+
 static bool save_page_use_compression(RAMState *rs);
 
 static void flush_compressed_data(RAMState *rs)
 {
-    int idx, len, thread_count;
+    int idx, thread_count;
+    CompressParam *param;
 
     if (!save_page_use_compression(rs)) {
         return;
     }
     thread_count = migrate_compress_threads();
 
-    qemu_mutex_lock(&comp_done_lock);
-    for (idx = 0; idx < thread_count; idx++) {
-        while (!comp_param[idx].done) {
-            qemu_cond_wait(&comp_done_cond, &comp_done_lock);
-        }
-    }
-    qemu_mutex_unlock(&comp_done_lock);
-
     for (idx = 0; idx < thread_count; idx++) {
-        qemu_mutex_lock(&comp_param[idx].mutex);
-        if (!comp_param[idx].quit) {
-            len = qemu_put_qemu_file(rs->f, comp_param[idx].file);
-            /*
-             * it's safe to fetch zero_page without holding comp_done_lock
-             * as there is no further request submitted to the thread,
-             * i.e, the thread should be waiting for a request at this point.
-             */
-            update_compress_thread_counts(&comp_param[idx], len);
+        param = &comp_param[idx];
+        while (atomic_load_acquire(&param->done) != param->head) {
+            qemu_event_reset(&comp_done_event);
+            if (atomic_load_acquire(&param->done) != param->head) {
+                qemu_event_wait(&comp_done_event);
+            }
         }
-        qemu_mutex_unlock(&comp_param[idx].mutex);
+        drain_compressed_data(rs, param);
     }
 }
 
-static inline void set_compress_params(CompressParam *param, RAMBlock *block,
-                                       ram_addr_t offset)
+/*
+ * Queue the page to the first thread, in turn, that has room in its ring.
+ * Returns true if the page was queued.
+ */
+static bool compress_queue_page(RAMState *rs, RAMBlock *block,
+                                ram_addr_t offset)
 {
-    param->block = block;
-    param->offset = offset;
+    int i, idx, thread_count;
+    CompressParam *param;
+    CompressSlot *slot;
+
+    thread_count = migrate_compress_threads();
+    for (i = 0; i < thread_count; i++) {
+        idx = (comp_next + i) % thread_count;
+        param = &comp_param[idx];
+        drain_compressed_data(rs, param);
+        if (param->head - param->tail < COMPRESS_RING_SIZE) {
+            slot = &param->slots[param->head % COMPRESS_RING_SIZE];
+            slot->block = block;
+            slot->offset = offset;
+            atomic_store_release(&param->head, param->head + 1);
+            qemu_event_set(&param->event);
+            comp_next = idx + 1;
+            return true;
+        }
+    }
+    return false;
 }
 
 static int compress_page_with_multi_thread(RAMState *rs, RAMBlock *block,
                                            ram_addr_t offset)
 {
-    int idx, thread_count, bytes_xmit = -1, pages = -1;
     bool wait = migrate_compress_wait_thread();
 
-    thread_count = migrate_compress_threads();
-    qemu_mutex_lock(&comp_done_lock);
-retry:
-    for (idx = 0; idx < thread_count; idx++) {
-        if (comp_param[idx].done) {
-            comp_param[idx].done = false;
-            bytes_xmit = qemu_put_qemu_file(rs->f, comp_param[idx].file);
-            qemu_mutex_lock(&comp_param[idx].mutex);
-            set_compress_params(&comp_param[idx], block, offset);
-            qemu_cond_signal(&comp_param[idx].cond);
-            qemu_mutex_unlock(&comp_param[idx].mutex);
-            pages = 1;
-            update_compress_thread_counts(&comp_param[idx], bytes_xmit);
+    while (!compress_queue_page(rs, block, offset)) {
+        /*
+         * wait for the free thread if the user specifies
+         * 'compress-wait-thread', otherwise we will post the page out
+         * in the main thread as normal page.
+         */
+        if (!wait) {
+            return -1;
+        }
+        qemu_event_reset(&comp_done_event);
+        if (compress_queue_page(rs, block, offset)) {
             break;
         }
+        qemu_event_wait(&comp_done_event);
     }
 
-    /*
-     * wait for the free thread if the user specifies 'compress-wait-thread',
-     * otherwise we will post the page out in the main thread as normal page.
-     */
-    if (pages < 0 && wait) {
-        qemu_cond_wait(&comp_done_cond, &comp_done_lock);
-        goto retry;
-    }
-    qemu_mutex_unlock(&comp_done_lock);
-
-    return pages;
+    return 1;
 }
 
 /**
@@ -1441,6 +1773,106 @@ static RAMBlock *unqueue_page(RAMState *rs, ram_addr_t *offset)
     return block;
 }
 
+/*
+ * With background snapshot, saved pages are unprotected in runs of up to
+ * this size rather than with one system call per page.
+ */
+#define WP_RELEASE_RUN_SIZE (1 * MiB)
+
+/**
+ * ram_write_tracking_flush: unprotect the pending run of saved pages
+ *
+ * Their content has already been copied to the migration stream, so the
+ * guest is free to modify them.
+ *
+ * @rs: current RAM state
+ */
+static void ram_write_tracking_flush(RAMState *rs)
+{
+    RAMBlock *block = rs->wp_block;
+
+    if (!rs->wp_pages) {
+        return;
+    }
+    trace_ram_write_tracking_release(block->idstr, rs->wp_start,
+                                     rs->wp_pages);
+    if (ufd_wp_protect(rs->uffdio_fd,
+                       block->host + ((ram_addr_t)rs->wp_start <<
+                                      TARGET_PAGE_BITS),
+                       (uint64_t)rs->wp_pages << TARGET_PAGE_BITS, false)) {
+        qemu_file_set_error(rs->f, -EIO);
+    }
+    rs->wp_pages = 0;
+}
+
+/**
+ * ram_write_tracking_release: unprotect pages once they have been saved
+ *
+ * The pages are added to the pending run, which is flushed when it stops
+ * being contiguous, grows large enough, or a vCPU is waiting for them.
+ *
+ * @rs: current RAM state
+ * @block: RAMBlock of the pages
+ * @start: first page saved
+ * @npages: number of pages saved
+ */
+static void ram_write_tracking_release(RAMState *rs, RAMBlock *block,
+                                       unsigned long start,
+                                       unsigned long npages)
+{
+    if (!(block->flags & RAM_UF_WRITEPROTECT)) {
+        return;
+    }
+    if (rs->wp_pages &&
+        (rs->wp_block != block || rs->wp_start + rs->wp_pages != start)) {
+        ram_write_tracking_flush(rs);
+    }
+    if (!rs->wp_pages) {
+        rs->wp_block = block;
+        rs->wp_start = start;
+    }
+    rs->wp_pages += npages;
+    if (rs->wp_urgent ||
+        ((ram_addr_t)rs->wp_pages << TARGET_PAGE_BITS) >= WP_RELEASE_RUN_SIZE) {
+        ram_write_tracking_flush(rs);
+        rs->wp_urgent = false;
+    }
+}
+
+/**
+ * poll_fault_page: get a page that a vCPU is blocked writing to
+ *
+ * With background snapshot, guest writes to pages that have not been
+ * saved yet fault, and the vCPU waits until the page is saved and
+ * unprotected.  The pending run of saved pages is released first, in
+ * case the fault hit one of them.
+ *
+ * Returns the block of the page, or NULL if no write fault is pending
+ *
+ * @rs: current RAM state
+ * @offset: used to return the offset within the RAMBlock
+ */
+static RAMBlock *poll_fault_page(RAMState *rs, ram_addr_t *offset)
+{
+    RAMBlock *block;
+    void *addr;
+
+    if (rs->uffdio_fd < 0) {
+        return NULL;
+    }
+    addr = ufd_wp_read_fault(rs->uffdio_fd);
+    if (!addr) {
+        return NULL;
+    }
+    ram_write_tracking_flush(rs);
+
+    block = qemu_ram_block_from_host(addr, false, offset);
+    assert(block && (block->flags & RAM_UF_WRITEPROTECT));
+    trace_ram_write_tracking_fault(block->idstr, *offset);
+    rs->wp_urgent = true;
+    return block;
+}
+
 /**
  * get_queued_page: unqueue a page from the postcopy requests
  *
@@ -1459,6 +1891,9 @@ static bool get_queued_page(RAMState *rs, PageSearchStatus *pss)
 
     do {
         block = unqueue_page(rs, &offset);
+        if (!block) {
+            block = poll_fault_page(rs, &offset);
+        }
         /*
          * We're sending this page, and since it's postcopy nothing else
          * will dirty it, and we must make sure it doesn't get sent again
@@ -1529,6 +1964,91 @@ static void migration_page_queue_free(RAMState *rs)
     }
 }
 
+static bool postcopy_preempt_active(void)
+{
+    return migrate_postcopy_preempt() && migration_in_postcopy();
+}
+
+/**
+ * ram_save_host_page_urgent: send a requested host page on the preempt channel
+ *
+ * Sends the dirty target pages of the host page containing @start as one
+ * self-contained chunk terminated by RAM_SAVE_FLAG_EOS, bypassing both
+ * the bulk stream and rate limiting.  Pages that are already clean are
+ * on their way through the main channel and are not sent again.
+ *
+ * Returns 0 on success or negative if the page could not be sent
+ *
+ * @rs: current RAM state
+ * @block: RAMBlock of the request
+ * @start: offset of the request inside @block
+ */
+static int ram_save_host_page_urgent(RAMState *rs, RAMBlock *block,
+                                     ram_addr_t start)
+{
+    QEMUFile *f = migrate_get_current()->postcopy_qemufile_src;
+    size_t pagesize = qemu_ram_pagesize(block);
+    ram_addr_t offset = QEMU_ALIGN_DOWN(start, pagesize);
+    ram_addr_t end = MIN(offset + pagesize, block->used_length);
+    int pages = 0;
+
+    QEMU_LOCK_GUARD(&rs->postcopy_page_mutex);
+
+    if (!f || rs->postcopy_preempt_done || qemu_file_get_error(f)) {
+        return -1;
+    }
+    if (rs->postcopy_main_block == block &&
+        rs->postcopy_main_offset == offset) {
+        /* Already being sent on the main channel, it will be there soon */
+        trace_ram_save_host_page_urgent(block->idstr, start, 0);
+        return 0;
+    }
+
+    for (; offset < end; offset += TARGET_PAGE_SIZE) {
+        uint8_t *p = block->host + offset;
+        ram_addr_t flags = pages ? RAM_SAVE_FLAG_CONTINUE : 0;
+        size_t len = 8;
+
+        if (!migration_bitmap_clear_dirty(rs, block,
+                                          offset >> TARGET_PAGE_BITS)) {
+            continue;
+        }
+
+        flags |= is_zero_range(p, TARGET_PAGE_SIZE) ? RAM_SAVE_FLAG_ZERO :
+                                                      RAM_SAVE_FLAG_PAGE;
+        qemu_put_be64(f, offset | flags);
+        if (!pages) {
+            size_t idlen = strlen(block->idstr);
+
+            qemu_put_byte(f, idlen);
+            qemu_put_buffer(f, (uint8_t *)block->idstr, idlen);
+            len += 1 + idlen;
+        }
+
+        if (flags & RAM_SAVE_FLAG_ZERO) {
+            qemu_put_byte(f, 0);
+            len += 1;
+            ram_counters.duplicate++;
+        } else {
+            qemu_put_buffer(f, p, TARGET_PAGE_SIZE);
+            len += TARGET_PAGE_SIZE;
+            ram_counters.normal++;
+        }
+        ram_counters.transferred += len;
+        ram_release_pages(block->idstr, offset, 1);
+        pages++;
+    }
+
+    if (pages) {
+        qemu_put_be64(f, RAM_SAVE_FLAG_EOS);
+        ram_counters.transferred += 8;
+        qemu_fflush(f);
+    }
+    trace_ram_save_host_page_urgent(block->idstr, start, pages);
+
+    return qemu_file_get_error(f);
+}
+
 /**
  * ram_save_queue_pages: queue the page for transmission
  *
@@ -1579,6 +2099,24 @@ int ram_save_queue_pages(const char *rbname, ram_addr_t start, ram_addr_t len)
         return -1;
     }
 
+    if (postcopy_preempt_active()) {
+        size_t pagesize = qemu_ram_pagesize(ramblock);
+
+        /*
+         * Send the pages right away on the preempt channel; whatever
+         * cannot be sent that way is queued for the migration thread.
+         */
+        while (len && !ram_save_host_page_urgent(rs, ramblock, start)) {
+            ram_addr_t next = QEMU_ALIGN_DOWN(start, pagesize) + pagesize;
+
+            len -= MIN(len, next - start);
+            start = next;
+        }
+        if (!len) {
+            return 0;
+        }
+    }
+
     struct RAMSrcPageRequest *new_entry =
         g_malloc0(sizeof(struct RAMSrcPageRequest));
     new_entry->rb = ramblock;
@@ -1660,6 +2198,7 @@ static int ram_save_target_page(RAMState *rs, PageSearchStatus *pss,
 {
     RAMBlock *block = pss->block;
     ram_addr_t offset = ((ram_addr_t)pss->page) << TARGET_PAGE_BITS;
+    bool use_multifd;
     int res;
 
     if (control_save_page(rs, block, offset, &res)) {
@@ -1670,6 +2209,20 @@ static int ram_save_target_page(RAMState *rs, PageSearchStatus *pss,
         return 1;
     }
 
+    /*
+     * Do not use multifd for:
+     * 1. Compression as the first page in the new block should be posted out
+     *    before sending the compressed page
+     * 2. In postcopy as one whole host page should be placed
+     */
+    use_multifd = !save_page_use_compression(rs) && migrate_use_multifd()
+                  && !migration_in_postcopy();
+
+    /* With multifd-zero-page, the multifd channels look for zero pages */
+    if (use_multifd && migrate_multifd_zero_page()) {
+        return ram_save_multifd_page(rs, block, offset);
+    }
+
     res = save_zero_page(rs, block, offset);
     if (res > 0) {
         /* Must let xbzrle know, otherwise a previous (now 0'd) cached
@@ -1684,14 +2237,7 @@ static int ram_save_target_page(RAMState *rs, PageSearchStatus *pss,
         return res;
     }
 
-    /*
-     * Do not use multifd for:
-     * 1. Compression as the first page in the new block should be posted out
-     *    before sending the compressed page
-     * 2. In postcopy as one whole host page should be placed
-     */
-    if (!save_page_use_compression(rs) && migrate_use_multifd()
-        && !migration_in_postcopy()) {
+    if (use_multifd) {
         return ram_save_multifd_page(rs, block, offset);
     }
 
@@ -1722,22 +2268,49 @@ static int ram_save_host_page(RAMState *rs, PageSearchStatus *pss,
     int tmppages, pages = 0;
     size_t pagesize_bits =
         qemu_ram_pagesize(pss->block) >> TARGET_PAGE_BITS;
+    unsigned long start_page = pss->page;
+    bool preempt = postcopy_preempt_active();
 
     if (ramblock_is_ignored(pss->block)) {
         error_report("block %s should not be migrated !", pss->block->idstr);
         return 0;
     }
 
+    /*
+     * Urgent requests must not grab a host page that is half sent, so
+     * tell them which one we are sending.  The lock is only held for
+     * each target page, so that they can go on with other host pages
+     * even when this one is huge.
+     */
+    if (preempt) {
+        WITH_QEMU_LOCK_GUARD(&rs->postcopy_page_mutex) {
+            rs->postcopy_main_block = pss->block;
+            rs->postcopy_main_offset =
+                QEMU_ALIGN_DOWN((ram_addr_t)pss->page << TARGET_PAGE_BITS,
+                                qemu_ram_pagesize(pss->block));
+        }
+    }
+
     do {
+        if (preempt) {
+            qemu_mutex_lock(&rs->postcopy_page_mutex);
+        }
         /* Check the pages is dirty and if it is send it */
         if (!migration_bitmap_clear_dirty(rs, pss->block, pss->page)) {
+            if (preempt) {
+                qemu_mutex_unlock(&rs->postcopy_page_mutex);
+            }
             pss->page++;
             continue;
         }
 
         tmppages = ram_save_target_page(rs, pss, last_stage);
+        if (preempt) {
+            qemu_mutex_unlock(&rs->postcopy_page_mutex);
+        }
         if (tmppages < 0) {
-            return tmppages;
+            pages = tmppages;
+            break;
         }
 
         pages += tmppages;
@@ -1748,6 +2321,19 @@ static int ram_save_host_page(RAMState *rs, PageSearchStatus *pss,
              offset_in_ramblock(pss->block,
                                 ((ram_addr_t)pss->page) << TARGET_PAGE_BITS));
 
+    if (preempt) {
+        WITH_QEMU_LOCK_GUARD(&rs->postcopy_page_mutex) {
+            rs->postcopy_main_block = NULL;
+        }
+    }
+    if (pages < 0) {
+        return pages;
+    }
+    if (rs->uffdio_fd >= 0) {
+        ram_write_tracking_release(rs, pss->block, start_page,
+                                   pss->page - start_page);
+    }
+
     /* The offset we leave with is the last one we looked at */
     pss->page--;
     return pages;
@@ -1859,7 +2445,9 @@ static void ram_state_cleanup(RAMState **rsp)
 {
     if (*rsp) {
         migration_page_queue_free(*rsp);
+        worker_pool_free((*rsp)->sync_pool);
         qemu_mutex_destroy(&(*rsp)->bitmap_mutex);
+        qemu_mutex_destroy(&(*rsp)->postcopy_page_mutex);
         qemu_mutex_destroy(&(*rsp)->src_page_req_mutex);
         g_free(*rsp);
         *rsp = NULL;
@@ -1890,7 +2478,9 @@ static void ram_save_cleanup(void *opaque)
     /* caller have hold iothread lock or is in a bh, so there is
      * no writing race against the migration bitmap
      */
-    memory_global_dirty_log_stop();
+    if (!migrate_background_snapshot()) {
+        memory_global_dirty_log_stop();
+    }
 
     RAMBLOCK_FOREACH_NOT_IGNORED(block) {
         g_free(block->clear_bmap);
@@ -1899,6 +2489,11 @@ static void ram_save_cleanup(void *opaque)
         block->bmap = NULL;
     }
 
+    RAMBLOCK_FOREACH_MIGRATABLE(block) {
+        g_free(block->file_bmap);
+        block->file_bmap = NULL;
+    }
+
     xbzrle_cleanup();
     compress_threads_save_cleanup();
     ram_state_cleanup(rsp);
@@ -2289,8 +2884,11 @@ static int ram_state_init(RAMState **rsp)
     }
 
     qemu_mutex_init(&(*rsp)->bitmap_mutex);
+    (*rsp)->sync_pool = worker_pool_new("dirty-sync");
+    qemu_mutex_init(&(*rsp)->postcopy_page_mutex);
     qemu_mutex_init(&(*rsp)->src_page_req_mutex);
     QSIMPLEQ_INIT(&(*rsp)->src_page_requests);
+    (*rsp)->uffdio_fd = -1;
 
     /*
      * Count the total number of pages used by ram blocks not including any
@@ -2350,8 +2948,11 @@ static void ram_init_bitmaps(RAMState *rs)
 
     WITH_RCU_READ_LOCK_GUARD() {
         ram_list_init_bitmaps();
-        memory_global_dirty_log_start();
-        migration_bitmap_sync_precopy(rs);
+        /* Background snapshot tracks writes with userfaultfd instead */
+        if (!migrate_background_snapshot()) {
+            memory_global_dirty_log_start();
+            migration_bitmap_sync_precopy(rs);
+        }
     }
     qemu_mutex_unlock_ramlist();
     qemu_mutex_unlock_iothread();
@@ -2373,6 +2974,166 @@ static int ram_init_all(RAMState **rsp)
     return 0;
 }
 
+/* Read-only and ROM device blocks are not written by the guest */
+static bool ram_write_tracking_skip(RAMBlock *block)
+{
+    return block->mr->readonly || block->mr->rom_device;
+}
+
+/* Returns true if the kernel supports userfaultfd write-protection */
+bool ram_write_tracking_available(void)
+{
+    return ufd_wp_supported_by_host();
+}
+
+/**
+ * ram_write_tracking_compatible: check that all RAM can be write-protected
+ *
+ * Registers every RAMBlock with a throwaway userfaultfd; this fails for
+ * memory types the kernel cannot write-protect, such as hugetlbfs or
+ * shared memory on older kernels.
+ *
+ * Returns true if background snapshot can be used with this guest
+ */
+bool ram_write_tracking_compatible(void)
+{
+    RAMBlock *block;
+    bool ret = true;
+    int ufd;
+
+    ufd = ufd_wp_open(false);
+    if (ufd < 0) {
+        return false;
+    }
+
+    WITH_RCU_READ_LOCK_GUARD() {
+        RAMBLOCK_FOREACH_NOT_IGNORED(block) {
+            if (ram_write_tracking_skip(block)) {
+                continue;
+            }
+            if (ufd_wp_register(ufd, block->host, block->used_length)) {
+                error_report("RAM block %s cannot be write-protected",
+                             block->idstr);
+                ret = false;
+                break;
+            }
+        }
+    }
+
+    /* Closing the descriptor unregisters all the ranges */
+    close(ufd);
+    return ret;
+}
+
+/**
+ * ram_write_tracking_prepare: populate RAM before it is write-protected
+ *
+ * Write-protection is not applied to pages that are not mapped yet, so
+ * every page is read once, which maps the shared zero page where the
+ * guest has not touched the memory yet.  This is done while the guest
+ * still runs.
+ */
+void ram_write_tracking_prepare(void)
+{
+    RAMBlock *block;
+    ram_addr_t offset;
+
+    RCU_READ_LOCK_GUARD();
+
+    RAMBLOCK_FOREACH_NOT_IGNORED(block) {
+        if (ram_write_tracking_skip(block)) {
+            continue;
+        }
+        for (offset = 0; offset < block->used_length;
+             offset += qemu_real_host_page_size) {
+            char tmp = *((volatile char *)block->host + offset);
+
+            (void)tmp;
+        }
+    }
+}
+
+/**
+ * ram_write_tracking_start: start tracking guest writes to RAM
+ *
+ * Write-protects all guest RAM; from now on a vCPU that writes to a page
+ * blocks until the page has been saved.  Must be called with the guest
+ * stopped, after ram_write_tracking_prepare().
+ *
+ * Returns 0 for success or -1 for error
+ */
+int ram_write_tracking_start(void)
+{
+    RAMState *rs = ram_state;
+    RAMBlock *block;
+
+    rs->uffdio_fd = ufd_wp_open(true);
+    if (rs->uffdio_fd < 0) {
+        return -1;
+    }
+
+    RCU_READ_LOCK_GUARD();
+
+    RAMBLOCK_FOREACH_NOT_IGNORED(block) {
+        if (ram_write_tracking_skip(block)) {
+            continue;
+        }
+        if (ufd_wp_register(rs->uffdio_fd, block->host, block->used_length)) {
+            goto fail;
+        }
+        if (ufd_wp_protect(rs->uffdio_fd, block->host, block->used_length,
+                           true)) {
+            ufd_wp_unregister(rs->uffdio_fd, block->host, block->used_length);
+            goto fail;
+        }
+        block->flags |= RAM_UF_WRITEPROTECT;
+        memory_region_ref(block->mr);
+        trace_ram_write_tracking_start(block->idstr, block->used_length);
+    }
+    return 0;
+
+fail:
+    error_report("%s: failed to write-protect RAM block %s", __func__,
+                 block->idstr);
+    ram_write_tracking_stop();
+    return -1;
+}
+
+/**
+ * ram_write_tracking_stop: stop tracking guest writes to RAM
+ *
+ * Unprotects all guest RAM, which also wakes up any vCPU still waiting
+ * on a write fault.  Does nothing if tracking is not active.
+ */
+void ram_write_tracking_stop(void)
+{
+    RAMState *rs = ram_state;
+    RAMBlock *block;
+
+    if (!rs || rs->uffdio_fd < 0) {
+        return;
+    }
+
+    WITH_RCU_READ_LOCK_GUARD() {
+        RAMBLOCK_FOREACH_NOT_IGNORED(block) {
+            if (!(block->flags & RAM_UF_WRITEPROTECT)) {
+                continue;
+            }
+            ufd_wp_protect(rs->uffdio_fd, block->host, block->used_length,
+                           false);
+            ufd_wp_unregister(rs->uffdio_fd, block->host, block->used_length);
+            block->flags &= ~RAM_UF_WRITEPROTECT;
+            memory_region_unref(block->mr);
+            trace_ram_write_tracking_stop(block->idstr);
+        }
+    }
+
+    close(rs->uffdio_fd);
+    rs->uffdio_fd = -1;
+    rs->wp_pages = 0;
+    rs->wp_urgent = false;
+}
+
 static void ram_state_resume_prepare(RAMState *rs, QEMUFile *out)
 {
     RAMBlock *block;
@@ -2462,6 +3223,75 @@ void qemu_guest_free_page_hint(void *addr, size_t len)
  * granularity of these critical sections.
  */
 
+/**
+ * mapped_ram_setup_ramblock: place a RAM block in the migration file
+ *
+ * Writes the mapped-ram header of @block, which gives the offsets of
+ * its bitmap and of its pages in the file, and moves the stream past
+ * the space reserved for them.
+ *
+ * Returns zero to indicate success and negative for error
+ *
+ * @f: QEMUFile where to send the data
+ * @block: RAMBlock to place
+ */
+static int mapped_ram_setup_ramblock(QEMUFile *f, RAMBlock *block)
+{
+    unsigned long num_pages = block->used_length >> TARGET_PAGE_BITS;
+    size_t bitmap_size = BITS_TO_LONGS(num_pages) * sizeof(unsigned long);
+    size_t header_size = sizeof(uint32_t) + 3 * sizeof(uint64_t);
+
+    block->bitmap_offset = qemu_ftell(f) + header_size;
+    block->pages_offset = ROUND_UP(block->bitmap_offset + bitmap_size,
+                                   MAPPED_RAM_FILE_ALIGN);
+    block->file_bmap = bitmap_new(num_pages);
+
+    qemu_put_be32(f, MAPPED_RAM_HDR_VERSION);
+    qemu_put_be64(f, TARGET_PAGE_SIZE);
+    qemu_put_be64(f, block->bitmap_offset);
+    qemu_put_be64(f, block->pages_offset);
+
+    return qemu_fseek(f, block->pages_offset + block->used_length);
+}
+
+/**
+ * mapped_ram_save_bitmaps: write the file bitmap of each RAM block
+ *
+ * Returns zero to indicate success and negative for error
+ *
+ * @f: QEMUFile where to send the data
+ */
+static int mapped_ram_save_bitmaps(QEMUFile *f)
+{
+    QIOChannel *ioc = qemu_file_get_ioc(f);
+    RAMBlock *block;
+    int ret = 0;
+
+    RCU_READ_LOCK_GUARD();
+
+    RAMBLOCK_FOREACH_MIGRATABLE(block) {
+        unsigned long num_pages = block->used_length >> TARGET_PAGE_BITS;
+        size_t bitmap_size = BITS_TO_LONGS(num_pages) * sizeof(unsigned long);
+        unsigned long *le_bitmap = bitmap_new(num_pages);
+        Error *local_err = NULL;
+
+        bitmap_to_le(le_bitmap, block->file_bmap, num_pages);
+        if (qio_channel_pwrite_all(ioc, (char *)le_bitmap, bitmap_size,
+                                   block->bitmap_offset, &local_err) < 0) {
+            qemu_file_set_error_obj(f, -EIO, local_err);
+            ret = -EIO;
+        } else {
+            qemu_file_account_pwrite(f, bitmap_size);
+        }
+        g_free(le_bitmap);
+        if (ret) {
+            break;
+        }
+    }
+
+    return ret;
+}
+
 /**
  * ram_save_setup: Setup RAM for migration
  *
@@ -2475,6 +3305,16 @@ static int ram_save_setup(QEMUFile *f, void *opaque)
     RAMState **rsp = opaque;
     RAMBlock *block;
 
+    if (migrate_mapped_ram()) {
+        QIOChannel *ioc = qemu_file_get_ioc(f);
+
+        if (!ioc || !qio_channel_has_feature(ioc,
+                                             QIO_CHANNEL_FEATURE_SEEKABLE)) {
+            error_report("mapped-ram requires a seekable migration file");
+            return -1;
+        }
+    }
+
     if (compress_threads_save_setup()) {
         return -1;
     }
@@ -2502,6 +3342,12 @@ static int ram_save_setup(QEMUFile *f, void *opaque)
             if (migrate_ignore_shared()) {
                 qemu_put_be64(f, block->mr->addr);
             }
+            if (migrate_mapped_ram() &&
+                mapped_ram_setup_ramblock(f, block) < 0) {
+                error_report("Failed to place RAM block %s in the "
+                             "migration file", block->idstr);
+                return -1;
+            }
         }
     }
 
@@ -2668,10 +3514,28 @@ static int ram_save_complete(QEMUFile *f, void *opaque)
 
     if (ret >= 0) {
         multifd_send_sync_main(rs->f);
+        /* All the pages are in the file now, say which ones */
+        if (migrate_mapped_ram()) {
+            ret = mapped_ram_save_bitmaps(f);
+        }
+    }
+
+    if (ret >= 0) {
         qemu_put_be64(f, RAM_SAVE_FLAG_EOS);
         qemu_fflush(f);
     }
 
+    if (postcopy_preempt_active()) {
+        QEMUFile *pf = migrate_get_current()->postcopy_qemufile_src;
+
+        /* A bare EOS tells the destination to stop reading this channel */
+        WITH_QEMU_LOCK_GUARD(&rs->postcopy_page_mutex) {
+            qemu_put_be64(pf, RAM_SAVE_FLAG_EOS);
+            qemu_fflush(pf);
+            rs->postcopy_preempt_done = true;
+        }
+    }
+
     return ret;
 }
 
@@ -2747,19 +3611,22 @@ static int load_xbzrle(QEMUFile *f, ram_addr_t addr, void *host)
  *
  * @f: QEMUFile where to read the data from
  * @flags: Page flags (mostly to see if it's a continuation of previous block)
+ * @channel: the channel @f belongs to, each one tracks its own last block
  */
-static inline RAMBlock *ram_block_from_stream(QEMUFile *f, int flags)
+static inline RAMBlock *ram_block_from_stream(QEMUFile *f, int flags,
+                                              int channel)
 {
-    static RAMBlock *block = NULL;
+    static RAMBlock *last_block[RAM_CHANNEL_MAX];
+    RAMBlock *block;
     char id[256];
     uint8_t len;
 
     if (flags & RAM_SAVE_FLAG_CONTINUE) {
-        if (!block) {
+        if (!last_block[channel]) {
             error_report("Ack, bad migration stream!");
             return NULL;
         }
-        return block;
+        return last_block[channel];
     }
 
     len = qemu_get_byte(f);
@@ -2777,6 +3644,7 @@ static inline RAMBlock *ram_block_from_stream(QEMUFile *f, int flags)
         return NULL;
     }
 
+    last_block[channel] = block;
     return block;
 }
 
@@ -2856,41 +3724,67 @@ qemu_uncompress_data(z_stream *stream, uint8_t *dest, size_t dest_len,
     return stream->total_out;
 }
 
+#ifdef CONFIG_ZSTD
+/* return the size after decompression, or negative value on error */
+static int qemu_zstd_uncompress_data(ZSTD_DCtx *dctx, uint8_t *dest,
+                                     size_t dest_len, const uint8_t *source,
+                                     size_t source_len)
+{
+    size_t ret = ZSTD_decompressDCtx(dctx, dest, dest_len, source,
+                                     source_len);
+
+    return ZSTD_isError(ret) ? -1 : ret;
+}
+#endif
+
+static void do_decompress_ram_page(DecompressParam *param,
+                                   DecompressSlot *slot)
+{
+    int ret;
+
+    switch (decomp_method) {
+#ifdef CONFIG_ZSTD
+    case COMPRESS_METHOD_ZSTD:
+        ret = qemu_zstd_uncompress_data(param->zdctx, slot->des,
+                                        TARGET_PAGE_SIZE, slot->compbuf,
+                                        slot->len);
+        break;
+#endif
+    default:
+        ret = qemu_uncompress_data(&param->stream, slot->des,
+                                   TARGET_PAGE_SIZE, slot->compbuf,
+                                   slot->len);
+        break;
+    }
+    if (ret < 0 && migrate_get_current()->decompress_error_check) {
+        error_report("decompress data failed");
+        qemu_file_set_error(decomp_file, ret);
+    }
+}
+
 static void *do_data_decompress(void *opaque)
 {
     DecompressParam *param = opaque;
-    unsigned long pagesize;
-    uint8_t *des;
-    int len, ret;
-
-    qemu_mutex_lock(&param->mutex);
-    while (!param->quit) {
-        if (param->des) {
-            des = param->des;
-            len = param->len;
-            param->des = 0;
-            qemu_mutex_unlock(&param->mutex);
-
-            pagesize = TARGET_PAGE_SIZE;
-
-            ret = qemu_uncompress_data(&param->stream, des, pagesize,
-                                       param->compbuf, len);
-            if (ret < 0 && migrate_get_current()->decompress_error_check) {
-                error_report("decompress data failed");
-                qemu_file_set_error(decomp_file, ret);
-            }
-
-            qemu_mutex_lock(&decomp_done_lock);
-            param->done = true;
-            qemu_cond_signal(&decomp_done_cond);
-            qemu_mutex_unlock(&decomp_done_lock);
+    unsigned done = param->done;
 
-            qemu_mutex_lock(&param->mutex);
-        } else {
-            qemu_cond_wait(&param->cond, &param->mutex);
+    while (true) {
+        if (done == atomic_load_acquire(&param->head)) {
+            if (atomic_read(&param->quit)) {
+                break;
+            }
+            qemu_event_reset(&param->event);
+            if (done == atomic_load_acquire(&param->head) &&
+                !atomic_read(&param->quit)) {
+                qemu_event_wait(&param->event);
+            }
+            continue;
         }
+
+        do_decompress_ram_page(param,
+                               &param->slots[done % COMPRESS_RING_SIZE]);
+        atomic_store_release(&param->done, ++done);
+        qemu_event_set(&decomp_done_event);
     }
-    qemu_mutex_unlock(&param->mutex);
 
     return NULL;
 }
@@ -2898,19 +3792,22 @@ static void *do_data_decompress(void *opaque)
 static int wait_for_decompress_done(void)
 {
     int idx, thread_count;
+    DecompressParam *param;
 
     if (!migrate_use_compression()) {
         return 0;
     }
 
     thread_count = migrate_decompress_threads();
-    qemu_mutex_lock(&decomp_done_lock);
     for (idx = 0; idx < thread_count; idx++) {
-        while (!decomp_param[idx].done) {
-            qemu_cond_wait(&decomp_done_cond, &decomp_done_lock);
+        param = &decomp_param[idx];
+        while (atomic_load_acquire(&param->done) != param->head) {
+            qemu_event_reset(&decomp_done_event);
+            if (atomic_load_acquire(&param->done) != param->head) {
+                qemu_event_wait(&decomp_done_event);
+            }
         }
     }
-    qemu_mutex_unlock(&decomp_done_lock);
     return qemu_file_get_error(decomp_file);
 }
 
@@ -2918,7 +3815,7 @@ static void compress_threads_load_cleanup(void)
 {
     int i, thread_count;
 
-    if (!migrate_use_compression()) {
+    if (!migrate_use_compression() || !decomp_param) {
         return;
     }
     thread_count = migrate_decompress_threads();
@@ -2931,10 +3828,8 @@ static void compress_threads_load_cleanup(void)
             break;
         }
 
-        qemu_mutex_lock(&decomp_param[i].mutex);
-        decomp_param[i].quit = true;
-        qemu_cond_signal(&decomp_param[i].cond);
-        qemu_mutex_unlock(&decomp_param[i].mutex);
+        atomic_set(&decomp_param[i].quit, true);
+        qemu_event_set(&decomp_param[i].event);
     }
     for (i = 0; i < thread_count; i++) {
         if (!decomp_param[i].compbuf) {
@@ -2942,12 +3837,21 @@ static void compress_threads_load_cleanup(void)
         }
 
         qemu_thread_join(decompress_threads + i);
-        qemu_mutex_destroy(&decomp_param[i].mutex);
-        qemu_cond_destroy(&decomp_param[i].cond);
-        inflateEnd(&decomp_param[i].stream);
+        qemu_event_destroy(&decomp_param[i].event);
+        switch (decomp_method) {
+#ifdef CONFIG_ZSTD
+        case COMPRESS_METHOD_ZSTD:
+            ZSTD_freeDCtx(decomp_param[i].zdctx);
+            break;
+#endif
+        default:
+            inflateEnd(&decomp_param[i].stream);
+            break;
+        }
         g_free(decomp_param[i].compbuf);
         decomp_param[i].compbuf = NULL;
     }
+    qemu_event_destroy(&decomp_done_event);
     g_free(decompress_threads);
     g_free(decomp_param);
     decompress_threads = NULL;
@@ -2957,7 +3861,8 @@ static void compress_threads_load_cleanup(void)
 
 static int compress_threads_load_setup(QEMUFile *f)
 {
-    int i, thread_count;
+    int i, j, thread_count;
+    size_t buf_size;
 
     if (!migrate_use_compression()) {
         return 0;
@@ -2966,19 +3871,34 @@ static int compress_threads_load_setup(QEMUFile *f)
     thread_count = migrate_decompress_threads();
     decompress_threads = g_new0(QemuThread, thread_count);
     decomp_param = g_new0(DecompressParam, thread_count);
-    qemu_mutex_init(&decomp_done_lock);
-    qemu_cond_init(&decomp_done_cond);
+    decomp_method = migrate_compress_method();
+    decomp_next = 0;
+    buf_size = compress_bound(decomp_method, TARGET_PAGE_SIZE);
+    qemu_event_init(&decomp_done_event, false);
     decomp_file = f;
     for (i = 0; i < thread_count; i++) {
-        if (inflateInit(&decomp_param[i].stream) != Z_OK) {
-            goto exit;
+        switch (decomp_method) {
+#ifdef CONFIG_ZSTD
+        case COMPRESS_METHOD_ZSTD:
+            decomp_param[i].zdctx = ZSTD_createDCtx();
+            if (!decomp_param[i].zdctx) {
+                goto exit;
+            }
+            break;
+#endif
+        default:
+            if (inflateInit(&decomp_param[i].stream) != Z_OK) {
+                goto exit;
+            }
+            break;
         }
 
-        decomp_param[i].compbuf = g_malloc0(compressBound(TARGET_PAGE_SIZE));
-        qemu_mutex_init(&decomp_param[i].mutex);
-        qemu_cond_init(&decomp_param[i].cond);
-        decomp_param[i].done = true;
-        decomp_param[i].quit = false;
+        decomp_param[i].compbuf = g_malloc0(COMPRESS_RING_SIZE * buf_size);
+        for (j = 0; j < COMPRESS_RING_SIZE; j++) {
+            decomp_param[i].slots[j].compbuf = decomp_param[i].compbuf +
+                                               j * buf_size;
+        }
+        qemu_event_init(&decomp_param[i].event, false);
         qemu_thread_create(decompress_threads + i, "decompress",
                            do_data_decompress, decomp_param + i,
                            QEMU_THREAD_JOINABLE);
@@ -2989,33 +3909,45 @@ exit:
     return -1;
 }
 
-static void decompress_data_with_multi_threads(QEMUFile *f,
-                                               void *host, int len)
+/*
+ * Queue the page to the first thread, in turn, that has room in its ring.
+ * Returns true if the page was queued.
+ */
+static bool decompress_queue_page(QEMUFile *f, void *host, int len)
 {
-    int idx, thread_count;
+    int i, idx, thread_count;
+    DecompressParam *param;
+    DecompressSlot *slot;
 
     thread_count = migrate_decompress_threads();
-    qemu_mutex_lock(&decomp_done_lock);
-    while (true) {
-        for (idx = 0; idx < thread_count; idx++) {
-            if (decomp_param[idx].done) {
-                decomp_param[idx].done = false;
-                qemu_mutex_lock(&decomp_param[idx].mutex);
-                qemu_get_buffer(f, decomp_param[idx].compbuf, len);
-                decomp_param[idx].des = host;
-                decomp_param[idx].len = len;
-                qemu_cond_signal(&decomp_param[idx].cond);
-                qemu_mutex_unlock(&decomp_param[idx].mutex);
-                break;
-            }
+    for (i = 0; i < thread_count; i++) {
+        idx = (decomp_next + i) % thread_count;
+        param = &decomp_param[idx];
+        if (param->head - atomic_load_acquire(&param->done) <
+            COMPRESS_RING_SIZE) {
+            slot = &param->slots[param->head % COMPRESS_RING_SIZE];
+            qemu_get_buffer(f, slot->compbuf, len);
+            slot->des = host;
+            slot->len = len;
+            atomic_store_release(&param->head, param->head + 1);
+            qemu_event_set(&param->event);
+            decomp_next = idx + 1;
+            return true;
         }
-        if (idx < thread_count) {
+    }
+    return false;
+}
+
+static void decompress_data_with_multi_threads(QEMUFile *f,
+                                               void *host, int len)
+{
+    while (!decompress_queue_page(f, host, len)) {
+        qemu_event_reset(&decomp_done_event);
+        if (decompress_queue_page(f, host, len)) {
             break;
-        } else {
-            qemu_cond_wait(&decomp_done_cond, &decomp_done_lock);
         }
+        qemu_event_wait(&decomp_done_event);
     }
-    qemu_mutex_unlock(&decomp_done_lock);
 }
 
 /*
@@ -3167,24 +4099,30 @@ int ram_postcopy_incoming_init(MigrationIncomingState *mis)
 /**
  * ram_load_postcopy: load a page in postcopy case
  *
- * Returns 0 for success or -errno in case of error
+ * Returns 0 for success, 1 if the source closed the preempt channel,
+ * or -errno in case of error
  *
- * Called in postcopy mode by ram_load().
+ * Called in postcopy mode by ram_load(), and by the preempt thread for
+ * each chunk of urgent pages.
  * rcu_read_lock is taken prior to this being called.
  *
  * @f: QEMUFile where to send the data
+ * @channel: RAM_CHANNEL_PRECOPY or RAM_CHANNEL_POSTCOPY (preempt)
  */
-static int ram_load_postcopy(QEMUFile *f)
+int ram_load_postcopy(QEMUFile *f, int channel)
 {
     int flags = 0, ret = 0;
     bool place_needed = false;
     bool matches_target_page_size = false;
     MigrationIncomingState *mis = migration_incoming_get_current();
     /* Temporary page that is later 'placed' */
-    void *postcopy_host_page = mis->postcopy_tmp_page;
+    void *postcopy_host_page = channel == RAM_CHANNEL_POSTCOPY ?
+                               mis->postcopy_preempt_tmp_page :
+                               mis->postcopy_tmp_page;
     void *this_host = NULL;
     bool all_zero = true;
     int target_pages = 0;
+    bool got_page = false;
 
     while (!ret && !(flags & RAM_SAVE_FLAG_EOS)) {
         ram_addr_t addr;
@@ -3212,8 +4150,9 @@ static int ram_load_postcopy(QEMUFile *f)
         trace_ram_load_postcopy_loop((uint64_t)addr, flags);
         if (flags & (RAM_SAVE_FLAG_ZERO | RAM_SAVE_FLAG_PAGE |
                      RAM_SAVE_FLAG_COMPRESS_PAGE)) {
-            block = ram_block_from_stream(f, flags);
+            block = ram_block_from_stream(f, flags, channel);
 
+            got_page = true;
             host = host_from_ram_block_offset(block, addr);
             if (!host) {
                 error_report("Illegal RAM offset " RAM_ADDR_FMT, addr);
@@ -3292,9 +4231,15 @@ static int ram_load_postcopy(QEMUFile *f)
             }
             break;
         case RAM_SAVE_FLAG_COMPRESS_PAGE:
+            if (channel == RAM_CHANNEL_POSTCOPY) {
+                error_report("Compressed page on the postcopy preempt channel");
+                ret = -EINVAL;
+                break;
+            }
             all_zero = false;
             len = qemu_get_be32(f);
-            if (len < 0 || len > compressBound(TARGET_PAGE_SIZE)) {
+            if (len < 0 ||
+                len > compress_bound(decomp_method, TARGET_PAGE_SIZE)) {
                 error_report("Invalid compressed data length: %d", len);
                 ret = -EINVAL;
                 break;
@@ -3303,6 +4248,11 @@ static int ram_load_postcopy(QEMUFile *f)
             break;
 
         case RAM_SAVE_FLAG_EOS:
+            if (channel == RAM_CHANNEL_POSTCOPY) {
+                /* End of a chunk, or the end of the channel if empty */
+                ret = got_page ? 0 : 1;
+                break;
+            }
             /* normal exit */
             multifd_recv_sync_main();
             break;
@@ -3314,7 +4264,7 @@ static int ram_load_postcopy(QEMUFile *f)
         }
 
         /* Got the whole host page, wait for decompress before placing. */
-        if (place_needed) {
+        if (place_needed && channel == RAM_CHANNEL_PRECOPY) {
             ret |= wait_for_decompress_done();
         }
 
@@ -3399,6 +4349,145 @@ void colo_flush_ram_cache(void)
     trace_colo_flush_ram_cache_end();
 }
 
+typedef struct MappedRamLoadParams {
+    QemuThread thread;
+    QIOChannel *ioc;
+    RAMBlock *block;
+    /* pages present in the file */
+    unsigned long *bitmap;
+    off_t pages_offset;
+    /* range of pages loaded by this thread */
+    unsigned long start;
+    unsigned long end;
+    Error *err;
+} MappedRamLoadParams;
+
+static void *mapped_ram_load_thread(void *opaque)
+{
+    MappedRamLoadParams *p = opaque;
+    unsigned long first, last = p->start;
+
+    /* Runs of pages are contiguous in the file too, read them at once */
+    while ((first = find_next_bit(p->bitmap, p->end, last)) < p->end) {
+        ram_addr_t offset = (ram_addr_t)first << TARGET_PAGE_BITS;
+        void *host = p->block->host + offset;
+
+        last = find_next_zero_bit(p->bitmap, p->end, first);
+        if (qio_channel_pread_all(p->ioc, host,
+                                  (size_t)(last - first) << TARGET_PAGE_BITS,
+                                  p->pages_offset + offset, &p->err) < 0) {
+            break;
+        }
+        ramblock_recv_bitmap_set_range(p->block, host, last - first);
+    }
+    return NULL;
+}
+
+/**
+ * mapped_ram_load_ramblock: load a RAM block from a mapped-ram file
+ *
+ * Reads the mapped-ram header and the bitmap of @block, then the pages
+ * present in the file, using as many threads as there are multifd
+ * channels, and finally moves the stream past the pages.
+ *
+ * Returns zero to indicate success and negative for error
+ *
+ * @f: QEMUFile where to receive the data
+ * @block: RAMBlock to load
+ * @length: length of the block in the stream
+ */
+static int mapped_ram_load_ramblock(QEMUFile *f, RAMBlock *block,
+                                    ram_addr_t length)
+{
+    QIOChannel *ioc = qemu_file_get_ioc(f);
+    unsigned long num_pages = length >> TARGET_PAGE_BITS;
+    size_t bitmap_size = BITS_TO_LONGS(num_pages) * sizeof(unsigned long);
+    int nthreads = migrate_use_multifd() ? migrate_multifd_channels() : 1;
+    uint32_t version;
+    uint64_t page_size, bitmap_offset, pages_offset;
+    unsigned long *le_bitmap, *bitmap;
+    unsigned long chunk;
+    MappedRamLoadParams *params;
+    Error *local_err = NULL;
+    int i, ret;
+
+    version = qemu_get_be32(f);
+    page_size = qemu_get_be64(f);
+    bitmap_offset = qemu_get_be64(f);
+    pages_offset = qemu_get_be64(f);
+    ret = qemu_file_get_error(f);
+    if (ret) {
+        return ret;
+    }
+    if (version != MAPPED_RAM_HDR_VERSION) {
+        error_report("Unsupported mapped-ram header version %" PRIu32
+                     " for block %s", version, block->idstr);
+        return -EINVAL;
+    }
+    if (page_size != TARGET_PAGE_SIZE) {
+        error_report("Mismatched mapped-ram page size for block %s: "
+                     "%" PRIu64 " != %d", block->idstr, page_size,
+                     TARGET_PAGE_SIZE);
+        return -EINVAL;
+    }
+    if (!ioc || !qio_channel_has_feature(ioc, QIO_CHANNEL_FEATURE_SEEKABLE)) {
+        error_report("mapped-ram requires a seekable migration file");
+        return -EINVAL;
+    }
+
+    le_bitmap = bitmap_new(num_pages);
+    if (qio_channel_pread_all(ioc, (char *)le_bitmap, bitmap_size,
+                              bitmap_offset, &local_err) < 0) {
+        error_report_err(local_err);
+        g_free(le_bitmap);
+        return -EIO;
+    }
+    bitmap = bitmap_new(num_pages);
+    bitmap_from_le(bitmap, le_bitmap, num_pages);
+    g_free(le_bitmap);
+
+    /* Split the block in chunks of whole words of the bitmap */
+    chunk = ROUND_UP(DIV_ROUND_UP(num_pages, nthreads), BITS_PER_LONG);
+    params = g_new0(MappedRamLoadParams, nthreads);
+    for (i = 0; i < nthreads; i++) {
+        MappedRamLoadParams *p = &params[i];
+
+        p->ioc = ioc;
+        p->block = block;
+        p->bitmap = bitmap;
+        p->pages_offset = pages_offset;
+        p->start = MIN((unsigned long)i * chunk, num_pages);
+        p->end = MIN(p->start + chunk, num_pages);
+        if (i) {
+            qemu_thread_create(&p->thread, "mapped-ram-load",
+                               mapped_ram_load_thread, p,
+                               QEMU_THREAD_JOINABLE);
+        }
+    }
+    mapped_ram_load_thread(&params[0]);
+    for (i = 1; i < nthreads; i++) {
+        qemu_thread_join(&params[i].thread);
+    }
+    for (i = 0; i < nthreads; i++) {
+        if (params[i].err) {
+            if (!ret) {
+                error_report_err(params[i].err);
+                ret = -EIO;
+            } else {
+                error_free(params[i].err);
+            }
+        }
+    }
+    g_free(params);
+    g_free(bitmap);
+
+    trace_ram_load_mapped_ram(block->idstr, nthreads, ret);
+    if (ret) {
+        return ret;
+    }
+    return qemu_fseek(f, pages_offset + length);
+}
+
 /**
  * ram_load_precopy: load pages in precopy case
  *
@@ -3449,7 +4538,8 @@ static int ram_load_precopy(QEMUFile *f)
 
         if (flags & (RAM_SAVE_FLAG_ZERO | RAM_SAVE_FLAG_PAGE |
                      RAM_SAVE_FLAG_COMPRESS_PAGE | RAM_SAVE_FLAG_XBZRLE)) {
-            RAMBlock *block = ram_block_from_stream(f, flags);
+            RAMBlock *block = ram_block_from_stream(f, flags,
+                                                    RAM_CHANNEL_PRECOPY);
 
             host = host_from_ram_block_offset(block, addr);
             /*
@@ -3538,6 +4628,9 @@ static int ram_load_precopy(QEMUFile *f)
                             ret = -EINVAL;
                         }
                     }
+                    if (!ret && migrate_mapped_ram()) {
+                        ret = mapped_ram_load_ramblock(f, block, length);
+                    }
                     ram_control_load_hook(f, RAM_CONTROL_BLOCK_REG,
                                           block->idstr);
                 } else {
@@ -3561,7 +4654,8 @@ static int ram_load_precopy(QEMUFile *f)
 
         case RAM_SAVE_FLAG_COMPRESS_PAGE:
             len = qemu_get_be32(f);
-            if (len < 0 || len > compressBound(TARGET_PAGE_SIZE)) {
+            if (len < 0 ||
+                len > compress_bound(decomp_method, TARGET_PAGE_SIZE)) {
                 error_report("Invalid compressed data length: %d", len);
                 ret = -EINVAL;
                 break;
@@ -3626,7 +4720,7 @@ static int ram_load(QEMUFile *f, void *opaque, int version_id)
      */
     WITH_RCU_READ_LOCK_GUARD() {
         if (postcopy_running) {
-            ret = ram_load_postcopy(f);
+            ret = ram_load_postcopy(f, RAM_CHANNEL_PRECOPY);
         } else {
             ret = ram_load_precopy(f);
         }
@@ -246,6 +246,12 @@ typedef struct SaveStateEntry {
     void *opaque;
     CompatEntry *compat;
     int is_ram;
+    /*
+     * Time spent saving and loading the device state at the end of the
+     * last migration, in microseconds, or -1.
+     */
+    int64_t save_time;
+    int64_t load_time;
 } SaveStateEntry;
 
 typedef struct SaveState {
@@ -768,6 +774,7 @@ int register_savevm_live(const char *idstr,
     se = g_new0(SaveStateEntry, 1);
     se->version_id = version_id;
     se->section_id = savevm_state.global_section_id++;
+    se->save_time = se->load_time = -1;
     se->ops = ops;
     se->opaque = opaque;
     se->vmsd = NULL;
@@ -826,6 +833,7 @@ int vmstate_register_with_alias_id(VMStateIf *obj, uint32_t instance_id,
     se = g_new0(SaveStateEntry, 1);
     se->version_id = vmsd->version_id;
     se->section_id = savevm_state.global_section_id++;
+    se->save_time = se->load_time = -1;
     se->opaque = opaque;
     se->vmsd = vmsd;
     se->alias_id = alias_id;
@@ -1353,7 +1361,6 @@ int qemu_savevm_state_complete_precopy_iterable(QEMUFile *f, bool in_postcopy)
     return 0;
 }
 
-static
 int qemu_savevm_state_complete_precopy_non_iterable(QEMUFile *f,
                                                     bool in_postcopy,
                                                     bool inactivate_disks)
@@ -1367,7 +1374,9 @@ int qemu_savevm_state_complete_precopy_non_iterable(QEMUFile *f,
     json_prop_int(vmdesc, "page_size", qemu_target_page_size());
     json_start_array(vmdesc, "devices");
     QTAILQ_FOREACH(se, &savevm_state.handlers, entry) {
+        int64_t start, offset;
 
+        se->save_time = -1;
         if ((!se->ops || !se->ops->save_state) && !se->vmsd) {
             continue;
         }
@@ -1382,7 +1391,9 @@ int qemu_savevm_state_complete_precopy_non_iterable(QEMUFile *f,
         json_prop_str(vmdesc, "name", se->idstr);
         json_prop_int(vmdesc, "instance_id", se->instance_id);
 
+        start = qemu_clock_get_us(QEMU_CLOCK_REALTIME);
         save_section_header(f, se, QEMU_VM_SECTION_FULL);
+        offset = qemu_ftell_fast(f);
         ret = vmstate_save(f, se, vmdesc);
         if (ret) {
             qemu_file_set_error(f, ret);
@@ -1390,6 +1401,10 @@ int qemu_savevm_state_complete_precopy_non_iterable(QEMUFile *f,
         }
         trace_savevm_section_end(se->idstr, se->section_id, 0);
         save_section_footer(f, se);
+        se->save_time = qemu_clock_get_us(QEMU_CLOCK_REALTIME) - start;
+        trace_savevm_device_state_time(se->idstr, se->instance_id,
+                                       qemu_ftell_fast(f) - offset,
+                                       se->save_time);
 
         json_end_object(vmdesc);
     }
@@ -1628,6 +1643,35 @@ static SaveStateEntry *find_se(const char *idstr, uint32_t instance_id)
     return NULL;
 }
 
+/*
+ * Time spent saving (@load false) or loading the state of each device at
+ * the end of the last migration, in the order of the handlers.
+ */
+DeviceStateTimeList *qemu_savevm_device_state_times(bool load)
+{
+    DeviceStateTimeList *head = NULL, **tail = &head;
+    SaveStateEntry *se;
+
+    QTAILQ_FOREACH(se, &savevm_state.handlers, entry) {
+        int64_t time = load ? se->load_time : se->save_time;
+        DeviceStateTimeList *entry;
+        DeviceStateTime *info;
+
+        if (time < 0) {
+            continue;
+        }
+        info = g_new0(DeviceStateTime, 1);
+        info->name = g_strdup(se->idstr);
+        info->instance_id = se->instance_id;
+        info->time = time;
+        entry = g_new0(DeviceStateTimeList, 1);
+        entry->value = info;
+        *tail = entry;
+        tail = &entry->next;
+    }
+    return head;
+}
+
 enum LoadVMExitCodes {
     /* Allow a command to quit all layers of nested loadvm loops */
     LOADVM_QUIT     =  1,
@@ -2276,6 +2320,7 @@ qemu_loadvm_section_start_full(QEMUFile *f, MigrationIncomingState *mis)
     uint32_t instance_id, version_id, section_id;
     SaveStateEntry *se;
     char idstr[256];
+    int64_t start;
     int ret;
 
     /* Read section start */
@@ -2322,6 +2367,7 @@ qemu_loadvm_section_start_full(QEMUFile *f, MigrationIncomingState *mis)
         return -EINVAL;
     }
 
+    start = qemu_clock_get_us(QEMU_CLOCK_REALTIME);
     ret = vmstate_load(f, se);
     if (ret < 0) {
         error_report("error while loading state for instance 0x%"PRIx32" of"
@@ -2331,6 +2377,12 @@ qemu_loadvm_section_start_full(QEMUFile *f, MigrationIncomingState *mis)
     if (!check_section_footer(f, se)) {
         return -EINVAL;
     }
+    /* Iterable sections start here, only their setup would be timed */
+    if (!se->ops || !se->ops->save_setup) {
+        se->load_time = qemu_clock_get_us(QEMU_CLOCK_REALTIME) - start;
+        trace_loadvm_device_state_time(se->idstr, se->instance_id,
+                                       se->load_time);
+    }
 
     return 0;
 }
@@ -2513,8 +2565,13 @@ retry:
                 goto out;
             }
             break;
-        case QEMU_VM_SECTION_PART:
         case QEMU_VM_SECTION_END:
+            /* The source only sends these once it has stopped the guest */
+            if (!mis->switchover_start) {
+                mis->switchover_start = qemu_clock_get_us(QEMU_CLOCK_REALTIME);
+            }
+            /* fall through */
+        case QEMU_VM_SECTION_PART:
             ret = qemu_loadvm_section_part_end(f, mis);
             if (ret < 0) {
                 goto out;
@@ -2639,6 +2696,12 @@ int qemu_loadvm_state(QEMUFile *f)
     qemu_loadvm_state_cleanup();
     cpu_synchronize_all_post_init();
 
+    if (ret == 0 && mis->switchover_start) {
+        mis->downtime_breakdown.has_load = true;
+        mis->downtime_breakdown.load =
+            migration_downtime_phase("load", mis->switchover_start);
+    }
+
     return ret;
 }
 
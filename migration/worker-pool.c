@@ -0,0 +1,178 @@
+/*
+ * Persistent pool of threads for the data-parallel parts of migration
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/atomic.h"
+#include "qemu/rcu.h"
+#include "qemu/thread.h"
+#include "worker-pool.h"
+
+typedef struct WorkerPoolThread {
+    WorkerPool *pool;
+    QemuThread thread;
+    unsigned int index;
+    /* last run seen by this thread */
+    uint64_t generation;
+} WorkerPoolThread;
+
+struct WorkerPool {
+    char *name;
+    QemuMutex lock;
+    /* signaled when a run starts, or on quit */
+    QemuCond work_cond;
+    /* signaled when the last pool thread of a run is done */
+    QemuCond done_cond;
+    WorkerPoolThread **threads;
+    unsigned int nthreads;
+    bool quit;
+
+    /* The current run; set under the lock before it is started */
+    uint64_t generation;
+    /* pool threads taking part in the run, and those not done yet */
+    unsigned int active;
+    unsigned int running;
+    WorkerPoolFunc *fn;
+    void *opaque;
+    unsigned int nr_jobs;
+    /* next job to hand out, and first error */
+    unsigned int next;
+    int ret;
+};
+
+static void worker_pool_do(WorkerPool *pool)
+{
+    unsigned int i;
+    int ret;
+
+    while (!atomic_read(&pool->ret) &&
+           (i = atomic_fetch_inc(&pool->next)) < pool->nr_jobs) {
+        ret = pool->fn(pool->opaque, i);
+        if (ret) {
+            atomic_cmpxchg(&pool->ret, 0, ret);
+        }
+    }
+}
+
+static void *worker_pool_thread(void *opaque)
+{
+    WorkerPoolThread *t = opaque;
+    WorkerPool *pool = t->pool;
+
+    rcu_register_thread();
+    qemu_mutex_lock(&pool->lock);
+    for (;;) {
+        while (!pool->quit && pool->generation == t->generation) {
+            qemu_cond_wait(&pool->work_cond, &pool->lock);
+        }
+        if (pool->quit) {
+            break;
+        }
+        t->generation = pool->generation;
+        if (t->index >= pool->active) {
+            continue;
+        }
+        qemu_mutex_unlock(&pool->lock);
+
+        worker_pool_do(pool);
+
+        qemu_mutex_lock(&pool->lock);
+        if (--pool->running == 0) {
+            qemu_cond_signal(&pool->done_cond);
+        }
+    }
+    qemu_mutex_unlock(&pool->lock);
+    rcu_unregister_thread();
+
+    return NULL;
+}
+
+WorkerPool *worker_pool_new(const char *name)
+{
+    WorkerPool *pool = g_new0(WorkerPool, 1);
+
+    pool->name = g_strdup(name);
+    qemu_mutex_init(&pool->lock);
+    qemu_cond_init(&pool->work_cond);
+    qemu_cond_init(&pool->done_cond);
+    return pool;
+}
+
+void worker_pool_free(WorkerPool *pool)
+{
+    unsigned int i;
+
+    if (!pool) {
+        return;
+    }
+
+    qemu_mutex_lock(&pool->lock);
+    pool->quit = true;
+    qemu_cond_broadcast(&pool->work_cond);
+    qemu_mutex_unlock(&pool->lock);
+
+    for (i = 0; i < pool->nthreads; i++) {
+        qemu_thread_join(&pool->threads[i]->thread);
+        g_free(pool->threads[i]);
+    }
+    g_free(pool->threads);
+
+    qemu_cond_destroy(&pool->done_cond);
+    qemu_cond_destroy(&pool->work_cond);
+    qemu_mutex_destroy(&pool->lock);
+    g_free(pool->name);
+    g_free(pool);
+}
+
+int worker_pool_run(WorkerPool *pool, unsigned int nthreads,
+                    unsigned int nr_jobs, WorkerPoolFunc *fn, void *opaque)
+{
+    /* The caller is one of the threads */
+    unsigned int helpers = MIN(nthreads, nr_jobs);
+    int ret;
+
+    if (!nr_jobs) {
+        return 0;
+    }
+    helpers = helpers ? helpers - 1 : 0;
+
+    qemu_mutex_lock(&pool->lock);
+    if (pool->nthreads < helpers) {
+        pool->threads = g_renew(WorkerPoolThread *, pool->threads, helpers);
+        while (pool->nthreads < helpers) {
+            WorkerPoolThread *t = g_new0(WorkerPoolThread, 1);
+
+            t->pool = pool;
+            t->index = pool->nthreads;
+            t->generation = pool->generation;
+            qemu_thread_create(&t->thread, pool->name, worker_pool_thread,
+                               t, QEMU_THREAD_JOINABLE);
+            pool->threads[pool->nthreads++] = t;
+        }
+    }
+
+    pool->fn = fn;
+    pool->opaque = opaque;
+    pool->nr_jobs = nr_jobs;
+    pool->next = 0;
+    pool->ret = 0;
+    pool->active = helpers;
+    pool->running = helpers;
+    pool->generation++;
+    qemu_cond_broadcast(&pool->work_cond);
+    qemu_mutex_unlock(&pool->lock);
+
+    worker_pool_do(pool);
+
+    qemu_mutex_lock(&pool->lock);
+    while (pool->running) {
+        qemu_cond_wait(&pool->done_cond, &pool->lock);
+    }
+    ret = pool->ret;
+    qemu_mutex_unlock(&pool->lock);
+
+    return ret;
+}
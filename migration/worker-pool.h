@@ -0,0 +1,55 @@
+/*
+ * Persistent pool of threads for the data-parallel parts of migration
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#ifndef QEMU_MIGRATION_WORKER_POOL_H
+#define QEMU_MIGRATION_WORKER_POOL_H
+
+typedef struct WorkerPool WorkerPool;
+
+/*
+ * Run by worker_pool_run() for each job index.  A non-zero return value
+ * stops the distribution of the remaining jobs.
+ */
+typedef int WorkerPoolFunc(void *opaque, unsigned int index);
+
+/**
+ * worker_pool_new: create a pool with no threads
+ *
+ * Threads are started by worker_pool_run() as they are needed, and then
+ * kept until worker_pool_free(), so that a pool owned by a migration
+ * does not create threads on each of its uses.
+ *
+ * @name: name of the threads
+ */
+WorkerPool *worker_pool_new(const char *name);
+
+/**
+ * worker_pool_free: stop the threads of the pool and free it
+ *
+ * @pool: the pool, may be NULL
+ */
+void worker_pool_free(WorkerPool *pool);
+
+/**
+ * worker_pool_run: run @fn on jobs 0 to @nr_jobs - 1 and wait for them
+ *
+ * The jobs are handed out one at a time from a shared index to up to
+ * @nthreads threads, the caller included, so their cost may vary.  Only
+ * one caller may use a pool at a time.
+ *
+ * Returns the first non-zero value returned by @fn, or 0.
+ *
+ * @pool: the pool
+ * @nthreads: maximum number of threads, the caller included
+ * @nr_jobs: number of jobs
+ * @fn: function called for each job
+ * @opaque: passed to @fn
+ */
+int worker_pool_run(WorkerPool *pool, unsigned int nthreads,
+                    unsigned int nr_jobs, WorkerPoolFunc *fn, void *opaque);
+
+#endif
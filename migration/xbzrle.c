@@ -12,8 +12,232 @@
  */
 #include "qemu/osdep.h"
 #include "qemu/cutils.h"
+#include "qemu/host-utils.h"
 #include "xbzrle.h"
 
+/*
+ * Run detection.  Starting at offset @i, return the offset of the first
+ * byte at which @old_buf and @new_buf differ (end of a zrun) or are equal
+ * (end of an nzrun), or @slen if there is none.  Runs are always maximal,
+ * so every implementation produces the same encoding.
+ */
+static int zrun_end_int(uint8_t *old_buf, uint8_t *new_buf, int i, int slen)
+{
+    /* not aligned to sizeof(long) */
+    long res = (slen - i) % sizeof(long);
+
+    while (res && old_buf[i] == new_buf[i]) {
+        i++;
+        res--;
+    }
+
+    /* word at a time for speed */
+    if (!res) {
+        while (i < slen &&
+               (*(long *)(old_buf + i)) == (*(long *)(new_buf + i))) {
+            i += sizeof(long);
+        }
+
+        /* go over the rest */
+        while (i < slen && old_buf[i] == new_buf[i]) {
+            i++;
+        }
+    }
+    return i;
+}
+
+static int nzrun_end_int(uint8_t *old_buf, uint8_t *new_buf, int i, int slen)
+{
+    /* not aligned to sizeof(long) */
+    long res = (slen - i) % sizeof(long);
+
+    while (res && old_buf[i] != new_buf[i]) {
+        i++;
+        res--;
+    }
+
+    /* word at a time for speed, use of 32-bit long okay */
+    if (!res) {
+        /* truncation to 32-bit long okay */
+        unsigned long mask = (unsigned long)0x0101010101010101ULL;
+        while (i < slen) {
+            unsigned long xor;
+            xor = *(unsigned long *)(old_buf + i)
+                ^ *(unsigned long *)(new_buf + i);
+            if ((xor - mask) & ~xor & (mask << 7)) {
+                /* found the end of an nzrun within the current long */
+                while (old_buf[i] != new_buf[i]) {
+                    i++;
+                }
+                break;
+            } else {
+                i += sizeof(long);
+            }
+        }
+    }
+    return i;
+}
+
+#if defined(CONFIG_AVX512F_OPT) || defined(CONFIG_AVX2_OPT)
+
+#ifdef CONFIG_AVX2_OPT
+#pragma GCC push_options
+#pragma GCC target("avx2")
+#include <immintrin.h>
+
+static int zrun_end_avx2(uint8_t *old_buf, uint8_t *new_buf, int i, int slen)
+{
+    for (; i + 32 <= slen; i += 32) {
+        __m256i a = _mm256_loadu_si256((__m256i *)(old_buf + i));
+        __m256i b = _mm256_loadu_si256((__m256i *)(new_buf + i));
+        uint32_t ne = ~(uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(a, b));
+
+        if (ne) {
+            return i + ctz32(ne);
+        }
+    }
+    return zrun_end_int(old_buf, new_buf, i, slen);
+}
+
+static int nzrun_end_avx2(uint8_t *old_buf, uint8_t *new_buf, int i, int slen)
+{
+    for (; i + 32 <= slen; i += 32) {
+        __m256i a = _mm256_loadu_si256((__m256i *)(old_buf + i));
+        __m256i b = _mm256_loadu_si256((__m256i *)(new_buf + i));
+        uint32_t eq = _mm256_movemask_epi8(_mm256_cmpeq_epi8(a, b));
+
+        if (eq) {
+            return i + ctz32(eq);
+        }
+    }
+    return nzrun_end_int(old_buf, new_buf, i, slen);
+}
+#pragma GCC pop_options
+#endif /* CONFIG_AVX2_OPT */
+
+#ifdef CONFIG_AVX512F_OPT
+#pragma GCC push_options
+#pragma GCC target("avx512f")
+#include <immintrin.h>
+
+/*
+ * AVX512F has no byte compares, so these find the first 32-bit lane that
+ * ends the run and then look for the byte within it.
+ */
+static int zrun_end_avx512(uint8_t *old_buf, uint8_t *new_buf, int i,
+                           int slen)
+{
+    for (; i + 64 <= slen; i += 64) {
+        __m512i a = _mm512_loadu_si512(old_buf + i);
+        __m512i b = _mm512_loadu_si512(new_buf + i);
+        __mmask16 ne = _mm512_cmpneq_epi32_mask(a, b);
+
+        if (ne) {
+            i += ctz32(ne) * 4;
+            while (old_buf[i] == new_buf[i]) {
+                i++;
+            }
+            return i;
+        }
+    }
+    return zrun_end_int(old_buf, new_buf, i, slen);
+}
+
+static int nzrun_end_avx512(uint8_t *old_buf, uint8_t *new_buf, int i,
+                            int slen)
+{
+    __m512i ones = _mm512_set1_epi32(0x01010101);
+    __m512i highs = _mm512_set1_epi32(0x80808080);
+
+    for (; i + 64 <= slen; i += 64) {
+        __m512i a = _mm512_loadu_si512(old_buf + i);
+        __m512i b = _mm512_loadu_si512(new_buf + i);
+        __m512i x = _mm512_xor_si512(a, b);
+        /* Same zero byte test as nzrun_end_int, one lane at a time */
+        __m512i t = _mm512_and_si512(_mm512_andnot_si512(x,
+                                         _mm512_sub_epi32(x, ones)), highs);
+        __mmask16 eq = _mm512_test_epi32_mask(t, t);
+
+        if (eq) {
+            i += ctz32(eq) * 4;
+            while (old_buf[i] != new_buf[i]) {
+                i++;
+            }
+            return i;
+        }
+    }
+    return nzrun_end_int(old_buf, new_buf, i, slen);
+}
+#pragma GCC pop_options
+#endif /* CONFIG_AVX512F_OPT */
+
+/* Note that for test_xbzrle_next_accel, the most preferred
+ * ISA must have the least significant bit.
+ */
+#define CACHE_AVX512F 1
+#define CACHE_AVX2    2
+
+static unsigned cpuid_cache;
+static int (*zrun_end_accel)(uint8_t *, uint8_t *, int, int) = zrun_end_int;
+static int (*nzrun_end_accel)(uint8_t *, uint8_t *, int, int) = nzrun_end_int;
+
+static void init_accel(unsigned cache)
+{
+    zrun_end_accel = zrun_end_int;
+    nzrun_end_accel = nzrun_end_int;
+#ifdef CONFIG_AVX2_OPT
+    if (cache & CACHE_AVX2) {
+        zrun_end_accel = zrun_end_avx2;
+        nzrun_end_accel = nzrun_end_avx2;
+    }
+#endif
+#ifdef CONFIG_AVX512F_OPT
+    if (cache & CACHE_AVX512F) {
+        zrun_end_accel = zrun_end_avx512;
+        nzrun_end_accel = nzrun_end_avx512;
+    }
+#endif
+}
+
+#include "qemu/cpuinfo.h"
+
+static void __attribute__((constructor)) init_cpuid_cache(void)
+{
+    unsigned info = cpuinfo_init();
+    unsigned cache = 0;
+
+    if (info & CPUINFO_AVX2) {
+        cache |= CACHE_AVX2;
+    }
+    if (info & CPUINFO_AVX512F) {
+        cache |= CACHE_AVX512F;
+    }
+    cpuid_cache = cache;
+    init_accel(cache);
+}
+
+bool test_xbzrle_next_accel(void)
+{
+    /* If no bits set, we just tested the integer versions, and there
+       are no more acceleration options to test.  */
+    if (cpuid_cache == 0) {
+        return false;
+    }
+    /* Disable the accelerator we used before and select a new one.  */
+    cpuid_cache &= cpuid_cache - 1;
+    init_accel(cpuid_cache);
+    return true;
+}
+
+#else
+#define zrun_end_accel  zrun_end_int
+#define nzrun_end_accel nzrun_end_int
+bool test_xbzrle_next_accel(void)
+{
+    return false;
+}
+#endif
+
 /*
   page = zrun nzrun
        | zrun nzrun page
@@ -28,8 +252,7 @@ int xbzrle_encode_buffer(uint8_t *old_buf, uint8_t *new_buf, int slen,
                          uint8_t *dst, int dlen)
 {
     uint32_t zrun_len = 0, nzrun_len = 0;
-    int d = 0, i = 0;
-    long res;
+    int d = 0, i = 0, end;
     uint8_t *nzrun_start = NULL;
 
     g_assert(!(((uintptr_t)old_buf | (uintptr_t)new_buf | slen) %
@@ -41,28 +264,9 @@ int xbzrle_encode_buffer(uint8_t *old_buf, uint8_t *new_buf, int slen,
             return -1;
         }
 
-        /* not aligned to sizeof(long) */
-        res = (slen - i) % sizeof(long);
-        while (res && old_buf[i] == new_buf[i]) {
-            zrun_len++;
-            i++;
-            res--;
-        }
-
-        /* word at a time for speed */
-        if (!res) {
-            while (i < slen &&
-                   (*(long *)(old_buf + i)) == (*(long *)(new_buf + i))) {
-                i += sizeof(long);
-                zrun_len += sizeof(long);
-            }
-
-            /* go over the rest */
-            while (i < slen && old_buf[i] == new_buf[i]) {
-                zrun_len++;
-                i++;
-            }
-        }
+        end = zrun_end_accel(old_buf, new_buf, i, slen);
+        zrun_len = end - i;
+        i = end;
 
         /* buffer unchanged */
         if (zrun_len == slen) {
@@ -76,42 +280,16 @@ int xbzrle_encode_buffer(uint8_t *old_buf, uint8_t *new_buf, int slen,
 
         d += uleb128_encode_small(dst + d, zrun_len);
 
-        zrun_len = 0;
         nzrun_start = new_buf + i;
 
         /* overflow */
         if (d + 2 > dlen) {
             return -1;
         }
-        /* not aligned to sizeof(long) */
-        res = (slen - i) % sizeof(long);
-        while (res && old_buf[i] != new_buf[i]) {
-            i++;
-            nzrun_len++;
-            res--;
-        }
-
-        /* word at a time for speed, use of 32-bit long okay */
-        if (!res) {
-            /* truncation to 32-bit long okay */
-            unsigned long mask = (unsigned long)0x0101010101010101ULL;
-            while (i < slen) {
-                unsigned long xor;
-                xor = *(unsigned long *)(old_buf + i)
-                    ^ *(unsigned long *)(new_buf + i);
-                if ((xor - mask) & ~xor & (mask << 7)) {
-                    /* found the end of an nzrun within the current long */
-                    while (old_buf[i] != new_buf[i]) {
-                        nzrun_len++;
-                        i++;
-                    }
-                    break;
-                } else {
-                    i += sizeof(long);
-                    nzrun_len += sizeof(long);
-                }
-            }
-        }
+
+        end = nzrun_end_accel(old_buf, new_buf, i, slen);
+        nzrun_len = end - i;
+        i = end;
 
         d += uleb128_encode_small(dst + d, nzrun_len);
         /* overflow */
@@ -120,7 +298,6 @@ int xbzrle_encode_buffer(uint8_t *old_buf, uint8_t *new_buf, int slen,
         }
         memcpy(dst + d, nzrun_start, nzrun_len);
         d += nzrun_len;
-        nzrun_len = 0;
     }
 
     return d;
@@ -266,6 +266,8 @@ void hmp_info_migrate(Monitor *mon, const QDict *qdict)
                        info->ram->normal_bytes >> 10);
         monitor_printf(mon, "dirty sync count: %" PRIu64 "\n",
                        info->ram->dirty_sync_count);
+        monitor_printf(mon, "dirty sync time: %" PRIu64 " us\n",
+                       info->ram->dirty_sync_time);
         monitor_printf(mon, "page size: %" PRIu64 " kbytes\n",
                        info->ram->page_size >> 10);
         monitor_printf(mon, "multifd bytes: %" PRIu64 " kbytes\n",
@@ -299,10 +301,14 @@ void hmp_info_migrate(Monitor *mon, const QDict *qdict)
                        info->xbzrle_cache->bytes >> 10);
         monitor_printf(mon, "xbzrle pages: %" PRIu64 " pages\n",
                        info->xbzrle_cache->pages);
+        monitor_printf(mon, "xbzrle cache hit: %" PRIu64 " pages\n",
+                       info->xbzrle_cache->cache_hit);
         monitor_printf(mon, "xbzrle cache miss: %" PRIu64 " pages\n",
                        info->xbzrle_cache->cache_miss);
         monitor_printf(mon, "xbzrle cache miss rate: %0.2f\n",
                        info->xbzrle_cache->cache_miss_rate);
+        monitor_printf(mon, "xbzrle cache eviction: %" PRIu64 " pages\n",
+                       info->xbzrle_cache->cache_eviction);
         monitor_printf(mon, "xbzrle encoding rate: %0.2f\n",
                        info->xbzrle_cache->encoding_rate);
         monitor_printf(mon, "xbzrle overflow: %" PRIu64 "\n",
@@ -322,6 +328,23 @@ void hmp_info_migrate(Monitor *mon, const QDict *qdict)
                        info->compression->compression_rate);
     }
 
+    if (info->has_multifd_stats) {
+        MultiFDChannelStatsList *list;
+
+        for (list = info->multifd_stats; list; list = list->next) {
+            MultiFDChannelStats *stats = list->value;
+
+            monitor_printf(mon, "multifd channel %" PRId64 ": %" PRIu64
+                           " packets, %" PRIu64 " pages, %" PRIu64
+                           " kbytes, %" PRIu64 " compressed kbytes,"
+                           " compression ratio %0.2f, compress time %"
+                           PRIu64 " us\n",
+                           stats->id, stats->packets, stats->pages,
+                           stats->bytes >> 10, stats->compressed_bytes >> 10,
+                           stats->compression_ratio, stats->compress_time);
+        }
+    }
+
     if (info->has_cpu_throttle_percentage) {
         monitor_printf(mon, "cpu throttle percentage: %" PRIu64 "\n",
                        info->cpu_throttle_percentage);
@@ -343,6 +366,34 @@ void hmp_info_migrate(Monitor *mon, const QDict *qdict)
         g_free(str);
         visit_free(v);
     }
+
+    if (info->has_vcpu_throttle_percentage) {
+        Visitor *v;
+        char *str;
+        v = string_output_visitor_new(false, &str);
+        visit_type_intList(v, NULL, &info->vcpu_throttle_percentage,
+                           &error_abort);
+        visit_complete(v, &str);
+        monitor_printf(mon, "vcpu throttle percentage: %s\n", str);
+        g_free(str);
+        visit_free(v);
+    }
+    if (info->has_postcopy_page_requests) {
+        monitor_printf(mon, "postcopy page requests: %" PRIu64 "\n",
+                       info->postcopy_page_requests);
+    }
+    if (info->has_postcopy_latency) {
+        monitor_printf(mon, "postcopy latency: %" PRIu64 " us (max %" PRIu64
+                       " us)\n", info->postcopy_latency,
+                       info->postcopy_latency_max);
+    }
+    if (info->has_postcopy_prefetch_pages &&
+        info->postcopy_prefetch_pages) {
+        monitor_printf(mon, "postcopy prefetch pages: %" PRIu64
+                       " (hits %" PRIu64 ")\n",
+                       info->postcopy_prefetch_pages,
+                       info->postcopy_prefetch_hits);
+    }
     if (info->has_socket_address) {
         SocketAddressList *addr;
 
@@ -430,6 +481,26 @@ void hmp_info_migrate_parameters(Monitor *mon, const QDict *qdict)
         monitor_printf(mon, "%s: %u\n",
             MigrationParameter_str(MIGRATION_PARAMETER_MAX_CPU_THROTTLE),
             params->max_cpu_throttle);
+        assert(params->has_postcopy_prefetch_window);
+        monitor_printf(mon, "%s: %u\n",
+            MigrationParameter_str(MIGRATION_PARAMETER_POSTCOPY_PREFETCH_WINDOW),
+            params->postcopy_prefetch_window);
+        assert(params->has_postcopy_prefetch_stride);
+        monitor_printf(mon, "%s: %s\n",
+            MigrationParameter_str(MIGRATION_PARAMETER_POSTCOPY_PREFETCH_STRIDE),
+            params->postcopy_prefetch_stride ? "on" : "off");
+        assert(params->has_dirty_sync_threads);
+        monitor_printf(mon, "%s: %u\n",
+            MigrationParameter_str(MIGRATION_PARAMETER_DIRTY_SYNC_THREADS),
+            params->dirty_sync_threads);
+        assert(params->has_compress_method);
+        monitor_printf(mon, "%s: %s\n",
+            MigrationParameter_str(MIGRATION_PARAMETER_COMPRESS_METHOD),
+            CompressMethod_str(params->compress_method));
+        assert(params->has_vcpu_dirty_limit);
+        monitor_printf(mon, "%s: %" PRIu64 " MB/s\n",
+            MigrationParameter_str(MIGRATION_PARAMETER_VCPU_DIRTY_LIMIT),
+            params->vcpu_dirty_limit);
         assert(params->has_tls_creds);
         monitor_printf(mon, "%s: '%s'\n",
             MigrationParameter_str(MIGRATION_PARAMETER_TLS_CREDS),
@@ -480,6 +551,34 @@ void hmp_info_migrate_cache_size(Monitor *mon, const QDict *qdict)
                    qmp_query_migrate_cache_size(NULL) >> 10);
 }
 
+void hmp_info_dirty_rate(Monitor *mon, const QDict *qdict)
+{
+    DirtyRateInfo *info = qmp_query_dirty_rate(NULL);
+
+    monitor_printf(mon, "Status: %s\n", DirtyRateStatus_str(info->status));
+    monitor_printf(mon, "Mode: %s\n", DirtyRateMeasureMode_str(info->mode));
+    monitor_printf(mon, "Start Time: %" PRIi64 " (s)\n", info->start_time);
+    monitor_printf(mon, "Sample Pages: %" PRIu64 " (per GB)\n",
+                   info->sample_pages);
+    monitor_printf(mon, "Period: %" PRIi64 " (sec)\n", info->calc_time);
+    if (info->has_dirty_rate) {
+        monitor_printf(mon, "Dirty rate: %" PRIi64 " (MB/s)\n",
+                       info->dirty_rate);
+    } else {
+        monitor_printf(mon, "Dirty rate: (not ready)\n");
+    }
+    if (info->has_vcpu_dirty_rate) {
+        DirtyRateVcpuList *rate;
+
+        for (rate = info->vcpu_dirty_rate; rate; rate = rate->next) {
+            monitor_printf(mon, "vcpu[%" PRIi64 "], Dirty rate: %" PRIi64
+                           " (MB/s)\n", rate->value->id,
+                           rate->value->dirty_rate);
+        }
+    }
+    qapi_free_DirtyRateInfo(info);
+}
+
 
 #ifdef CONFIG_VNC
 /* Helper for hmp_info_vnc_clients, _servers */
@@ -1205,6 +1304,26 @@ void hmp_migrate_set_cache_size(Monitor *mon, const QDict *qdict)
     hmp_handle_error(mon, err);
 }
 
+void hmp_calc_dirty_rate(Monitor *mon, const QDict *qdict)
+{
+    int64_t sec = qdict_get_int(qdict, "second");
+    int64_t sample_pages = qdict_get_try_int(qdict, "sample_pages_per_GB", -1);
+    bool dirty_ring = qdict_get_try_bool(qdict, "dirty_ring", false);
+    Error *err = NULL;
+
+    qmp_calc_dirty_rate(sec, sample_pages != -1, sample_pages, true,
+                        dirty_ring ? DIRTY_RATE_MEASURE_MODE_DIRTY_RING :
+                        DIRTY_RATE_MEASURE_MODE_PAGE_SAMPLING, &err);
+    if (err) {
+        hmp_handle_error(mon, err);
+        return;
+    }
+
+    monitor_printf(mon, "Starting dirty rate measurement with period %" PRIi64
+                   " seconds\n", sec);
+    monitor_printf(mon, "[Please use 'info dirty_rate' to check results]\n");
+}
+
 /* Kept for backwards compatibility */
 void hmp_migrate_set_speed(Monitor *mon, const QDict *qdict)
 {
@@ -1368,6 +1487,26 @@ void hmp_migrate_set_parameter(Monitor *mon, const QDict *qdict)
         p->has_max_postcopy_bandwidth = true;
         visit_type_size(v, param, &p->max_postcopy_bandwidth, &err);
         break;
+    case MIGRATION_PARAMETER_POSTCOPY_PREFETCH_WINDOW:
+        p->has_postcopy_prefetch_window = true;
+        visit_type_int(v, param, &p->postcopy_prefetch_window, &err);
+        break;
+    case MIGRATION_PARAMETER_POSTCOPY_PREFETCH_STRIDE:
+        p->has_postcopy_prefetch_stride = true;
+        visit_type_bool(v, param, &p->postcopy_prefetch_stride, &err);
+        break;
+    case MIGRATION_PARAMETER_DIRTY_SYNC_THREADS:
+        p->has_dirty_sync_threads = true;
+        visit_type_uint8(v, param, &p->dirty_sync_threads, &err);
+        break;
+    case MIGRATION_PARAMETER_COMPRESS_METHOD:
+        p->has_compress_method = true;
+        visit_type_CompressMethod(v, param, &p->compress_method, &err);
+        break;
+    case MIGRATION_PARAMETER_VCPU_DIRTY_LIMIT:
+        p->has_vcpu_dirty_limit = true;
+        visit_type_int(v, param, &p->vcpu_dirty_limit, &err);
+        break;
     case MIGRATION_PARAMETER_ANNOUNCE_INITIAL:
         p->has_announce_initial = true;
         visit_type_size(v, param, &p->announce_initial, &err);
@@ -21,6 +21,7 @@
 #include "net/eth.h"
 #include "qom/object_interfaces.h"
 #include "qemu/iov.h"
+#include "qemu/crc32c.h"
 #include "qom/object.h"
 #include "net/queue.h"
 #include "chardev/char-fe.h"
@@ -47,6 +48,7 @@ static NotifierList colo_compare_notifiers =
 
 #define COMPARE_READ_LEN_MAX NET_BUFSIZE
 #define MAX_QUEUE_SIZE 1024
+#define MAX_COMPARE_THREADS 64
 
 #define COLO_COMPARE_FREE_PRIMARY     0x01
 #define COLO_COMPARE_FREE_SECONDARY   0x02
@@ -100,6 +102,39 @@ typedef struct SendEntry {
     uint8_t *buf;
 } SendEntry;
 
+/*
+ * Connections are spread over the shards by the hash of their key, and
+ * with compare_threads > 1 each shard is compared by a thread of its own.
+ * The iothread parses the packets and hands them over through the pending
+ * queues; the primary packets that pass the comparison come back through
+ * the release queue, since only the iothread writes to the chardevs.
+ */
+typedef struct CompareShard {
+    struct CompareState *s;
+    /* Protects the connections and their packets */
+    QemuMutex lock;
+    /*
+     * Record the connection that through the NIC
+     * Element type: Connection
+     */
+    GQueue conn_list;
+    /* Record the connection without repetition */
+    GHashTable *connection_track_table;
+
+    /* Protects the fields below */
+    QemuMutex queue_lock;
+    QemuCond queue_cond;
+    /* Packets not compared yet, element type: Packet */
+    GQueue pri_pending;
+    GQueue sec_pending;
+    /* Primary packets to send out, element type: Packet */
+    GQueue release;
+    /* A miscompare asks for a checkpoint */
+    bool inconsistent;
+    bool quit;
+    QemuThread thread;
+} CompareShard;
+
 typedef struct CompareState {
     Object parent;
 
@@ -119,14 +154,10 @@ typedef struct CompareState {
     bool vnet_hdr;
     uint32_t compare_timeout;
     uint32_t expired_scan_cycle;
+    uint32_t compare_threads;
 
-    /*
-     * Record the connection that through the NIC
-     * Element type: Connection
-     */
-    GQueue conn_list;
-    /* Record the connection without repetition */
-    GHashTable *connection_track_table;
+    /* compare_threads shards of the connections */
+    CompareShard *shards;
 
     IOThread *iothread;
     GMainContext *worker_context;
@@ -134,6 +165,8 @@ typedef struct CompareState {
 
     QEMUBH *event_bh;
     enum colo_event event;
+    /* Sends out the packets released by the compare threads */
+    QEMUBH *release_bh;
 
     QTAILQ_ENTRY(CompareState) next;
 } CompareState;
@@ -238,40 +271,27 @@ static int colo_insert_packet(GQueue *queue, Packet *pkt, uint32_t *max_ack)
     return 0;
 }
 
+static void colo_compare_connection(CompareShard *shard, Connection *conn);
+
 /*
- * Return 0 on success, if return -1 means the pkt
- * is unsupported(arp and ipv6) and will be sent later
+ * Called with shard->lock held to queue @pkt to its connection
+ * and compare it.
  */
-static int packet_enqueue(CompareState *s, int mode, Connection **con)
+static void colo_compare_shard_packet(CompareShard *shard, Packet *pkt,
+                                      int mode)
 {
     ConnectionKey key;
-    Packet *pkt = NULL;
     Connection *conn;
     int ret;
 
-    if (mode == PRIMARY_IN) {
-        pkt = packet_new(s->pri_rs.buf,
-                         s->pri_rs.packet_len,
-                         s->pri_rs.vnet_hdr_len);
-    } else {
-        pkt = packet_new(s->sec_rs.buf,
-                         s->sec_rs.packet_len,
-                         s->sec_rs.vnet_hdr_len);
-    }
-
-    if (parse_packet_early(pkt)) {
-        packet_destroy(pkt, NULL);
-        pkt = NULL;
-        return -1;
-    }
     fill_connection_key(pkt, &key);
 
-    conn = connection_get(s->connection_track_table,
+    conn = connection_get(shard->connection_track_table,
                           &key,
-                          &s->conn_list);
+                          &shard->conn_list);
 
     if (!conn->processing) {
-        g_queue_push_tail(&s->conn_list, conn);
+        g_queue_push_tail(&shard->conn_list, conn);
         conn->processing = true;
     }
 
@@ -288,7 +308,82 @@ static int packet_enqueue(CompareState *s, int mode, Connection **con)
         pkt = NULL;
     }
 
-    *con = conn;
+    /* compare packet in the specified connection */
+    colo_compare_connection(shard, conn);
+}
+
+/*
+ * Called with shard->lock held to compare the packets that the
+ * iothread has handed over to the shard.
+ */
+static void colo_compare_shard_run(CompareShard *shard)
+{
+    GQueue pri_pending, sec_pending;
+    Packet *pkt;
+
+    qemu_mutex_lock(&shard->queue_lock);
+    pri_pending = shard->pri_pending;
+    sec_pending = shard->sec_pending;
+    g_queue_init(&shard->pri_pending);
+    g_queue_init(&shard->sec_pending);
+    qemu_mutex_unlock(&shard->queue_lock);
+
+    /*
+     * Queue the secondary packets first, so that the primary
+     * packets of the batch find their counterparts.
+     */
+    while ((pkt = g_queue_pop_head(&sec_pending))) {
+        colo_compare_shard_packet(shard, pkt, SECONDARY_IN);
+    }
+    while ((pkt = g_queue_pop_head(&pri_pending))) {
+        colo_compare_shard_packet(shard, pkt, PRIMARY_IN);
+    }
+}
+
+static void colo_compare_release(CompareState *s);
+
+/*
+ * Return 0 on success, if return -1 means the pkt
+ * is unsupported(arp and ipv6) and will be sent later
+ */
+static int packet_enqueue(CompareState *s, int mode)
+{
+    ConnectionKey key;
+    CompareShard *shard;
+    Packet *pkt = NULL;
+
+    if (mode == PRIMARY_IN) {
+        pkt = packet_new(s->pri_rs.buf,
+                         s->pri_rs.packet_len,
+                         s->pri_rs.vnet_hdr_len);
+    } else {
+        pkt = packet_new(s->sec_rs.buf,
+                         s->sec_rs.packet_len,
+                         s->sec_rs.vnet_hdr_len);
+    }
+
+    if (parse_packet_early(pkt)) {
+        packet_destroy(pkt, NULL);
+        pkt = NULL;
+        return -1;
+    }
+    fill_connection_key(pkt, &key);
+    shard = &s->shards[connection_key_hash(&key) % s->compare_threads];
+
+    if (s->compare_threads == 1) {
+        /* No compare thread, compare right away */
+        qemu_mutex_lock(&shard->lock);
+        colo_compare_shard_packet(shard, pkt, mode);
+        qemu_mutex_unlock(&shard->lock);
+        colo_compare_release(s);
+        return 0;
+    }
+
+    qemu_mutex_lock(&shard->queue_lock);
+    g_queue_push_tail(mode == PRIMARY_IN ? &shard->pri_pending :
+                                           &shard->sec_pending, pkt);
+    qemu_cond_signal(&shard->queue_cond);
+    qemu_mutex_unlock(&shard->queue_lock);
 
     return 0;
 }
@@ -298,20 +393,101 @@ static inline bool after(uint32_t seq1, uint32_t seq2)
         return (int32_t)(seq1 - seq2) > 0;
 }
 
-static void colo_release_primary_pkt(CompareState *s, Packet *pkt)
+static void colo_release_primary_pkt(CompareShard *shard, Packet *pkt)
 {
+    qemu_mutex_lock(&shard->queue_lock);
+    g_queue_push_tail(&shard->release, pkt);
+    qemu_mutex_unlock(&shard->queue_lock);
+    trace_colo_compare_main("packet same and release packet");
+}
+
+static void colo_compare_shard_inconsistent(CompareShard *shard)
+{
+    qemu_mutex_lock(&shard->queue_lock);
+    shard->inconsistent = true;
+    qemu_mutex_unlock(&shard->queue_lock);
+}
+
+/*
+ * Send out the primary packets released by @shard.
+ * Return true if the shard found an inconsistency.
+ */
+static bool colo_compare_release_shard(CompareState *s, CompareShard *shard)
+{
+    GQueue release;
+    Packet *pkt;
+    bool inconsistent;
     int ret;
-    ret = compare_chr_send(s,
-                           pkt->data,
-                           pkt->size,
-                           pkt->vnet_hdr_len,
-                           false,
-                           true);
-    if (ret < 0) {
-        error_report("colo send primary packet failed");
+
+    qemu_mutex_lock(&shard->queue_lock);
+    release = shard->release;
+    g_queue_init(&shard->release);
+    inconsistent = shard->inconsistent;
+    shard->inconsistent = false;
+    qemu_mutex_unlock(&shard->queue_lock);
+
+    while ((pkt = g_queue_pop_head(&release))) {
+        ret = compare_chr_send(s,
+                               pkt->data,
+                               pkt->size,
+                               pkt->vnet_hdr_len,
+                               false,
+                               true);
+        if (ret < 0) {
+            error_report("colo send primary packet failed");
+        }
+        packet_destroy_partial(pkt, NULL);
     }
-    trace_colo_compare_main("packet same and release packet");
-    packet_destroy_partial(pkt, NULL);
+
+    return inconsistent;
+}
+
+/*
+ * Called from the compare thread on the primary to send out what
+ * the shards released, and to ask for a checkpoint if one of them
+ * found an inconsistency.
+ */
+static void colo_compare_release(CompareState *s)
+{
+    bool inconsistent = false;
+    uint32_t i;
+
+    for (i = 0; i < s->compare_threads; i++) {
+        inconsistent |= colo_compare_release_shard(s, &s->shards[i]);
+    }
+    if (inconsistent) {
+        colo_compare_inconsistency_notify(s);
+    }
+}
+
+static void colo_compare_release_bh(void *opaque)
+{
+    colo_compare_release(opaque);
+}
+
+static void *colo_compare_worker(void *opaque)
+{
+    CompareShard *shard = opaque;
+
+    qemu_mutex_lock(&shard->queue_lock);
+    while (!shard->quit) {
+        if (g_queue_is_empty(&shard->pri_pending) &&
+            g_queue_is_empty(&shard->sec_pending)) {
+            qemu_cond_wait(&shard->queue_cond, &shard->queue_lock);
+            continue;
+        }
+        qemu_mutex_unlock(&shard->queue_lock);
+
+        qemu_mutex_lock(&shard->lock);
+        colo_compare_shard_run(shard);
+        qemu_mutex_unlock(&shard->lock);
+        qemu_bh_schedule(shard->s->release_bh);
+
+        qemu_mutex_lock(&shard->queue_lock);
+    }
+    qemu_mutex_unlock(&shard->queue_lock);
+
+    return NULL;
 }
 
 /*
@@ -348,6 +524,11 @@ static int colo_compare_packet_payload(Packet *ppkt,
  * return true means that the payload is consist and
  * need to make the next comparison, false means do
  * the checkpoint
+ *
+ * Each byte of the stream is compared once: the compared part of the
+ * longer packet is skipped through its offset, and a pair that does not
+ * match forces a checkpoint rather than being compared again.  Hashing
+ * the payloads would not save anything, as it reads the same bytes.
 */
 static bool colo_mark_tcp_pkt(Packet *ppkt, Packet *spkt,
                               int8_t *mark, uint32_t max_ack)
@@ -397,7 +578,7 @@ static bool colo_mark_tcp_pkt(Packet *ppkt, Packet *spkt,
     return false;
 }
 
-static void colo_compare_tcp(CompareState *s, Connection *conn)
+static void colo_compare_tcp(CompareShard *shard, Connection *conn)
 {
     Packet *ppkt = NULL, *spkt = NULL;
     int8_t mark;
@@ -428,13 +609,13 @@ sec:
     spkt = g_queue_pop_head(&conn->secondary_list);
 
     if (ppkt->tcp_seq == ppkt->seq_end) {
-        colo_release_primary_pkt(s, ppkt);
+        colo_release_primary_pkt(shard, ppkt);
         ppkt = NULL;
     }
 
     if (ppkt && conn->compare_seq && !after(ppkt->seq_end, conn->compare_seq)) {
         trace_colo_compare_main("pri: this packet has compared");
-        colo_release_primary_pkt(s, ppkt);
+        colo_release_primary_pkt(shard, ppkt);
         ppkt = NULL;
     }
 
@@ -474,7 +655,7 @@ sec:
 
         if (mark == COLO_COMPARE_FREE_PRIMARY) {
             conn->compare_seq = ppkt->seq_end;
-            colo_release_primary_pkt(s, ppkt);
+            colo_release_primary_pkt(shard, ppkt);
             g_queue_push_head(&conn->secondary_list, spkt);
             goto pri;
         }
@@ -485,7 +666,7 @@ sec:
         }
         if (mark == (COLO_COMPARE_FREE_PRIMARY | COLO_COMPARE_FREE_SECONDARY)) {
             conn->compare_seq = ppkt->seq_end;
-            colo_release_primary_pkt(s, ppkt);
+            colo_release_primary_pkt(shard, ppkt);
             packet_destroy(spkt, NULL);
             goto pri;
         }
@@ -500,7 +681,7 @@ sec:
                         "colo-compare spkt", spkt->size);
         }
 
-        colo_compare_inconsistency_notify(s);
+        colo_compare_shard_inconsistent(shard);
     }
 }
 
@@ -650,13 +831,7 @@ static int colo_old_packet_check_one_conn(Connection *conn,
                                  &s->compare_timeout,
                                  (GCompareFunc)colo_old_packet_check_one);
 
-    if (result) {
-        /* Do checkpoint will flush old packet */
-        colo_compare_inconsistency_notify(s);
-        return 0;
-    }
-
-    return 1;
+    return result ? 0 : 1;
 }
 
 /*
@@ -667,16 +842,84 @@ static int colo_old_packet_check_one_conn(Connection *conn,
 static void colo_old_packet_check(void *opaque)
 {
     CompareState *s = opaque;
+    GList *result = NULL;
+    uint32_t i;
 
     /*
      * If we find one old packet, stop finding job and notify
      * COLO frame do checkpoint.
      */
-    g_queue_find_custom(&s->conn_list, s,
-                        (GCompareFunc)colo_old_packet_check_one_conn);
+    for (i = 0; i < s->compare_threads && !result; i++) {
+        CompareShard *shard = &s->shards[i];
+
+        qemu_mutex_lock(&shard->lock);
+        result = g_queue_find_custom(&shard->conn_list, s,
+                                (GCompareFunc)colo_old_packet_check_one_conn);
+        qemu_mutex_unlock(&shard->lock);
+    }
+
+    if (result) {
+        /* Do checkpoint will flush old packet */
+        colo_compare_inconsistency_notify(s);
+    }
+}
+
+/*
+ * Hash of the part of @pkt from @offset on; the result is kept in
+ * the packet so that it is computed once for a given offset.
+ */
+static uint32_t colo_packet_hash(Packet *pkt, uint16_t offset)
+{
+    if (!pkt->has_hash || pkt->hash_offset != offset) {
+        pkt->hash = crc32c(0xffffffff, (uint8_t *)pkt->data + offset,
+                           pkt->size > offset ? pkt->size - offset : 0);
+        pkt->hash_offset = offset;
+        pkt->has_hash = true;
+    }
+    return pkt->hash;
+}
+
+/*
+ * Find the secondary packet that matches @ppkt.  Each HandlePacket
+ * function compares packets of the same size from the same offset of
+ * the primary packet on, which is the part that is hashed here.
+ */
+static GList *colo_find_secondary_pkt(Connection *conn, Packet *ppkt,
+                                      int (*HandlePacket)(Packet *spkt,
+                                      Packet *ppkt))
+{
+    GList *result = conn->secondary_list.head;
+    uint16_t offset = ppkt->vnet_hdr_len;
+    uint32_t hash;
+
+    /* Usually the secondary sends its packets in the same order */
+    if (!HandlePacket(result->data, ppkt)) {
+        return result;
+    }
+
+    /*
+     * Otherwise compare hashes first, so that the payload of each
+     * secondary packet is read once rather than once per primary
+     * packet that is looked up.
+     */
+    if (conn->ip_proto == IPPROTO_UDP || conn->ip_proto == IPPROTO_ICMP) {
+        offset += (ppkt->ip->ip_hl << 2) + ETH_HLEN;
+    }
+    hash = colo_packet_hash(ppkt, offset);
+
+    for (result = result->next; result; result = result->next) {
+        Packet *spkt = result->data;
+
+        if (spkt->size == ppkt->size &&
+            colo_packet_hash(spkt, offset) == hash &&
+            !HandlePacket(spkt, ppkt)) {
+            return result;
+        }
+    }
+    return NULL;
 }
 
-static void colo_compare_packet(CompareState *s, Connection *conn,
+static void colo_compare_packet(CompareShard *shard, Connection *conn,
                                 int (*HandlePacket)(Packet *spkt,
                                 Packet *ppkt))
 {
@@ -686,11 +929,10 @@ static void colo_compare_packet(CompareState *s, Connection *conn,
     while (!g_queue_is_empty(&conn->primary_list) &&
            !g_queue_is_empty(&conn->secondary_list)) {
         pkt = g_queue_pop_head(&conn->primary_list);
-        result = g_queue_find_custom(&conn->secondary_list,
-                 pkt, (GCompareFunc)HandlePacket);
+        result = colo_find_secondary_pkt(conn, pkt, HandlePacket);
 
         if (result) {
-            colo_release_primary_pkt(s, pkt);
+            colo_release_primary_pkt(shard, pkt);
             g_queue_remove(&conn->secondary_list, result->data);
         } else {
             /*
@@ -702,7 +944,7 @@ static void colo_compare_packet(CompareState *s, Connection *conn,
             trace_colo_compare_main("packet different");
             g_queue_push_head(&conn->primary_list, pkt);
 
-            colo_compare_inconsistency_notify(s);
+            colo_compare_shard_inconsistent(shard);
             break;
         }
     }
@@ -714,23 +956,20 @@ static void colo_compare_packet(CompareState *s, Connection *conn,
  * specified connection when a new packet was
  * queued to it.
  */
-static void colo_compare_connection(void *opaque, void *user_data)
+static void colo_compare_connection(CompareShard *shard, Connection *conn)
 {
-    CompareState *s = user_data;
-    Connection *conn = opaque;
-
     switch (conn->ip_proto) {
     case IPPROTO_TCP:
-        colo_compare_tcp(s, conn);
+        colo_compare_tcp(shard, conn);
         break;
     case IPPROTO_UDP:
-        colo_compare_packet(s, conn, colo_packet_compare_udp);
+        colo_compare_packet(shard, conn, colo_packet_compare_udp);
         break;
     case IPPROTO_ICMP:
-        colo_compare_packet(s, conn, colo_packet_compare_icmp);
+        colo_compare_packet(shard, conn, colo_packet_compare_icmp);
         break;
     default:
-        colo_compare_packet(s, conn, colo_packet_compare_other);
+        colo_compare_packet(shard, conn, colo_packet_compare_other);
         break;
     }
 }
@@ -958,7 +1197,7 @@ static void colo_compare_timer_del(CompareState *s)
     }
  }
 
-static void colo_flush_packets(void *opaque, void *user_data);
+static void colo_flush_all(CompareState *s);
 
 static void colo_compare_handle_event(void *opaque)
 {
@@ -966,7 +1205,7 @@ static void colo_compare_handle_event(void *opaque)
 
     switch (s->event) {
     case COLO_EVENT_CHECKPOINT:
-        g_queue_foreach(&s->conn_list, colo_flush_packets, s);
+        colo_flush_all(s);
         break;
     case COLO_EVENT_FAILOVER:
         break;
@@ -1001,6 +1240,7 @@ static void colo_compare_iothread(CompareState *s)
 
     colo_compare_timer_init(s);
     s->event_bh = aio_bh_new(ctx, colo_compare_handle_event, s);
+    s->release_bh = aio_bh_new(ctx, colo_compare_release_bh, s);
 }
 
 static char *compare_get_pri_indev(Object *obj, Error **errp)
@@ -1135,6 +1375,40 @@ static void compare_set_expired_scan_cycle(Object *obj, Visitor *v,
     s->expired_scan_cycle = value;
 }
 
+static void compare_get_compare_threads(Object *obj, Visitor *v,
+                                        const char *name, void *opaque,
+                                        Error **errp)
+{
+    CompareState *s = COLO_COMPARE(obj);
+    uint32_t value = s->compare_threads;
+
+    visit_type_uint32(v, name, &value, errp);
+}
+
+static void compare_set_compare_threads(Object *obj, Visitor *v,
+                                        const char *name, void *opaque,
+                                        Error **errp)
+{
+    CompareState *s = COLO_COMPARE(obj);
+    uint32_t value;
+
+    /* Connections are already hashed over the shards */
+    if (s->shards) {
+        error_setg(errp, "Property '%s.%s' can't be changed once the object "
+                   "is created", object_get_typename(obj), name);
+        return;
+    }
+    if (!visit_type_uint32(v, name, &value, errp)) {
+        return;
+    }
+    if (!value || value > MAX_COMPARE_THREADS) {
+        error_setg(errp, "Property '%s.%s' requires a value between 1 and %d",
+                   object_get_typename(obj), name, MAX_COMPARE_THREADS);
+        return;
+    }
+    s->compare_threads = value;
+}
+
 static void get_max_queue_size(Object *obj, Visitor *v,
                                const char *name, void *opaque,
                                Error **errp)
@@ -1169,9 +1443,8 @@ out:
 static void compare_pri_rs_finalize(SocketReadState *pri_rs)
 {
     CompareState *s = container_of(pri_rs, CompareState, pri_rs);
-    Connection *conn = NULL;
 
-    if (packet_enqueue(s, PRIMARY_IN, &conn)) {
+    if (packet_enqueue(s, PRIMARY_IN)) {
         trace_colo_compare_main("primary: unsupported packet in");
         compare_chr_send(s,
                          pri_rs->buf,
@@ -1179,22 +1452,15 @@ static void compare_pri_rs_finalize(SocketReadState *pri_rs)
                          pri_rs->vnet_hdr_len,
                          false,
                          false);
-    } else {
-        /* compare packet in the specified connection */
-        colo_compare_connection(conn, s);
     }
 }
 
 static void compare_sec_rs_finalize(SocketReadState *sec_rs)
 {
     CompareState *s = container_of(sec_rs, CompareState, sec_rs);
-    Connection *conn = NULL;
 
-    if (packet_enqueue(s, SECONDARY_IN, &conn)) {
+    if (packet_enqueue(s, SECONDARY_IN)) {
         trace_colo_compare_main("secondary: unsupported packet in");
-    } else {
-        /* compare packet in the specified connection */
-        colo_compare_connection(conn, s);
     }
 }
 
@@ -1216,7 +1482,7 @@ static void compare_notify_rs_finalize(SocketReadState *notify_rs)
                                   notify_rs->buf,
                                   notify_rs->packet_len)) {
         /* colo-compare do checkpoint, flush pri packet and remove sec packet */
-        g_queue_foreach(&s->conn_list, colo_flush_packets, s);
+        colo_flush_all(s);
     } else {
         error_report("COLO compare got unsupported instruction");
     }
@@ -1260,6 +1526,7 @@ static void colo_compare_complete(UserCreatable *uc, Error **errp)
 {
     CompareState *s = COLO_COMPARE(uc);
     Chardev *chr;
+    uint32_t i;
 
     if (!s->pri_indev || !s->sec_indev || !s->outdev || !s->iothread) {
         error_setg(errp, "colo compare needs 'primary_in' ,"
@@ -1288,6 +1555,11 @@ static void colo_compare_complete(UserCreatable *uc, Error **errp)
         max_queue_size = MAX_QUEUE_SIZE;
     }
 
+    if (!s->compare_threads) {
+        /* Compare in the iothread by default */
+        s->compare_threads = 1;
+    }
+
     if (find_and_check_chardev(&chr, s->pri_indev, errp) ||
         !qemu_chr_fe_init(&s->chr_pri_in, chr, errp)) {
         return;
@@ -1331,15 +1603,35 @@ static void colo_compare_complete(UserCreatable *uc, Error **errp)
         g_queue_init(&s->notify_sendco.send_list);
     }
 
-    g_queue_init(&s->conn_list);
+    s->shards = g_new0(CompareShard, s->compare_threads);
+    for (i = 0; i < s->compare_threads; i++) {
+        CompareShard *shard = &s->shards[i];
 
-    s->connection_track_table = g_hash_table_new_full(connection_key_hash,
-                                                      connection_key_equal,
-                                                      g_free,
-                                                      connection_destroy);
+        shard->s = s;
+        qemu_mutex_init(&shard->lock);
+        g_queue_init(&shard->conn_list);
+        shard->connection_track_table =
+            g_hash_table_new_full(connection_key_hash,
+                                  connection_key_equal,
+                                  g_free,
+                                  connection_destroy);
+        qemu_mutex_init(&shard->queue_lock);
+        qemu_cond_init(&shard->queue_cond);
+        g_queue_init(&shard->pri_pending);
+        g_queue_init(&shard->sec_pending);
+        g_queue_init(&shard->release);
+    }
 
     colo_compare_iothread(s);
 
+    if (s->compare_threads > 1) {
+        for (i = 0; i < s->compare_threads; i++) {
+            qemu_thread_create(&s->shards[i].thread, "colo-compare",
+                               colo_compare_worker, &s->shards[i],
+                               QEMU_THREAD_JOINABLE);
+        }
+    }
+
     qemu_mutex_lock(&colo_compare_mutex);
     if (!colo_compare_active) {
         qemu_mutex_init(&event_mtx);
@@ -1374,6 +1666,47 @@ static void colo_flush_packets(void *opaque, void *user_data)
     }
 }
 
+/*
+ * Send out all the primary packets of @shard, including those not
+ * compared yet, and drop the secondary ones.
+ */
+static void colo_flush_shard(CompareState *s, CompareShard *shard)
+{
+    Packet *pkt;
+
+    qemu_mutex_lock(&shard->lock);
+
+    /* What was released comes first; the flush takes care of the rest */
+    colo_compare_release_shard(s, shard);
+    g_queue_foreach(&shard->conn_list, colo_flush_packets, s);
+
+    qemu_mutex_lock(&shard->queue_lock);
+    while ((pkt = g_queue_pop_head(&shard->pri_pending))) {
+        compare_chr_send(s,
+                         pkt->data,
+                         pkt->size,
+                         pkt->vnet_hdr_len,
+                         false,
+                         true);
+        packet_destroy_partial(pkt, NULL);
+    }
+    while ((pkt = g_queue_pop_head(&shard->sec_pending))) {
+        packet_destroy(pkt, NULL);
+    }
+    qemu_mutex_unlock(&shard->queue_lock);
+
+    qemu_mutex_unlock(&shard->lock);
+}
+
+static void colo_flush_all(CompareState *s)
+{
+    uint32_t i;
+
+    for (i = 0; i < s->compare_threads; i++) {
+        colo_flush_shard(s, &s->shards[i]);
+    }
+}
+
 static void colo_compare_class_init(ObjectClass *oc, void *data)
 {
     UserCreatableClass *ucc = USER_CREATABLE_CLASS(oc);
@@ -1411,6 +1744,10 @@ static void colo_compare_init(Object *obj)
                         get_max_queue_size,
                         set_max_queue_size, NULL, NULL);
 
+    object_property_add(obj, "compare_threads", "uint32",
+                        compare_get_compare_threads,
+                        compare_set_compare_threads, NULL, NULL);
+
     s->vnet_hdr = false;
     object_property_add_bool(obj, "vnet_hdr_support", compare_get_vnet_hdr,
                              compare_set_vnet_hdr);
@@ -1420,6 +1757,7 @@ static void colo_compare_finalize(Object *obj)
 {
     CompareState *s = COLO_COMPARE(obj);
     CompareState *tmp = NULL;
+    uint32_t i;
 
     qemu_mutex_lock(&colo_compare_mutex);
     QTAILQ_FOREACH(tmp, &net_compares, next) {
@@ -1444,7 +1782,20 @@ static void colo_compare_finalize(Object *obj)
 
     colo_compare_timer_del(s);
 
+    if (s->shards && s->compare_threads > 1) {
+        for (i = 0; i < s->compare_threads; i++) {
+            CompareShard *shard = &s->shards[i];
+
+            qemu_mutex_lock(&shard->queue_lock);
+            shard->quit = true;
+            qemu_cond_signal(&shard->queue_cond);
+            qemu_mutex_unlock(&shard->queue_lock);
+            qemu_thread_join(&shard->thread);
+        }
+    }
+
     qemu_bh_delete(s->event_bh);
+    qemu_bh_delete(s->release_bh);
 
     AioContext *ctx = iothread_get_aio_context(s->iothread);
     aio_context_acquire(ctx);
@@ -1455,18 +1806,26 @@ static void colo_compare_finalize(Object *obj)
     aio_context_release(ctx);
 
     /* Release all unhandled packets after compare thead exited */
-    g_queue_foreach(&s->conn_list, colo_flush_packets, s);
+    if (s->shards) {
+        colo_flush_all(s);
+    }
     AIO_WAIT_WHILE(NULL, !s->out_sendco.done);
 
-    g_queue_clear(&s->conn_list);
     g_queue_clear(&s->out_sendco.send_list);
     if (s->notify_dev) {
         g_queue_clear(&s->notify_sendco.send_list);
     }
 
-    if (s->connection_track_table) {
-        g_hash_table_destroy(s->connection_track_table);
+    for (i = 0; s->shards && i < s->compare_threads; i++) {
+        CompareShard *shard = &s->shards[i];
+
+        g_queue_clear(&shard->conn_list);
+        g_hash_table_destroy(shard->connection_track_table);
+        qemu_mutex_destroy(&shard->lock);
+        qemu_mutex_destroy(&shard->queue_lock);
+        qemu_cond_destroy(&shard->queue_cond);
     }
+    g_free(s->shards);
 
     object_unref(OBJECT(s->iothread));
 
@@ -141,6 +141,7 @@ Connection *connection_new(ConnectionKey *key)
     conn->tcp_state = TCPS_CLOSED;
     conn->pack = 0;
     conn->sack = 0;
+    conn->compare_seq = 0;
     g_queue_init(&conn->primary_list);
     g_queue_init(&conn->secondary_list);
 
@@ -173,6 +174,8 @@ Packet *packet_new(const void *data, int size, int vnet_hdr_len)
     pkt->payload_size = 0;
     pkt->offset = 0;
     pkt->flags = 0;
+    pkt->hash = 0;
+    pkt->has_hash = false;
 
     return pkt;
 }
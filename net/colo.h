@@ -54,6 +54,10 @@ typedef struct Packet {
     /* record the payload offset(the length that has been compared) */
     uint16_t offset;
     uint8_t flags; /* Flags(aka Control bits) */
+    /* crc32c of the packet from hash_offset on, valid if has_hash */
+    uint32_t hash;
+    uint16_t hash_offset;
+    bool has_hash;
 } Packet;
 
 typedef struct ConnectionKey {
@@ -25,33 +25,52 @@
 #include "qemu/osdep.h"
 #include "qemu-common.h"
 #include "qemu/thread.h"
+#include "qemu/units.h"
+#include "exec/target_page.h"
 #include "hw/core/cpu.h"
 #include "qemu/main-loop.h"
 #include "sysemu/cpus.h"
 #include "sysemu/cpu-throttle.h"
+#include "trace-root.h"
 
 /* vcpu throttling controls */
 static QEMUTimer *throttle_timer;
 static unsigned int throttle_percentage;
+/* Time of the previous per-vCPU dirty rate sample, or 0 if none */
+static int64_t dirty_limit_stamp;
 
 #define CPU_THROTTLE_PCT_MIN 1
 #define CPU_THROTTLE_PCT_MAX 99
 #define CPU_THROTTLE_TIMESLICE_NS 10000000
 
+/*
+ * Each vCPU is throttled by the larger of the global percentage and its
+ * own, set by the dirty rate limit.
+ */
+static int cpu_throttle_vcpu_effective(CPUState *cpu)
+{
+    return MAX(cpu_throttle_get_percentage(),
+               atomic_read(&cpu->throttle_percentage));
+}
+
 static void cpu_throttle_thread(CPUState *cpu, run_on_cpu_data opaque)
 {
+    int64_t period_ns = opaque.host_ulong;
     double pct;
-    double throttle_ratio;
     int64_t sleeptime_ns, endtime_ns;
 
-    if (!cpu_throttle_get_percentage()) {
+    pct = (double)cpu_throttle_vcpu_effective(cpu) / 100;
+    if (!pct) {
+        atomic_set(&cpu->throttle_thread_scheduled, 0);
         return;
     }
 
-    pct = (double)cpu_throttle_get_percentage() / 100;
-    throttle_ratio = pct / (1 - pct);
-    /* Add 1ns to fix double's rounding error (like 0.9999999...) */
-    sleeptime_ns = (int64_t)(throttle_ratio * CPU_THROTTLE_TIMESLICE_NS + 1);
+    /*
+     * Sleep for pct of the timer period; with a single percentage this
+     * is the usual pct / (1 - pct) timeslices.  Add 1ns to fix double's
+     * rounding error (like 0.9999999...)
+     */
+    sleeptime_ns = (int64_t)(pct * period_ns + 1);
     endtime_ns = qemu_clock_get_ns(QEMU_CLOCK_REALTIME) + sleeptime_ns;
     while (sleeptime_ns > 0 && !cpu->stop) {
         if (sleeptime_ns > SCALE_MS) {
@@ -70,22 +89,30 @@ static void cpu_throttle_thread(CPUState *cpu, run_on_cpu_data opaque)
 static void cpu_throttle_timer_tick(void *opaque)
 {
     CPUState *cpu;
-    double pct;
+    int pct_max = 0;
+    int64_t period_ns;
+
+    CPU_FOREACH(cpu) {
+        pct_max = MAX(pct_max, cpu_throttle_vcpu_effective(cpu));
+    }
 
     /* Stop the timer if needed */
-    if (!cpu_throttle_get_percentage()) {
+    if (!pct_max) {
         return;
     }
+
+    /* The most throttled vCPU still gets a full timeslice per period */
+    period_ns = CPU_THROTTLE_TIMESLICE_NS / (1 - (double)pct_max / 100);
     CPU_FOREACH(cpu) {
-        if (!atomic_xchg(&cpu->throttle_thread_scheduled, 1)) {
+        if (cpu_throttle_vcpu_effective(cpu) &&
+            !atomic_xchg(&cpu->throttle_thread_scheduled, 1)) {
             async_run_on_cpu(cpu, cpu_throttle_thread,
-                             RUN_ON_CPU_NULL);
+                             RUN_ON_CPU_HOST_ULONG(period_ns));
         }
     }
 
-    pct = (double)cpu_throttle_get_percentage() / 100;
     timer_mod(throttle_timer, qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL_RT) +
-                                   CPU_THROTTLE_TIMESLICE_NS / (1 - pct));
+                                   period_ns);
 }
 
 void cpu_throttle_set(int new_throttle_pct)
@@ -100,9 +127,97 @@ void cpu_throttle_set(int new_throttle_pct)
                                        CPU_THROTTLE_TIMESLICE_NS);
 }
 
+void cpu_throttle_set_vcpu(CPUState *cpu, int new_throttle_pct)
+{
+    if (new_throttle_pct > 0) {
+        new_throttle_pct = MIN(new_throttle_pct, CPU_THROTTLE_PCT_MAX);
+        new_throttle_pct = MAX(new_throttle_pct, CPU_THROTTLE_PCT_MIN);
+    } else {
+        new_throttle_pct = 0;
+    }
+
+    atomic_set(&cpu->throttle_percentage, new_throttle_pct);
+
+    /* Do not delay the vCPUs that are already being throttled */
+    if (new_throttle_pct && !timer_pending(throttle_timer)) {
+        timer_mod(throttle_timer, qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL_RT) +
+                                           CPU_THROTTLE_TIMESLICE_NS);
+    }
+}
+
+int cpu_throttle_get_vcpu_percentage(CPUState *cpu)
+{
+    return atomic_read(&cpu->throttle_percentage);
+}
+
+bool cpu_throttle_vcpu_active(void)
+{
+    CPUState *cpu;
+
+    CPU_FOREACH(cpu) {
+        if (cpu_throttle_get_vcpu_percentage(cpu)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void cpu_throttle_dirty_limit(uint64_t quota_mbps, int max_pct)
+{
+    int64_t now = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+    int64_t period_ns = now - dirty_limit_stamp;
+    bool first = !dirty_limit_stamp;
+    CPUState *cpu;
+
+    dirty_limit_stamp = now;
+
+    CPU_FOREACH(cpu) {
+        uint64_t pages = cpu->dirty_pages - cpu->dirty_pages_sampled;
+        double rate;
+        int pct;
+
+        cpu->dirty_pages_sampled = cpu->dirty_pages;
+        if (first || period_ns <= 0) {
+            continue;
+        }
+
+        rate = (double)pages * qemu_target_page_size() / MiB *
+               NANOSECONDS_PER_SECOND / period_ns;
+        pct = cpu_throttle_get_vcpu_percentage(cpu);
+
+        /*
+         * The vCPU ran for (100 - pct)% of the period and dirtied @rate;
+         * let it run only as much as dirties @quota_mbps.  This raises the
+         * throttle of the vCPUs above the quota and lowers it, down to
+         * nothing, for those below.
+         */
+        if (rate) {
+            /*
+             * Compute in double and clamp before converting back, so that
+             * a large quota or a tiny rate cannot overflow.
+             */
+            double run = (100 - pct) * (double)quota_mbps / rate;
+
+            pct = run >= 100 ? 0 : MIN(100 - (int)run, max_pct);
+        } else {
+            pct = 0;
+        }
+
+        trace_cpu_throttle_dirty_limit(cpu->cpu_index, (uint64_t)rate, pct);
+        cpu_throttle_set_vcpu(cpu, pct);
+    }
+}
+
 void cpu_throttle_stop(void)
 {
+    CPUState *cpu;
+
     atomic_set(&throttle_percentage, 0);
+
+    CPU_FOREACH(cpu) {
+        atomic_set(&cpu->throttle_percentage, 0);
+    }
+    dirty_limit_stamp = 0;
 }
 
 bool cpu_throttle_active(void)
@@ -12,6 +12,7 @@
  */
 #include "qemu/osdep.h"
 #include "qemu/units.h"
+#include "qemu/bswap.h"
 #include "crypto/init.h"
 #include "crypto/cipher.h"
 
@@ -160,6 +161,82 @@ static void test_cipher_speed_xts_aes_256(const void *opaque)
                       QCRYPTO_CIPHER_ALG_AES_256);
 }
 
+typedef struct CipherSectorsSpeedData {
+    QCryptoCipherAlgorithm alg;
+    size_t sector_size;
+    size_t nsectors;
+} CipherSectorsSpeedData;
+
+static void test_cipher_speed_sectors(const void *opaque)
+{
+    const CipherSectorsSpeedData *data = opaque;
+    QCryptoCipher *cipher;
+    Error *err = NULL;
+    uint8_t *key = NULL, *ivs = NULL, *buf = NULL;
+    size_t nkey, niv, i;
+    size_t chunk_size = data->sector_size * data->nsectors;
+    const size_t total = 2 * GiB;
+    size_t remain;
+
+    if (!qcrypto_cipher_supports(data->alg, QCRYPTO_CIPHER_MODE_XTS)) {
+        return;
+    }
+
+    nkey = qcrypto_cipher_get_key_len(data->alg) * 2;
+    niv = qcrypto_cipher_get_iv_len(data->alg, QCRYPTO_CIPHER_MODE_XTS);
+
+    key = g_new0(uint8_t, nkey);
+    memset(key, g_test_rand_int(), nkey);
+
+    /* plain64 style IVs: little endian sector number */
+    ivs = g_new0(uint8_t, niv * data->nsectors);
+    for (i = 0; i < data->nsectors; i++) {
+        stq_le_p(ivs + i * niv, i);
+    }
+
+    buf = g_new0(uint8_t, chunk_size);
+    memset(buf, g_test_rand_int(), chunk_size);
+
+    cipher = qcrypto_cipher_new(data->alg, QCRYPTO_CIPHER_MODE_XTS,
+                                key, nkey, &err);
+    g_assert(cipher != NULL);
+
+    g_test_timer_start();
+    remain = total;
+    while (remain >= chunk_size) {
+        g_assert(qcrypto_cipher_encrypt_sectors(cipher, ivs, niv, buf,
+                                                data->sector_size,
+                                                data->nsectors,
+                                                &err) == 0);
+        remain -= chunk_size;
+    }
+    g_test_timer_elapsed();
+
+    g_print("Enc %zu x %zu byte sectors ", data->nsectors, data->sector_size);
+    g_print("%.2f MB/sec ",
+            (double)(total - remain) / MiB / g_test_timer_last());
+
+    g_test_timer_start();
+    remain = total;
+    while (remain >= chunk_size) {
+        g_assert(qcrypto_cipher_decrypt_sectors(cipher, ivs, niv, buf,
+                                                data->sector_size,
+                                                data->nsectors,
+                                                &err) == 0);
+        remain -= chunk_size;
+    }
+    g_test_timer_elapsed();
+
+    g_print("Dec %zu x %zu byte sectors ", data->nsectors, data->sector_size);
+    g_print("%.2f MB/sec ",
+            (double)(total - remain) / MiB / g_test_timer_last());
+
+    qcrypto_cipher_free(cipher);
+    g_free(buf);
+    g_free(ivs);
+    g_free(key);
+}
+
 
 int main(int argc, char **argv)
 {
@@ -200,5 +277,34 @@ int main(int argc, char **argv)
     ADD_TESTS(16384);
     ADD_TESTS(65536);
 
+#define ADD_SECTORS_TEST(keysize, sector, count)                        \
+    if ((!alg || g_str_equal(alg, "xts-sectors")) &&                    \
+        (!size || g_str_equal(size, #sector))) {                        \
+        static const CipherSectorsSpeedData data = {                    \
+            .alg = QCRYPTO_CIPHER_ALG_AES_ ## keysize,                  \
+            .sector_size = sector,                                      \
+            .nsectors = count,                                          \
+        };                                                              \
+        g_test_add_data_func(                                           \
+            "/crypto/cipher/xts-sectors-aes-" #keysize                  \
+            "/sector-" #sector "/count-" #count,                        \
+            &data, test_cipher_speed_sectors);                          \
+    }
+
+#define ADD_SECTORS_TESTS(sector)                       \
+    do {                                                \
+        ADD_SECTORS_TEST(128, sector, 1);               \
+        ADD_SECTORS_TEST(128, sector, 8);               \
+        ADD_SECTORS_TEST(128, sector, 64);              \
+        ADD_SECTORS_TEST(128, sector, 256);             \
+        ADD_SECTORS_TEST(256, sector, 1);               \
+        ADD_SECTORS_TEST(256, sector, 8);               \
+        ADD_SECTORS_TEST(256, sector, 64);              \
+        ADD_SECTORS_TEST(256, sector, 256);             \
+    } while (0)
+
+    ADD_SECTORS_TESTS(512);
+    ADD_SECTORS_TESTS(4096);
+
     return g_test_run();
 }
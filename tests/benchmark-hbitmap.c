@@ -0,0 +1,163 @@
+/*
+ * Hierarchical bitmap speed benchmark
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/units.h"
+#include "qemu/hbitmap.h"
+
+/* A 16 TiB disk tracked at 64 KiB granularity */
+#define BENCH_SIZE          (16 * TiB)
+#define BENCH_GRANULARITY   16
+#define BENCH_CLUSTER       (1ULL << BENCH_GRANULARITY)
+
+typedef struct HBitmapBenchData {
+    const char *name;
+    /* Every @stride bytes, a run of @run bytes is dirtied */
+    uint64_t stride;
+    uint64_t run;
+} HBitmapBenchData;
+
+static const HBitmapBenchData bench_data[] = {
+    { "empty", 0, 0 },
+    { "sparse", 1 * GiB, BENCH_CLUSTER },
+    { "clustered", 4 * GiB, 256 * MiB },
+    { "dense", 128 * MiB, 64 * MiB },
+};
+
+static HBitmap *bench_alloc(const HBitmapBenchData *data)
+{
+    HBitmap *hb = hbitmap_alloc(BENCH_SIZE, BENCH_GRANULARITY);
+    uint64_t offset;
+
+    if (data->stride) {
+        for (offset = 0; offset < BENCH_SIZE; offset += data->stride) {
+            hbitmap_set(hb, offset, MIN(data->run, BENCH_SIZE - offset));
+        }
+    }
+
+    return hb;
+}
+
+static void bench_print(const char *what, double secs)
+{
+    g_print("%s %.3f ms ", what, secs * 1000);
+}
+
+static void test_hbitmap_speed(const void *opaque)
+{
+    const HBitmapBenchData *data = opaque;
+    HBitmap *hb, *hb2, *result;
+    HBitmapIter hbi;
+    uint64_t count = 0, size;
+    int64_t offset, dirty_start, dirty_count;
+    uint8_t *buf;
+
+    g_test_timer_start();
+    hb = bench_alloc(data);
+    bench_print("set", g_test_timer_elapsed());
+
+    g_test_timer_start();
+    hbitmap_iter_init(&hbi, hb, 0);
+    while (hbitmap_iter_next(&hbi) >= 0) {
+        count++;
+    }
+    bench_print("iter", g_test_timer_elapsed());
+    g_assert_cmpint(count << BENCH_GRANULARITY, ==, hbitmap_count(hb));
+
+    g_test_timer_start();
+    for (offset = 0;
+         hbitmap_next_dirty_area(hb, offset, BENCH_SIZE, INT64_MAX,
+                                 &dirty_start, &dirty_count);
+         offset = dirty_start + dirty_count) {
+        /* nothing */
+    }
+    bench_print("dirty-area", g_test_timer_elapsed());
+
+    g_test_timer_start();
+    offset = 0;
+    while (offset >= 0 && offset < BENCH_SIZE) {
+        offset = hbitmap_next_zero(hb, offset, BENCH_SIZE - offset);
+        if (offset >= 0) {
+            offset = hbitmap_next_dirty(hb, offset, BENCH_SIZE - offset);
+        }
+    }
+    bench_print("next-zero", g_test_timer_elapsed());
+
+    hb2 = bench_alloc(data);
+    result = hbitmap_alloc(BENCH_SIZE, BENCH_GRANULARITY);
+    g_test_timer_start();
+    hbitmap_merge(hb, hb2, result);
+    bench_print("merge", g_test_timer_elapsed());
+
+    size = hbitmap_serialization_size(hb, 0, BENCH_SIZE);
+    buf = g_malloc(size);
+    g_test_timer_start();
+    hbitmap_serialize_part(hb, buf, 0, BENCH_SIZE);
+    bench_print("serialize", g_test_timer_elapsed());
+
+    g_test_timer_start();
+    hbitmap_deserialize_part(hb2, buf, 0, BENCH_SIZE, true);
+    bench_print("deserialize", g_test_timer_elapsed());
+
+    g_test_timer_start();
+    hbitmap_reset_all(hb);
+    bench_print("reset-all", g_test_timer_elapsed());
+
+    g_free(buf);
+    hbitmap_free(result);
+    hbitmap_free(hb2);
+    hbitmap_free(hb);
+}
+
+/*
+ * Time the word scan and merge kernels on fully populated bitmaps, once
+ * per available implementation, from most to least preferred.
+ */
+static void test_hbitmap_kernels_speed(void)
+{
+    HBitmap *a = hbitmap_alloc(BENCH_SIZE, BENCH_GRANULARITY);
+    HBitmap *b = hbitmap_alloc(BENCH_SIZE, BENCH_GRANULARITY);
+    HBitmap *result = hbitmap_alloc(BENCH_SIZE, BENCH_GRANULARITY);
+    unsigned accel = 0;
+
+    hbitmap_set(a, 0, BENCH_SIZE);
+    hbitmap_set(b, 0, BENCH_SIZE);
+
+    do {
+        g_print("\naccel %u: ", accel++);
+
+        g_test_timer_start();
+        g_assert_cmpint(hbitmap_next_zero(a, 0, BENCH_SIZE), ==, -1);
+        bench_print("scan", g_test_timer_elapsed());
+
+        g_test_timer_start();
+        hbitmap_merge(a, b, result);
+        bench_print("merge", g_test_timer_elapsed());
+    } while (test_hbitmap_next_accel());
+
+    hbitmap_free(result);
+    hbitmap_free(b);
+    hbitmap_free(a);
+}
+
+int main(int argc, char **argv)
+{
+    size_t i;
+
+    g_test_init(&argc, &argv, NULL);
+
+    for (i = 0; i < G_N_ELEMENTS(bench_data); i++) {
+        g_autofree char *path =
+            g_strdup_printf("/hbitmap/speed/%s", bench_data[i].name);
+        g_test_add_data_func(path, &bench_data[i], test_hbitmap_speed);
+    }
+
+    /* Keep this last: it leaves the generic kernels selected */
+    g_test_add_func("/hbitmap/speed/kernels", test_hbitmap_kernels_speed);
+
+    return g_test_run();
+}
@@ -15,6 +15,7 @@
 #include "libqtest.h"
 #include "qapi/error.h"
 #include "qapi/qmp/qdict.h"
+#include "qapi/qmp/qlist.h"
 #include "qemu/module.h"
 #include "qemu/option.h"
 #include "qemu/range.h"
@@ -356,6 +357,23 @@ static void migrate_set_parameter_int(QTestState *who, const char *parameter,
     migrate_check_parameter_int(who, parameter, value);
 }
 
+static void migrate_set_parameter_bool(QTestState *who, const char *parameter,
+                                       bool value)
+{
+    QDict *rsp;
+
+    rsp = qtest_qmp(who,
+                    "{ 'execute': 'migrate-set-parameters',"
+                    "'arguments': { %s: %i } }",
+                    parameter, value);
+    g_assert(qdict_haskey(rsp, "return"));
+    qobject_unref(rsp);
+
+    rsp = wait_command(who, "{ 'execute': 'query-migrate-parameters' }");
+    g_assert(qdict_get_bool(rsp, parameter) == value);
+    qobject_unref(rsp);
+}
+
 static char *migrate_get_parameter_str(QTestState *who,
                                        const char *parameter)
 {
@@ -465,6 +483,12 @@ typedef struct {
     bool use_shmem;
     /* only launch the target process */
     bool only_target;
+    /* send requested pages on a separate channel during postcopy */
+    bool postcopy_preempt;
+    /* request pages following each postcopy fault */
+    bool postcopy_prefetch;
+    /* give the source KVM dirty rings, if the host supports them */
+    bool use_dirty_ring;
     char *opts_source;
     char *opts_target;
 } MigrateStart;
@@ -571,11 +595,13 @@ static int test_migrate_start(QTestState **from, QTestState **to,
         shmem_opts = g_strdup("");
     }
 
-    cmd_source = g_strdup_printf("-accel kvm -accel tcg%s%s "
+    cmd_source = g_strdup_printf("-accel kvm%s -accel tcg%s%s "
                                  "-name source,debug-threads=on "
                                  "-m %s "
                                  "-serial file:%s/src_serial "
                                  "%s %s %s %s",
+                                 args->use_dirty_ring ?
+                                 ",dirty-ring-size=4096" : "",
                                  machine_opts ? " -machine " : "",
                                  machine_opts ? machine_opts : "",
                                  memory_size, tmpfs,
@@ -703,6 +729,8 @@ static int migrate_postcopy_prepare(QTestState **from_ptr,
                                     MigrateStart *args)
 {
     char *uri = g_strdup_printf("unix:%s/migsocket", tmpfs);
+    bool postcopy_preempt = args->postcopy_preempt;
+    bool postcopy_prefetch = args->postcopy_prefetch;
     QTestState *from, *to;
 
     if (test_migrate_start(&from, &to, uri, args)) {
@@ -712,6 +740,14 @@ static int migrate_postcopy_prepare(QTestState **from_ptr,
     migrate_set_capability(from, "postcopy-ram", true);
     migrate_set_capability(to, "postcopy-ram", true);
     migrate_set_capability(to, "postcopy-blocktime", true);
+    if (postcopy_preempt) {
+        migrate_set_capability(from, "postcopy-preempt", true);
+        migrate_set_capability(to, "postcopy-preempt", true);
+    }
+    if (postcopy_prefetch) {
+        migrate_set_parameter_int(to, "postcopy-prefetch-window", 16);
+        migrate_set_parameter_bool(to, "postcopy-prefetch-stride", true);
+    }
 
     /* We want to pick a speed slow enough that the test completes
      * quickly, but that it doesn't complete precopy even on a slow
@@ -760,6 +796,32 @@ static void test_postcopy(void)
     migrate_postcopy_complete(from, to);
 }
 
+static void test_postcopy_preempt(void)
+{
+    MigrateStart *args = migrate_start_new();
+    QTestState *from, *to;
+
+    args->postcopy_preempt = true;
+    if (migrate_postcopy_prepare(&from, &to, args)) {
+        return;
+    }
+    migrate_postcopy_start(from, to);
+    migrate_postcopy_complete(from, to);
+}
+
+static void test_postcopy_prefetch(void)
+{
+    MigrateStart *args = migrate_start_new();
+    QTestState *from, *to;
+
+    args->postcopy_prefetch = true;
+    if (migrate_postcopy_prepare(&from, &to, args)) {
+        return;
+    }
+    migrate_postcopy_start(from, to);
+    migrate_postcopy_complete(from, to);
+}
+
 static void test_postcopy_recovery(void)
 {
     MigrateStart *args = migrate_start_new();
@@ -838,6 +900,115 @@ static void test_baddest(void)
     test_migrate_end(from, to, false);
 }
 
+static void do_test_dirty_rate(MigrateStart *args, const char *mode)
+{
+    QTestState *from, *to;
+    QDict *rsp;
+    const char *status;
+
+    if (test_migrate_start(&from, &to, "defer", args)) {
+        return;
+    }
+
+    /* Wait for the guest to start dirtying its memory */
+    wait_for_serial("src_serial");
+
+    rsp = qtest_qmp(from, "{ 'execute': 'calc-dirty-rate',"
+                          "  'arguments': { 'calc-time': 1, 'mode': %s }}",
+                    mode);
+    if (qdict_haskey(rsp, "error")) {
+        /* Only the dirty ring can be missing, with TCG or an old kernel */
+        g_assert_cmpstr(mode, ==, "dirty-ring");
+        g_test_message("Skipping test: KVM dirty ring not available");
+        qobject_unref(rsp);
+        test_migrate_end(from, to, false);
+        return;
+    }
+    qobject_unref(rsp);
+
+    do {
+        g_usleep(100 * 1000);
+        rsp = wait_command(from, "{ 'execute': 'query-dirty-rate' }");
+        status = qdict_get_str(rsp, "status");
+        if (strcmp(status, "measured")) {
+            g_assert_cmpstr(status, ==, "measuring");
+            qobject_unref(rsp);
+            rsp = NULL;
+        }
+    } while (!rsp);
+
+    /* The guest writes to all of its memory in a loop */
+    g_assert_cmpint(qdict_get_int(rsp, "calc-time"), ==, 1);
+    g_assert_cmpint(qdict_get_int(rsp, "dirty-rate"), >, 0);
+    g_assert_cmpstr(qdict_get_str(rsp, "mode"), ==, mode);
+    if (g_str_equal(mode, "dirty-ring")) {
+        QList *vcpus = qdict_get_qlist(rsp, "vcpu-dirty-rate");
+        QDict *vcpu;
+
+        /* The guest only has one vCPU, so it dirties everything */
+        g_assert(vcpus);
+        vcpu = qobject_to(QDict, qlist_peek(vcpus));
+        g_assert_cmpint(qdict_get_int(vcpu, "id"), ==, 0);
+        g_assert_cmpint(qdict_get_int(vcpu, "dirty-rate"), ==,
+                        qdict_get_int(rsp, "dirty-rate"));
+    } else {
+        g_assert(!qdict_haskey(rsp, "vcpu-dirty-rate"));
+    }
+    qobject_unref(rsp);
+
+    test_migrate_end(from, to, false);
+}
+
+static void test_dirty_rate(void)
+{
+    MigrateStart *args = migrate_start_new();
+
+    do_test_dirty_rate(args, "page-sampling");
+}
+
+static void test_dirty_rate_dirty_ring(void)
+{
+    MigrateStart *args = migrate_start_new();
+
+    args->use_dirty_ring = true;
+    do_test_dirty_rate(args, "dirty-ring");
+}
+
+/*
+ * Check that the phases of the switchover seen from @who were timed.
+ */
+static void check_downtime_breakdown(QTestState *who, bool source)
+{
+    QDict *rsp = wait_command(who, "{ 'execute': 'query-migrate' }");
+    QDict *dt = qdict_get_qdict(rsp, "downtime-breakdown");
+
+    g_assert(dt);
+    if (source) {
+        g_assert(qdict_haskey(dt, "vm-stop"));
+        g_assert(qdict_haskey(dt, "iterable"));
+        g_assert(qdict_haskey(dt, "bitmap-sync"));
+        g_assert(qdict_haskey(dt, "non-iterable"));
+        g_assert_cmpint(qdict_get_int(dt, "bitmap-sync"), <=,
+                        qdict_get_int(dt, "iterable"));
+    } else {
+        g_assert(qdict_haskey(dt, "load"));
+        g_assert(qdict_haskey(dt, "vm-start"));
+    }
+    qobject_unref(rsp);
+}
+
+/*
+ * Check that the time spent on the state of each device was reported.
+ */
+static void check_device_state_times(QTestState *who)
+{
+    QDict *rsp = wait_command(who, "{ 'execute': 'query-migrate' }");
+    QList *list = qdict_get_qlist(rsp, "device-state-times");
+
+    g_assert(list && !qlist_empty(list));
+    qobject_unref(rsp);
+}
+
 static void test_precopy_unix(void)
 {
     char *uri = g_strdup_printf("unix:%s/migsocket", tmpfs);
@@ -876,6 +1047,69 @@ static void test_precopy_unix(void)
     wait_for_serial("dest_serial");
     wait_for_migration_complete(from);
 
+    check_downtime_breakdown(from, true);
+    check_downtime_breakdown(to, false);
+    check_device_state_times(from);
+    check_device_state_times(to);
+
+    test_migrate_end(from, to, true);
+    g_free(uri);
+}
+
+/*
+ * Synchronize the dirty bitmap with several threads of the pool that
+ * lives for the whole migration; each pass reuses them.
+ */
+static void test_dirty_sync_threads(void)
+{
+    char *uri = g_strdup_printf("unix:%s/migsocket", tmpfs);
+    MigrateStart *args = migrate_start_new();
+    QTestState *from, *to;
+    QDict *rsp;
+    int i;
+    static const int invalid[] = { 0, 65, 256 };
+
+    if (test_migrate_start(&from, &to, uri, args)) {
+        return;
+    }
+
+    for (i = 0; i < ARRAY_SIZE(invalid); i++) {
+        rsp = qtest_qmp(from,
+                        "{ 'execute': 'migrate-set-parameters',"
+                        "'arguments': { 'dirty-sync-threads': %d } }",
+                        invalid[i]);
+        g_assert(qdict_haskey(rsp, "error"));
+        qobject_unref(rsp);
+        migrate_check_parameter_int(from, "dirty-sync-threads", 4);
+    }
+    migrate_set_parameter_int(from, "dirty-sync-threads", 8);
+
+    /* 1 ms should make it not converge */
+    migrate_set_parameter_int(from, "downtime-limit", 1);
+    /* 1GB/s */
+    migrate_set_parameter_int(from, "max-bandwidth", 1000000000);
+
+    /* Wait for the first serial output from the source */
+    wait_for_serial("src_serial");
+
+    migrate_qmp(from, uri, "{}");
+
+    /* A few passes, each with a sync */
+    wait_for_migration_pass(from);
+    wait_for_migration_pass(from);
+
+    /* 300 ms should converge */
+    migrate_set_parameter_int(from, "downtime-limit", 300);
+
+    if (!got_stop) {
+        qtest_qmp_eventwait(from, "STOP");
+    }
+
+    qtest_qmp_eventwait(to, "RESUME");
+
+    wait_for_serial("dest_serial");
+    wait_for_migration_complete(from);
+
     test_migrate_end(from, to, true);
     g_free(uri);
 }
@@ -970,6 +1204,68 @@ static void test_xbzrle_unix(void)
     g_free(uri);
 }
 
+static void test_compress(const char *method)
+{
+    char *uri = g_strdup_printf("unix:%s/migsocket", tmpfs);
+    MigrateStart *args = migrate_start_new();
+    QTestState *from, *to;
+
+    if (test_migrate_start(&from, &to, uri, args)) {
+        g_free(uri);
+        return;
+    }
+
+    /*
+     * We want to pick a speed slow enough that the test completes
+     * quickly, but that it doesn't complete precopy even on a slow
+     * machine, so also set the downtime.
+     */
+    /* 1 ms should make it not converge*/
+    migrate_set_parameter_int(from, "downtime-limit", 1);
+    /* 1GB/s */
+    migrate_set_parameter_int(from, "max-bandwidth", 1000000000);
+
+    migrate_set_parameter_int(from, "compress-threads", 4);
+    migrate_set_parameter_int(to, "decompress-threads", 2);
+    migrate_set_parameter_str(from, "compress-method", method);
+    migrate_set_parameter_str(to, "compress-method", method);
+
+    migrate_set_capability(from, "compress", "true");
+    migrate_set_capability(to, "compress", "true");
+    /* Wait for the first serial output from the source */
+    wait_for_serial("src_serial");
+
+    migrate_qmp(from, uri, "{}");
+
+    wait_for_migration_pass(from);
+
+    /* 300ms should converge */
+    migrate_set_parameter_int(from, "downtime-limit", 300);
+
+    if (!got_stop) {
+        qtest_qmp_eventwait(from, "STOP");
+    }
+    qtest_qmp_eventwait(to, "RESUME");
+
+    wait_for_serial("dest_serial");
+    wait_for_migration_complete(from);
+
+    test_migrate_end(from, to, true);
+    g_free(uri);
+}
+
+static void test_compress_zlib(void)
+{
+    test_compress("zlib");
+}
+
+#ifdef CONFIG_ZSTD
+static void test_compress_zstd(void)
+{
+    test_compress("zstd");
+}
+#endif
+
 static void test_precopy_tcp(void)
 {
     MigrateStart *args = migrate_start_new();
@@ -1260,7 +1556,7 @@ static void test_migrate_auto_converge(void)
     test_migrate_end(from, to, true);
 }
 
-static void test_multifd_tcp(const char *method)
+static void test_multifd_tcp(const char *method, bool zero_page)
 {
     MigrateStart *args = migrate_start_new();
     QTestState *from, *to;
@@ -1290,6 +1586,11 @@ static void test_multifd_tcp(const char *method)
     migrate_set_capability(from, "multifd", "true");
     migrate_set_capability(to, "multifd", "true");
 
+    if (zero_page) {
+        migrate_set_capability(from, "multifd-zero-page", "true");
+        migrate_set_capability(to, "multifd-zero-page", "true");
+    }
+
     /* Start incoming migration from the 1st socket */
     rsp = wait_command(to, "{ 'execute': 'migrate-incoming',"
                            "  'arguments': { 'uri': 'tcp:127.0.0.1:0' }}");
@@ -1314,24 +1615,198 @@ static void test_multifd_tcp(const char *method)
 
     wait_for_serial("dest_serial");
     wait_for_migration_complete(from);
+
+    test_migrate_end(from, to, true);
+    g_free(uri);
+}
+
+static void test_mapped_ram(bool multifd)
+{
+    MigrateStart *args = migrate_start_new();
+    QTestState *from, *to;
+    QDict *rsp;
+    char *uri = g_strdup_printf("file:%s/migfile", tmpfs);
+
+    if (test_migrate_start(&from, &to, "defer", args)) {
+        return;
+    }
+
+    /*
+     * Let the source go through a few passes, so that some pages are
+     * written more than once at their place in the file.
+     */
+    /* 1 ms should make it not converge*/
+    migrate_set_parameter_int(from, "downtime-limit", 1);
+    /* 1GB/s */
+    migrate_set_parameter_int(from, "max-bandwidth", 1000000000);
+
+    migrate_set_capability(from, "mapped-ram", "true");
+    migrate_set_capability(to, "mapped-ram", "true");
+
+    if (multifd) {
+        migrate_set_parameter_int(from, "multifd-channels", 4);
+        migrate_set_parameter_int(to, "multifd-channels", 4);
+        migrate_set_capability(from, "multifd", "true");
+        migrate_set_capability(to, "multifd", "true");
+        migrate_set_capability(from, "multifd-zero-page", "true");
+    }
+
+    /* Wait for the first serial output from the source */
+    wait_for_serial("src_serial");
+
+    migrate_qmp(from, uri, "{}");
+
+    wait_for_migration_pass(from);
+
+    /* 300ms it should converge */
+    migrate_set_parameter_int(from, "downtime-limit", 300);
+
+    if (!got_stop) {
+        qtest_qmp_eventwait(from, "STOP");
+    }
+    wait_for_migration_complete(from);
+
+    /* The file is complete, restore it */
+    rsp = wait_command(to, "{ 'execute': 'migrate-incoming',"
+                           "  'arguments': { 'uri': %s }}", uri);
+    qobject_unref(rsp);
+    qtest_qmp_eventwait(to, "RESUME");
+
+    wait_for_serial("dest_serial");
+    test_migrate_end(from, to, true);
+    cleanup("migfile");
+    g_free(uri);
+}
+
+static void test_mapped_ram_file(void)
+{
+    test_mapped_ram(false);
+}
+
+static void test_multifd_file_mapped_ram(void)
+{
+    test_mapped_ram(true);
+}
+
+static void test_background_snapshot(void)
+{
+    MigrateStart *args = migrate_start_new();
+    QTestState *from, *to;
+    QDict *rsp;
+    char *uri = g_strdup_printf("file:%s/migfile", tmpfs);
+
+    if (test_migrate_start(&from, &to, "defer", args)) {
+        return;
+    }
+
+    rsp = qtest_qmp(from, "{ 'execute': 'migrate-set-capabilities',"
+                          "'arguments': { 'capabilities': [ {"
+                          "'capability': 'background-snapshot',"
+                          "'state': true } ] } }");
+    if (!qdict_haskey(rsp, "return")) {
+        g_test_message("Skipping test: userfaultfd write-protect "
+                       "not available");
+        qobject_unref(rsp);
+        test_migrate_end(from, to, false);
+        cleanup("migfile");
+        g_free(uri);
+        return;
+    }
+    qobject_unref(rsp);
+
+    /* Wait for the first serial output from the source */
+    wait_for_serial("src_serial");
+
+    migrate_qmp(from, uri, "{}");
+    wait_for_migration_complete(from);
+
+    /* The source only stopped while its device state was saved */
+    rsp = wait_command(from, "{ 'execute': 'query-status' }");
+    g_assert(qdict_get_bool(rsp, "running"));
+    qobject_unref(rsp);
+    /* Writes were tracked with userfaultfd, not the dirty log */
+    g_assert_cmpint(read_ram_property_int(from, "dirty-sync-count"), ==, 0);
+
+    /* Restore the snapshot */
+    rsp = wait_command(to, "{ 'execute': 'migrate-incoming',"
+                           "  'arguments': { 'uri': %s }}", uri);
+    qobject_unref(rsp);
+    qtest_qmp_eventwait(to, "RESUME");
+
+    wait_for_serial("dest_serial");
     test_migrate_end(from, to, true);
+    cleanup("migfile");
     g_free(uri);
 }
 
 static void test_multifd_tcp_none(void)
 {
-    test_multifd_tcp("none");
+    test_multifd_tcp("none", false);
+}
+
+static void test_multifd_tcp_zero_page(void)
+{
+    test_multifd_tcp("none", true);
+}
+
+/*
+ * A destination without multifd-zero-page would not understand the zero
+ * pages in the packets, so the channels must refuse to connect.
+ */
+static void test_multifd_tcp_zero_page_mismatch(void)
+{
+    MigrateStart *args = migrate_start_new();
+    QTestState *from, *to;
+    QDict *rsp;
+    char *uri;
+
+    args->hide_stderr = true;
+    if (test_migrate_start(&from, &to, "defer", args)) {
+        return;
+    }
+
+    migrate_set_parameter_int(from, "multifd-channels", 2);
+    migrate_set_parameter_int(to, "multifd-channels", 2);
+
+    migrate_set_capability(from, "multifd", "true");
+    migrate_set_capability(to, "multifd", "true");
+    migrate_set_capability(from, "multifd-zero-page", "true");
+
+    /* Start incoming migration from the 1st socket */
+    rsp = wait_command(to, "{ 'execute': 'migrate-incoming',"
+                           "  'arguments': { 'uri': 'tcp:127.0.0.1:0' }}");
+    qobject_unref(rsp);
+
+    /* Wait for the first serial output from the source */
+    wait_for_serial("src_serial");
+
+    uri = migrate_get_socket_address(to, "socket-address");
+
+    migrate_qmp(from, uri, "{}");
+
+    /* The destination drops the channels and keeps waiting */
+    wait_for_migration_fail(from, true);
+
+    test_migrate_end(from, to, false);
+    g_free(uri);
 }
 
 static void test_multifd_tcp_zlib(void)
 {
-    test_multifd_tcp("zlib");
+    test_multifd_tcp("zlib", false);
 }
 
 #ifdef CONFIG_ZSTD
 static void test_multifd_tcp_zstd(void)
 {
-    test_multifd_tcp("zstd");
+    test_multifd_tcp("zstd", false);
+}
+#endif
+
+#ifdef CONFIG_LZ4
+static void test_multifd_tcp_lz4(void)
+{
+    test_multifd_tcp("lz4", false);
 }
 #endif
 
@@ -1481,12 +1956,23 @@ int main(int argc, char **argv)
 
     qtest_add_func("/migration/postcopy/unix", test_postcopy);
     qtest_add_func("/migration/postcopy/recovery", test_postcopy_recovery);
+    qtest_add_func("/migration/postcopy/preempt", test_postcopy_preempt);
+    qtest_add_func("/migration/postcopy/prefetch", test_postcopy_prefetch);
     qtest_add_func("/migration/deprecated", test_deprecated);
     qtest_add_func("/migration/bad_dest", test_baddest);
+    qtest_add_func("/migration/dirty_rate", test_dirty_rate);
+    qtest_add_func("/migration/dirty_rate/dirty_ring",
+                   test_dirty_rate_dirty_ring);
     qtest_add_func("/migration/precopy/unix", test_precopy_unix);
     qtest_add_func("/migration/precopy/tcp", test_precopy_tcp);
+    qtest_add_func("/migration/precopy/dirty-sync-threads",
+                   test_dirty_sync_threads);
     /* qtest_add_func("/migration/ignore_shared", test_ignore_shared); */
     qtest_add_func("/migration/xbzrle/unix", test_xbzrle_unix);
+    qtest_add_func("/migration/compress/zlib", test_compress_zlib);
+#ifdef CONFIG_ZSTD
+    qtest_add_func("/migration/compress/zstd", test_compress_zstd);
+#endif
     qtest_add_func("/migration/fd_proto", test_migrate_fd_proto);
     qtest_add_func("/migration/validate_uuid", test_validate_uuid);
     qtest_add_func("/migration/validate_uuid_error", test_validate_uuid_error);
@@ -1496,12 +1982,23 @@ int main(int argc, char **argv)
                    test_validate_uuid_dst_not_set);
 
     qtest_add_func("/migration/auto_converge", test_migrate_auto_converge);
+    qtest_add_func("/migration/mapped-ram/file", test_mapped_ram_file);
+    qtest_add_func("/migration/background-snapshot", test_background_snapshot);
     qtest_add_func("/migration/multifd/tcp/none", test_multifd_tcp_none);
+    qtest_add_func("/migration/multifd/tcp/zero-page",
+                   test_multifd_tcp_zero_page);
+    qtest_add_func("/migration/multifd/tcp/zero-page-mismatch",
+                   test_multifd_tcp_zero_page_mismatch);
     qtest_add_func("/migration/multifd/tcp/cancel", test_multifd_tcp_cancel);
+    qtest_add_func("/migration/multifd/file/mapped-ram",
+                   test_multifd_file_mapped_ram);
     qtest_add_func("/migration/multifd/tcp/zlib", test_multifd_tcp_zlib);
 #ifdef CONFIG_ZSTD
     qtest_add_func("/migration/multifd/tcp/zstd", test_multifd_tcp_zstd);
 #endif
+#ifdef CONFIG_LZ4
+    qtest_add_func("/migration/multifd/tcp/lz4", test_multifd_tcp_lz4);
+#endif
 
     ret = g_test_run();
 
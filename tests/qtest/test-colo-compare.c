@@ -0,0 +1,175 @@
+/*
+ * QTest testcase for colo-compare
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or
+ * later.  See the COPYING file in the top-level directory.
+ *
+ * The test feeds the same TCP segments, one per connection, to the
+ * primary and secondary inputs of colo-compare, and checks that every
+ * primary segment comes out of outdev once it has been compared:
+ *
+ * test side              | qemu side
+ *                        |
+ * +---------+   send     | +--------------+
+ * | pri[0]  +----------->+ primary_in   |
+ * +---------+            | |              |
+ * +---------+   send     | |              |
+ * | sec[0]  +----------->+ secondary_in |
+ * +---------+            | | colo-compare |
+ * +---------+   recv     | |              |
+ * | out[0]  +<-----------+ outdev       |
+ * +---------+            | +--------------+
+ */
+
+#include "qemu/osdep.h"
+#include "qemu-common.h"
+#include "libqtest.h"
+#include "qapi/qmp/qdict.h"
+#include "qemu/bswap.h"
+#include "qemu/iov.h"
+#include "qemu/sockets.h"
+
+#define NR_CONNECTIONS 16
+#define NR_COMPARE_THREADS 4
+
+#define ETH_HDR_LEN 14
+#define IP_HDR_LEN 20
+#define TCP_HDR_LEN 20
+#define FRAME_LEN(payload_len) \
+    (ETH_HDR_LEN + IP_HDR_LEN + TCP_HDR_LEN + (payload_len))
+
+/* Build an Ethernet frame with an IPv4 TCP segment from @sport */
+static size_t build_tcp_frame(uint8_t *buf, uint16_t sport,
+                              const char *payload)
+{
+    size_t payload_len = strlen(payload);
+    uint8_t *ip = buf + ETH_HDR_LEN;
+    uint8_t *tcp = ip + IP_HDR_LEN;
+
+    memset(buf, 0, FRAME_LEN(0));
+
+    /* destination and source MAC, IPv4 */
+    memcpy(buf, "\x52\x54\x00\x12\x34\x56\x52\x54\x00\x12\x34\x57\x08\x00",
+           ETH_HDR_LEN);
+
+    ip[0] = 0x45;
+    stw_be_p(ip + 2, IP_HDR_LEN + TCP_HDR_LEN + payload_len);
+    ip[8] = 64;
+    ip[9] = IPPROTO_TCP;
+    stl_be_p(ip + 12, 0x0a000001);
+    stl_be_p(ip + 16, 0x0a000002);
+
+    stw_be_p(tcp, sport);
+    stw_be_p(tcp + 2, 80);
+    stl_be_p(tcp + 4, 1000);
+    stl_be_p(tcp + 8, 1);
+    tcp[12] = (TCP_HDR_LEN / 4) << 4;
+    tcp[13] = 0x18; /* PSH | ACK */
+    stw_be_p(tcp + 14, 65535);
+
+    memcpy(tcp + TCP_HDR_LEN, payload, payload_len);
+    return FRAME_LEN(payload_len);
+}
+
+static void send_frame(int sock, uint8_t *buf, size_t len)
+{
+    uint32_t size = htonl(len);
+    struct iovec iov[] = {
+        {
+            .iov_base = &size,
+            .iov_len = sizeof(size),
+        }, {
+            .iov_base = buf,
+            .iov_len = len,
+        },
+    };
+    ssize_t ret;
+
+    ret = iov_send(sock, iov, 2, 0, sizeof(size) + len);
+    g_assert_cmpint(ret, ==, sizeof(size) + len);
+}
+
+static void test_compare_threads(void)
+{
+    int pri_sock[2], sec_sock[2], out_sock[2];
+    uint8_t frames[NR_CONNECTIONS][FRAME_LEN(32)];
+    size_t frame_len[NR_CONNECTIONS];
+    bool seen[NR_CONNECTIONS] = { false };
+    char payload[32];
+    QTestState *qts;
+    QDict *rsp;
+    int ret, i;
+
+    ret = socketpair(PF_UNIX, SOCK_STREAM, 0, pri_sock);
+    g_assert_cmpint(ret, !=, -1);
+    ret = socketpair(PF_UNIX, SOCK_STREAM, 0, sec_sock);
+    g_assert_cmpint(ret, !=, -1);
+    ret = socketpair(PF_UNIX, SOCK_STREAM, 0, out_sock);
+    g_assert_cmpint(ret, !=, -1);
+
+    qts = qtest_initf(
+        "-M none "
+        "-chardev socket,id=pri0,fd=%d "
+        "-chardev socket,id=sec0,fd=%d "
+        "-chardev socket,id=out0,fd=%d "
+        "-object iothread,id=iothread0 "
+        "-object colo-compare,id=comp0,primary_in=pri0,secondary_in=sec0,"
+        "outdev=out0,iothread=iothread0,compare_threads=%d",
+        pri_sock[1], sec_sock[1], out_sock[1], NR_COMPARE_THREADS);
+
+    for (i = 0; i < NR_CONNECTIONS; i++) {
+        snprintf(payload, sizeof(payload), "connection %d", i);
+        frame_len[i] = build_tcp_frame(frames[i], 10000 + i, payload);
+    }
+
+    /* The primary segments have to wait for the secondary ones */
+    for (i = 0; i < NR_CONNECTIONS; i++) {
+        send_frame(pri_sock[0], frames[i], frame_len[i]);
+    }
+    for (i = 0; i < NR_CONNECTIONS; i++) {
+        send_frame(sec_sock[0], frames[i], frame_len[i]);
+    }
+
+    /* Connections are compared by different threads, in any order */
+    for (i = 0; i < NR_CONNECTIONS; i++) {
+        uint8_t buf[FRAME_LEN(32)];
+        uint32_t len;
+        int conn;
+
+        ret = qemu_recv(out_sock[0], &len, sizeof(len), MSG_WAITALL);
+        g_assert_cmpint(ret, ==, sizeof(len));
+        len = ntohl(len);
+        g_assert_cmpint(len, <=, sizeof(buf));
+        ret = qemu_recv(out_sock[0], buf, len, MSG_WAITALL);
+        g_assert_cmpint(ret, ==, len);
+
+        conn = lduw_be_p(buf + ETH_HDR_LEN + IP_HDR_LEN) - 10000;
+        g_assert_cmpint(conn, >=, 0);
+        g_assert_cmpint(conn, <, NR_CONNECTIONS);
+        g_assert_false(seen[conn]);
+        seen[conn] = true;
+        g_assert_cmpint(len, ==, frame_len[conn]);
+        g_assert(!memcmp(buf, frames[conn], len));
+    }
+
+    /* The connections are hashed over the shards for good */
+    rsp = qtest_qmp(qts, "{ 'execute': 'qom-set', 'arguments': {"
+                         "  'path': '/objects/comp0',"
+                         "  'property': 'compare_threads', 'value': 8 } }");
+    g_assert(qdict_haskey(rsp, "error"));
+    qobject_unref(rsp);
+
+    close(pri_sock[0]);
+    close(sec_sock[0]);
+    close(out_sock[0]);
+    qtest_quit(qts);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+
+    qtest_add_func("/colo-compare/compare_threads", test_compare_threads);
+
+    return g_test_run();
+}
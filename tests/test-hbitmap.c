@@ -920,6 +920,47 @@ static void test_hbitmap_next_x_after_truncate(TestHBitmapData *data,
     test_hbitmap_next_x_check(data, 0);
 }
 
+static void test_hbitmap_merge_check(void)
+{
+    HBitmap *a = hbitmap_alloc(L3, 0);
+    HBitmap *b = hbitmap_alloc(L3, 0);
+    HBitmap *r = hbitmap_alloc(L3, 0);
+    uint64_t count = 0;
+    int64_t i;
+
+    hbitmap_set(a, L2 - 3, L1 + 7);
+    hbitmap_set(a, L2 * 3, L2);
+    hbitmap_set(b, L2 + 5, L2);
+    hbitmap_set(b, L3 - L1 - 1, L1 + 1);
+
+    g_assert(hbitmap_merge(a, b, r));
+    for (i = 0; i < L3; i++) {
+        g_assert_cmpint(hbitmap_get(r, i), ==,
+                        hbitmap_get(a, i) || hbitmap_get(b, i));
+        count += hbitmap_get(r, i);
+    }
+    g_assert_cmpint(hbitmap_count(r), ==, count);
+
+    g_assert(hbitmap_merge(a, b, a));
+    for (i = 0; i < L3; i++) {
+        g_assert_cmpint(hbitmap_get(a, i), ==, hbitmap_get(r, i));
+    }
+
+    hbitmap_free(a);
+    hbitmap_free(b);
+    hbitmap_free(r);
+}
+
+/* Run the scan and merge checks with each of the vectorized kernels */
+static void test_hbitmap_accel(TestHBitmapData *data, const void *unused)
+{
+    do {
+        test_hbitmap_next_x_do(data, 0);
+        hbitmap_test_teardown(data, NULL);
+        test_hbitmap_merge_check();
+    } while (test_hbitmap_next_accel());
+}
+
 static void test_hbitmap_next_dirty_area_check_limited(TestHBitmapData *data,
                                                        int64_t offset,
                                                        int64_t count,
@@ -1113,6 +1154,9 @@ int main(int argc, char **argv)
     hbitmap_test_add("/hbitmap/next_dirty_area/next_dirty_area_after_truncate",
                      test_hbitmap_next_dirty_area_after_truncate);
 
+    /* Keep this last: it leaves the generic kernels selected */
+    hbitmap_test_add("/hbitmap/accel", test_hbitmap_accel);
+
     g_test_run();
 
     return 0;
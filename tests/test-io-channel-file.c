@@ -92,6 +92,46 @@ static void test_io_channel_fd(void)
 }
 
 
+#ifdef CONFIG_PREADV
+static void test_io_channel_file_prw(void)
+{
+    QIOChannel *ioc;
+    char buf[16];
+    struct iovec iov[2] = {
+        { .iov_base = buf, .iov_len = 3 },
+        { .iov_base = buf + 3, .iov_len = 4 },
+    };
+
+    unlink(TEST_FILE);
+    ioc = QIO_CHANNEL(qio_channel_file_new_path(TEST_FILE,
+                                                O_RDWR | O_CREAT | O_TRUNC,
+                                                0600, &error_abort));
+    g_assert(qio_channel_has_feature(ioc, QIO_CHANNEL_FEATURE_SEEKABLE));
+
+    /* Positioned writes leave holes and don't move the channel offset */
+    g_assert_cmpint(qio_channel_pwrite_all(ioc, "world", 5, 4096,
+                                           &error_abort), ==, 0);
+    g_assert_cmpint(qio_channel_pwrite_all(ioc, "hello", 5, 0,
+                                           &error_abort), ==, 0);
+    g_assert_cmpint(qio_channel_io_seek(ioc, 0, SEEK_CUR, &error_abort),
+                    ==, 0);
+
+    g_assert_cmpint(qio_channel_preadv_all(ioc, iov, 2, 2,
+                                           &error_abort), ==, 0);
+    g_assert(!memcmp(buf, "llo\0\0\0\0", 7));
+    g_assert_cmpint(qio_channel_pread_all(ioc, buf, 5, 4096,
+                                          &error_abort), ==, 0);
+    g_assert(!memcmp(buf, "world", 5));
+
+    /* Reading past the end of the file is an error */
+    g_assert_cmpint(qio_channel_pread_all(ioc, buf, 6, 4096, NULL), ==, -1);
+
+    unlink(TEST_FILE);
+    object_unref(OBJECT(ioc));
+}
+#endif
+
+
 #ifndef _WIN32
 static void test_io_channel_pipe(bool async)
 {
@@ -106,6 +146,7 @@ static void test_io_channel_pipe(bool async)
 
     src = QIO_CHANNEL(qio_channel_file_new_fd(fd[1]));
     dst = QIO_CHANNEL(qio_channel_file_new_fd(fd[0]));
+    g_assert(!qio_channel_has_feature(src, QIO_CHANNEL_FEATURE_SEEKABLE));
 
     test = qio_channel_test_new();
     qio_channel_test_run_threads(test, async, src, dst);
@@ -137,6 +178,9 @@ int main(int argc, char **argv)
     g_test_add_func("/io/channel/file", test_io_channel_file);
     g_test_add_func("/io/channel/file/rdwr", test_io_channel_file_rdwr);
     g_test_add_func("/io/channel/file/fd", test_io_channel_fd);
+#ifdef CONFIG_PREADV
+    g_test_add_func("/io/channel/file/prw", test_io_channel_file_prw);
+#endif
 #ifndef _WIN32
     g_test_add_func("/io/channel/pipe/sync", test_io_channel_pipe_sync);
     g_test_add_func("/io/channel/pipe/async", test_io_channel_pipe_async);
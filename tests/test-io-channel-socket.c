@@ -551,6 +551,68 @@ static void test_io_channel_ipv4_fd(void)
 }
 
 
+static void test_io_channel_ipv4_zero_copy(void)
+{
+    SocketAddress *listen_addr = g_new0(SocketAddress, 1);
+    SocketAddress *connect_addr = g_new0(SocketAddress, 1);
+    QIOChannel *srv, *src, *dst;
+    size_t len = 16 * 1024;
+    g_autofree char *sendbuf = g_malloc(len);
+    g_autofree char *recvbuf = g_malloc0(len);
+    struct iovec iov[2] = {
+        { .iov_base = sendbuf, .iov_len = len / 2 },
+        { .iov_base = sendbuf + len / 2, .iov_len = len / 2 },
+    };
+    size_t i;
+
+    listen_addr->type = SOCKET_ADDRESS_TYPE_INET;
+    listen_addr->u.inet = (InetSocketAddress) {
+        .host = g_strdup("127.0.0.1"),
+        .port = NULL, /* Auto-select */
+    };
+
+    connect_addr->type = SOCKET_ADDRESS_TYPE_INET;
+    connect_addr->u.inet = (InetSocketAddress) {
+        .host = g_strdup("127.0.0.1"),
+        .port = NULL, /* Filled in later */
+    };
+
+    for (i = 0; i < len; i++) {
+        sendbuf[i] = i % 251;
+    }
+
+    test_io_channel_setup_sync(listen_addr, connect_addr, &srv, &src, &dst);
+
+    if (!qio_channel_has_feature(src, QIO_CHANNEL_FEATURE_WRITE_ZERO_COPY)) {
+        /* Without host support the request must fail cleanly */
+        g_assert_cmpint(qio_channel_writev_all_flags(
+                            src, iov, 2, QIO_CHANNEL_WRITE_FLAG_ZERO_COPY,
+                            NULL), ==, -1);
+        g_assert_cmpint(qio_channel_flush(src, &error_abort), ==, 0);
+        goto cleanup;
+    }
+
+    g_assert_cmpint(qio_channel_writev_all_flags(
+                        src, iov, 2, QIO_CHANNEL_WRITE_FLAG_ZERO_COPY,
+                        &error_abort), ==, 0);
+    g_assert_cmpint(qio_channel_read_all(dst, recvbuf, len, &error_abort),
+                    ==, 0);
+    /* Loopback makes the kernel copy the data, so 1 is fine too */
+    g_assert_cmpint(qio_channel_flush(src, &error_abort), >=, 0);
+    g_assert(memcmp(sendbuf, recvbuf, len) == 0);
+
+    /* Nothing is pending any more */
+    g_assert_cmpint(qio_channel_flush(src, &error_abort), ==, 0);
+
+ cleanup:
+    object_unref(OBJECT(src));
+    object_unref(OBJECT(dst));
+    object_unref(OBJECT(srv));
+    qapi_free_SocketAddress(listen_addr);
+    qapi_free_SocketAddress(connect_addr);
+}
+
+
 int main(int argc, char **argv)
 {
     bool has_ipv4, has_ipv6;
@@ -577,6 +639,8 @@ int main(int argc, char **argv)
                         test_io_channel_ipv4_async);
         g_test_add_func("/io/channel/socket/ipv4-fd",
                         test_io_channel_ipv4_fd);
+        g_test_add_func("/io/channel/socket/ipv4-zero-copy",
+                        test_io_channel_ipv4_zero_copy);
     }
     if (has_ipv6) {
         g_test_add_func("/io/channel/socket/ipv6-sync",
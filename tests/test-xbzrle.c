@@ -13,7 +13,9 @@
 #include "qemu/osdep.h"
 #include "qemu-common.h"
 #include "qemu/cutils.h"
+#include "qapi/error.h"
 #include "../migration/xbzrle.h"
+#include "../migration/page_cache.h"
 
 #define PAGE_SIZE 4096
 
@@ -174,6 +176,124 @@ static void test_encode_decode(void)
     }
 }
 
+static void test_page_cache(void)
+{
+    /* 16 pages, that is 4 sets of 4 ways */
+    PageCache *cache = cache_init(16 * PAGE_SIZE, PAGE_SIZE, &error_abort);
+    uint64_t stride = 4 * PAGE_SIZE;
+    uint8_t *page = g_malloc0(PAGE_SIZE);
+    int i;
+
+    /* pages of the same set do not evict each other */
+    for (i = 0; i < 4; i++) {
+        page[0] = i;
+        g_assert_cmpint(cache_insert(cache, i * stride, page, 0), ==, 0);
+    }
+    for (i = 0; i < 4; i++) {
+        g_assert(cache_is_cached(cache, i * stride, 0));
+        g_assert_cmpint(get_cached_data(cache, i * stride)[0], ==, i);
+    }
+
+    /* the set is full of fresh pages */
+    g_assert_cmpint(cache_insert(cache, 4 * stride, page, 1), ==, -1);
+    g_assert(!cache_is_cached(cache, 4 * stride, 1));
+
+    /* the least recently used page is evicted once it is old enough */
+    g_assert(cache_is_cached(cache, 0, 2));
+    g_assert(cache_is_cached(cache, 2 * stride, 2));
+    g_assert(cache_is_cached(cache, 3 * stride, 2));
+    g_assert_cmpint(cache_insert(cache, 4 * stride, page, 2), ==, 1);
+    g_assert(cache_is_cached(cache, 4 * stride, 2));
+    g_assert(!cache_is_cached(cache, stride, 2));
+    g_assert(cache_is_cached(cache, 0, 2));
+
+    /* other sets are not affected */
+    g_assert(!cache_is_cached(cache, PAGE_SIZE, 2));
+    g_assert(get_cached_data(cache, PAGE_SIZE) == NULL);
+
+    /* updating a cached page always succeeds */
+    page[0] = 42;
+    g_assert_cmpint(cache_insert(cache, 0, page, 2), ==, 0);
+    g_assert_cmpint(get_cached_data(cache, 0)[0], ==, 42);
+
+    cache_fini(cache);
+    g_free(page);
+}
+
+/* Pages that each xbzrle implementation must encode identically */
+#define ACCEL_PAGES 64
+
+static void fill_accel_pages(uint8_t *old_buf, uint8_t *new_buf, int page)
+{
+    /* Runs from a few bytes (dense writes) up to most of the page */
+    int max_run = 2 << (page % 12);
+    int i = 0;
+
+    memset(old_buf, page, PAGE_SIZE);
+    memcpy(new_buf, old_buf, PAGE_SIZE);
+    while (i < PAGE_SIZE) {
+        int zrun = g_test_rand_int_range(0, max_run);
+        int nzrun = g_test_rand_int_range(1, max_run);
+
+        for (i += zrun; nzrun-- && i < PAGE_SIZE; i++) {
+            new_buf[i] = old_buf[i] + g_test_rand_int_range(1, 256);
+        }
+    }
+}
+
+/*
+ * Check that every available encoder produces exactly the same stream,
+ * and time them when running in perf mode.  This leaves the generic
+ * encoder selected.
+ */
+static void test_encode_accel(void)
+{
+    uint8_t *old_buf = g_malloc(PAGE_SIZE * ACCEL_PAGES);
+    uint8_t *new_buf = g_malloc(PAGE_SIZE * ACCEL_PAGES);
+    uint8_t *expected = g_malloc(PAGE_SIZE * ACCEL_PAGES);
+    uint8_t *compressed = g_malloc(PAGE_SIZE);
+    int expected_len[ACCEL_PAGES];
+    int iterations = g_test_perf() ? 2000 : 1;
+    unsigned accel = 0;
+    int i, j, dlen;
+
+    for (i = 0; i < ACCEL_PAGES; i++) {
+        fill_accel_pages(old_buf + i * PAGE_SIZE, new_buf + i * PAGE_SIZE, i);
+        expected_len[i] = xbzrle_encode_buffer(old_buf + i * PAGE_SIZE,
+                                               new_buf + i * PAGE_SIZE,
+                                               PAGE_SIZE,
+                                               expected + i * PAGE_SIZE,
+                                               PAGE_SIZE);
+    }
+
+    do {
+        g_test_timer_start();
+        for (j = 0; j < iterations; j++) {
+            for (i = 0; i < ACCEL_PAGES; i++) {
+                dlen = xbzrle_encode_buffer(old_buf + i * PAGE_SIZE,
+                                            new_buf + i * PAGE_SIZE,
+                                            PAGE_SIZE, compressed, PAGE_SIZE);
+                g_assert_cmpint(dlen, ==, expected_len[i]);
+                if (dlen > 0) {
+                    g_assert(memcmp(compressed, expected + i * PAGE_SIZE,
+                                    dlen) == 0);
+                }
+            }
+        }
+        if (g_test_perf()) {
+            g_test_message("accel %u: %.1f MB/s", accel,
+                           (double)iterations * ACCEL_PAGES * PAGE_SIZE /
+                           g_test_timer_elapsed() / 1e6);
+        }
+        accel++;
+    } while (test_xbzrle_next_accel());
+
+    g_free(old_buf);
+    g_free(new_buf);
+    g_free(expected);
+    g_free(compressed);
+}
+
 int main(int argc, char **argv)
 {
     g_test_init(&argc, &argv, NULL);
@@ -186,6 +306,9 @@ int main(int argc, char **argv)
     g_test_add_func("/xbzrle/encode_decode_overflow",
                     test_encode_decode_overflow);
     g_test_add_func("/xbzrle/encode_decode", test_encode_decode);
+    g_test_add_func("/xbzrle/page_cache", test_page_cache);
+    /* Keep this last: it leaves the generic encoder selected */
+    g_test_add_func("/xbzrle/encode_accel", test_encode_accel);
 
     return g_test_run();
 }
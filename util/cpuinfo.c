@@ -0,0 +1,63 @@
+/*
+ * Host x86 ISA feature detection
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/cpuinfo.h"
+
+#ifdef CONFIG_CPUID_H
+#include "qemu/cpuid.h"
+
+static unsigned cpuinfo;
+
+unsigned cpuinfo_init(void)
+{
+    unsigned info = cpuinfo;
+    int max, a, b, c, d;
+
+    if (info) {
+        return info;
+    }
+
+    info = CPUINFO_ALWAYS;
+    max = __get_cpuid_max(0, NULL);
+    if (max >= 1) {
+        __cpuid(1, a, b, c, d);
+        if (d & bit_SSE2) {
+            info |= CPUINFO_SSE2;
+        }
+        if (c & bit_SSE4_1) {
+            info |= CPUINFO_SSE4;
+        }
+
+        /* We must check that AVX is not just available, but usable.  */
+        if ((c & bit_OSXSAVE) && (c & bit_AVX) && max >= 7) {
+            int bv;
+            __asm("xgetbv" : "=a"(bv), "=d"(d) : "c"(0));
+            __cpuid_count(7, 0, a, b, c, d);
+            if ((bv & 0x6) == 0x6 && (b & bit_AVX2)) {
+                info |= CPUINFO_AVX2;
+            }
+            /* 0xe6:
+            *  XCR0[7:5] = 111b (OPMASK state, upper 256-bit of ZMM0-ZMM15
+            *                    and ZMM16-ZMM31 state are enabled by OS)
+            *  XCR0[2:1] = 11b (XMM state and YMM state are enabled by OS)
+            */
+            if ((bv & 0xe6) == 0xe6 && (b & bit_AVX512F)) {
+                info |= CPUINFO_AVX512F;
+            }
+        }
+    }
+
+    cpuinfo = info;
+    return info;
+}
+#else
+unsigned cpuinfo_init(void)
+{
+    return 0;
+}
+#endif
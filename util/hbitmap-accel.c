@@ -0,0 +1,298 @@
+/*
+ * Hierarchical Bitmap Data Type - vectorized word kernels
+ *
+ * The bottom level of a large HBitmap is scanned and merged in long runs
+ * of words; these helpers process such runs a vector at a time, with the
+ * implementation selected at startup according to the host CPU in the
+ * same way as buffer_is_zero().
+ *
+ * hbitmap_iter_next() does not use them: the upper levels lead it
+ * straight to the nonzero words of the bottom level, so it never reads a
+ * run of zero words.  Only searches the upper levels cannot help with,
+ * such as for zero bits, scan the bottom level word by word.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or
+ * later.  See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/hbitmap.h"
+#include "hbitmap-accel.h"
+
+static size_t
+hb_scan_int(const unsigned long *p, size_t n, unsigned long skip)
+{
+    size_t i = 0;
+
+    for (; i + 4 <= n; i += 4) {
+        if ((p[i] ^ skip) | (p[i + 1] ^ skip) |
+            (p[i + 2] ^ skip) | (p[i + 3] ^ skip)) {
+            break;
+        }
+    }
+    while (i < n && p[i] == skip) {
+        i++;
+    }
+    return i;
+}
+
+static void
+hb_or_int(unsigned long *dst, const unsigned long *a,
+          const unsigned long *b, size_t n)
+{
+    size_t i;
+
+    for (i = 0; i < n; i++) {
+        dst[i] = a[i] | b[i];
+    }
+}
+
+#if defined(CONFIG_AVX512F_OPT) || defined(CONFIG_AVX2_OPT) || defined(__SSE2__)
+/* Do not use push_options pragmas unnecessarily, because clang
+ * does not support them.
+ */
+#if defined(CONFIG_AVX512F_OPT) || defined(CONFIG_AVX2_OPT)
+#pragma GCC push_options
+#pragma GCC target("sse2")
+#endif
+#include <emmintrin.h>
+
+#define SSE2_WORDS (16 / sizeof(unsigned long))
+
+static size_t
+hb_scan_sse2(const unsigned long *p, size_t n, unsigned long skip)
+{
+    __m128i s = _mm_set1_epi8((char)skip);
+    size_t i = 0;
+
+    /* Compare 64 bytes per iteration; the tail is left to the scalar loop */
+    for (; i + 4 * SSE2_WORDS <= n; i += 4 * SSE2_WORDS) {
+        const __m128i *v = (const __m128i *)(p + i);
+        __m128i t = _mm_cmpeq_epi8(_mm_loadu_si128(v), s) &
+                    _mm_cmpeq_epi8(_mm_loadu_si128(v + 1), s) &
+                    _mm_cmpeq_epi8(_mm_loadu_si128(v + 2), s) &
+                    _mm_cmpeq_epi8(_mm_loadu_si128(v + 3), s);
+
+        if (unlikely(_mm_movemask_epi8(t) != 0xFFFF)) {
+            break;
+        }
+    }
+    return i + hb_scan_int(p + i, n - i, skip);
+}
+
+static void
+hb_or_sse2(unsigned long *dst, const unsigned long *a,
+           const unsigned long *b, size_t n)
+{
+    size_t i = 0;
+
+    for (; i + SSE2_WORDS <= n; i += SSE2_WORDS) {
+        _mm_storeu_si128((__m128i *)(dst + i),
+                         _mm_or_si128(_mm_loadu_si128((__m128i *)(a + i)),
+                                      _mm_loadu_si128((__m128i *)(b + i))));
+    }
+    hb_or_int(dst + i, a + i, b + i, n - i);
+}
+#if defined(CONFIG_AVX512F_OPT) || defined(CONFIG_AVX2_OPT)
+#pragma GCC pop_options
+#endif
+
+#ifdef CONFIG_AVX2_OPT
+#pragma GCC push_options
+#pragma GCC target("avx2")
+#include <immintrin.h>
+
+#define AVX2_WORDS (32 / sizeof(unsigned long))
+
+static size_t
+hb_scan_avx2(const unsigned long *p, size_t n, unsigned long skip)
+{
+    __m256i s = _mm256_set1_epi8((char)skip);
+    size_t i = 0;
+
+    /* Compare 128 bytes per iteration */
+    for (; i + 4 * AVX2_WORDS <= n; i += 4 * AVX2_WORDS) {
+        const __m256i *v = (const __m256i *)(p + i);
+        __m256i t = _mm256_cmpeq_epi8(_mm256_loadu_si256(v), s) &
+                    _mm256_cmpeq_epi8(_mm256_loadu_si256(v + 1), s) &
+                    _mm256_cmpeq_epi8(_mm256_loadu_si256(v + 2), s) &
+                    _mm256_cmpeq_epi8(_mm256_loadu_si256(v + 3), s);
+
+        if (unlikely(_mm256_movemask_epi8(t) != -1)) {
+            break;
+        }
+    }
+    return i + hb_scan_int(p + i, n - i, skip);
+}
+
+static void
+hb_or_avx2(unsigned long *dst, const unsigned long *a,
+           const unsigned long *b, size_t n)
+{
+    size_t i = 0;
+
+    for (; i + AVX2_WORDS <= n; i += AVX2_WORDS) {
+        __m256i va = _mm256_loadu_si256((__m256i *)(a + i));
+        __m256i vb = _mm256_loadu_si256((__m256i *)(b + i));
+
+        _mm256_storeu_si256((__m256i *)(dst + i), _mm256_or_si256(va, vb));
+    }
+    hb_or_int(dst + i, a + i, b + i, n - i);
+}
+#pragma GCC pop_options
+#endif /* CONFIG_AVX2_OPT */
+
+#ifdef CONFIG_AVX512F_OPT
+#pragma GCC push_options
+#pragma GCC target("avx512f")
+#include <immintrin.h>
+
+#define AVX512_WORDS (64 / sizeof(unsigned long))
+
+static size_t
+hb_scan_avx512(const unsigned long *p, size_t n, unsigned long skip)
+{
+    __m512i s = _mm512_set1_epi64((long long)(skip ? -1 : 0));
+    size_t i = 0;
+
+    /* Compare 256 bytes per iteration */
+    for (; i + 4 * AVX512_WORDS <= n; i += 4 * AVX512_WORDS) {
+        const __m512i *v = (const __m512i *)(p + i);
+        __m512i t = (_mm512_loadu_si512(v) ^ s) |
+                    (_mm512_loadu_si512(v + 1) ^ s) |
+                    (_mm512_loadu_si512(v + 2) ^ s) |
+                    (_mm512_loadu_si512(v + 3) ^ s);
+
+        if (unlikely(_mm512_test_epi64_mask(t, t))) {
+            break;
+        }
+    }
+    return i + hb_scan_int(p + i, n - i, skip);
+}
+
+static void
+hb_or_avx512(unsigned long *dst, const unsigned long *a,
+             const unsigned long *b, size_t n)
+{
+    size_t i = 0;
+
+    for (; i + AVX512_WORDS <= n; i += AVX512_WORDS) {
+        __m512i va = _mm512_loadu_si512(a + i);
+        __m512i vb = _mm512_loadu_si512(b + i);
+
+        _mm512_storeu_si512(dst + i, _mm512_or_si512(va, vb));
+    }
+    hb_or_int(dst + i, a + i, b + i, n - i);
+}
+#pragma GCC pop_options
+#endif /* CONFIG_AVX512F_OPT */
+
+
+/* Note that for test_hbitmap_next_accel, the most preferred
+ * ISA must have the least significant bit.
+ */
+#define CACHE_AVX512F 1
+#define CACHE_AVX2    2
+#define CACHE_SSE2    4
+
+/* Make sure that these variables are appropriately initialized when
+ * SSE2 is enabled on the compiler command-line, but the compiler is
+ * too old to support CONFIG_AVX2_OPT.
+ */
+#if defined(CONFIG_AVX512F_OPT) || defined(CONFIG_AVX2_OPT)
+# define INIT_CACHE 0
+# define INIT_SCAN  hb_scan_int
+# define INIT_OR    hb_or_int
+#else
+# ifndef __SSE2__
+#  error "ISA selection confusion"
+# endif
+# define INIT_CACHE CACHE_SSE2
+# define INIT_SCAN  hb_scan_sse2
+# define INIT_OR    hb_or_sse2
+#endif
+
+static unsigned cpuid_cache = INIT_CACHE;
+static size_t (*scan_accel)(const unsigned long *, size_t,
+                            unsigned long) = INIT_SCAN;
+static void (*or_accel)(unsigned long *, const unsigned long *,
+                        const unsigned long *, size_t) = INIT_OR;
+
+static void init_accel(unsigned cache)
+{
+    scan_accel = hb_scan_int;
+    or_accel = hb_or_int;
+    if (cache & CACHE_SSE2) {
+        scan_accel = hb_scan_sse2;
+        or_accel = hb_or_sse2;
+    }
+#ifdef CONFIG_AVX2_OPT
+    if (cache & CACHE_AVX2) {
+        scan_accel = hb_scan_avx2;
+        or_accel = hb_or_avx2;
+    }
+#endif
+#ifdef CONFIG_AVX512F_OPT
+    if (cache & CACHE_AVX512F) {
+        scan_accel = hb_scan_avx512;
+        or_accel = hb_or_avx512;
+    }
+#endif
+}
+
+#if defined(CONFIG_AVX512F_OPT) || defined(CONFIG_AVX2_OPT)
+#include "qemu/cpuinfo.h"
+
+static void __attribute__((constructor)) init_cpuid_cache(void)
+{
+    unsigned info = cpuinfo_init();
+    unsigned cache = 0;
+
+    if (info & CPUINFO_SSE2) {
+        cache |= CACHE_SSE2;
+    }
+    if (info & CPUINFO_AVX2) {
+        cache |= CACHE_AVX2;
+    }
+    if (info & CPUINFO_AVX512F) {
+        cache |= CACHE_AVX512F;
+    }
+    cpuid_cache = cache;
+    init_accel(cache);
+}
+#endif /* CONFIG_AVX2_OPT */
+
+bool test_hbitmap_next_accel(void)
+{
+    /* If no bits set, we just tested the integer versions, and there
+       are no more acceleration options to test.  */
+    if (cpuid_cache == 0) {
+        return false;
+    }
+    /* Disable the accelerator we used before and select a new one.  */
+    cpuid_cache &= cpuid_cache - 1;
+    init_accel(cpuid_cache);
+    return true;
+}
+
+#else
+#define scan_accel  hb_scan_int
+#define or_accel    hb_or_int
+bool test_hbitmap_next_accel(void)
+{
+    return false;
+}
+#endif
+
+size_t hbitmap_accel_scan(const unsigned long *p, size_t n,
+                          unsigned long skip)
+{
+    assert(skip == 0 || skip == ~0UL);
+    return scan_accel(p, n, skip);
+}
+
+void hbitmap_accel_or(unsigned long *dst, const unsigned long *a,
+                      const unsigned long *b, size_t n)
+{
+    or_accel(dst, a, b, n);
+}
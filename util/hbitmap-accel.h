@@ -0,0 +1,24 @@
+/*
+ * Hierarchical Bitmap Data Type - vectorized word kernels
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or
+ * later.  See the COPYING file in the top-level directory.
+ */
+
+#ifndef HBITMAP_ACCEL_H
+#define HBITMAP_ACCEL_H
+
+/*
+ * Return the index of the first word in @p[0..@n) that differs from @skip,
+ * or @n if there is none.  @skip must be either 0 or ~0UL.
+ */
+size_t hbitmap_accel_scan(const unsigned long *p, size_t n,
+                          unsigned long skip);
+
+/* Compute @dst[i] = @a[i] | @b[i] for i in [0, @n).  @dst may alias @a
+ * or @b.
+ */
+void hbitmap_accel_or(unsigned long *dst, const unsigned long *a,
+                      const unsigned long *b, size_t n);
+
+#endif
@@ -12,8 +12,10 @@
 #include "qemu/osdep.h"
 #include "qemu/hbitmap.h"
 #include "qemu/host-utils.h"
+#include "qemu/cutils.h"
 #include "trace.h"
 #include "crypto/hash.h"
+#include "hbitmap-accel.h"
 
 /* HBitmaps provides an array of bits.  The bits are stored as usual in an
  * array of unsigned longs, but HBitmap is also optimized to provide fast
@@ -50,8 +52,19 @@
  * extremely sparse, this is also O(m + m/W + m/W^2 + ...), so the amortized
  * cost of advancing from one bit to the next is usually constant (worst case
  * O(logB n) as in the non-amortized complexity).
+ *
+ * Each level is split into chunks of HBITMAP_CHUNK_WORDS words (4 KiB on
+ * 64-bit hosts), which are only allocated once a bit is set in them; a
+ * missing chunk reads as all zeroes.  Dirty bitmaps for large disks are
+ * usually sparse, so this saves most of the memory that a fully allocated
+ * bottom level would take.  Chunks are freed again when a reset covers
+ * them entirely, and on hbitmap_reset_all.
  */
 
+#define HBITMAP_CHUNK_SHIFT    9
+#define HBITMAP_CHUNK_WORDS    (1ULL << HBITMAP_CHUNK_SHIFT)
+#define HBITMAP_CHUNK_MASK     (HBITMAP_CHUNK_WORDS - 1)
+
 struct HBitmap {
     /*
      * Size of the bitmap, as requested in hbitmap_alloc or in hbitmap_truncate.
@@ -92,15 +105,79 @@ struct HBitmap {
      * has a set bit, except the last level where each bit represents the
      * actual bitmap.
      *
+     * Each level is an array of pointers to chunks of HBITMAP_CHUNK_WORDS
+     * words; a NULL chunk is all zeroes.  The last chunk of a level is
+     * shorter if the level size is not a multiple of HBITMAP_CHUNK_WORDS.
+     *
      * Note that all bitmaps have the same number of levels.  Even a 1-bit
      * bitmap will still allocate HBITMAP_LEVELS arrays.
      */
-    unsigned long *levels[HBITMAP_LEVELS];
+    unsigned long **levels[HBITMAP_LEVELS];
 
-    /* The length of each levels[] array. */
+    /* The length of each level, in words. */
     uint64_t sizes[HBITMAP_LEVELS];
 };
 
+static inline uint64_t hb_nchunks(uint64_t words)
+{
+    return DIV_ROUND_UP(words, HBITMAP_CHUNK_WORDS);
+}
+
+/* Number of words in chunk @c of a level that is @words long.  */
+static inline uint64_t hb_chunk_len(uint64_t words, uint64_t c)
+{
+    return MIN(HBITMAP_CHUNK_WORDS, words - (c << HBITMAP_CHUNK_SHIFT));
+}
+
+static inline unsigned long hb_word(const HBitmap *hb, int level, uint64_t pos)
+{
+    const unsigned long *chunk = hb->levels[level][pos >> HBITMAP_CHUNK_SHIFT];
+
+    return chunk ? chunk[pos & HBITMAP_CHUNK_MASK] : 0;
+}
+
+/* Return chunk @c of @level, allocating it if needed.  */
+static unsigned long *hb_chunk_get(HBitmap *hb, int level, uint64_t c)
+{
+    unsigned long **chunk = &hb->levels[level][c];
+
+    if (!*chunk) {
+        *chunk = g_new0(unsigned long, hb_chunk_len(hb->sizes[level], c));
+    }
+    return *chunk;
+}
+
+static void hb_chunk_free(HBitmap *hb, int level, uint64_t c)
+{
+    g_free(hb->levels[level][c]);
+    hb->levels[level][c] = NULL;
+}
+
+static void hb_level_clear(HBitmap *hb, int level)
+{
+    uint64_t c;
+
+    for (c = 0; c < hb_nchunks(hb->sizes[level]); c++) {
+        hb_chunk_free(hb, level, c);
+    }
+}
+
+/* Return a pointer to word @pos of @level, allocating its chunk if needed.  */
+static inline unsigned long *hb_word_ptr(HBitmap *hb, int level, uint64_t pos)
+{
+    return &hb_chunk_get(hb, level,
+                         pos >> HBITMAP_CHUNK_SHIFT)[pos & HBITMAP_CHUNK_MASK];
+}
+
+/* Same, but return NULL if the word lies in a chunk that is not allocated.  */
+static inline unsigned long *hb_word_ptr_noalloc(HBitmap *hb, int level,
+                                                 uint64_t pos)
+{
+    unsigned long *chunk = hb->levels[level][pos >> HBITMAP_CHUNK_SHIFT];
+
+    return chunk ? &chunk[pos & HBITMAP_CHUNK_MASK] : NULL;
+}
+
 /* Advance hbi to the next nonzero word and return it.  hbi->pos
  * is updated.  Returns zero if we reach the end of the bitmap.
  */
@@ -114,7 +191,7 @@ static unsigned long hbitmap_iter_skip_words(HBitmapIter *hbi)
     do {
         i--;
         pos >>= BITS_PER_LEVEL;
-        cur = hbi->cur[i] & hb->levels[i][pos];
+        cur = hbi->cur[i] & hb_word(hb, i, pos);
     } while (cur == 0);
 
     /* Check for end of iteration.  We always use fewer than BITS_PER_LONG
@@ -136,7 +213,7 @@ static unsigned long hbitmap_iter_skip_words(HBitmapIter *hbi)
         hbi->cur[i] = cur & (cur - 1);
 
         /* Set up next level for iteration.  */
-        cur = hb->levels[i + 1][pos];
+        cur = hb_word(hb, i + 1, pos);
     }
 
     hbi->pos = pos;
@@ -149,7 +226,7 @@ static unsigned long hbitmap_iter_skip_words(HBitmapIter *hbi)
 int64_t hbitmap_iter_next(HBitmapIter *hbi)
 {
     unsigned long cur = hbi->cur[HBITMAP_LEVELS - 1] &
-            hbi->hb->levels[HBITMAP_LEVELS - 1][hbi->pos];
+            hb_word(hbi->hb, HBITMAP_LEVELS - 1, hbi->pos);
     int64_t item;
 
     if (cur == 0) {
@@ -182,7 +259,7 @@ void hbitmap_iter_init(HBitmapIter *hbi, const HBitmap *hb, uint64_t first)
         pos >>= BITS_PER_LEVEL;
 
         /* Drop bits representing items before first.  */
-        hbi->cur[i] = hb->levels[i][pos] & ~((1UL << bit) - 1);
+        hbi->cur[i] = hb_word(hb, i, pos) & ~((1UL << bit) - 1);
 
         /* We have already added level i+1, so the lowest set bit has
          * been processed.  Clear it.
@@ -217,11 +294,35 @@ int64_t hbitmap_next_dirty(const HBitmap *hb, int64_t start, int64_t count)
     return MAX(start, first_dirty_off);
 }
 
+/* Return the index of the first word of the last level in [@pos, @end) that
+ * is not all ones, or @end if there is none.
+ */
+static uint64_t hb_find_not_full(const HBitmap *hb, uint64_t pos, uint64_t end)
+{
+    const int level = HBITMAP_LEVELS - 1;
+
+    while (pos < end) {
+        uint64_t c = pos >> HBITMAP_CHUNK_SHIFT;
+        uint64_t chunk_end = MIN((c + 1) << HBITMAP_CHUNK_SHIFT, end);
+        const unsigned long *chunk = hb->levels[level][c];
+
+        if (!chunk) {
+            return pos;
+        }
+        pos += hbitmap_accel_scan(chunk + (pos & HBITMAP_CHUNK_MASK),
+                                  chunk_end - pos, ~0UL);
+        if (pos < chunk_end) {
+            return pos;
+        }
+    }
+
+    return end;
+}
+
 int64_t hbitmap_next_zero(const HBitmap *hb, int64_t start, int64_t count)
 {
     size_t pos = (start >> hb->granularity) >> BITS_PER_LEVEL;
-    unsigned long *last_lev = hb->levels[HBITMAP_LEVELS - 1];
-    unsigned long cur = last_lev[pos];
+    unsigned long cur;
     unsigned start_bit_offset;
     uint64_t end_bit, sz;
     int64_t res;
@@ -232,6 +333,8 @@ int64_t hbitmap_next_zero(const HBitmap *hb, int64_t start, int64_t count)
         return -1;
     }
 
+    cur = hb_word(hb, HBITMAP_LEVELS - 1, pos);
+
     end_bit = count > hb->orig_size - start ?
                 hb->size :
                 ((start + count - 1) >> hb->granularity) + 1;
@@ -245,15 +348,13 @@ int64_t hbitmap_next_zero(const HBitmap *hb, int64_t start, int64_t count)
     assert((start >> hb->granularity) < hb->size);
 
     if (cur == (unsigned long)-1) {
-        do {
-            pos++;
-        } while (pos < sz && last_lev[pos] == (unsigned long)-1);
+        pos = hb_find_not_full(hb, pos + 1, sz);
 
         if (pos >= sz) {
             return -1;
         }
 
-        cur = last_lev[pos];
+        cur = hb_word(hb, HBITMAP_LEVELS - 1, pos);
     }
 
     res = (pos << BITS_PER_LEVEL) + ctol(cur);
@@ -406,18 +507,21 @@ static bool hb_set_between(HBitmap *hb, int level, uint64_t start,
     i = pos;
     if (i < lastpos) {
         uint64_t next = (start | (BITS_PER_LONG - 1)) + 1;
-        changed |= hb_set_elem(&hb->levels[level][i], start, next - 1);
+        changed |= hb_set_elem(hb_word_ptr(hb, level, i), start, next - 1);
         for (;;) {
+            unsigned long *elem;
+
             start = next;
             next += BITS_PER_LONG;
             if (++i == lastpos) {
                 break;
             }
-            changed |= (hb->levels[level][i] == 0);
-            hb->levels[level][i] = ~0UL;
+            elem = hb_word_ptr(hb, level, i);
+            changed |= (*elem == 0);
+            *elem = ~0UL;
         }
     }
-    changed |= hb_set_elem(&hb->levels[level][i], start, last);
+    changed |= hb_set_elem(hb_word_ptr(hb, level, i), start, last);
 
     /* If there was any change in this layer, we may have to update
      * the one above.
@@ -471,6 +575,15 @@ static inline bool hb_reset_elem(unsigned long *elem, uint64_t start, uint64_t l
     return blanked;
 }
 
+/* Same as hb_reset_elem, for a word that may lie in an unallocated chunk.  */
+static inline bool hb_reset_word(HBitmap *hb, int level, uint64_t pos,
+                                 uint64_t start, uint64_t last)
+{
+    unsigned long *elem = hb_word_ptr_noalloc(hb, level, pos);
+
+    return elem && hb_reset_elem(elem, start, last);
+}
+
 /* The recursive workhorse (the depth is limited to HBITMAP_LEVELS)...
  * Returns true if at least one bit is changed. */
 static bool hb_reset_between(HBitmap *hb, int level, uint64_t start,
@@ -490,25 +603,48 @@ static bool hb_reset_between(HBitmap *hb, int level, uint64_t start,
          * unless the lower-level word became entirely zero.  So, remove pos
          * from the upper-level range if bits remain set.
          */
-        if (hb_reset_elem(&hb->levels[level][i], start, next - 1)) {
+        if (hb_reset_word(hb, level, i, start, next - 1)) {
             changed = true;
         } else {
             pos++;
         }
 
         for (;;) {
+            unsigned long *elem;
+
             start = next;
             next += BITS_PER_LONG;
             if (++i == lastpos) {
                 break;
             }
-            changed |= (hb->levels[level][i] != 0);
-            hb->levels[level][i] = 0UL;
+
+            /* Chunks that are entirely inside the range are dropped.  */
+            if (!(i & HBITMAP_CHUNK_MASK) &&
+                i + HBITMAP_CHUNK_WORDS <= lastpos) {
+                uint64_t c = i >> HBITMAP_CHUNK_SHIFT;
+                unsigned long *chunk = hb->levels[level][c];
+
+                if (chunk) {
+                    changed |= !buffer_is_zero(chunk, HBITMAP_CHUNK_WORDS *
+                                                      sizeof(unsigned long));
+                    hb_chunk_free(hb, level, c);
+                }
+                i += HBITMAP_CHUNK_WORDS - 1;
+                start += (HBITMAP_CHUNK_WORDS - 1) * BITS_PER_LONG;
+                next += (HBITMAP_CHUNK_WORDS - 1) * BITS_PER_LONG;
+                continue;
+            }
+
+            elem = hb_word_ptr_noalloc(hb, level, i);
+            if (elem) {
+                changed |= (*elem != 0);
+                *elem = 0UL;
+            }
         }
     }
 
     /* Same as above, this time for lastpos.  */
-    if (hb_reset_elem(&hb->levels[level][i], start, last)) {
+    if (hb_reset_word(hb, level, i, start, last)) {
         changed = true;
     } else {
         lastpos--;
@@ -554,12 +690,12 @@ void hbitmap_reset_all(HBitmap *hb)
 {
     unsigned int i;
 
-    /* Same as hbitmap_alloc() except for memset() instead of malloc() */
+    /* Drop all chunks, except for the one holding the sentinel */
     for (i = HBITMAP_LEVELS; --i >= 1; ) {
-        memset(hb->levels[i], 0, hb->sizes[i] * sizeof(unsigned long));
+        hb_level_clear(hb, i);
     }
 
-    hb->levels[0][0] = 1UL << (BITS_PER_LONG - 1);
+    *hb_word_ptr(hb, 0, 0) = 1UL << (BITS_PER_LONG - 1);
     hb->count = 0;
 }
 
@@ -588,7 +724,7 @@ bool hbitmap_get(const HBitmap *hb, uint64_t item)
     unsigned long bit = 1UL << (pos & (BITS_PER_LONG - 1));
     assert(pos < hb->size);
 
-    return (hb->levels[HBITMAP_LEVELS - 1][pos >> BITS_PER_LEVEL] & bit) != 0;
+    return (hb_word(hb, HBITMAP_LEVELS - 1, pos >> BITS_PER_LEVEL) & bit) != 0;
 }
 
 uint64_t hbitmap_serialization_align(const HBitmap *hb)
@@ -605,7 +741,7 @@ uint64_t hbitmap_serialization_align(const HBitmap *hb)
  */
 static void serialization_chunk(const HBitmap *hb,
                                 uint64_t start, uint64_t count,
-                                unsigned long **first_el, uint64_t *el_count)
+                                uint64_t *first_el, uint64_t *el_count)
 {
     uint64_t last = start + count - 1;
     uint64_t gran = hbitmap_serialization_align(hb);
@@ -619,7 +755,7 @@ static void serialization_chunk(const HBitmap *hb,
     start = (start >> hb->granularity) >> BITS_PER_LEVEL;
     last = (last >> hb->granularity) >> BITS_PER_LEVEL;
 
-    *first_el = &hb->levels[HBITMAP_LEVELS - 1][start];
+    *first_el = start;
     *el_count = last - start + 1;
 }
 
@@ -627,7 +763,7 @@ uint64_t hbitmap_serialization_size(const HBitmap *hb,
                                     uint64_t start, uint64_t count)
 {
     uint64_t el_count;
-    unsigned long *cur;
+    uint64_t cur;
 
     if (!count) {
         return 0;
@@ -641,7 +777,7 @@ void hbitmap_serialize_part(const HBitmap *hb, uint8_t *buf,
                             uint64_t start, uint64_t count)
 {
     uint64_t el_count;
-    unsigned long *cur, *end;
+    uint64_t cur, end;
 
     if (!count) {
         return;
@@ -650,8 +786,9 @@ void hbitmap_serialize_part(const HBitmap *hb, uint8_t *buf,
     end = cur + el_count;
 
     while (cur != end) {
-        unsigned long el =
-            (BITS_PER_LONG == 32 ? cpu_to_le32(*cur) : cpu_to_le64(*cur));
+        unsigned long el = hb_word(hb, HBITMAP_LEVELS - 1, cur);
+
+        el = (BITS_PER_LONG == 32 ? cpu_to_le32(el) : cpu_to_le64(el));
 
         memcpy(buf, &el, sizeof(el));
         buf += sizeof(el);
@@ -664,7 +801,7 @@ void hbitmap_deserialize_part(HBitmap *hb, uint8_t *buf,
                               bool finish)
 {
     uint64_t el_count;
-    unsigned long *cur, *end;
+    uint64_t cur, end;
 
     if (!count) {
         return;
@@ -673,12 +810,21 @@ void hbitmap_deserialize_part(HBitmap *hb, uint8_t *buf,
     end = cur + el_count;
 
     while (cur != end) {
-        memcpy(cur, buf, sizeof(*cur));
+        unsigned long el, *elem;
+
+        memcpy(&el, buf, sizeof(el));
 
         if (BITS_PER_LONG == 32) {
-            le32_to_cpus((uint32_t *)cur);
+            le32_to_cpus((uint32_t *)&el);
         } else {
-            le64_to_cpus((uint64_t *)cur);
+            le64_to_cpus((uint64_t *)&el);
+        }
+
+        /* Do not allocate chunks just to store zeroes in them */
+        elem = el ? hb_word_ptr(hb, HBITMAP_LEVELS - 1, cur) :
+                    hb_word_ptr_noalloc(hb, HBITMAP_LEVELS - 1, cur);
+        if (elem) {
+            *elem = el;
         }
 
         buf += sizeof(unsigned long);
@@ -693,14 +839,20 @@ void hbitmap_deserialize_zeroes(HBitmap *hb, uint64_t start, uint64_t count,
                                 bool finish)
 {
     uint64_t el_count;
-    unsigned long *first;
+    uint64_t first, pos;
 
     if (!count) {
         return;
     }
     serialization_chunk(hb, start, count, &first, &el_count);
 
-    memset(first, 0, el_count * sizeof(unsigned long));
+    for (pos = first; pos < first + el_count; pos++) {
+        unsigned long *elem = hb_word_ptr_noalloc(hb, HBITMAP_LEVELS - 1, pos);
+
+        if (elem) {
+            *elem = 0;
+        }
+    }
     if (finish) {
         hbitmap_deserialize_finish(hb);
     }
@@ -710,14 +862,16 @@ void hbitmap_deserialize_ones(HBitmap *hb, uint64_t start, uint64_t count,
                               bool finish)
 {
     uint64_t el_count;
-    unsigned long *first;
+    uint64_t first, pos;
 
     if (!count) {
         return;
     }
     serialization_chunk(hb, start, count, &first, &el_count);
 
-    memset(first, 0xff, el_count * sizeof(unsigned long));
+    for (pos = first; pos < first + el_count; pos++) {
+        *hb_word_ptr(hb, HBITMAP_LEVELS - 1, pos) = ~0UL;
+    }
     if (finish) {
         hbitmap_deserialize_finish(hb);
     }
@@ -725,26 +879,35 @@ void hbitmap_deserialize_ones(HBitmap *hb, uint64_t start, uint64_t count,
 
 void hbitmap_deserialize_finish(HBitmap *bitmap)
 {
-    int64_t i, size, prev_size;
+    uint64_t c, i, prev_size;
     int lev;
 
     /* restore levels starting from penultimate to zero level, assuming
      * that the last level is ok */
-    size = MAX((bitmap->size + BITS_PER_LONG - 1) >> BITS_PER_LEVEL, 1);
     for (lev = HBITMAP_LEVELS - 1; lev-- > 0; ) {
-        prev_size = size;
-        size = MAX((size + BITS_PER_LONG - 1) >> BITS_PER_LEVEL, 1);
-        memset(bitmap->levels[lev], 0, size * sizeof(unsigned long));
+        prev_size = bitmap->sizes[lev + 1];
+        hb_level_clear(bitmap, lev);
+
+        for (c = 0; c < hb_nchunks(prev_size); c++) {
+            const unsigned long *chunk = bitmap->levels[lev + 1][c];
+            uint64_t len = hb_chunk_len(prev_size, c);
+            uint64_t base = c << HBITMAP_CHUNK_SHIFT;
 
-        for (i = 0; i < prev_size; ++i) {
-            if (bitmap->levels[lev + 1][i]) {
-                bitmap->levels[lev][i >> BITS_PER_LEVEL] |=
-                    1UL << (i & (BITS_PER_LONG - 1));
+            if (!chunk) {
+                continue;
+            }
+            for (i = 0; ; ++i) {
+                i += hbitmap_accel_scan(chunk + i, len - i, 0);
+                if (i >= len) {
+                    break;
+                }
+                *hb_word_ptr(bitmap, lev, (base + i) >> BITS_PER_LEVEL) |=
+                    1UL << ((base + i) & (BITS_PER_LONG - 1));
             }
         }
     }
 
-    bitmap->levels[0][0] |= 1UL << (BITS_PER_LONG - 1);
+    *hb_word_ptr(bitmap, 0, 0) |= 1UL << (BITS_PER_LONG - 1);
     bitmap->count = hb_count_between(bitmap, 0, bitmap->size - 1);
 }
 
@@ -753,6 +916,7 @@ void hbitmap_free(HBitmap *hb)
     unsigned i;
     assert(!hb->meta);
     for (i = HBITMAP_LEVELS; i-- > 0; ) {
+        hb_level_clear(hb, i);
         g_free(hb->levels[i]);
     }
     g_free(hb);
@@ -775,7 +939,7 @@ HBitmap *hbitmap_alloc(uint64_t size, int granularity)
     for (i = HBITMAP_LEVELS; i-- > 0; ) {
         size = MAX((size + BITS_PER_LONG - 1) >> BITS_PER_LEVEL, 1);
         hb->sizes[i] = size;
-        hb->levels[i] = g_new0(unsigned long, size);
+        hb->levels[i] = g_new0(unsigned long *, hb_nchunks(size));
     }
 
     /* We necessarily have free bits in level 0 due to the definition
@@ -783,16 +947,48 @@ HBitmap *hbitmap_alloc(uint64_t size, int granularity)
      * hbitmap_iter_skip_words.
      */
     assert(size == 1);
-    hb->levels[0][0] |= 1UL << (BITS_PER_LONG - 1);
+    *hb_word_ptr(hb, 0, 0) |= 1UL << (BITS_PER_LONG - 1);
     return hb;
 }
 
+/* Resize @level to @words words, zeroing any new words.  */
+static void hb_level_resize(HBitmap *hb, int level, uint64_t words)
+{
+    uint64_t old = hb->sizes[level];
+    uint64_t old_nchunks = hb_nchunks(old);
+    uint64_t nchunks = hb_nchunks(words);
+    uint64_t c, old_len, new_len;
+    unsigned long *chunk;
+
+    for (c = nchunks; c < old_nchunks; c++) {
+        hb_chunk_free(hb, level, c);
+    }
+    hb->levels[level] = g_renew(unsigned long *, hb->levels[level], nchunks);
+    for (c = old_nchunks; c < nchunks; c++) {
+        hb->levels[level][c] = NULL;
+    }
+    hb->sizes[level] = words;
+
+    /* The chunk that was, or now is, the last one may change length */
+    c = MIN(old_nchunks, nchunks) - 1;
+    chunk = hb->levels[level][c];
+    old_len = hb_chunk_len(old, c);
+    new_len = hb_chunk_len(words, c);
+    if (chunk && old_len != new_len) {
+        chunk = g_renew(unsigned long, chunk, new_len);
+        if (new_len > old_len) {
+            memset(&chunk[old_len], 0,
+                   (new_len - old_len) * sizeof(unsigned long));
+        }
+        hb->levels[level][c] = chunk;
+    }
+}
+
 void hbitmap_truncate(HBitmap *hb, uint64_t size)
 {
     bool shrink;
     unsigned i;
     uint64_t num_elements = size;
-    uint64_t old;
 
     assert(size <= INT64_MAX);
     hb->orig_size = size;
@@ -827,13 +1023,7 @@ void hbitmap_truncate(HBitmap *hb, uint64_t size)
         if (hb->sizes[i] == size) {
             break;
         }
-        old = hb->sizes[i];
-        hb->sizes[i] = size;
-        hb->levels[i] = g_realloc(hb->levels[i], size * sizeof(unsigned long));
-        if (!shrink) {
-            memset(&hb->levels[i][old], 0x00,
-                   (size - old) * sizeof(*hb->levels[i]));
-        }
+        hb_level_resize(hb, i, size);
     }
     if (hb->meta) {
         hbitmap_truncate(hb->meta, hb->size << hb->granularity);
@@ -864,6 +1054,34 @@ static void hbitmap_sparse_merge(HBitmap *dst, const HBitmap *src)
     }
 }
 
+/* Merge chunk @c of @level, treating unallocated chunks as zero.  */
+static void hb_merge_chunk(const HBitmap *a, const HBitmap *b, HBitmap *result,
+                           int level, uint64_t c)
+{
+    const unsigned long *ca = a->levels[level][c];
+    const unsigned long *cb = b->levels[level][c];
+    uint64_t len = hb_chunk_len(a->sizes[level], c);
+    unsigned long *cr;
+
+    if (!ca && !cb) {
+        hb_chunk_free(result, level, c);
+        return;
+    }
+
+    cr = hb_chunk_get(result, level, c);
+    if (!ca) {
+        if (cr != cb) {
+            memcpy(cr, cb, len * sizeof(unsigned long));
+        }
+    } else if (!cb) {
+        if (cr != ca) {
+            memcpy(cr, ca, len * sizeof(unsigned long));
+        }
+    } else {
+        hbitmap_accel_or(cr, ca, cb, len);
+    }
+}
+
 /**
  * Given HBitmaps A and B, let R := A (BITOR) B.
  * Bitmaps A and B will not be modified,
@@ -875,7 +1093,7 @@ static void hbitmap_sparse_merge(HBitmap *dst, const HBitmap *src)
 bool hbitmap_merge(const HBitmap *a, const HBitmap *b, HBitmap *result)
 {
     int i;
-    uint64_t j;
+    uint64_t c;
 
     if (!hbitmap_can_merge(a, b) || !hbitmap_can_merge(a, result)) {
         return false;
@@ -905,14 +1123,13 @@ bool hbitmap_merge(const HBitmap *a, const HBitmap *b, HBitmap *result)
         return true;
     }
 
-    /* This merge is O(size), as BITS_PER_LONG and HBITMAP_LEVELS are constant.
-     * It may be possible to improve running times for sparsely populated maps
-     * by using hbitmap_iter_next, but this is suboptimal for dense maps.
+    /* This merge is O(size), as BITS_PER_LONG and HBITMAP_LEVELS are constant,
+     * but chunks that are unallocated in both A and B are skipped.
      */
     assert(a->size == b->size);
     for (i = HBITMAP_LEVELS - 1; i >= 0; i--) {
-        for (j = 0; j < a->sizes[i]; j++) {
-            result->levels[i][j] = a->levels[i][j] | b->levels[i][j];
+        for (c = 0; c < hb_nchunks(a->sizes[i]); c++) {
+            hb_merge_chunk(a, b, result, i, c);
         }
     }
 
@@ -924,10 +1141,21 @@ bool hbitmap_merge(const HBitmap *a, const HBitmap *b, HBitmap *result)
 
 char *hbitmap_sha256(const HBitmap *bitmap, Error **errp)
 {
-    size_t size = bitmap->sizes[HBITMAP_LEVELS - 1] * sizeof(unsigned long);
-    char *data = (char *)bitmap->levels[HBITMAP_LEVELS - 1];
+    uint64_t words = bitmap->sizes[HBITMAP_LEVELS - 1];
+    uint64_t nchunks = hb_nchunks(words);
+    g_autofree struct iovec *iov = g_new(struct iovec, nchunks);
+    g_autofree unsigned long *zero =
+        g_new0(unsigned long, MIN(words, HBITMAP_CHUNK_WORDS));
     char *hash = NULL;
-    qcrypto_hash_digest(QCRYPTO_HASH_ALG_SHA256, data, size, &hash, errp);
+    uint64_t c;
+
+    for (c = 0; c < nchunks; c++) {
+        unsigned long *chunk = bitmap->levels[HBITMAP_LEVELS - 1][c];
+
+        iov[c].iov_base = chunk ? chunk : zero;
+        iov[c].iov_len = hb_chunk_len(words, c) * sizeof(unsigned long);
+    }
+    qcrypto_hash_digestv(QCRYPTO_HASH_ALG_SHA256, iov, nchunks, &hash, errp);
 
     return hash;
 }
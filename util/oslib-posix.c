@@ -39,9 +39,11 @@
 #include "qemu/thread.h"
 #include <libgen.h>
 #include "qemu/cutils.h"
+#include "qemu/bitops.h"
 
 #ifdef CONFIG_LINUX
 #include <sys/syscall.h>
+#include <sched.h>
 #endif
 
 #ifdef __FreeBSD__
@@ -76,6 +78,9 @@ struct MemsetThread {
     char *addr;
     size_t numpages;
     size_t hpagesize;
+    /* host CPUs the thread may run on, or NULL for any */
+    const unsigned long *cpus;
+    int nr_cpus;
     QemuThread pgthread;
     sigjmp_buf env;
 };
@@ -456,11 +461,40 @@ static void sigbus_handler(int signal)
     }
 }
 
+#ifdef CONFIG_LINUX
+static void memset_thread_set_affinity(MemsetThread *memset_args)
+{
+    size_t size = CPU_ALLOC_SIZE(memset_args->nr_cpus);
+    cpu_set_t *set = CPU_ALLOC(memset_args->nr_cpus);
+    unsigned long cpu;
+
+    if (!set) {
+        return;
+    }
+    CPU_ZERO_S(size, set);
+    for (cpu = find_first_bit(memset_args->cpus, memset_args->nr_cpus);
+         cpu < memset_args->nr_cpus;
+         cpu = find_next_bit(memset_args->cpus, memset_args->nr_cpus,
+                             cpu + 1)) {
+        CPU_SET_S(cpu, size, set);
+    }
+    /* Best effort: the pages get touched from any CPU if this fails */
+    sched_setaffinity(0, size, set);
+    CPU_FREE(set);
+}
+#endif
+
 static void *do_touch_pages(void *arg)
 {
     MemsetThread *memset_args = (MemsetThread *)arg;
     sigset_t set, oldset;
 
+#ifdef CONFIG_LINUX
+    if (memset_args->cpus) {
+        memset_thread_set_affinity(memset_args);
+    }
+#endif
+
     /*
      * On Linux, the page faults from the loop below can cause mmap_sem
      * contention with allocation of the thread stacks.  Do not start
@@ -505,20 +539,22 @@ static void *do_touch_pages(void *arg)
     return NULL;
 }
 
-static inline int get_memset_num_threads(int smp_cpus)
+static inline int get_memset_num_threads(int smp_cpus, int ngroups)
 {
     long host_procs = sysconf(_SC_NPROCESSORS_ONLN);
+    int max_threads = MAX_MEM_PREALLOC_THREAD_COUNT * MAX(ngroups, 1);
     int ret = 1;
 
     if (host_procs > 0) {
-        ret = MIN(MIN(host_procs, MAX_MEM_PREALLOC_THREAD_COUNT), smp_cpus);
+        ret = MIN(MIN(host_procs, max_threads), smp_cpus);
     }
     /* In case sysconf() fails, we fall back to single threaded */
     return ret;
 }
 
 static bool touch_all_pages(char *area, size_t hpagesize, size_t numpages,
-                            int smp_cpus)
+                            int smp_cpus, unsigned long **cpus, int ngroups,
+                            int nr_cpus)
 {
     static gsize initialized = 0;
     size_t numpages_per_thread, leftover;
@@ -533,7 +569,7 @@ static bool touch_all_pages(char *area, size_t hpagesize, size_t numpages,
 
     memset_thread_failed = false;
     threads_created_flag = false;
-    memset_num_threads = get_memset_num_threads(smp_cpus);
+    memset_num_threads = get_memset_num_threads(smp_cpus, ngroups);
     memset_thread = g_new0(MemsetThread, memset_num_threads);
     numpages_per_thread = numpages / memset_num_threads;
     leftover = numpages % memset_num_threads;
@@ -541,6 +577,14 @@ static bool touch_all_pages(char *area, size_t hpagesize, size_t numpages,
         memset_thread[i].addr = addr;
         memset_thread[i].numpages = numpages_per_thread + (i < leftover);
         memset_thread[i].hpagesize = hpagesize;
+        if (ngroups) {
+            /*
+             * Consecutive threads share a group, so that each group
+             * touches a contiguous part of the area.
+             */
+            memset_thread[i].cpus = cpus[i * ngroups / memset_num_threads];
+            memset_thread[i].nr_cpus = nr_cpus;
+        }
         qemu_thread_create(&memset_thread[i].pgthread, "touch_pages",
                            do_touch_pages, &memset_thread[i],
                            QEMU_THREAD_JOINABLE);
@@ -561,8 +605,9 @@ static bool touch_all_pages(char *area, size_t hpagesize, size_t numpages,
     return memset_thread_failed;
 }
 
-void os_mem_prealloc(int fd, char *area, size_t memory, int smp_cpus,
-                     Error **errp)
+void os_mem_prealloc_on_cpus(int fd, char *area, size_t memory,
+                             int smp_cpus, unsigned long **cpus,
+                             int ngroups, int nr_cpus, Error **errp)
 {
     int ret;
     struct sigaction act, oldact;
@@ -581,7 +626,8 @@ void os_mem_prealloc(int fd, char *area, size_t memory, int smp_cpus,
     }
 
     /* touch pages simultaneously */
-    if (touch_all_pages(area, hpagesize, numpages, smp_cpus)) {
+    if (touch_all_pages(area, hpagesize, numpages, smp_cpus, cpus, ngroups,
+                        nr_cpus)) {
         error_setg(errp, "os_mem_prealloc: Insufficient free host memory "
             "pages available to allocate guest RAM");
     }
@@ -594,6 +640,12 @@ void os_mem_prealloc(int fd, char *area, size_t memory, int smp_cpus,
     }
 }
 
+void os_mem_prealloc(int fd, char *area, size_t memory, int smp_cpus,
+                     Error **errp)
+{
+    os_mem_prealloc_on_cpus(fd, area, memory, smp_cpus, NULL, 0, 0, errp);
+}
+
 char *qemu_get_pid_name(pid_t pid)
 {
     char *name = NULL;
@@ -569,6 +569,13 @@ void os_mem_prealloc(int fd, char *area, size_t memory, int smp_cpus,
     }
 }
 
+void os_mem_prealloc_on_cpus(int fd, char *area, size_t memory,
+                             int smp_cpus, unsigned long **cpus,
+                             int ngroups, int nr_cpus, Error **errp)
+{
+    os_mem_prealloc(fd, area, memory, smp_cpus, errp);
+}
+
 char *qemu_get_pid_name(pid_t pid)
 {
     /* XXX Implement me */